@@ -0,0 +1,93 @@
+// Formats a typical widget text once per tick with TextFormat and with a naive std::format (an ostringstream where
+// the standard library has no <format>), and prints the time and heap allocations per format of both
+#include "allocationCounter.hpp"
+#include "textFormat.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <version>
+#ifdef __cpp_lib_format
+#include <format>
+#endif
+
+namespace {
+	constexpr uint64_t iterations = 1'000'000;
+	constexpr std::string_view source = "{cpu:>3}% {mem_used:.1f}G";
+
+	// Keeps the compiler from dropping the work
+	volatile std::size_t sink = 0;
+
+	double cpuAt(uint64_t tick) { return static_cast<double>(tick % 101); }
+	double memoryAt(uint64_t tick) { return 1.0 + static_cast<double>(tick % 1600) / 100.0; }
+
+	template<typename Function>
+	void measure(const char *name, Function &&function)
+	{
+		const uint64_t allocationsBefore = AllocationCounter::GetCount();
+		const auto start = std::chrono::steady_clock::now();
+		for (uint64_t tick = 0; tick < iterations; tick++)
+			function(tick);
+		const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		const uint64_t allocations = AllocationCounter::GetCount() - allocationsBefore;
+		std::printf("%-34s %8.1f ns/format", name, elapsed / static_cast<double>(iterations));
+		if (AllocationCounter::enabled)
+			std::printf(" %6.2f allocations/format", static_cast<double>(allocations) / static_cast<double>(iterations));
+		std::printf("\n");
+	}
+}
+
+int main()
+{
+	TextFormat format;
+	if (!format.Parse(source))
+		return 1;
+	std::printf("Template \"%.*s\", %llu formats each\n", static_cast<int>(source.size()), source.data(), static_cast<unsigned long long>(iterations));
+
+	FormattedText text;
+	uint64_t changes = 0;
+	measure("TextFormat, numbers", [&](uint64_t tick) {
+		const TextFormat::Argument arguments[] = { TextFormat::Argument::FromNumber(cpuAt(tick)), TextFormat::Argument::FromNumber(memoryAt(tick)) };
+		changes += text.Update(format, arguments);
+		sink = sink + text.GetText().size();
+	});
+	std::printf("  %llu of the texts changed\n", static_cast<unsigned long long>(changes));
+
+	// What the widget store hands over, the numbers are read from the text on every format. Written beforehand, the
+	// modules do that once per change and not per format
+	constexpr std::size_t textsCount = 1600;
+	static char texts[textsCount][2][16];
+	static std::size_t textLengths[textsCount][2];
+	for (std::size_t i = 0; i < textsCount; i++) {
+		textLengths[i][0] = static_cast<std::size_t>(std::snprintf(texts[i][0], sizeof(texts[i][0]), "%g", cpuAt(i)));
+		textLengths[i][1] = static_cast<std::size_t>(std::snprintf(texts[i][1], sizeof(texts[i][1]), "%g", memoryAt(i)));
+	}
+	measure("TextFormat, texts of the store", [&](uint64_t tick) {
+		const std::size_t i = tick % textsCount;
+		const TextFormat::Argument arguments[] = {
+			TextFormat::Argument::FromText(std::string_view(texts[i][0], textLengths[i][0])),
+			TextFormat::Argument::FromText(std::string_view(texts[i][1], textLengths[i][1]))
+		};
+		text.Update(format, arguments);
+		sink = sink + text.GetText().size();
+	});
+
+#ifdef __cpp_lib_format
+	measure("std::format", [](uint64_t tick) {
+		const std::string result = std::format("{:>3}% {:.1f}G", cpuAt(tick), memoryAt(tick));
+		sink = sink + result.size();
+	});
+#else
+	measure("std::ostringstream (no <format>)", [](uint64_t tick) {
+		std::ostringstream stream;
+		stream << std::setw(3) << cpuAt(tick) << "% " << std::fixed << std::setprecision(1) << memoryAt(tick) << "G";
+		const std::string result = stream.str();
+		sink = sink + result.size();
+	});
+#endif
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+# Turns a SPIR-V binary into a header with an `inline constexpr uint32_t` array, so shaders need no file I/O at runtime
+#   cmake -DINPUT=quad.vert.spv -DOUTPUT=quad.vert.hpp -DNAME=quadVertSpirv -P EmbedSpirv.cmake
+
+file(READ "${INPUT}" CONTENT HEX)
+string(LENGTH "${CONTENT}" CONTENT_LENGTH)
+math(EXPR REMAINDER "${CONTENT_LENGTH} % 8")
+if (CONTENT_LENGTH EQUAL 0 OR NOT REMAINDER EQUAL 0)
+	message(FATAL_ERROR "${INPUT} is not a SPIR-V binary")
+endif ()
+
+# SPIR-V is a stream of little-endian words, so every 4 bytes are swapped into one literal
+string(REGEX MATCHALL "([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])" WORDS "${CONTENT}")
+set(BODY "")
+set(WORDS_IN_LINE 0)
+foreach (WORD ${WORDS})
+	string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u," LITERAL "${WORD}")
+	if (WORDS_IN_LINE EQUAL 0)
+		string(APPEND BODY "\t")
+	endif ()
+	string(APPEND BODY "${LITERAL}")
+	math(EXPR WORDS_IN_LINE "${WORDS_IN_LINE} + 1")
+	if (WORDS_IN_LINE EQUAL 8)
+		string(APPEND BODY "\n")
+		set(WORDS_IN_LINE 0)
+	else ()
+		string(APPEND BODY " ")
+	endif ()
+endforeach ()
+string(REGEX REPLACE "[ \n]+$" "" BODY "${BODY}")
+
+get_filename_component(INPUT_NAME "${INPUT}" NAME)
+file(WRITE "${OUTPUT}" "#pragma once
+
+// Generated from ${INPUT_NAME} by EmbedSpirv.cmake, don't edit
+
+#include <cstdint>
+
+inline constexpr uint32_t ${NAME}[] = {
+${BODY}
+};
+")
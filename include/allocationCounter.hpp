@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+// Counts the heap allocations made through operator new, so the benchmark can check that a steady state frame doesn't
+// allocate. Only builds with NCBAR_TRACK_ALLOCATIONS (on by default in debug builds) replace operator new; in the
+// others the count stays 0. Allocations of C libraries (malloc) are not seen
+class AllocationCounter
+{
+public:
+#ifdef NCBAR_TRACK_ALLOCATIONS
+	static constexpr bool enabled = true;
+#else
+	static constexpr bool enabled = false;
+#endif
+
+	static uint64_t GetCount();
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "imageDecoder.hpp"
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+// The 5x7 ASCII font of character LCDs, so widget text needs no font library. Text is rasterized on the CPU into an
+// image of its exact size in device pixels, every font pixel a `pixelSize` square, which DrawImage draws 1:1.
+// Anything outside of printable ASCII is a `?`, one per UTF-8 character
+class BitmapFont
+{
+public:
+	// Glyphs with a column and a row of spacing, the last row is for descenders
+	static constexpr uint32_t cellWidth = 6;
+	static constexpr uint32_t cellHeight = 8;
+
+	static uint32_t GetWidth(std::string_view text, uint32_t pixelSize);
+	static uint32_t GetHeight(uint32_t pixelSize) { return cellHeight * pixelSize; }
+	// Straight alpha RGBA of `color` on transparent, an empty image for an empty text
+	static void Render(std::string_view text, uint32_t pixelSize, std::array<uint8_t, 4> color, ImageDecoder::Image &image);
+};
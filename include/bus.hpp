@@ -0,0 +1,88 @@
+#pragma once
+
+#include <dbus/dbus.h>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Core;
+
+// Private connection to the session bus driven by Core's event loop: libdbus watches become registered fds, its
+// timeouts become timerfds, and queued messages are dispatched from an eventfd, so there is no second main loop.
+// Modules make only asynchronous calls, nothing here blocks on the bus
+class Bus
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::shared_ptr<Bus> Ptr;
+	// Gets nullptr if the call failed or timed out
+	typedef std::function<void(DBusMessage *reply)> ReplyCallbackType;
+	// Returns true if the message was handled and nobody else should see it
+	typedef std::function<bool(DBusMessage *message)> FilterCallbackType;
+
+	Bus() = delete;
+	Bus(const Private&) {}
+	~Bus();
+	static Bus::Ptr Create(CorePtr core)
+	{
+		auto ptr = std::make_shared<Bus>(Private());
+		if (!ptr->Init(core))
+			return nullptr;
+		return ptr;
+	}
+
+	DBusConnection* GetConnection() { return connection; }
+	const char* GetUniqueName() const { return dbus_bus_get_unique_name(connection); }
+
+	// Sends a method call and takes the reference of `message`
+	bool Call(DBusMessage *message, ReplyCallbackType callback, int timeout = DBUS_TIMEOUT_USE_DEFAULT);
+	// Sends a signal or a reply and takes the reference of `message`
+	bool Send(DBusMessage *message);
+	// Sees every incoming message, including the signals of added matches
+	uint32_t AddFilter(FilterCallbackType filter);
+	void RemoveFilter(uint32_t id);
+	// Match rules are sent without waiting for the reply
+	void AddMatch(const std::string &rule);
+	void RemoveMatch(const std::string &rule);
+
+private:
+	struct Watches {
+		std::vector<DBusWatch*> watches;
+		uint32_t events = 0;
+	};
+
+	bool Init(CorePtr core);
+	void UpdateFdEvents(int fd);
+	void OnFdEvents(int fd, uint32_t events);
+	void Dispatch();
+
+	// libdbus main loop hooks
+	static dbus_bool_t OnAddWatch(DBusWatch *watch, void *data);
+	static void OnRemoveWatch(DBusWatch *watch, void *data);
+	static void OnToggleWatch(DBusWatch *watch, void *data);
+	static dbus_bool_t OnAddTimeout(DBusTimeout *timeout, void *data);
+	static void OnRemoveTimeout(DBusTimeout *timeout, void *data);
+	static void OnToggleTimeout(DBusTimeout *timeout, void *data);
+	static void OnDispatchStatus(DBusConnection *connection, DBusDispatchStatus status, void *data);
+	static DBusHandlerResult OnMessage(DBusConnection *connection, DBusMessage *message, void *data);
+	void ArmTimeout(DBusTimeout *timeout);
+
+	CorePtr core;
+	DBusConnection *connection = nullptr;
+	// libdbus watches reading and writing of the same socket separately
+	std::unordered_map<int, Watches> watchesByFd;
+	std::unordered_map<DBusTimeout*, int> timeoutFds;
+	// Signalled when messages are queued outside of our own dispatch, e.g. while a watch is handled
+	int dispatchFd = -1;
+	// A list, so a filter that removes itself keeps running
+	std::list<std::pair<uint32_t, FilterCallbackType>> filters;
+	uint32_t lastFilterId = 0;
+	bool filtering = false;
+	bool filterAdded = false;
+};
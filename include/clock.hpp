@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Core;
+
+// Wall clock of every clock widget on every output. Formats take strftime conversions, are compiled once into a
+// plan of literals and fields and published under their key. One CLOCK_REALTIME timerfd is armed with
+// TFD_TIMER_ABSTIME at the next boundary the finest format needs (second, minute, hour or local midnight), so a
+// minute clock wakes up once a minute. TFD_TIMER_CANCEL_ON_SET wakes it up when the time is set (NTP steps, resume
+// from suspend, `date -s`) and /etc/localtime is watched, so the timezone is only read again when it changes
+class Clock
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Clock> Ptr;
+	enum Resolution : uint8_t {
+		ResolutionSecond,
+		ResolutionMinute,
+		ResolutionHour,
+		ResolutionDay
+	};
+
+	Clock() = delete;
+	Clock(const Private&) {}
+	~Clock();
+	static Clock::Ptr Create(CorePtr core)
+	{
+		auto ptr = std::make_unique<Clock>(Private());
+		if (!ptr->Init(core))
+			return nullptr;
+		return ptr;
+	}
+
+	// Publishes `format` under `key` right away and on every boundary it needs, replaces the format of a known key
+	void AddFormat(std::string_view key, std::string_view format);
+	// The key is published empty
+	void RemoveFormat(std::string_view key);
+
+	// Finest boundary that changes the output of `format`, conversions that aren't known count as seconds
+	static Resolution GetResolution(std::string_view format);
+
+private:
+	enum class Field : uint8_t {
+		Literal,
+		Year,
+		ShortYear,
+		Month,
+		Day,
+		PaddedDay,
+		Hour,
+		Hour12,
+		Minute,
+		Second,
+		AmPm,
+		ShortWeekday,
+		Weekday,
+		ShortMonth,
+		MonthName,
+		YearDay,
+		MondayWeekday,
+		SundayWeekday,
+		Epoch,
+		ZoneName,
+		ZoneOffset,
+		// Conversion without a field of its own, the step's text is handed to strftime
+		Other
+	};
+	struct Step {
+		Field field = Field::Literal;
+		// Into `Format::text`
+		uint32_t offset = 0;
+		uint32_t length = 0;
+	};
+	struct Format {
+		std::string key;
+		std::string text;
+		std::vector<Step> steps;
+		Resolution resolution = ResolutionDay;
+		// Reused, publishing doesn't allocate once it has grown
+		std::string value;
+	};
+
+	bool Init(CorePtr core);
+	static void Compile(std::string_view format, Format &compiled);
+	void Render(Format &format, time_t now, const tm &local);
+	void OnTimer();
+	void OnTimezone();
+	// Publishes every format for now and arms the timer at the next boundary
+	void Tick();
+
+	CorePtr core;
+	int timerFd = -1;
+	int inotifyFd = -1;
+	std::vector<Format> formats;
+	// Short and full names of days and months in the current locale, read once
+	std::string weekdayNames[2][7];
+	std::string monthNames[2][12];
+	std::string amPmNames[2];
+};
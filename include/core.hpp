@@ -1,12 +1,27 @@
 #pragma once
 
+#include "seat.hpp"
+#include "settings.hpp"
+#include "taskbar.hpp"
 #include "vulkanInclude.hpp"
+#include "waylandListener.hpp"
+#include "widgetStore.hpp"
 #include "wlr-layer-shell-unstable-v1-wrapper.hpp"
+#include <fractional-scale-v1.h>
+#include <presentation-time.h>
+#include <viewporter.h>
 #include <wayland-client.h>
+#include <wlr-output-power-management-unstable-v1.h>
+#include <wlr-screencopy-unstable-v1.h>
 #include <xdg-shell.h>
+#include <ctime>
 #include <cstdint>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 class Core : public std::enable_shared_from_this<Core>
 {
@@ -15,44 +30,119 @@ class Core : public std::enable_shared_from_this<Core>
 	struct Private { explicit Private() = default; };
 public:
 	typedef std::shared_ptr<Core> Ptr;
-	struct WlRegistryListenerWrapper {
-		std::function<void(wl_registry *registry, uint32_t name, const char* interface, uint32_t version)> onGlobal;
-		~WlRegistryListenerWrapper() {
-			onGlobal = nullptr;
-		}
+	// Gets epoll events (EPOLLIN, EPOLLOUT, EPOLLHUP...) of the fd
+	typedef std::function<void(uint32_t events)> FdCallbackType;
+	// Called before the wl_output is destroyed, a new output may get its address afterwards
+	typedef std::function<void(wl_output *output)> OnOutputRemovedCallbackType;
+	struct Output {
+		wl_output *output = nullptr;
+		uint32_t name = 0;
+		int32_t scale = 1;
+		int32_t pendingScale = 1;
+		// DPMS state, if the compositor supports wlr-output-power-management
+		zwlr_output_power_v1 *power = nullptr;
+		bool powered = true;
+
+		void OnScale(wl_output *output, int32_t factor);
+		void OnDone(wl_output *output);
+		void OnPowerMode(zwlr_output_power_v1 *power, uint32_t mode);
+		void OnPowerFailed(zwlr_output_power_v1 *power);
+		static const wl_output_listener listener;
+		static const zwlr_output_power_v1_listener powerListener;
 	};
-	struct XdgWmBaseListenerWrapper {
-		std::function<void(xdg_wm_base *shell, uint32_t serial)> onPing;
-		~XdgWmBaseListenerWrapper() {
-			onPing = nullptr;
-		}
+	// Entry points of the Vulkan 1.3 path, loaded from the device so that an older loader still starts the bar
+	struct Vulkan13Functions {
+		PFN_vkCmdBeginRendering cmdBeginRendering = nullptr;
+		PFN_vkCmdEndRendering cmdEndRendering = nullptr;
+		PFN_vkCmdPipelineBarrier2 cmdPipelineBarrier2 = nullptr;
+		PFN_vkQueueSubmit2 queueSubmit2 = nullptr;
+		PFN_vkWaitSemaphores waitSemaphores = nullptr;
 	};
 
 	Core() = delete;
-	Core(const Core::Private&);
+	Core(const Core::Private&, const Settings &settings);
 	~Core();
-	static Core::Ptr Create()
+	static Core::Ptr Create(const Settings &settings = Settings())
 	{
-		auto ptr = std::make_shared<Core>(Private());
+		auto ptr = std::make_shared<Core>(Private(), settings);
 		if (!ptr->Init())
 			return nullptr;
 		return ptr;
 	}
 
+	const Settings &GetSettings() const { return settings; }
+	WidgetStore &GetWidgetStore() { return widgetStore; }
+
+	// Event loop. Callbacks may add and remove fds, including their own. An fd number that is reused within one
+	// dispatch may get a stale readiness event, so registered fds must be non-blocking
+	bool AddFd(int fd, uint32_t events, FdCallbackType callback);
+	bool ModifyFd(int fd, uint32_t events);
+	void RemoveFd(int fd);
+	// Waits up to `timeout` milliseconds (-1 for infinity) for Wayland events or registered fds and dispatches them
+	bool Dispatch(int timeout);
+
 	wl_display* GetDisplay() { return display; }
 	wl_compositor* GetCompositor() { return compositor; }
 	zwlr_layer_shell_v1* GetLayerShell() { return layerShell; }
 	xdg_wm_base* GetXdgWmBase() { return shell; }
+	wp_presentation* GetPresentation() { return presentation; }
+	wp_viewporter* GetViewporter() { return viewporter; }
+	wp_fractional_scale_manager_v1* GetFractionalScaleManager() { return fractionalScaleManager; }
+	wl_shm* GetShm() { return shm; }
+	// nullptr if the compositor doesn't support wlr-screencopy
+	zwlr_screencopy_manager_v1* GetScreencopyManager() { return screencopyManager; }
+	// nullptr if the compositor doesn't support wlr-foreign-toplevel-management
+	Taskbar* GetTaskbar() { return taskbar.get(); }
+	// nullptr without a seat, only the first one is followed
+	Seat* GetSeat() { return seat.get(); }
+	// False once the output was removed, its wl_output is destroyed then
+	bool HasOutput(wl_output *output) const;
+	// Integer scale of an output, 1 if it's unknown
+	int32_t GetOutputScale(wl_output *output) const;
+	// False while the output is powered off, true if it's unknown
+	bool IsOutputPowered(wl_output *output) const;
+	// Changes whenever an output is added
+	uint64_t GetOutputsGeneration() const { return outputsGeneration; }
+	// For everything that keeps wl_output pointers. Callbacks must not unsubscribe
+	uint32_t SubscribeOutputRemoved(OnOutputRemovedCallbackType onOutputRemoved);
+	void UnsubscribeOutputRemoved(uint32_t id);
+	clockid_t GetPresentationClock() const { return presentationClock; }
+	// Current time of the presentation clock in nanoseconds
+	uint64_t GetPresentationTime() const;
 
 	VkInstance GetInstance() const { return instance; }
 	VkPhysicalDevice GetPhysicalDevice() const { return physicalDevice; }
 	VkDevice GetDevice() const { return device; }
 	uint32_t GetQueueFamilyIndex() const { return queueFamilyIndex; }
+	// Every window's render thread submits to and presents on the one queue of the family, and waits for the device;
+	// Vulkan wants those externally synchronized
+	std::mutex& GetQueueMutex() { return queueMutex; }
+	// Set when the device was created with dynamic rendering, synchronization2 and timeline semaphores
+	const Vulkan13Functions* GetVulkan13() const { return vulkan13.queueSubmit2 ? &vulkan13 : nullptr; }
 
 	bool IsVulkanInitialized() const { return vulkanInitialized; }
 
 private:
 	bool Init();
+	void AddOutput(wl_registry *registry, uint32_t name, uint32_t version);
+	void WatchOutputPower(Output &output);
+
+	// Wayland events
+	void OnRegistryGlobal(wl_registry *registry, uint32_t name, const char *interface, uint32_t version);
+	void OnRegistryGlobalRemove(wl_registry *registry, uint32_t name);
+	void OnXdgWmBasePing(xdg_wm_base *shell, uint32_t serial);
+	void OnPresentationClockId(wp_presentation *presentation, uint32_t clockId);
+	static const wl_registry_listener wlRegistryListener;
+	static const xdg_wm_base_listener xdgWmBaseListener;
+	static const wp_presentation_listener wpPresentationListener;
+
+	Settings settings;
+	WidgetStore widgetStore;
+
+	// Event loop
+	int epollFd = -1;
+	// Shared, so a callback that removes itself keeps running
+	std::unordered_map<int, std::shared_ptr<FdCallbackType>> fdCallbacks;
 
 	// Wayland
 	wl_display *display = nullptr;
@@ -60,8 +150,21 @@ private:
 	wl_compositor *compositor = nullptr;
 	zwlr_layer_shell_v1 *layerShell = nullptr;
 	xdg_wm_base *shell = nullptr;
-	std::unique_ptr<WlRegistryListenerWrapper> wlRegistryListenerWrapper;
-	std::unique_ptr<XdgWmBaseListenerWrapper> xdgWmBaseListenerWrapper;
+	wp_presentation *presentation = nullptr;
+	wp_viewporter *viewporter = nullptr;
+	wp_fractional_scale_manager_v1 *fractionalScaleManager = nullptr;
+	zwlr_output_power_manager_v1 *outputPowerManager = nullptr;
+	wl_shm *shm = nullptr;
+	zwlr_screencopy_manager_v1 *screencopyManager = nullptr;
+	// Pointers are handed to listeners, so outputs don't move
+	std::vector<std::unique_ptr<Output>> outputs;
+	uint64_t outputsGeneration = 0;
+	std::list<std::pair<uint32_t, OnOutputRemovedCallbackType>> outputRemovedSubscribers;
+	uint32_t lastOutputRemovedSubscriberId = 0;
+	Taskbar::Ptr taskbar;
+	Seat::Ptr seat;
+	uint32_t seatName = 0;
+	clockid_t presentationClock = CLOCK_MONOTONIC;
 
 	void TryInitVulkan();
 	bool InitVkInstance();
@@ -74,5 +177,8 @@ private:
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
 	VkDevice device = VK_NULL_HANDLE;
 	uint32_t queueFamilyIndex = 0;
+	std::mutex queueMutex;
+	uint32_t instanceVersion = VK_API_VERSION_1_0;
+	Vulkan13Functions vulkan13;
 	bool vulkanInitialized = false;
 };
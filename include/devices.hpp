@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Core;
+
+// Power supplies, backlights and display connectors from sysfs, read again when the kernel sends a uevent for
+// them on a NETLINK_KOBJECT_UEVENT socket in the event loop. Published keys:
+//   power.<name>.type                  Battery, Mains, USB...
+//   power.<name>.capacity, .status     batteries, percent and Charging/Discharging/Full...
+//   power.<name>.online                other supplies, 1 or 0
+//   power.ac                           1 if any non-battery supply is online
+//   backlight.<name>.brightness        percent of the maximum
+//   display.<connector>.status         connected or disconnected, like `card0-HDMI-A-1`
+// Removed devices are published with empty values. Some firmware changes the battery capacity without an event,
+// so while there is a battery its values are also read every `safetyPollInterval`.
+// A data source only: the keys are drawn through `--text` templates, which update their label as soon as a value is
+// published
+class Devices
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Devices> Ptr;
+	static constexpr uint64_t safetyPollInterval = 60'000'000'000;
+	enum Changes : uint32_t {
+		ChangedNothing = 0,
+		ChangedPower = 1 << 0,
+		ChangedBacklight = 1 << 1,
+		ChangedDisplays = 1 << 2
+	};
+	// Called once per batch of uevents with what changed in it
+	typedef std::function<void(uint32_t changes)> OnChangeCallbackType;
+
+	Devices() = delete;
+	Devices(const Private&) {}
+	~Devices();
+	static Devices::Ptr Create(CorePtr core)
+	{
+		auto ptr = std::make_unique<Devices>(Private());
+		if (!ptr->Init(core))
+			return nullptr;
+		return ptr;
+	}
+
+	void SetOnChange(OnChangeCallbackType onChange);
+
+private:
+	bool Init(CorePtr core);
+	void OnReadable();
+	void OnTimer();
+	void HandleEvent(std::string_view action, std::string_view subsystem, std::string_view name);
+	// Everything is read again, after start and after lost events
+	void Rescan();
+	void UpdatePowerSupply(const std::string &name, bool removed);
+	void UpdateAc();
+	void UpdateBacklight(const std::string &name, bool removed);
+	// Connectors come and go with MST docks, so they are listed again on every drm event
+	void UpdateDisplays();
+	void UpdateSafetyPoll();
+	// Returns true if the value changed
+	bool PublishValue(std::string_view prefix, std::string_view name, std::string_view field, std::string_view value);
+
+	CorePtr core;
+	int ueventFd = -1;
+	int timerFd = -1;
+	std::vector<char> receiveBuffer;
+	std::set<std::string, std::less<>> powerSupplies;
+	std::set<std::string, std::less<>> batteries;
+	std::set<std::string, std::less<>> backlights;
+	std::set<std::string, std::less<>> connectors;
+	bool safetyPollArmed = false;
+	uint32_t changes = ChangedNothing;
+	OnChangeCallbackType onChange;
+	// Reused for the widget keys, so publishing doesn't allocate once it has grown
+	std::string keyBuffer;
+};
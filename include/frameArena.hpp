@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for the data that lives for one frame: layout, text runs, draw lists. Everything is freed at once by
+// Reset() at the frame boundary. A frame that didn't fit gets extra blocks, and they are merged into one block that fits
+// on the next Reset(), so a steady state frame doesn't touch the heap
+class FrameArena
+{
+public:
+	static constexpr std::size_t defaultBlockSize = 64 * 1024;
+
+	// std::allocator replacement for containers that live within a frame, deallocation is a no-op
+	template<typename Type>
+	class Allocator
+	{
+	public:
+		typedef Type value_type;
+
+		Allocator(FrameArena &arena) : arena(&arena) {}
+		template<typename Other>
+		Allocator(const Allocator<Other> &other) : arena(other.arena) {}
+
+		Type* allocate(std::size_t count) { return static_cast<Type*>(arena->Allocate(count * sizeof(Type), alignof(Type))); }
+		void deallocate(Type *pointer, std::size_t count) { (void)pointer; (void)count; }
+
+		template<typename Other>
+		bool operator==(const Allocator<Other> &other) const { return arena == other.arena; }
+
+	private:
+		template<typename Other>
+		friend class Allocator;
+		FrameArena *arena;
+	};
+	template<typename Type>
+	using Vector = std::vector<Type, Allocator<Type>>;
+
+	explicit FrameArena(std::size_t blockSize = defaultBlockSize);
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator=(const FrameArena&) = delete;
+
+	void* Allocate(std::size_t size, std::size_t alignment);
+	// Nothing is destroyed on Reset(), so only trivially destructible types are allowed
+	template<typename Type>
+	std::span<Type> AllocateArray(std::size_t count)
+	{
+		static_assert(std::is_trivially_destructible_v<Type>, "Frame arena doesn't run destructors");
+		auto pointer = static_cast<Type*>(Allocate(count * sizeof(Type), alignof(Type)));
+		std::uninitialized_value_construct_n(pointer, count);
+		return std::span<Type>(pointer, count);
+	}
+	// Invalidates everything allocated since the previous Reset()
+	void Reset();
+	// Reset() that also gives back what the busiest frames made the block grow to
+	void Shrink();
+
+	std::size_t GetUsedSize() const { return usedSize; }
+	std::size_t GetCapacity() const { return blockSize + overflowSize; }
+
+private:
+	std::unique_ptr<std::byte[]> block;
+	std::size_t blockSize = 0;
+	std::size_t initialBlockSize = 0;
+	// Blocks added during the frame, the last one is the one being filled
+	std::vector<std::pair<std::unique_ptr<std::byte[]>, std::size_t>> overflowBlocks;
+	std::size_t overflowSize = 0;
+	std::byte *current = nullptr;
+	std::size_t currentSize = 0;
+	std::size_t offset = 0;
+	std::size_t usedSize = 0;
+};
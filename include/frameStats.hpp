@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+
+// Histogram with power-of-two buckets over microseconds, so adding a sample never allocates
+class LatencyHistogram
+{
+public:
+	static constexpr std::size_t bucketsCount = 24; // up to ~8 seconds
+
+	void Add(uint64_t nanoseconds);
+	void Reset() { *this = LatencyHistogram(); }
+
+	uint64_t GetCount() const { return count; }
+	uint64_t GetMin() const { return count ? min : 0; }
+	uint64_t GetMax() const { return max; }
+	uint64_t GetAverage() const { return count ? sum / count : 0; }
+	// Upper bound of the bucket that holds the given percentile (0..100), in nanoseconds
+	uint64_t GetPercentile(double percentile) const;
+
+	void Dump(std::ostream &out, const char *name) const;
+
+private:
+	std::array<uint64_t, bucketsCount> buckets{};
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t min = std::numeric_limits<uint64_t>::max();
+	uint64_t max = 0;
+};
+
+// Frame timings gathered from wp_presentation feedback. All times are in nanoseconds on the presentation clock
+class FrameStats
+{
+public:
+	// `consecutive` if the frame was meant for the vblank after the last presented one, only those count missed
+	// vblanks and present intervals; the bar skips vblanks on purpose while nothing changes
+	void OnPresented(uint64_t updateTime, uint64_t inputTime, uint64_t presentTime, uint32_t refresh, uint64_t sequence, bool consecutive);
+	void OnDiscarded() { discardedFrames++; }
+	void OnUntracked() { untrackedFrames++; }
+	void Reset() { *this = FrameStats(); }
+
+	const LatencyHistogram &GetUpdateToPresent() const { return updateToPresent; }
+	const LatencyHistogram &GetInputToPhoton() const { return inputToPhoton; }
+	const LatencyHistogram &GetPresentInterval() const { return presentInterval; }
+	uint64_t GetPresentedFrames() const { return presentedFrames; }
+	uint64_t GetDiscardedFrames() const { return discardedFrames; }
+	uint64_t GetMissedFrames() const { return missedFrames; }
+
+	void Dump(std::ostream &out) const;
+
+private:
+	LatencyHistogram updateToPresent;
+	LatencyHistogram inputToPhoton;
+	LatencyHistogram presentInterval;
+	uint64_t presentedFrames = 0;
+	uint64_t discardedFrames = 0;
+	uint64_t untrackedFrames = 0;
+	// Vblanks skipped between a presented frame and a consecutive one
+	uint64_t missedFrames = 0;
+	uint64_t lastPresentTime = 0;
+	// vblank counter of the last presentation, 0 if it wasn't synchronized to one
+	uint64_t lastSequence = 0;
+	uint32_t lastRefresh = 0;
+};
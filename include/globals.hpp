@@ -1,6 +1,11 @@
 #pragma once
 
+#include <cstdint>
+
 constexpr const auto appName = "NCBar";
 constexpr const auto appId = "ncbar";
 constexpr const auto engineName = "ncbar";
 constexpr const auto windowTitle = "NyanCoder's Bar [Window]";
+// Logical size of a window the compositor lets us choose the size of
+constexpr const uint32_t defaultWindowWidth = 1280;
+constexpr const uint32_t defaultWindowHeight = 720;
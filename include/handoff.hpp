@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+class Core;
+
+// State handed from a running instance to the one replacing it (`--replace`). The successor asks the running instance
+// for its state over the control socket (`handoff`), renders its first frame from it and only then tells it to `quit`,
+// so the bar never disappears and no cache starts cold.
+// The state is a sealed memfd of tagged sections, sections that a version doesn't know are skipped
+class Handoff
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Handoff> Ptr;
+	// How long the running instance gets to reply and to exit, in milliseconds
+	static constexpr int timeout = 5000;
+	static constexpr std::size_t maxStateSize = 64 * 1024 * 1024;
+	// How long restored module values are shown without their module publishing them again, in milliseconds.
+	// WidgetStore::ClearProvisional() is due then
+	static constexpr int provisionalTimeout = 5000;
+
+	Handoff() = delete;
+	Handoff(const Private&) {}
+	~Handoff();
+	// Takes the state of the instance listening on `socketPath` (the default path if empty) into the core,
+	// nullptr if there is no instance or it didn't reply
+	static Handoff::Ptr Create(CorePtr core, const std::string &socketPath)
+	{
+		auto ptr = std::make_unique<Handoff>(Private());
+		if (!ptr->Init(core, socketPath))
+			return nullptr;
+		return ptr;
+	}
+
+	// Asks the previous instance to quit and waits until it has released the control socket
+	bool Finish();
+
+	static void Serialize(Core &core, std::string &data);
+	static bool Restore(Core &core, std::string_view data);
+
+private:
+	bool Init(CorePtr core, const std::string &socketPath);
+	// Reads one reply line, `fd` gets the fd that came with it or -1
+	bool ReadLine(std::string &line, int *fd);
+
+	int connectionFd = -1;
+	std::string input;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Widget bounds of a horizontal bar as x-ranges sorted by their start, a point is found with one binary search and a
+// short walk back over the ranges that may still reach it. Filled in whole when the layout changes and only read
+// between layouts, so pointer motion never allocates
+class HitIndex
+{
+public:
+	struct Entry {
+		int32_t x0 = 0;
+		int32_t x1 = 0;
+		int32_t y0 = 0;
+		int32_t y1 = 0;
+		uint32_t id = 0;
+	};
+
+	// Keeps the memory for the next build
+	void Clear();
+	// Areas may come in any order and overlap, Build sorts them once all are in. Id 0 is what Find reports for no
+	// widget, its areas (the background spanning the bar) aren't added: they would keep every walk back going to the
+	// first entry
+	void Add(uint32_t id, int32_t x, int32_t y, uint32_t width, uint32_t height);
+	void Build();
+	// Highest id among the areas under the point, the one drawn on top; 0 if there is none
+	uint32_t Find(int32_t x, int32_t y) const;
+	std::size_t GetSize() const { return entries.size(); }
+
+private:
+	std::vector<Entry> entries;
+	// Largest x1 of the entries up to each one, the walk back stops where nothing before reaches the point
+	std::vector<int32_t> reach;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Core;
+
+// Decodes PNG and JPEG files on a worker thread and scales them down to a height once, so a large cover never
+// stalls a frame. Results are handed back on the event loop through an eventfd. Formats whose library wasn't found
+// at build time (NCBAR_HAVE_PNG, NCBAR_HAVE_JPEG) fail to decode
+class ImageDecoder
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<ImageDecoder> Ptr;
+	// Larger images fail to decode, their headers alone would make the worker allocate whatever they claim
+	static constexpr uint64_t maxPixels = 8192 * 8192;
+	// Straight alpha RGBA
+	struct Image {
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::vector<uint8_t> pixels;
+	};
+	typedef std::shared_ptr<const Image> ImagePtr;
+	// `image` is nullptr if the file couldn't be read or decoded
+	typedef std::function<void(const std::string &path, uint32_t height, ImagePtr image)> OnDecodedCallbackType;
+
+	ImageDecoder() = delete;
+	ImageDecoder(const Private&) {}
+	~ImageDecoder();
+	static ImageDecoder::Ptr Create(CorePtr core)
+	{
+		auto ptr = std::make_unique<ImageDecoder>(Private());
+		if (!ptr->Init(core))
+			return nullptr;
+		return ptr;
+	}
+
+	void SetOnDecoded(OnDecodedCallbackType onDecoded);
+	// Images taller than `height` are scaled down to it keeping the aspect, smaller ones are kept as they are.
+	// A request that is already queued isn't queued again
+	void Decode(const std::string &path, uint32_t height);
+
+	// What the worker runs, usable on its own
+	static ImagePtr DecodeFile(const std::string &path, uint32_t height);
+
+private:
+	struct Request {
+		std::string path;
+		uint32_t height = 0;
+		ImagePtr image;
+	};
+
+	bool Init(CorePtr core);
+	void Run();
+	void OnReadable();
+
+	CorePtr core;
+	OnDecodedCallbackType onDecoded;
+	int eventFd = -1;
+	std::thread worker;
+	// Guards the queues and `stopping`
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::deque<Request> requests;
+	std::vector<Request> results;
+	bool stopping = false;
+};
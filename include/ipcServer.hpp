@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Core;
+
+// Control socket for external scripts. The protocol is line based:
+//   set <key> <value>       store a value, nothing is replied unless it fails
+//   setfd <key> <size>      same, but the value is the first <size> bytes of a memfd passed along with the line
+//   get <key>               replies `value <key> <value>`
+//   list                    replies `value <key> <value>` for every key and then `end`
+//   subscribe [prefix]      replies with the current state like `list` and then streams `changed <key> <value>`
+//   handoff                 replies `handofffd <size>` with the state for a successor in a sealed memfd (see Handoff)
+//   quit                    asks the bar to exit, the socket is unlinked before the connections are closed
+// Values larger than `largeValueSize` or with line breaks are replied as `valuefd <key> <size>` or
+// `changedfd <key> <size>` with a sealed memfd attached. Errors are replied as `error <message>`
+class IpcServer
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<IpcServer> Ptr;
+	static constexpr std::size_t maxClientsCount = 128;
+	static constexpr std::size_t maxLineSize = 64 * 1024;
+	static constexpr std::size_t maxPayloadSize = 16 * 1024 * 1024;
+	static constexpr std::size_t largeValueSize = 4096;
+	// A subscriber that doesn't read is dropped rather than buffered forever
+	static constexpr std::size_t maxOutputSize = 4 * 1024 * 1024;
+
+	IpcServer() = delete;
+	IpcServer(const Private&) {}
+	~IpcServer();
+	static IpcServer::Ptr Create(CorePtr core, const std::string &socketPath)
+	{
+		auto ptr = std::make_unique<IpcServer>(Private());
+		if (!ptr->Init(core, socketPath))
+			return nullptr;
+		return ptr;
+	}
+
+	// $XDG_RUNTIME_DIR/ncbar-$WAYLAND_DISPLAY.sock, empty without XDG_RUNTIME_DIR: a shared directory like /tmp would
+	// let other users race for the path
+	static std::string GetDefaultSocketPath();
+	// The process on the other end of the connected socket runs as our user, nobody else may control us or read
+	// our state
+	static bool IsPeerTrusted(int fd);
+	// Passes the first `size` bytes of a received file to `consume`. Mapped if the sender sealed it against shrinking,
+	// read into a copy otherwise: a file truncated under the mapping would kill the bar with SIGBUS. False if the file
+	// is smaller than `size` or can't be read
+	static bool ReadFd(int fd, std::size_t size, const std::function<void(std::string_view)> &consume);
+	const std::string &GetSocketPath() const { return socketPath; }
+	bool IsQuitRequested() const { return quitRequested; }
+
+private:
+	struct Client {
+		int fd = -1;
+		std::string input;
+		std::string output;
+		// fds received with the input, consumed by `setfd` in order
+		std::deque<int> receivedFds;
+		// fds to send, attached to the output byte at the given offset
+		std::deque<std::pair<std::size_t, int>> outputFds;
+		std::string subscriptionPrefix;
+		bool subscribed = false;
+		bool watchingOutput = false;
+		bool closing = false;
+	};
+
+	bool Init(CorePtr core, const std::string &socketPath);
+	void OnAccept();
+	void OnClientEvents(Client *client, uint32_t events);
+	bool ReadClient(Client *client);
+	void HandleLine(Client *client, std::string_view line);
+	void OnChange(std::string_view key, std::string_view value);
+	void QueueValue(Client *client, std::string_view tag, std::string_view key, std::string_view value);
+	bool FlushClient(Client *client);
+	void UpdateClientEvents(Client *client);
+	void CloseClient(Client *client);
+	// Clients are destroyed only here, out of their own callbacks
+	void ReapClients();
+
+	CorePtr core;
+	std::string socketPath;
+	int listenFd = -1;
+	std::vector<std::unique_ptr<Client>> clients;
+	uint32_t subscriptionId = 0;
+	bool handlingClient = false;
+	bool quitRequested = false;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+// Leveled logging that never waits for the terminal or the journal.
+//
+//   NCBAR_LOG_ERROR << "Clock: Failed to create timer: " << strerror(errno);
+//
+// A line is formatted in place into a slot of a lock-free ring that any thread may write, and a flusher thread
+// writes the slots out in batches, errors and warnings to stderr, the rest to stdout. A full ring drops lines and
+// the flusher reports how many, so a burst of validation messages costs the frame loop a few copies at most.
+// Lines below NCBAR_LOG_LEVEL (0 debug, 1 info, 2 warning, 3 error) are compiled out together with their arguments.
+// What's logged before the program exits is written out, Flush() waits for it before then
+class Log
+{
+public:
+	enum Level : uint8_t {
+		LevelDebug,
+		LevelInfo,
+		LevelWarning,
+		LevelError
+	};
+#ifdef NCBAR_LOG_LEVEL
+	static constexpr Level minLevel = static_cast<Level>(NCBAR_LOG_LEVEL);
+#else
+	static constexpr Level minLevel = LevelInfo;
+#endif
+	// A validation message fits in a slot, longer lines are cut
+	static constexpr std::size_t slotSize = 2048;
+	static constexpr std::size_t slotsCount = 256;
+	struct Slot;
+
+	static constexpr bool IsEnabled(Level level) { return level >= minLevel; }
+
+	// One line, published when it goes out of scope
+	class Line
+	{
+	public:
+		explicit Line(Level level);
+		~Line();
+		Line(const Line&) = delete;
+		Line& operator=(const Line&) = delete;
+
+		Line& operator<<(std::string_view text);
+		Line& operator<<(const char *text) { return *this << std::string_view(text ? text : "(null)"); }
+		Line& operator<<(char c) { return *this << std::string_view(&c, 1); }
+		Line& operator<<(bool value) { return *this << std::string_view(value ? "true" : "false"); }
+		Line& operator<<(double number);
+		template<typename Integer> requires std::is_integral_v<Integer> && (!std::is_same_v<Integer, bool>)
+		Line& operator<<(Integer number)
+		{
+			char digits[24];
+			const auto end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+			return *this << std::string_view(digits, static_cast<std::size_t>(end - digits));
+		}
+
+	private:
+		// nullptr if the line is dropped
+		Slot *slot = nullptr;
+		uint64_t position = 0;
+	};
+
+	// Waits until the lines logged so far are written
+	static void Flush();
+};
+
+// A loop and not an `if`, so that it nests in an if-else without braces. The condition is a constant, disabled lines
+// are dropped by the compiler
+#define NCBAR_LOG(level) for (bool ncbarLogOnce = Log::IsEnabled(Log::level); ncbarLogOnce; ncbarLogOnce = false) Log::Line(Log::level)
+#define NCBAR_LOG_DEBUG NCBAR_LOG(LevelDebug)
+#define NCBAR_LOG_INFO NCBAR_LOG(LevelInfo)
+#define NCBAR_LOG_WARNING NCBAR_LOG(LevelWarning)
+#define NCBAR_LOG_ERROR NCBAR_LOG(LevelError)
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "bus.hpp"
+#include "imageDecoder.hpp"
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Core;
+
+// MPRIS media players on the session bus. Players are followed through PropertiesChanged and Seeked signals,
+// Position is never polled: the progress is interpolated from the last known position and rate, and a timer wakes
+// up only when the fill of a progress bar of `SetProgressWidth` pixels moves by one pixel. The active player is the
+// one playing, or the one that changed last. Its state is published as `media.player`, `media.status`,
+// `media.title`, `media.artist`, `media.album`, `media.art_url` and `media.length` (seconds), empty without a player.
+// Local album art (`file://`) is decoded on the ImageDecoder's thread, scaled to `SetArtHeight` and kept in a small
+// LRU cache, so going back to a track doesn't decode its cover again
+class Media
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Media> Ptr;
+	// Covers kept decoded, at one size each
+	static constexpr std::size_t artCacheCapacity = 8;
+	enum Changes : uint32_t {
+		ChangedNothing = 0,
+		// Another player became active, or the last one went away
+		ChangedPlayer = 1 << 0,
+		ChangedStatus = 1 << 1,
+		ChangedTrack = 1 << 2,
+		// The progress bar moved by a pixel, or the position jumped
+		ChangedProgress = 1 << 3,
+		ChangedArt = 1 << 4
+	};
+	typedef std::function<void(uint32_t changes)> OnChangeCallbackType;
+
+	Media() = delete;
+	Media(const Private&) {}
+	~Media();
+	static Media::Ptr Create(CorePtr core, Bus::Ptr bus)
+	{
+		auto ptr = std::make_unique<Media>(Private());
+		if (!ptr->Init(core, bus))
+			return nullptr;
+		return ptr;
+	}
+
+	void SetOnChange(OnChangeCallbackType onChange);
+	// Height in device pixels covers are scaled to
+	void SetArtHeight(uint32_t height);
+	// Width in device pixels of the progress bar, 0 while it isn't on screen stops the progress timer
+	void SetProgressWidth(uint32_t width);
+
+	bool HasPlayer() const { return active >= 0; }
+	bool IsPlaying() const;
+	// 0 to 1, interpolated to now; 0 if the track length isn't known
+	double GetProgress() const;
+	// Cover of the active player's track, nullptr while it's decoded or if there is none. Never changed once decoded,
+	// so it can be shared with another thread
+	const ImageDecoder::ImagePtr& GetArt() const { return art; }
+
+	void PlayPause();
+	void Next();
+	void Previous();
+
+private:
+	struct Player {
+		std::string busName;
+		// Unique name, signals come from it
+		std::string owner;
+		std::string status;
+		std::string title;
+		std::string artist;
+		std::string album;
+		std::string artUrl;
+		std::string trackId;
+		// Microseconds, the position at `positionTime` (CLOCK_MONOTONIC nanoseconds)
+		int64_t length = 0;
+		int64_t position = 0;
+		uint64_t positionTime = 0;
+		double rate = 1.0;
+		// Order of the last change, the most recent one wins when nothing plays
+		uint64_t lastChange = 0;
+	};
+	struct ArtEntry {
+		std::string path;
+		uint32_t height = 0;
+		ImageDecoder::ImagePtr image;
+	};
+
+	bool Init(CorePtr core, Bus::Ptr bus);
+	void AddPlayer(const std::string &busName, const std::string &owner);
+	void RemovePlayer(const std::string &busName);
+	void FetchProperties(const std::string &busName);
+	void FetchPosition(const std::string &busName);
+	// Properties of a GetAll reply or of PropertiesChanged, returns the changes
+	uint32_t ReadProperties(Player &player, DBusMessageIter *dictionary);
+	int32_t FindPlayer(const std::string &busName) const;
+	int64_t GetPosition(const Player &player) const;
+	void CallPlayer(const char *method);
+
+	bool OnMessage(DBusMessage *message);
+	void OnTimer();
+	void OnDecoded(const std::string &path, uint32_t height, ImageDecoder::ImagePtr image);
+	// Picks the active player, publishes it, looks up its cover and rearms the timer, then reports `changes` of the
+	// player at `index` if it's the active one
+	void Update(int32_t index, uint32_t changes);
+	void UpdateArt(uint32_t &changes);
+	void ArmProgressTimer();
+	void Publish();
+
+	CorePtr core;
+	Bus::Ptr bus;
+	ImageDecoder::Ptr decoder;
+	uint32_t filterId = 0;
+	int timerFd = -1;
+	std::vector<Player> players;
+	int32_t active = -1;
+	std::string activeName;
+	uint64_t changeCounter = 0;
+	uint32_t artHeight = 0;
+	uint32_t progressWidth = 0;
+	// Cover of the active track and the file it's from
+	std::string artPath;
+	ImageDecoder::ImagePtr art;
+	// Most recently used first
+	std::list<ArtEntry> artCache;
+	OnChangeCallbackType onChange;
+};
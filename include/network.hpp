@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Core;
+struct nlmsghdr;
+
+// Network state from rtnetlink. Link, address and route changes come as notifications on a NETLINK_ROUTE socket
+// in the event loop, so nothing is polled and nothing is published until the kernel reports a change.
+// Every interface publishes `network.<name>.state` (`up` or `down`), `network.<name>.ipv4` and
+// `network.<name>.ipv6` (space separated `address/prefix`), removed interfaces are published with empty values.
+// `network.default` is the interface of the default route with the lowest metric, IPv4 first.
+// While the throughput is visible, the counters of all links are read with one RTM_GETLINK dump every
+// `throughputInterval` and `network.<name>.rx_rate`, `network.<name>.tx_rate`, `network.rx_rate` and
+// `network.tx_rate` (all but loopback) are published in bytes per second
+class Network
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Network> Ptr;
+	static constexpr uint64_t throughputInterval = 1'000'000'000;
+	enum Changes : uint32_t {
+		ChangedNothing = 0,
+		ChangedLink = 1 << 0,
+		ChangedAddresses = 1 << 1,
+		ChangedDefaultRoute = 1 << 2,
+		ChangedThroughput = 1 << 3
+	};
+	// Called once per batch of kernel messages with what changed in it
+	typedef std::function<void(uint32_t changes)> OnChangeCallbackType;
+	struct Address {
+		uint8_t family = 0;
+		uint8_t prefixLength = 0;
+		std::array<uint8_t, 16> bytes = {};
+		uint64_t generation = 0;
+
+		bool operator==(const Address &other) const { return family == other.family && prefixLength == other.prefixLength && bytes == other.bytes; }
+	};
+	struct Interface {
+		std::string name;
+		bool up = false;
+		bool loopback = false;
+		std::vector<Address> addresses;
+		uint64_t rxBytes = 0;
+		uint64_t txBytes = 0;
+		// Counters at the previous throughput sample
+		bool sampled = false;
+		uint64_t sampleRxBytes = 0;
+		uint64_t sampleTxBytes = 0;
+		uint64_t rxRate = 0;
+		uint64_t txRate = 0;
+		uint64_t generation = 0;
+		uint32_t dirty = ChangedNothing;
+	};
+
+	Network() = delete;
+	Network(const Private&) {}
+	~Network();
+	static Network::Ptr Create(CorePtr core)
+	{
+		auto ptr = std::make_unique<Network>(Private());
+		if (!ptr->Init(core))
+			return nullptr;
+		return ptr;
+	}
+
+	void SetOnChange(OnChangeCallbackType onChange);
+	// The counters are dumped only while somebody shows them
+	void SetThroughputVisible(bool visible);
+
+	// Interfaces by index
+	const std::map<int32_t, Interface> &GetInterfaces() const { return interfaces; }
+	// Index of the interface with the default route, 0 if there is none
+	int32_t GetDefaultInterface() const;
+	bool IsDefaultInterfaceUp() const;
+	// Bytes per second over all interfaces but loopback
+	uint64_t GetRxRate() const { return rxRate; }
+	uint64_t GetTxRate() const { return txRate; }
+
+private:
+	enum Dumps : uint32_t {
+		DumpLinks = 1 << 0,
+		DumpAddresses = 1 << 1,
+		DumpRoutes = 1 << 2
+	};
+	struct DefaultRoute {
+		uint8_t family = 0;
+		int32_t interface = 0;
+		uint32_t priority = 0;
+		uint64_t generation = 0;
+	};
+
+	bool Init(CorePtr core);
+	void RequestDumps(uint32_t dumps);
+	bool SendNextDump();
+	void OnReadable();
+	void OnTimer();
+	void HandleMessage(const nlmsghdr *message);
+	void HandleLink(const nlmsghdr *message);
+	void HandleAddress(const nlmsghdr *message);
+	void HandleRoute(const nlmsghdr *message);
+	// Drops what the finished dump didn't report, it went away while notifications were lost
+	void FinishDump();
+	void RemoveInterface(std::map<int32_t, Interface>::iterator it);
+	void SampleThroughput();
+	void Publish();
+	// A removed interface publishes empty values
+	void PublishInterface(const Interface &interface, uint32_t fields, bool removed = false);
+	void PublishValue(std::string_view name, std::string_view field, std::string_view value);
+
+	CorePtr core;
+	int netlinkFd = -1;
+	int timerFd = -1;
+	std::vector<char> receiveBuffer;
+	std::map<int32_t, Interface> interfaces;
+	std::vector<DefaultRoute> defaultRoutes;
+	int32_t publishedDefaultInterface = 0;
+	// Dump that waits for its NLMSG_DONE and the ones queued after it, a socket runs one dump at a time
+	uint32_t runningDump = 0;
+	uint32_t pendingDumps = 0;
+	uint32_t dumpSequence = 0;
+	// The kernel changed the tables while dumping, what came is incomplete and the dump is repeated
+	bool dumpInterrupted = false;
+	uint64_t generation = 1;
+	uint32_t changes = ChangedNothing;
+	bool throughputVisible = false;
+	uint64_t sampleTime = 0;
+	uint64_t rxRate = 0;
+	uint64_t txRate = 0;
+	OnChangeCallbackType onChange;
+	// Reused for the widget keys, so publishing doesn't allocate once it has grown
+	std::string keyBuffer;
+};
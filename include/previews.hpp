@@ -0,0 +1,175 @@
+#pragma once
+
+#include "imageDecoder.hpp"
+#include "waylandListener.hpp"
+#include <wayland-client.h>
+#include <wlr-screencopy-unstable-v1.h>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Core;
+
+// Live thumbnails of outputs for the preview of a hovered taskbar entry, captured through zwlr_screencopy_manager_v1.
+// Nothing is captured, mapped or started until a preview is opened: then the output is copied into a wl_shm buffer
+// that is reused for every capture while it's open, and from the second capture on only once the compositor reports
+// damage, at most every `refreshInterval`. A worker thread box-filters the copy down to `SetThumbnailHeight`, only
+// where it was damaged, and the thumbnails stay in a small LRU cache per output, so hovering an entry again shows the
+// last one at once. The buffer is given back when the preview is closed
+class Previews
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Previews> Ptr;
+	typedef ImageDecoder::ImagePtr ImagePtr;
+	// A new thumbnail of the output
+	typedef std::function<void(wl_output *output)> OnChangeCallbackType;
+	// Outputs whose last thumbnail is kept
+	static constexpr std::size_t thumbnailsCapacity = 4;
+	static constexpr uint64_t refreshInterval = 100'000'000;
+	// Part of a capture, in its pixels
+	struct Damage {
+		uint32_t x = 0;
+		uint32_t y = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+	};
+
+	Previews() = delete;
+	Previews(const Private&) {}
+	~Previews();
+	// nullptr if the compositor has no screencopy
+	static Previews::Ptr Create(CorePtr core)
+	{
+		auto ptr = std::make_unique<Previews>(Private());
+		if (!ptr->Init(core))
+			return nullptr;
+		return ptr;
+	}
+
+	void SetOnChange(OnChangeCallbackType onChange);
+	// Device pixels, cached thumbnails of another height are made again by the next capture of their output
+	void SetThumbnailHeight(uint32_t height);
+	// Captures the output until Close() or until another one is opened
+	void Open(wl_output *output);
+	void Close();
+	wl_output* GetOpenOutput() const { return openOutput; }
+	// Last thumbnail of the output, nullptr if it wasn't captured yet or fell out of the cache
+	ImagePtr GetThumbnail(wl_output *output) const;
+
+	// What the worker runs, usable on its own. Box-filters the part of a 32-bit wl_shm capture that covers `damage`
+	// into `thumbnail`, which has to be of the size Downscale() picks for its height and hold the rest already.
+	// `sums` is scratch memory that keeps its capacity
+	static void Downscale(const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t stride, uint32_t format, bool yInvert, const Damage &damage, ImageDecoder::Image &thumbnail, std::vector<uint32_t> &sums);
+	static uint32_t GetThumbnailWidth(uint32_t width, uint32_t height, uint32_t thumbnailHeight);
+	static bool IsFormatSupported(uint32_t format);
+
+private:
+	// A wl_shm buffer the compositor copies into, mapped for the worker
+	struct Buffer {
+		uint8_t *data = nullptr;
+		std::size_t size = 0;
+		wl_buffer *buffer = nullptr;
+		uint32_t format = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t stride = 0;
+	};
+	struct Thumbnail {
+		wl_output *output = nullptr;
+		// Size of the capture it was made from
+		uint32_t sourceWidth = 0;
+		uint32_t sourceHeight = 0;
+		ImagePtr image;
+	};
+	// One downscale of the mapped buffer, at most one is in flight
+	struct Job {
+		wl_output *output = nullptr;
+		const uint8_t *pixels = nullptr;
+		uint64_t generation = 0;
+		uint32_t format = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t stride = 0;
+		bool yInvert = false;
+		Damage damage;
+		uint32_t thumbnailHeight = 0;
+		// Copied and updated where damaged, nullptr for a full downscale
+		ImagePtr previous;
+		ImagePtr result;
+	};
+
+	bool Init(CorePtr core);
+	void Run();
+	void OnReadable();
+	void OnTimer();
+	// Asks for the next copy of the open output
+	void Capture();
+	void StartCopy();
+	// Reuses the buffer if the frame wants one of the same size and format
+	bool PrepareBuffer();
+	void ReleaseBuffer();
+	void DestroyFrame();
+	Thumbnail* FindThumbnail(wl_output *output);
+	// Closes the preview of a removed output and drops its thumbnails
+	void ForgetOutput(wl_output *output);
+
+	// Wayland events
+	void OnBuffer(zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride);
+	void OnFlags(zwlr_screencopy_frame_v1 *frame, uint32_t flags);
+	void OnReady(zwlr_screencopy_frame_v1 *frame, uint32_t tvSecHi, uint32_t tvSecLo, uint32_t tvNsec);
+	void OnFailed(zwlr_screencopy_frame_v1 *frame);
+	void OnDamage(zwlr_screencopy_frame_v1 *frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+	void OnBufferDone(zwlr_screencopy_frame_v1 *frame);
+	static const zwlr_screencopy_frame_v1_listener frameListener;
+
+	CorePtr core;
+	OnChangeCallbackType onChange;
+	uint32_t thumbnailHeight = 0;
+	wl_output *openOutput = nullptr;
+	// Changes with every Open() and Close(), results of an older one are dropped
+	uint64_t generation = 0;
+	int timerFd = -1;
+	uint32_t outputRemovedSubscription = 0;
+	// A capture of the open output was downscaled, later ones only wait for damage
+	bool openCaptured = false;
+
+	// Capture in progress
+	zwlr_screencopy_frame_v1 *frame = nullptr;
+	uint32_t frameFormat = 0;
+	uint32_t frameWidth = 0;
+	uint32_t frameHeight = 0;
+	uint32_t frameStride = 0;
+	bool frameYInvert = false;
+	bool frameFullCopy = false;
+	bool frameHasDamage = false;
+	Damage frameDamage;
+	Buffer buffer;
+	// The worker reads the buffer
+	bool downscaling = false;
+	// Output of the capture the worker has, nullptr once it was removed
+	wl_output *downscaledOutput = nullptr;
+
+	// Most recently used first
+	std::list<Thumbnail> thumbnails;
+
+	// Worker, started with the first preview
+	int eventFd = -1;
+	std::thread worker;
+	// Guards `job`, `jobPending`, `jobDone` and `stopping`
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	Job job;
+	bool jobPending = false;
+	bool jobDone = false;
+	bool stopping = false;
+	// Worker only
+	std::vector<uint32_t> sums;
+};
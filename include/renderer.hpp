@@ -1,9 +1,13 @@
 #pragma once
 
+#include "frameArena.hpp"
 #include "rendererHelper.hpp"
+#include "shaders.hpp"
 #include "vulkanInclude.hpp"
+#include <array>
 #include <functional>
 #include <memory>
+#include <span>
 #include <vector>
 
 class Core;
@@ -18,15 +22,50 @@ class Renderer
 
 public:
 	typedef std::unique_ptr<Renderer> Ptr;
-	struct SwapchainResources {
+	// Everything the CPU needs to record and submit one frame, there are `framesInFlight` of them
+	struct FrameResources {
+		// Own pool per frame, so the whole frame is reset with one call instead of per buffer
+		VkCommandPool commandPool = nullptr;
 		VkCommandBuffer commandBuffer = nullptr;
+		// Waited by the submit of the same frame, so it's free again as soon as the frame's fence is signalled
+		VkSemaphore acquireSemaphore = nullptr;
+		VkFence fence = nullptr;
+		// Vulkan 1.3 path: value of the frame timeline that the frame's submit signals, instead of the fence
+		uint64_t timelineValue = 0;
+	};
+	struct SwapchainResources {
 		VkImage image = nullptr;
 		VkImageView imageView = nullptr;
+		// Only on the 1.0 path, dynamic rendering takes the image view
 		VkFramebuffer framebuffer = nullptr;
-		VkSemaphore startSemaphore = nullptr;
-		VkSemaphore endSemaphore = nullptr;
-		VkFence fence = nullptr;
-		VkFence lastFence = nullptr;
+		// Waited by the presentation engine, we can't know when it's done with it, so it's reused only when
+		// the same image is acquired again
+		VkSemaphore presentSemaphore = nullptr;
+	};
+	// Part of the bar recorded once into secondary command buffers and replayed until it changes
+	struct Region {
+		// Secondary buffer of one frame in flight and the generations it was recorded for, each frame has its own
+		// copy so a buffer is never re-recorded while the GPU may still execute it
+		struct Cache {
+			VkCommandBuffer commandBuffer = nullptr;
+			uint64_t layoutGeneration = 0;
+			uint64_t contentGeneration = 0;
+		};
+		uint32_t id = 0;
+		VkRect2D area = {};
+		RecordRegionCallbackType record;
+		uint64_t contentGeneration = 1;
+		std::vector<Cache> caches;
+	};
+	// Sampled RGBA image, e.g. a tray icon, drawn by region callbacks with DrawImage
+	struct Image {
+		uint32_t id = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		VkImage image = VK_NULL_HANDLE;
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkImageView imageView = VK_NULL_HANDLE;
+		VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
 	};
 
 	Renderer() = delete;
@@ -45,26 +84,68 @@ public:
 	bool Render();
 
 	bool OnResize();
+	// Gives back the swapchain, the recorded regions and the per-frame memory while nothing is shown, the next
+	// Render() creates them again. Regions, images and pipelines are kept
+	void Trim();
+	bool IsTrimmed() const { return !swapchain; }
+
+	void SetOnLayout(OnLayoutCallbackType onLayout);
+	void SetClearColor(VkClearColorValue color) { clearColor = color; }
+
+	// Regions are drawn in the order of their ids
+	void SetRegion(uint32_t id, VkRect2D area, RecordRegionCallbackType record);
+	void RemoveRegion(uint32_t id);
+	// Re-record a single region, e.g. when the text of a widget changes
+	void InvalidateRegion(uint32_t id);
+	// Re-record everything and call the layout callback again
+	void InvalidateLayout() { layoutGeneration++; }
+	uint64_t GetLayoutGeneration() const { return layoutGeneration; }
+	uint64_t GetRecordedRegionsCount() const { return recordedRegionsCount; }
+	// Sorted by id. The generation changes whenever regions are added, moved or removed, the window hit-tests on the
+	// main thread with a copy of them
+	const std::vector<Renderer::Region>& GetRegions() const { return regions; }
+	uint64_t GetRegionsGeneration() const { return regionsGeneration; }
 
-	void SetOnPresent(OnPresentCallbackType onPresent);
+	// Fills `rect` (framebuffer pixels) with a color of straight alpha, with antialiased rounded corners if `radius`
+	// is set. Meant for region callbacks, it sets its own pipeline, viewport and scissor
+	void DrawQuad(VkCommandBuffer commandBuffer, const VkRect2D &rect, VkClearColorValue color, float radius = 0.0f);
+	VkPipelineLayout GetPipelineLayout() const { return pipelineLayout; }
+	VkPipeline GetQuadPipeline(QuadVariant variant) const { return quadPipelines[variant]; }
+
+	// Uploads straight alpha RGBA pixels, waiting for the copy. The same size is updated in place, the recorded regions
+	// stay valid and only need a new frame; a new size recreates the image and invalidates the layout
+	bool SetImage(uint32_t id, uint32_t width, uint32_t height, std::span<const uint8_t> pixels);
+	void RemoveImage(uint32_t id);
+	bool HasImage(uint32_t id) const;
+	// Like DrawQuad, with the image stretched over `rect`, linearly filtered
+	void DrawImage(VkCommandBuffer commandBuffer, const VkRect2D &rect, uint32_t id, float radius = 0.0f);
+
+	// Renders and presents one frame and reads it back as premultiplied BGRA, waiting for the GPU. Only once the
+	// render thread is stopped; false without a swapchain or if the swapchain can't be read
+	bool CaptureFrame(std::vector<uint8_t> &pixels, VkExtent2D &capturedExtent);
 
 	WindowPtr GetWindow() const { return windowWeak.lock(); }
 	VkQueue GetGraphicsQueue() const { return graphicsQueue; }
 	VkSurfaceKHR GetSurface() const { return surface; }
-	VkCommandPool GetCommandPool() const { return commandPool; }
 	VkSwapchainKHR GetSwapchain() const { return swapchain; }
+	// VK_NULL_HANDLE on the Vulkan 1.3 path
 	VkRenderPass GetRenderPass() const { return renderPass; }
+	bool UsesVulkan13() const { return useVulkan13; }
+	VkExtent2D GetExtent() const { return extent; }
+	std::vector<Renderer::FrameResources> &GetFrameResources() { return frameResources; }
 	std::vector<Renderer::SwapchainResources> &GetSwapchainResources() { return swapchainResources; }
-	VkCommandBuffer GetCurrentFrameCommandBuffer(uint32_t frameIndex) const { return swapchainResources[frameIndex].commandBuffer; }
-	VkImage GetCurrentFrameImage(uint32_t frameIndex) const { return swapchainResources[frameIndex].image; }
-	VkImageView GetCurrentFrameImageView(uint32_t frameIndex) const { return swapchainResources[frameIndex].imageView; }
-	VkFramebuffer GetCurrentFrameFramebuffer(uint32_t frameIndex) const { return swapchainResources[frameIndex].framebuffer; }
-	VkSemaphore GetCurrentFrameStartSemaphore(uint32_t frameIndex) const { return swapchainResources[frameIndex].startSemaphore; }
-	VkSemaphore GetCurrentFrameEndSemaphore(uint32_t frameIndex) const { return swapchainResources[frameIndex].endSemaphore; }
-	VkFence GetCurrentFrameFence(uint32_t frameIndex) const { return swapchainResources[frameIndex].fence; }
-	VkFence GetCurrentFrameLastFence(uint32_t frameIndex) const { return swapchainResources[frameIndex].lastFence; }
-	uint32_t GetFramesCount() const { return framesCount; }
+	VkCommandPool GetCurrentFrameCommandPool() const { return frameResources[currentFrame].commandPool; }
+	VkCommandBuffer GetCurrentFrameCommandBuffer() const { return frameResources[currentFrame].commandBuffer; }
+	VkImage GetImage(uint32_t imageIndex) const { return swapchainResources[imageIndex].image; }
+	VkImageView GetImageView(uint32_t imageIndex) const { return swapchainResources[imageIndex].imageView; }
+	VkFramebuffer GetFramebuffer(uint32_t imageIndex) const { return swapchainResources[imageIndex].framebuffer; }
+	uint32_t GetFramesInFlight() const { return framesInFlight; }
+	uint32_t GetImagesCount() const { return imagesCount; }
 	uint32_t GetCurrentFrameIndex() const { return currentFrame; }
+	// Scratch memory for the frame being recorded, reset when the next frame starts. The GPU never reads it, so it's
+	// one arena rather than one per frame in flight
+	FrameArena& GetFrameArena() { return frameArena; }
+	uint32_t GetCurrentImageIndex() const { return currentImage; }
 
 private:
 	bool Init(WindowPtr window);
@@ -72,21 +153,87 @@ private:
 	CorePtr core;
 	WindowWeakPtr windowWeak;
 
-	OnPresentCallbackType callbackOnPresent;
+	OnLayoutCallbackType callbackOnLayout;
 
 	void InitGraphicsQueue(WindowPtr window);
 	bool InitSurface(WindowPtr window);
-	bool InitCommandPool();
+	bool InitFrames();
+	void DestroyFrames();
 	bool InitSwapchain();
 	void DestroySwapchain();
+	bool InitPipelines(VkFormat format);
+	VkPipeline CreatePipeline(VkShaderModule vertexModule, VkShaderModule fragmentModule, QuadVariant variant, VkFormat format);
+	void DestroyPipelines();
+	bool InitImages();
+	void DestroyImages();
+	void DestroyImage(Renderer::Image &image);
+	bool CreateImage(Renderer::Image &image);
+	bool UploadImage(Renderer::Image &image, std::span<const uint8_t> pixels);
+	uint32_t FindMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const;
+	void WaitFrames();
+	void WaitTimeline(uint64_t value);
+	// Starts and ends drawing into the current image, with a render pass or with dynamic rendering and the layout
+	// transitions around it
+	void BeginRendering(VkCommandBuffer commandBuffer);
+	void EndRendering(VkCommandBuffer commandBuffer);
+	bool Submit();
+	// For a frame that fails after its image was acquired: an empty submit waits for the acquire semaphore and
+	// signals what the frame's next use waits for, so the semaphore isn't reused while its signal is pending
+	void DiscardFrame();
+	// Copies the current image into the capture buffer, after EndRendering()
+	void RecordCapture(VkCommandBuffer commandBuffer);
+	bool InitRegions();
+	void DestroyRegions();
+	bool RecordRegions();
 
 	VkQueue graphicsQueue = VK_NULL_HANDLE;
 	VkSurfaceKHR surface = VK_NULL_HANDLE;
-	VkCommandPool commandPool = VK_NULL_HANDLE;
 	VkSwapchainKHR swapchain = VK_NULL_HANDLE;
 	VkRenderPass renderPass = VK_NULL_HANDLE;
+	std::vector<Renderer::FrameResources> frameResources;
 	std::vector<Renderer::SwapchainResources> swapchainResources;
-	uint32_t framesCount = 0;
+	uint32_t framesInFlight = 0;
+	uint32_t imagesCount = 0;
 	uint32_t currentFrame = 0;
-	uint32_t nextFrame = 0;
+	uint32_t currentImage = 0;
+	VkExtent2D extent = {};
+	VkClearColorValue clearColor = {};
+	// The swapchain images can be copied from, only asked for when startup snapshots are enabled
+	bool swapchainReadable = false;
+
+	// Readback of the next frame, see CaptureFrame()
+	VkBuffer captureBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory captureMemory = VK_NULL_HANDLE;
+	VkExtent2D captureExtent = {};
+	bool captured = false;
+
+	// Vulkan 1.3 path: no render pass or framebuffers, and one timeline semaphore paces the frames instead of fences
+	bool useVulkan13 = false;
+	VkSemaphore frameTimeline = VK_NULL_HANDLE;
+	uint64_t frameTimelineValue = 0;
+
+	// Pipelines only need a compatible render pass or the same attachment format, so they are recreated when the
+	// format changes, not on resize
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	std::array<VkPipeline, QuadVariantsCount> quadPipelines = {};
+	std::array<VkPipeline, QuadVariantsCount> imagePipelines = {};
+	VkFormat pipelinesFormat = VK_FORMAT_UNDEFINED;
+
+	// Images, sorted by id like the regions. The set layout outlives the pipelines, their layout is made with it
+	VkDescriptorSetLayout imageSetLayout = VK_NULL_HANDLE;
+	VkDescriptorPool imageDescriptorPool = VK_NULL_HANDLE;
+	VkSampler imageSampler = VK_NULL_HANDLE;
+	std::vector<Renderer::Image> images;
+
+	// Cached regions
+	VkCommandPool regionCommandPool = VK_NULL_HANDLE;
+	std::vector<Renderer::Region> regions;
+	// In the frame arena
+	std::span<VkCommandBuffer> regionCommandBuffers;
+	uint64_t layoutGeneration = 1;
+	uint64_t laidOutGeneration = 0;
+	uint64_t recordedRegionsCount = 0;
+	uint64_t regionsGeneration = 1;
+
+	FrameArena frameArena;
 };
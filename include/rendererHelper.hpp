@@ -1,9 +1,13 @@
 #pragma once
 
+#include "vulkanInclude.hpp"
 #include <cstdint>
 #include <functional>
 #include <memory>
 
 class Renderer;
 
-typedef std::function<bool(uint32_t frameIndex, Renderer *renderer)> OnPresentCallbackType;
+// Called when the layout generation changes (e.g. on resize), regions should be (re)placed here
+typedef std::function<void(VkExtent2D extent, Renderer *renderer)> OnLayoutCallbackType;
+// Records a region into a secondary command buffer inside the render pass
+typedef std::function<void(VkCommandBuffer commandBuffer, const VkRect2D &area, Renderer *renderer)> RecordRegionCallbackType;
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+// Surface scale in 120ths, the way wp_fractional_scale_v1 reports it
+struct Scale
+{
+	static constexpr uint32_t denominator = 120;
+
+	uint32_t value = denominator;
+
+	static constexpr Scale FromInteger(int32_t scale) { return Scale{ .value = static_cast<uint32_t>(scale > 0 ? scale : 1) * denominator }; }
+
+	bool IsInteger() const { return value % denominator == 0; }
+	float ToFloat() const { return static_cast<float>(value) / denominator; }
+	// Logical size to device pixels, rounded half away from zero as the protocol asks
+	uint32_t ToDevice(uint32_t logical) const { return (logical * value + denominator / 2) / denominator; }
+
+	bool operator==(const Scale &other) const = default;
+};
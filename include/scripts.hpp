@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+class Core;
+
+// Widgets fed by shell commands, published as `script.<name>`. Commands run with `/bin/sh -c` through posix_spawn
+// (vfork semantics, the bar's pages aren't copied) in a process group of their own, and their stdout is read from
+// a non-blocking pipe in the event loop, so the bar never waits for them.
+// An interval script runs every `interval` and publishes the first line of its output when it exits, it's killed
+// with its children after `timeout`. Runs are spread by a random phase and a jitter of up to a tenth of the interval
+// so that scripts don't all fire on the same tick, and at most `maxRunning` of them run at once; due ones wait for
+// a slot in the order they became due. A tail script runs for good and publishes every line it prints, it's started
+// again `interval` after it exits and doesn't count against the limit. Lines are hashed and a line equal to the last
+// one isn't published again, so a script that prints the same wakes up no subscriber.
+// A data source only: nothing draws `script.<name>` by itself, a `--text` template that uses it is drawn as a label
+class Scripts
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Scripts> Ptr;
+	static constexpr std::string_view keyPrefix = "script.";
+	// Longer lines are cut, the rest of the output is thrown away
+	static constexpr std::size_t maxLineLength = 1024;
+	// While a script that closed its stdout hasn't exited, it's checked this often
+	static constexpr uint64_t reapInterval = 50'000'000;
+	// First runs are spread over this much time after adding
+	static constexpr uint64_t startSpread = 1'000'000'000;
+	struct Options {
+		uint64_t interval = 10'000'000'000;
+		// 0 for the interval, ignored by tail scripts
+		uint64_t timeout = 0;
+		bool tail = false;
+	};
+
+	Scripts() = delete;
+	Scripts(const Private&) {}
+	~Scripts();
+	static Scripts::Ptr Create(CorePtr core, uint32_t maxRunning)
+	{
+		auto ptr = std::make_unique<Scripts>(Private());
+		if (!ptr->Init(core, maxRunning))
+			return nullptr;
+		return ptr;
+	}
+
+	// `script.<name>` is published empty until the first line. False if the name is taken or the options are invalid
+	bool Add(std::string_view name, std::string_view command, const Options &options);
+	// `NAME[:INTERVAL[:TIMEOUT]]=COMMAND` with seconds or `tail` for the interval, false if it isn't
+	static bool Parse(std::string_view text, std::string &name, std::string &command, Options &options);
+
+private:
+	struct Script {
+		std::string key;
+		std::string command;
+		Options options;
+		// Running process, its stdout and when it started and has to finish (monotonic)
+		pid_t pid = -1;
+		int outputFd = -1;
+		uint64_t started = 0;
+		uint64_t deadline = 0;
+		// When it's due next, 0 while it runs
+		uint64_t due = 0;
+		// Line being read and the last complete one, swapped so that neither allocates once grown. An interval
+		// script keeps its first line and ignores the rest
+		std::string line;
+		std::string text;
+		bool lineComplete = false;
+		// Stdout is closed but the process hasn't exited yet
+		bool reaping = false;
+		bool timedOut = false;
+		uint64_t publishedHash = 0;
+	};
+
+	bool Init(CorePtr core, uint32_t maxRunning);
+	bool Start(Script &script, uint64_t now);
+	void OnOutput(Script *script, uint32_t events);
+	// Publishes `text` unless its hash is the one of the last published text
+	void Publish(Script &script);
+	void CloseOutput(Script &script);
+	// Reaps the process if it has exited, the script is scheduled again then
+	bool TryReap(Script &script, uint64_t now);
+	void Kill(Script &script);
+	void OnTimer();
+	// Starts what's due within the limit and arms the timer at the next due time, deadline or reap check
+	void Schedule();
+	// Interval after the last start, or after `now` for a tail script, with jitter
+	uint64_t NextRun(const Script &script, uint64_t now);
+	uint64_t GetTime() const;
+
+	CorePtr core;
+	int timerFd = -1;
+	uint32_t maxRunning = 0;
+	uint32_t running = 0;
+	std::vector<std::unique_ptr<Script>> scripts;
+	std::minstd_rand random;
+	// Reused by Schedule
+	std::vector<Script*> dueScripts;
+};
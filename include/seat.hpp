@@ -0,0 +1,100 @@
+#pragma once
+
+#include "waylandListener.hpp"
+#include <wayland-client.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+class Window;
+
+// What a window reports to its input callback, positions are in device pixels of its buffer
+struct InputEvent {
+	enum Type : uint8_t {
+		// The pointer moved onto or off `region`, for hover effects
+		TypeEnter,
+		TypeLeave,
+		// A button (BTN_LEFT, BTN_RIGHT...) or a touch point, which counts as BTN_LEFT, was released on the region it
+		// was pressed on
+		TypeClick,
+		// Whole wheel detents, or as much finger scrolling, positive down or right
+		TypeScroll
+	};
+	Type type = TypeEnter;
+	uint32_t region = 0;
+	int32_t x = 0;
+	int32_t y = 0;
+	uint32_t button = 0;
+	int32_t steps = 0;
+	bool horizontal = false;
+	uint32_t serial = 0;
+};
+typedef std::function<void(const InputEvent &event)> OnInputCallbackType;
+
+// Pointer and touch of a wl_seat, handed to the Window of the surface they are on. Nothing is hit-tested here: motion
+// only stores the position and the window looks it up once per frame, so a 1000Hz mouse costs a store per event.
+// Scrolling is summed up per wl_pointer.frame into whole steps
+class Seat
+{
+	struct Private { explicit Private() = default; };
+
+public:
+	typedef std::unique_ptr<Seat> Ptr;
+	// Continuous scrolling (touchpads) per step, about what compositors send for one wheel detent
+	static constexpr double scrollStepDistance = 10.0;
+
+	Seat() = delete;
+	Seat(const Private&) {}
+	~Seat();
+	// Capabilities are sent right after binding, so the seat has to be created before the next dispatch
+	static Seat::Ptr Create(wl_seat *seat)
+	{
+		auto ptr = std::make_unique<Seat>(Private());
+		if (!ptr->Init(seat))
+			return nullptr;
+		return ptr;
+	}
+
+	wl_seat* GetSeat() { return seat; }
+	// Called by a window before it destroys its surface, events already queued for it are dropped
+	void ForgetSurface(wl_surface *surface);
+
+private:
+	bool Init(wl_seat *seat);
+	void ReleasePointer();
+	void ReleaseTouch();
+	// The window of one of our surfaces, the listener data of every wl_surface is its Window
+	static Window* GetWindow(wl_surface *surface);
+	void FlushScroll();
+
+	// Wayland events
+	void OnCapabilities(wl_seat *seat, uint32_t capabilities);
+	void OnPointerEnter(wl_pointer *pointer, uint32_t serial, wl_surface *surface, wl_fixed_t x, wl_fixed_t y);
+	void OnPointerLeave(wl_pointer *pointer, uint32_t serial, wl_surface *surface);
+	void OnPointerMotion(wl_pointer *pointer, uint32_t time, wl_fixed_t x, wl_fixed_t y);
+	void OnPointerButton(wl_pointer *pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state);
+	void OnPointerAxis(wl_pointer *pointer, uint32_t time, uint32_t axis, wl_fixed_t value);
+	void OnPointerFrame(wl_pointer *pointer);
+	void OnPointerAxisDiscrete(wl_pointer *pointer, uint32_t axis, int32_t discrete);
+	void OnPointerAxisValue120(wl_pointer *pointer, uint32_t axis, int32_t value120);
+	void OnTouchDown(wl_touch *touch, uint32_t serial, uint32_t time, wl_surface *surface, int32_t id, wl_fixed_t x, wl_fixed_t y);
+	void OnTouchUp(wl_touch *touch, uint32_t serial, uint32_t time, int32_t id);
+	void OnTouchMotion(wl_touch *touch, uint32_t time, int32_t id, wl_fixed_t x, wl_fixed_t y);
+	void OnTouchCancel(wl_touch *touch);
+	static const wl_seat_listener seatListener;
+	static const wl_pointer_listener pointerListener;
+	static const wl_touch_listener touchListener;
+
+	wl_seat *seat = nullptr;
+	wl_pointer *pointer = nullptr;
+	wl_touch *touch = nullptr;
+	wl_surface *pointerSurface = nullptr;
+	// Scrolling of the current frame and what's left of the previous ones, per axis; 120ths for wheels
+	double scrollDistance[2] = {};
+	int32_t scroll120[2] = {};
+	bool scrollPending = false;
+	bool scrollDiscrete = false;
+	// The first touch point, the others are ignored
+	wl_surface *touchSurface = nullptr;
+	int32_t touchId = -1;
+};
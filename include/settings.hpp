@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Options that are chosen per deployment, filled from the command line
+struct Settings
+{
+	// CPU frames recorded ahead of the GPU: 1 gives the lowest latency, 2 gives more throughput
+	uint32_t framesInFlight = 2;
+	// Render with dynamic rendering, synchronization2 and a timeline semaphore when the device has Vulkan 1.3
+	bool vulkan13 = true;
+	// Control socket for external scripts, empty for the default path
+	bool ipcEnabled = true;
+	std::string ipcSocketPath;
+	// Last frame shown at startup until the first one is rendered, empty for the default path
+	bool snapshotEnabled = true;
+	std::string snapshotPath;
+	// strftime formats of `clock.time` and `clock.date`
+	std::string clockFormat = "%H:%M";
+	std::string dateFormat = "%a %d %b";
+	// Interval scripts that may run at once, the others wait for a slot
+	uint32_t maxRunningScripts = 4;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+// Shaders of shaders/, compiled to SPIR-V and embedded at build time, so creating a pipeline reads no files
+#include <shaders/image.frag.hpp>
+#include <shaders/quad.frag.hpp>
+#include <shaders/quad.vert.hpp>
+#include <cstdint>
+
+// Push constants of quad.vert, quad.frag and image.frag, the layout has to match the GLSL block
+struct QuadPushConstants
+{
+	// x, y, width, height in framebuffer pixels
+	float rect[4];
+	// Straight alpha, premultiplied by the shader
+	float color[4];
+	float viewport[2];
+	float radius;
+};
+static_assert(sizeof(QuadPushConstants) == 44, "QuadPushConstants must match the push constant block of the quad shaders");
+
+// Values of the specialization constants, each one is a pipeline of its own
+enum QuadVariant : uint32_t {
+	QuadVariantPlain = 0,
+	QuadVariantRounded,
+	QuadVariantsCount
+};
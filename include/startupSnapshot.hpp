@@ -0,0 +1,67 @@
+#pragma once
+
+#include "scale.hpp"
+#include <wayland-client.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+class Core;
+class Window;
+
+// The last frame of the previous run, so the bar is on screen the moment its surface is configured: before Vulkan is
+// up and before any module has data. The window attaches the pixels straight from the file through wl_shm, the first
+// frame it renders replaces them. The file also holds the handoff state of the widgets, whose pushed values and icons
+// the modules build on until their own keys are published again.
+// A snapshot is written on exit from one last capture of the swapchain, into a new file that replaces the old one, so
+// a file is never written once a compositor may have it mapped
+class StartupSnapshot
+{
+	struct Private { explicit Private() = default; };
+
+public:
+	typedef std::unique_ptr<StartupSnapshot> Ptr;
+
+	StartupSnapshot() = delete;
+	StartupSnapshot(const Private&) {}
+	~StartupSnapshot();
+	// nullptr if there is no snapshot at `path` (the default path if empty), it's of an incompatible version or not
+	// owned by our user
+	static StartupSnapshot::Ptr Create(const std::string &path)
+	{
+		auto ptr = std::make_unique<StartupSnapshot>(Private());
+		if (!ptr->Init(path))
+			return nullptr;
+		return ptr;
+	}
+
+	// $XDG_CACHE_HOME/ncbar-$WAYLAND_DISPLAY.frame, the runtime directory is emptied at logout and only used without
+	// a home. Empty if neither is set, a shared directory like /tmp would let other users plant the state we restore
+	static std::string GetDefaultPath();
+	// Renders one more frame of the stopped window, captures it and replaces the snapshot at `path` (the default path
+	// if empty)
+	static bool Save(const std::string &path, Window &window, Core &core);
+
+	// Logical size and the scale the pixels were rendered at
+	uint32_t GetWidth() const { return width; }
+	uint32_t GetHeight() const { return height; }
+	Scale GetScale() const { return scale; }
+	// Handoff state, see Handoff::Restore()
+	std::string_view GetState() const { return state; }
+	// A premultiplied ARGB8888 buffer of the pixels in the file, nullptr on failure. It may be destroyed right after
+	// the commit that attaches it, the file it's made of never changes
+	wl_buffer* CreateBuffer(wl_shm *shm) const;
+
+private:
+	bool Init(const std::string &snapshotPath);
+
+	int fd = -1;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	Scale scale;
+	uint32_t bufferWidth = 0;
+	uint32_t bufferHeight = 0;
+	uint64_t fileSize = 0;
+	std::string state;
+};
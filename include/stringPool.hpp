@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Reference-counted interned strings. Equal strings get the same id, so comparing two ids compares the strings,
+// and strings that repeat a lot (app ids, icon names) are stored once. Id 0 is always the empty string
+class StringPool
+{
+public:
+	typedef uint32_t Id;
+	static constexpr Id emptyId = 0;
+
+	StringPool();
+
+	// Takes a reference, every Intern() must be paired with a Release()
+	Id Intern(std::string_view string);
+	// Takes one more reference on a string that is already interned
+	void Acquire(Id id) { if (id != emptyId) entries[id].references++; }
+	void Release(Id id);
+	std::string_view Get(Id id) const { return entries[id].string; }
+	std::size_t GetSize() const { return lookup.size(); }
+
+private:
+	struct Entry {
+		std::string string;
+		uint32_t references = 0;
+	};
+	// Deque, so the strings the lookup keys point to never move
+	std::deque<Entry> entries;
+	std::vector<Id> freeIds;
+	std::unordered_map<std::string_view, Id> lookup;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "stringPool.hpp"
+#include "waylandListener.hpp"
+#include <wayland-client.h>
+#include <wlr-foreign-toplevel-management-unstable-v1.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class WidgetStore;
+
+// Window list fed by zwlr_foreign_toplevel_manager_v1. Toplevels live in slots that keep their index for the whole
+// life of the window, so a change of one window touches only its own slot, widget keys and region.
+// Every slot publishes `taskbar.<slot>.title`, `taskbar.<slot>.app_id` and `taskbar.<slot>.state`, closed slots
+// are published with empty values
+class Taskbar
+{
+	struct Private { explicit Private() = default; };
+
+public:
+	typedef std::unique_ptr<Taskbar> Ptr;
+	enum Changes : uint32_t {
+		ChangedNothing = 0,
+		ChangedAdded = 1 << 0,
+		ChangedRemoved = 1 << 1,
+		ChangedTitle = 1 << 2,
+		ChangedAppId = 1 << 3,
+		ChangedState = 1 << 4
+	};
+	enum States : uint32_t {
+		StateMaximized = 1 << ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED,
+		StateMinimized = 1 << ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED,
+		StateActivated = 1 << ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED,
+		StateFullscreen = 1 << ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN
+	};
+	// Called once per `done` of a toplevel with what changed since the previous one
+	typedef std::function<void(uint32_t slot, uint32_t changes)> OnChangeCallbackType;
+	struct Toplevel {
+		// nullptr for a free slot
+		zwlr_foreign_toplevel_handle_v1 *handle = nullptr;
+		StringPool::Id title = StringPool::emptyId;
+		StringPool::Id appId = StringPool::emptyId;
+		uint32_t states = 0;
+		// Double-buffered until `done`
+		StringPool::Id pendingTitle = StringPool::emptyId;
+		StringPool::Id pendingAppId = StringPool::emptyId;
+		uint32_t pendingStates = 0;
+		bool announced = false;
+		// Output the window entered last, nullptr once it left every output or the output was removed. Not owned
+		wl_output *output = nullptr;
+	};
+
+	Taskbar() = delete;
+	Taskbar(const Private&, WidgetStore &widgetStore) : widgetStore(widgetStore) {}
+	~Taskbar();
+	// The manager announces the existing toplevels right after it's bound, so the taskbar has to be created before
+	// the next dispatch
+	static Taskbar::Ptr Create(zwlr_foreign_toplevel_manager_v1 *manager, WidgetStore &widgetStore)
+	{
+		auto ptr = std::make_unique<Taskbar>(Private(), widgetStore);
+		if (!ptr->Init(manager))
+			return nullptr;
+		return ptr;
+	}
+
+	void SetOnChange(OnChangeCallbackType onChange);
+
+	// Slots, including the free ones, their count only grows up to the highest number of windows open at once
+	uint32_t GetSlotsCount() const { return static_cast<uint32_t>(toplevels.size()); }
+	uint32_t GetToplevelsCount() const { return toplevelsCount; }
+	const Toplevel &GetToplevel(uint32_t slot) const { return toplevels[slot]; }
+	std::string_view GetTitle(uint32_t slot) const { return strings.Get(toplevels[slot].title); }
+	std::string_view GetAppId(uint32_t slot) const { return strings.Get(toplevels[slot].appId); }
+	// Icon name from the desktop entry of the app id, looked up on first use and cached per app id
+	std::string_view GetIcon(uint32_t slot);
+	// Icons resolved so far, handed over to the next instance on restart
+	template<typename Function>
+	void ForEachIcon(Function &&function) const
+	{
+		for (const auto &[appId, icon] : icons)
+			function(strings.Get(appId), strings.Get(icon));
+	}
+	void AddIcon(std::string_view appId, std::string_view icon);
+
+	void Activate(uint32_t slot, wl_seat *seat);
+	void Close(uint32_t slot);
+	// Called by Core before it destroys a removed output
+	void ForgetOutput(wl_output *output);
+
+private:
+	bool Init(zwlr_foreign_toplevel_manager_v1 *manager);
+	Toplevel* FindToplevel(zwlr_foreign_toplevel_handle_v1 *handle, uint32_t *slot);
+	void Publish(uint32_t slot, uint32_t changes);
+	void ReleaseToplevel(Toplevel &toplevel);
+	StringPool::Id ResolveIcon(StringPool::Id appId);
+
+	// Wayland events
+	void OnToplevel(zwlr_foreign_toplevel_manager_v1 *manager, zwlr_foreign_toplevel_handle_v1 *handle);
+	void OnFinished(zwlr_foreign_toplevel_manager_v1 *manager);
+	void OnTitle(zwlr_foreign_toplevel_handle_v1 *handle, const char *title);
+	void OnAppId(zwlr_foreign_toplevel_handle_v1 *handle, const char *appId);
+	void OnOutputEnter(zwlr_foreign_toplevel_handle_v1 *handle, wl_output *output);
+	void OnOutputLeave(zwlr_foreign_toplevel_handle_v1 *handle, wl_output *output);
+	void OnState(zwlr_foreign_toplevel_handle_v1 *handle, wl_array *states);
+	void OnDone(zwlr_foreign_toplevel_handle_v1 *handle);
+	void OnClosed(zwlr_foreign_toplevel_handle_v1 *handle);
+	static const zwlr_foreign_toplevel_manager_v1_listener managerListener;
+	static const zwlr_foreign_toplevel_handle_v1_listener handleListener;
+
+	WidgetStore &widgetStore;
+	zwlr_foreign_toplevel_manager_v1 *manager = nullptr;
+	StringPool strings;
+	std::vector<Toplevel> toplevels;
+	std::vector<uint32_t> freeSlots;
+	std::unordered_map<zwlr_foreign_toplevel_handle_v1*, uint32_t> slotsByHandle;
+	uint32_t toplevelsCount = 0;
+	// App id to icon name, both interned. The pool keeps a reference on each of them
+	std::unordered_map<StringPool::Id, StringPool::Id> icons;
+	OnChangeCallbackType onChange;
+	// Reused for the widget keys, so publishing doesn't allocate once it has grown
+	std::string keyBuffer;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Template of a widget's text like "{cpu:>3}% {mem_used:.1f}G", parsed once into a flat list of operations. Formatting
+// walks that list and writes with std::to_chars into a caller's buffer, so it never touches the heap.
+//
+// `{name}` or `{name:spec}` is a field, spec is `[[fill]align][width][.precision][type]` as in std::format: align is
+// `<`, `>` or `^`, type is `f` (fixed, precision 6 by default), `d` (rounded to an integer) or nothing (texts as they
+// are, numbers as short as possible). The precision cuts texts. Numbers are right aligned and texts left aligned by
+// default, widths count UTF-8 characters. `{?name}...{/}` keeps its part only if the field is set and neither empty nor
+// 0, `{!name}...{/}` only if it isn't; they nest. `{{` and `}}` are braces
+class TextFormat
+{
+public:
+	// Longest text a template produces, the rest is cut
+	static constexpr std::size_t maxLength = 256;
+
+	// Value of a field, a text is read as a number by the numeric types
+	struct Argument {
+		std::string_view text;
+		double number = 0.0;
+		bool isNumber = false;
+		bool isSet = false;
+
+		static Argument FromText(std::string_view text) { return Argument{ .text = text, .number = 0.0, .isNumber = false, .isSet = true }; }
+		static Argument FromNumber(double number) { return Argument{ .text = {}, .number = number, .isNumber = true, .isSet = true }; }
+	};
+
+	// Prints what's wrong and returns false on a syntax error, the template is empty then
+	bool Parse(std::string_view source);
+	// Field names in the order of their first use, arguments are passed in this order
+	const std::vector<std::string>& GetFields() const { return fields; }
+	// Writes the text into `output`, cut to its size, and returns the length. Missing arguments are unset fields
+	std::size_t Format(std::span<const Argument> arguments, std::span<char> output) const;
+
+private:
+	enum OpType : uint8_t {
+		OpLiteral,
+		OpField,
+		// Jumps to `skipTo` unless the field is set, OpUnless the other way around
+		OpIf,
+		OpUnless
+	};
+	enum Align : uint8_t {
+		AlignDefault,
+		AlignLeft,
+		AlignRight,
+		AlignCenter
+	};
+	enum Type : uint8_t {
+		TypeDefault,
+		TypeFixed,
+		TypeInteger
+	};
+	struct Op {
+		OpType type = OpLiteral;
+		Align align = AlignDefault;
+		Type numberType = TypeDefault;
+		char fill = ' ';
+		// Literal: range in `literals`; field and conditions: index in `fields`
+		uint32_t offset = 0;
+		uint32_t length = 0;
+		uint32_t field = 0;
+		// Conditions: op after the matching `{/}`
+		uint32_t skipTo = 0;
+		uint16_t width = 0;
+		int16_t precision = -1;
+	};
+
+	bool ParseField(std::string_view field);
+	uint32_t AddField(std::string_view name);
+	void AddLiteral(std::string_view literal);
+	// The value of a field without padding, numbers are written into `buffer`
+	static std::string_view FormatValue(const Op &op, const Argument &argument, std::span<char> buffer, bool &isNumber);
+
+	std::vector<Op> ops;
+	std::string literals;
+	std::vector<std::string> fields;
+};
+
+// Last text of one widget, updated in place so that an unchanged text can skip layout and redrawing
+class FormattedText
+{
+public:
+	// Formats again and returns true if the text differs from the previous one, or if it's the first
+	bool Update(const TextFormat &format, std::span<const TextFormat::Argument> arguments);
+	std::string_view GetText() const { return std::string_view(text.data(), length); }
+
+private:
+	std::array<char, TextFormat::maxLength> text = {};
+	std::size_t length = 0;
+	bool formatted = false;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "textFormat.hpp"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Core;
+
+// Texts made of other keys of the widget store with a TextFormat template, like `text.cpu` from "{cpu:>3}%".
+// Templates are parsed once when they are added. A change of a key that a template uses formats it again into its
+// fixed buffer, and `text.<name>` is only published when the text differs, so an unchanged one costs no layout
+// and no redraw. Nothing is allocated per update once the published value has grown
+class TextWidgets
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<TextWidgets> Ptr;
+	static constexpr std::string_view keyPrefix = "text.";
+
+	TextWidgets() = delete;
+	TextWidgets(const Private&) {}
+	~TextWidgets();
+	static TextWidgets::Ptr Create(CorePtr core)
+	{
+		auto ptr = std::make_unique<TextWidgets>(Private());
+		if (!ptr->Init(core))
+			return nullptr;
+		return ptr;
+	}
+
+	// Publishes `text.<name>` right away and on every change of its fields. False if the template is invalid
+	bool Add(std::string_view name, std::string_view source);
+
+private:
+	struct Widget {
+		std::string key;
+		TextFormat format;
+		FormattedText text;
+		// One per field of the format, pointing into the values of the store
+		std::vector<TextFormat::Argument> arguments;
+		// A template that uses its own key would update itself forever
+		bool updating = false;
+	};
+
+	bool Init(CorePtr core);
+	void OnChange(std::string_view key);
+	void Update(Widget &widget);
+
+	CorePtr core;
+	uint32_t subscriptionId = 0;
+	std::vector<std::unique_ptr<Widget>> widgets;
+	// Store key to the widgets that use it
+	std::map<std::string, std::vector<Widget*>, std::less<>> users;
+};
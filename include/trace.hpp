@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Scoped trace events, exported in the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+//
+//   void Renderer::Render()
+//   {
+//   	NCBAR_TRACE_SCOPE("render", "Renderer::Render");
+//   	...
+//
+// Every thread writes into its own ring buffer without locks, so the rings always hold the last events and can be
+// dumped at any time. Names and categories must be string literals, recording an event copies two pointers and two
+// timestamps. Without NCBAR_TRACING the macros expand to nothing
+class Trace
+{
+public:
+#ifdef NCBAR_TRACING
+	static constexpr bool enabled = true;
+#else
+	static constexpr bool enabled = false;
+#endif
+	// Events kept per thread, about a minute of a busy render loop
+	static constexpr std::size_t ringCapacity = 1 << 16;
+
+	struct Event {
+		const char *category = nullptr;
+		const char *name = nullptr;
+		uint64_t start = 0;
+		uint64_t duration = 0;
+		uint32_t thread = 0;
+	};
+
+	class Scope
+	{
+	public:
+		Scope(const char *category, const char *name) : category(category), name(name), start(Now()) {}
+		~Scope() { Record(category, name, start, Now()); }
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		const char *category;
+		const char *name;
+		uint64_t start;
+	};
+
+	// Back-to-back events in one scope: each Begin() ends the previous phase, the destructor ends the last one
+	class Phases
+	{
+	public:
+		explicit Phases(const char *category) : category(category) {}
+		~Phases() { End(); }
+		Phases(const Phases&) = delete;
+		Phases& operator=(const Phases&) = delete;
+
+		void Begin(const char *name)
+		{
+			const uint64_t now = Now();
+			if (this->name)
+				Record(category, this->name, start, now);
+			this->name = name;
+			start = now;
+		}
+		void End()
+		{
+			if (name)
+				Record(category, name, start, Now());
+			name = nullptr;
+		}
+
+	private:
+		const char *category;
+		const char *name = nullptr;
+		uint64_t start = 0;
+	};
+
+	// A Chrome trace file that events are appended to while the program runs, so a trace of the whole run never has to
+	// be held in memory. Thread names are written when it's closed
+	class Stream
+	{
+	public:
+		Stream() = default;
+		~Stream();
+		Stream(const Stream&) = delete;
+		Stream& operator=(const Stream&) = delete;
+
+		// An `exclusive` file must not exist yet and is created with mode 0600, so a path in a shared directory
+		// can't be made to point elsewhere
+		bool Open(const std::string &path, bool exclusive = false);
+		bool IsOpen() const { return file != nullptr; }
+		bool Append(const std::vector<Event> &events);
+		bool Close();
+		uint64_t GetEventsCount() const { return eventsCount; }
+
+	private:
+		std::FILE *file = nullptr;
+		uint64_t eventsCount = 0;
+		bool first = true;
+	};
+
+	// Monotonic time in nanoseconds
+	static uint64_t Now();
+	static void Record(const char *category, const char *name, uint64_t start, uint64_t end);
+	// Shown in the trace viewer, the name must be a string literal
+	static void SetThreadName(const char *name);
+
+	// Appends the events of every thread that started at `since` or later
+	static void CollectSince(uint64_t since, std::vector<Event> &events);
+	// Appends the events recorded since the previous call, for a trace of the whole run. Returns the number of events
+	// that were overwritten before they were collected
+	static uint64_t CollectNew(std::vector<Event> &events);
+	// Creates a new file, see Stream::Open()
+	static bool WriteChromeJson(const std::string &path, const std::vector<Event> &events);
+};
+
+#ifdef NCBAR_TRACING
+#define NCBAR_TRACE_CONCAT_INNER(a, b) a##b
+#define NCBAR_TRACE_CONCAT(a, b) NCBAR_TRACE_CONCAT_INNER(a, b)
+#define NCBAR_TRACE_SCOPE(category, name) Trace::Scope NCBAR_TRACE_CONCAT(traceScope, __LINE__)(category, name)
+#define NCBAR_TRACE_PHASES(phases, category) Trace::Phases phases(category)
+#define NCBAR_TRACE_PHASE(phases, name) phases.Begin(name)
+#define NCBAR_TRACE_END(phases) phases.End()
+#else
+#define NCBAR_TRACE_SCOPE(category, name) do {} while (false)
+#define NCBAR_TRACE_PHASES(phases, category) do {} while (false)
+#define NCBAR_TRACE_PHASE(phases, name) do {} while (false)
+#define NCBAR_TRACE_END(phases) do {} while (false)
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "bus.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Core;
+
+// System tray on the StatusNotifierItem protocol. The tray is the StatusNotifierHost and also the
+// StatusNotifierWatcher if no other watcher owns the name, which is the case unless another bar or a desktop
+// shell runs. Items live in slots that keep their index for the whole life of the item, like the taskbar's.
+// Every slot publishes `tray.<slot>.id`, `tray.<slot>.title`, `tray.<slot>.status` and `tray.<slot>.icon_name`,
+// removed items are published with empty values.
+// Signals of an item (NewIcon, NewTitle...) only mark it, its properties are fetched with one GetAll that is
+// repeated once at most however many signals arrive meanwhile, and the icon is reported as changed only if the
+// hash of the pixmap changed
+class Tray
+{
+	struct Private { explicit Private() = default; };
+	typedef std::shared_ptr<Core> CorePtr;
+
+public:
+	typedef std::unique_ptr<Tray> Ptr;
+	enum Changes : uint32_t {
+		ChangedNothing = 0,
+		ChangedAdded = 1 << 0,
+		ChangedRemoved = 1 << 1,
+		ChangedTitle = 1 << 2,
+		ChangedStatus = 1 << 3,
+		ChangedIcon = 1 << 4
+	};
+	// Called once per fetch of an item's properties with what changed
+	typedef std::function<void(uint32_t slot, uint32_t changes)> OnChangeCallbackType;
+	struct Item {
+		// Bus name and object path, empty for a free slot
+		std::string service;
+		std::string busName;
+		std::string path;
+		// Unique name of the bus name's owner, signals come from it
+		std::string owner;
+		std::string id;
+		std::string title;
+		std::string status;
+		std::string iconName;
+		// Straight alpha RGBA of the pixmap closest to the icon size, empty if the item has only an icon name
+		std::vector<uint8_t> iconPixels;
+		uint32_t iconWidth = 0;
+		uint32_t iconHeight = 0;
+		uint64_t iconHash = 0;
+		std::string matchRule;
+		bool fetching = false;
+		bool refetch = false;
+		bool announced = false;
+	};
+
+	Tray() = delete;
+	Tray(const Private&) {}
+	~Tray();
+	static Tray::Ptr Create(CorePtr core, Bus::Ptr bus)
+	{
+		auto ptr = std::make_unique<Tray>(Private());
+		if (!ptr->Init(core, bus))
+			return nullptr;
+		return ptr;
+	}
+
+	void SetOnChange(OnChangeCallbackType onChange);
+	// Size in device pixels the icons are drawn at, the pixmap closest to it is taken
+	void SetIconSize(uint32_t size);
+
+	uint32_t GetSlotsCount() const { return static_cast<uint32_t>(items.size()); }
+	const Item &GetItem(uint32_t slot) const { return items[slot]; }
+	bool IsWatcher() const { return watcher; }
+
+	void Activate(uint32_t slot, int32_t x, int32_t y);
+	void SecondaryActivate(uint32_t slot, int32_t x, int32_t y);
+	void ContextMenu(uint32_t slot, int32_t x, int32_t y);
+	void Scroll(uint32_t slot, int32_t delta, bool horizontal);
+
+private:
+	bool Init(CorePtr core, Bus::Ptr bus);
+	void RequestWatcherName();
+	void RegisterAtWatcher();
+	void AddItem(const std::string &service);
+	void RemoveItem(const std::string &service);
+	void FetchProperties(uint32_t slot);
+	void OnProperties(uint32_t slot, DBusMessage *reply);
+	void Publish(uint32_t slot, uint32_t changes);
+	void CallItem(uint32_t slot, const char *method, int32_t x, int32_t y);
+	int32_t FindSlot(std::string_view service) const;
+
+	// Messages to us and signals we subscribed to
+	bool OnMessage(DBusMessage *message);
+	bool OnWatcherCall(DBusMessage *message);
+	void EmitWatcherSignal(const char *member, const std::string *service);
+
+	CorePtr core;
+	Bus::Ptr bus;
+	uint32_t filterId = 0;
+	// Owning org.kde.StatusNotifierWatcher, otherwise we're only a host of another watcher
+	bool watcher = false;
+	std::string hostName;
+	// Services as the watcher has them: `busname/path` or only `busname` for /StatusNotifierItem
+	std::vector<std::string> registeredServices;
+	std::vector<Item> items;
+	std::vector<uint32_t> freeSlots;
+	uint32_t iconSize = 22;
+	OnChangeCallbackType onChange;
+	// Reused for the widget keys, so publishing doesn't allocate once it has grown
+	std::string keyBuffer;
+};
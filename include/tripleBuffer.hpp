@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Latest value handed from one producer thread to one consumer thread, neither ever waits for the other. The producer
+// fills the back slot and swaps it with the middle one, the consumer swaps the middle one with its front slot when it
+// holds something new; values published in between are skipped. Slots are reused, so a value whose assignment keeps
+// its capacity (vectors, strings) stops allocating once every slot has seen the largest one. The back slot holds
+// whatever was there before, the producer has to overwrite all of it
+template<typename T>
+class TripleBuffer
+{
+public:
+	// Producer
+	T& GetBack() { return slots[back]; }
+	void Publish()
+	{
+		const uint8_t previous = middle.exchange(static_cast<uint8_t>(back | freshBit), std::memory_order_acq_rel);
+		back = previous & indexMask;
+	}
+
+	// Consumer: true if a value was published since the last call, GetFront() is that value then
+	bool Take()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & freshBit))
+			return false;
+		const uint8_t previous = middle.exchange(front, std::memory_order_acq_rel);
+		front = previous & indexMask;
+		return true;
+	}
+	const T& GetFront() const { return slots[front]; }
+
+private:
+	static constexpr uint8_t indexMask = 3;
+	static constexpr uint8_t freshBit = 4;
+
+	std::array<T, 3> slots = {};
+	// Owned by the producer
+	uint8_t back = 0;
+	// Index of the slot in between and freshBit while the consumer hasn't taken it, the only shared state
+	alignas(64) std::atomic<uint8_t> middle = 1;
+	// Owned by the consumer
+	alignas(64) uint8_t front = 2;
+};
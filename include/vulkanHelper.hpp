@@ -1,14 +1,16 @@
 #pragma once
 
+#include "log.hpp"
 #include "vulkanInclude.hpp"
 #include <vulkan/vk_enum_string_helper.h>
-#include <iostream>
-#include <string>
 
-constexpr void print_vk_result(std::string name, VkResult result)
+// Out of line and cold, so that a successful call costs a compare and a branch
+[[gnu::cold, gnu::noinline]] inline void logVkResult(const char *call, VkResult result)
 {
-	if (result != VK_SUCCESS) {
-		std::cerr << "Vulkan: Failed to run command `" << name << "`: " << string_VkResult(result) << std::endl;
-	}
+	NCBAR_LOG_ERROR << "Vulkan: Failed to run command `" << call << "`: " << string_VkResult(result);
 }
-#define CHECK_VK_RESULT(result) print_vk_result(#result, result)
+#define CHECK_VK_RESULT(call) do { \
+		const VkResult checkedResult = (call); \
+		if (checkedResult != VK_SUCCESS) [[unlikely]] \
+			logVkResult(#call, checkedResult); \
+	} while (false)
@@ -0,0 +1,36 @@
+#pragma once
+
+// Compile-time binding of Wayland listener entries to member functions.
+//
+//   const wl_surface_listener Window::wlSurfaceListener = {
+//   	.enter = BindListener<&Window::OnSurfaceEnter>,
+//   	.leave = BindListener<&Window::OnSurfaceLeave>
+//   };
+//   wl_surface_add_listener(surface, &wlSurfaceListener, this);
+//
+// Every entry is a plain function generated per member function, it casts the listener's `data` back to the object
+// and calls the member directly: no allocations, no type erasure and no null checks on the way. Tables are defined as
+// static members of the class, so they can bind private handlers.
+
+template<auto Method>
+struct ListenerThunk;
+
+template<typename Class, typename... Args, void (Class::*Method)(Args...)>
+struct ListenerThunk<Method>
+{
+	static void Call(void *data, Args... args)
+	{
+		(static_cast<Class*>(data)->*Method)(args...);
+	}
+};
+
+template<auto Method>
+inline constexpr auto BindListener = &ListenerThunk<Method>::Call;
+
+// For events we don't care about. libwayland calls every entry of a listener unconditionally, so none may be null
+template<typename... Args>
+void IgnoreListener(void *data, Args... args)
+{
+	(void)data;
+	((void)args, ...);
+}
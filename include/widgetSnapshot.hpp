@@ -0,0 +1,48 @@
+#pragma once
+
+#include "imageDecoder.hpp"
+#include <cstdint>
+#include <vector>
+
+// What the bar's widgets draw, copied out of the modules on the main thread and handed to the render thread of every
+// window, whose region callbacks never touch a module. Plain values and shared immutable images, so a copy into a
+// slot that was used before doesn't allocate and a changed image is a changed pointer
+struct WidgetSnapshot {
+	typedef ImageDecoder::ImagePtr ImagePtr;
+	struct TaskbarEntry {
+		bool announced = false;
+		uint32_t states = 0;
+
+		bool operator==(const TaskbarEntry &other) const = default;
+	};
+	struct TrayItem {
+		bool announced = false;
+		bool needsAttention = false;
+		// Straight alpha RGBA, nullptr if the item has only an icon name
+		ImagePtr icon;
+
+		bool operator==(const TrayItem &other) const = default;
+	};
+
+	// By slot, like the modules
+	std::vector<TaskbarEntry> taskbar;
+	// Thumbnail of the output the window of the hovered taskbar entry is on, nullptr while there is none
+	ImagePtr preview;
+	uint32_t previewSlot = 0;
+	std::vector<TrayItem> tray;
+
+	bool hasNetwork = false;
+	bool networkUp = false;
+	uint64_t rxRate = 0;
+	uint64_t txRate = 0;
+
+	bool hasMedia = false;
+	bool hasPlayer = false;
+	bool playing = false;
+	// 0 to 1 as of when it was copied, Media reports a change whenever the bar moves by a pixel
+	double progress = 0.0;
+	ImagePtr mediaArt;
+
+	// Texts of store keys rendered at the scale of the window, by label; nullptr while a label's text is empty
+	std::vector<ImagePtr> labels;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <string_view>
+
+// Key-value state of the widgets, fed by modules and external pushers
+class WidgetStore
+{
+public:
+	typedef std::function<void(std::string_view key, std::string_view value)> OnChangeCallbackType;
+
+	// Returns false if the value is the same as before, nobody is notified then
+	bool Set(std::string_view key, std::string_view value);
+	// A value restored from a previous instance, it stays until ClearProvisional() unless the key is set meanwhile,
+	// even to the same value
+	bool SetProvisional(std::string_view key, std::string_view value);
+	// Empties the provisional values that nobody set again, the way a module removes a key
+	void ClearProvisional();
+	// nullptr if there is no such key
+	const std::string *Get(std::string_view key) const;
+	uint64_t GetGeneration(std::string_view key) const;
+
+	uint32_t Subscribe(OnChangeCallbackType onChange);
+	void Unsubscribe(uint32_t id);
+
+	template<typename Function>
+	void ForEach(Function &&function) const
+	{
+		for (const auto &[key, entry] : entries)
+			function(std::string_view(key), std::string_view(entry.value));
+	}
+
+private:
+	struct Entry {
+		std::string value;
+		uint64_t generation = 0;
+		bool provisional = false;
+	};
+	std::map<std::string, Entry, std::less<>> entries;
+	// A list, so subscribing from a callback doesn't move the callback that runs
+	std::list<std::pair<uint32_t, OnChangeCallbackType>> subscribers;
+	uint32_t lastSubscriberId = 0;
+	uint64_t generation = 0;
+	uint32_t provisionalCount = 0;
+	// Nesting of notifications, a callback may set another key
+	uint32_t notifying = 0;
+};
@@ -1,65 +1,170 @@
 #pragma once
 
+#include "frameStats.hpp"
+#include "globals.hpp"
+#include "hitIndex.hpp"
 #include "rendererHelper.hpp"
+#include "scale.hpp"
+#include "seat.hpp"
+#include "tripleBuffer.hpp"
+#include "waylandListener.hpp"
+#include "widgetSnapshot.hpp"
 #include "wlr-layer-shell-unstable-v1-wrapper.hpp"
+#include <fractional-scale-v1.h>
+#include <presentation-time.h>
+#include <viewporter.h>
 #include <wayland-client.h>
 #include <xdg-shell.h>
+#include <array>
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <thread>
+#include <vector>
 
 class Core;
 class Renderer;
+class StartupSnapshot;
 
 constexpr auto windowMagicNumber = 0x000b00b5;
+// A surface of the bar and the thread that draws it. The main thread owns the surface and its role, takes the input
+// and runs the modules; the render thread owns the Renderer, and the frame callbacks and presentation feedback of the
+// surface, which come on a wl_event_queue of its own. A window whose GPU or compositor is slow only holds up itself.
+// The threads share no lock: the main thread publishes a Snapshot (size, visibility, hover, widgets) that the render
+// thread takes before each frame, and the render thread publishes a RenderState (regions, extent) back, each through
+// a TripleBuffer. Methods are for the main thread unless they say otherwise
 class Window : public std::enable_shared_from_this<Window>
 {
 	struct Private { explicit Private() = default; };
 	friend Renderer;
+	friend Seat;
 	typedef std::unique_ptr<Renderer> RendererPtr;
 	typedef std::shared_ptr<Core> CorePtr;
 public:
 	typedef std::shared_ptr<Window> Ptr;
-	struct XdgSurfaceListenerWrapper {
-		std::function<void(xdg_surface *shellSurface, uint32_t serial)> onConfigure;
-		~XdgSurfaceListenerWrapper() {
-			onConfigure = nullptr;
-		}
+	// Render thread: the widgets of the snapshot drawn so far and of the one about to be drawn
+	typedef std::function<void(const WidgetSnapshot &previous, const WidgetSnapshot &current, Renderer *renderer)> OnWidgetsCallbackType;
+	// Main thread: the render thread draws at another extent or scale
+	typedef std::function<void(VkExtent2D extent, Scale scale)> OnResizeCallbackType;
+	// Render thread: after every frame, false stops drawing
+	typedef std::function<bool()> OnFrameCallbackType;
+	// One pending wp_presentation_feedback with the timestamps of the frame it was requested for
+	struct PresentationFeedback {
+		Window *window = nullptr;
+		wp_presentation_feedback *feedback = nullptr;
+		uint64_t updateTime = 0;
+		uint64_t inputTime = 0;
+		// Drawn for the vblank after the last presented frame: continuously, or while that frame was still pending
+		bool consecutive = false;
+
+		void OnPresented(wp_presentation_feedback *feedback, uint32_t tvSecHi, uint32_t tvSecLo, uint32_t tvNsec, uint32_t refresh, uint32_t seqHi, uint32_t seqLo, uint32_t flags);
+		void OnDiscarded(wp_presentation_feedback *feedback);
+		static const wp_presentation_feedback_listener listener;
+	};
+	// Feedbacks are pending for a couple of frames at most, more than that means the compositor isn't presenting us
+	static constexpr std::size_t presentationFeedbacksCount = 8;
+	// Why nothing is drawn, while any is set the GPU resources of the renderer are released
+	enum HiddenReason : uint32_t {
+		// Every output the surface is on is powered off
+		HiddenOutputsOff = 1 << 0,
+		// The last frame callback didn't come within occlusionTimeout: fullscreen window on top, locked screen...
+		HiddenOccluded = 1 << 1,
+		// The compositor closed the layer surface with its output, it's opened again when an output appears
+		HiddenClosed = 1 << 2
 	};
-	struct XdgToplevelListenerWrapper {
-		std::function<void(xdg_toplevel *toplevel, int32_t width, int32_t height, wl_array *states)> onConfigure;
-		std::function<void(xdg_toplevel *toplevel)> onClose;
-		~XdgToplevelListenerWrapper() {
-			onConfigure = nullptr;
-			onClose = nullptr;
-		}
+	static constexpr uint64_t occlusionTimeout = 1'000'000'000;
+	// What the main thread hands to the render thread
+	struct Snapshot {
+		// Logical size, applied with a swapchain of the new size when the generation changes
+		uint32_t width = 0;
+		uint32_t height = 0;
+		Scale scale;
+		uint64_t surfaceGeneration = 0;
+		// HiddenOutputsOff and HiddenClosed, the render thread finds out about occlusion itself
+		uint32_t hiddenReasons = 0;
+		uint32_t hoveredRegion = 0;
+		// Oldest input the next frame reflects, on the presentation clock; 0 if none
+		uint64_t inputTime = 0;
+		WidgetSnapshot widgets;
 	};
-	struct XdgPopupListenerWrapper {
-		std::function<void(xdg_popup *popup, int32_t x, int32_t y, int32_t width, int32_t height)> onConfigure;
-		~XdgPopupListenerWrapper() {
-			onConfigure = nullptr;
-		}
+	// What the render thread hands back whenever it changes
+	struct RenderState {
+		struct Region {
+			uint32_t id = 0;
+			VkRect2D area = {};
+		};
+		// Without the background
+		std::vector<Region> regions;
+		VkExtent2D extent = {};
+		Scale scale;
+		uint32_t hiddenReasons = 0;
 	};
-	struct ZwlrLayerSurfaceListenerWrapper {
-		std::function<void(zwlr_layer_surface_v1 *layerSurface, uint32_t serial, uint32_t width, uint32_t height)> onConfigure;
-		std::function<void(zwlr_layer_surface_v1 *layerSurface)> onClosed;
-		~ZwlrLayerSurfaceListenerWrapper() {
-			onConfigure = nullptr;
-			onClosed = nullptr;
-		}
+	enum RenderStatus : uint8_t {
+		RenderStarting,
+		RenderDrawing,
+		RenderStopped,
+		RenderFailed
 	};
+
 	Window() = delete;
 	Window(const Private&);
 	~Window();
-	static Window::Ptr Create(CorePtr core)
+	// The snapshot is shown until the first frame if it fits the first configure, it isn't needed afterwards
+	static Window::Ptr Create(CorePtr core, const StartupSnapshot *snapshot = nullptr)
 	{
 		auto ptr = std::make_shared<Window>(Private());
-		if (!ptr->Init(core))
+		if (!ptr->Init(core, snapshot))
 			return nullptr;
 		return ptr;
 	}
 
-	bool Render();
+	// Publishes the first snapshot and starts the render thread, the callbacks are set before
+	void Start();
+	// Waits for the frame being drawn and stops the render thread, then collects the feedback of the frames that are
+	// still on their way to the screen
+	void Stop();
+	// Hands what changed since the last call to the render thread, the event loop calls it after every dispatch.
+	// False if the layer surface couldn't be opened again
+	bool Publish();
+	// Until the first frame is drawn or the render thread stops
+	void WaitForFirstFrame() const;
+	bool IsRendering() const { return renderStatus.load(std::memory_order_acquire) < RenderStopped; }
+	bool HasFailed() const { return renderStatus.load(std::memory_order_acquire) == RenderFailed; }
+	// As of the last state the render thread published
+	bool IsVisible() const { return !drawnHiddenReasons; }
+	uint32_t GetHiddenReasons() const { return drawnHiddenReasons; }
+	VkExtent2D GetDrawnExtent() const { return drawnExtent; }
+	// Input positions are in device pixels of this scale
+	Scale GetDrawnScale() const { return drawnScale; }
+
+	// Widgets of the next snapshot, modules write into them when they change
+	WidgetSnapshot& EditWidgets();
+	// Render thread: widgets of the frame being drawn, for region callbacks
+	const WidgetSnapshot& GetWidgets() const { return drawnSnapshot.widgets; }
+	// Render thread: region under the pointer as of the frame being drawn, 0 if none
+	uint32_t GetHoveredRegion() const { return drawnSnapshot.hoveredRegion; }
 
-	void SetOnPresent(OnPresentCallbackType onPresent);
+	void SetOnLayout(OnLayoutCallbackType onLayout);
+	void SetOnWidgets(OnWidgetsCallbackType onWidgets);
+	void SetOnResize(OnResizeCallbackType onResize);
+	void SetOnFrame(OnFrameCallbackType onFrame);
+	// Draw a frame per frame callback even when nothing changed, for benchmarks. Set before Start()
+	void SetContinuous(bool continuous);
+	// Pointer and touch input on the regions of the renderer, the background (region 0) gets none
+	void SetOnInput(OnInputCallbackType onInput);
+
+	// Remember the time (on the presentation clock) of an input event that the next frame is going to reflect
+	void MarkInput(uint64_t inputTime);
+	// Render thread: ask the compositor when the next commit hits the screen, must be called right before the commit
+	void RequestPresentationFeedback();
+	// Render thread: ask for a frame callback with the next commit, unless one is still pending. One that never comes
+	// means that the surface isn't shown
+	void RequestFrameCallback();
+	// Render thread: set double-buffered surface state (buffer scale, viewport) that must go with the next buffer
+	void ApplySurfaceState();
+	// Render thread, or once it's stopped
+	const FrameStats &GetFrameStats() const { return frameStats; }
+	void ResetFrameStats() { frameStats.Reset(); }
 
 	wl_surface* GetSurface() { return surface; }
 	xdg_surface* GetXdgSurface() { return xdgSurface; }
@@ -67,12 +172,74 @@ public:
 	xdg_positioner* GetXdgPopupPositioner() { return xdgPopupPositioner; }
 	xdg_popup* GetXdgPopup() { return xdgPopup; }
 	zwlr_layer_surface_v1* GetLayerSurface() { return layerSurface; }
+	// Render thread, or once it's stopped
+	Renderer* GetRenderer() { return renderer.get(); }
+	// Render thread: size in logical (surface-local) coordinates
 	int32_t GetWidth() const { return width; }
 	int32_t GetHeight() const { return height; }
+	// Render thread: size of the rendered buffer in device pixels
+	uint32_t GetBufferWidth() const { return scale.ToDevice(width); }
+	uint32_t GetBufferHeight() const { return scale.ToDevice(height); }
+	Scale GetScale() const { return scale; }
 	bool IsGoingToClose() const { return isGoingToClose; }
 
 private:
-	bool Init(CorePtr core);
+	bool Init(CorePtr core, const StartupSnapshot *snapshot);
+	// Attaches the snapshot's pixels through wl_shm, before there is a renderer
+	void PresentSnapshot(const StartupSnapshot &snapshot);
+	bool CreateLayerSurface();
+	bool ReopenLayerSurface();
+	void SetPendingScale(Scale newScale);
+	void UpdateIntegerScale();
+	void UpdateOutputsPower();
+	// Takes the state the render thread published
+	void OnRenderState();
+
+	// Render thread
+	void RenderLoop();
+	// Takes the latest snapshot, if there's a new one
+	void ApplySnapshot();
+	void UpdateVisibility();
+	bool RenderFrame();
+	void PublishRenderState();
+	// Sleeps until an event of the surface's queue, a new snapshot or `timeout` milliseconds (-1 for none)
+	bool WaitForEvents(int timeout);
+
+	// Wayland events
+	void OnXdgSurfaceConfigure(xdg_surface *shellSurface, uint32_t serial);
+	void OnXdgToplevelConfigure(xdg_toplevel *toplevel, int32_t width, int32_t height, wl_array *states);
+	void OnXdgToplevelClose(xdg_toplevel *toplevel);
+	void OnXdgPopupConfigure(xdg_popup *popup, int32_t x, int32_t y, int32_t width, int32_t height);
+	void OnXdgPopupDone(xdg_popup *popup);
+	void OnLayerSurfaceConfigure(zwlr_layer_surface_v1 *layerSurface, uint32_t serial, uint32_t width, uint32_t height);
+	void OnLayerSurfaceClosed(zwlr_layer_surface_v1 *layerSurface);
+	void OnSurfaceEnter(wl_surface *surface, wl_output *output);
+	void OnSurfaceLeave(wl_surface *surface, wl_output *output);
+	// A removed output leaves no surface_leave behind
+	void ForgetOutput(wl_output *output);
+	void OnPreferredScale(wp_fractional_scale_v1 *fractionalScale, uint32_t scale);
+	// On the render thread's queue
+	void OnFrameDone(wl_callback *callback, uint32_t time);
+	static const xdg_surface_listener xdgSurfaceListener;
+	static const xdg_toplevel_listener xdgToplevelListener;
+	static const xdg_popup_listener xdgPopupListener;
+	static const zwlr_layer_surface_v1_listener zwlrLayerSurfaceListener;
+	static const wl_surface_listener wlSurfaceListener;
+	static const wp_fractional_scale_v1_listener wpFractionalScaleListener;
+	static const wl_callback_listener wlFrameCallbackListener;
+
+	// Input from the Seat in surface-local coordinates
+	void OnPointerMotion(double x, double y);
+	void OnPointerLeave();
+	void OnPointerButton(uint32_t button, bool pressed, uint32_t serial);
+	void OnPointerScroll(int32_t steps, bool horizontal);
+	void OnTouchDown(double x, double y, uint32_t serial);
+	void OnTouchMotion(double x, double y);
+	void OnTouchUp(uint32_t serial);
+	void OnTouchCancel();
+	// Hit-tests the last pointer position, once per dispatch and before buttons, and reports hover changes
+	void UpdateHover();
+	void EmitInput(InputEvent::Type type, uint32_t region, int32_t x, int32_t y, uint32_t button, uint32_t serial);
 
 	CorePtr core;
 	// Wayland
@@ -82,20 +249,96 @@ private:
 	xdg_positioner *xdgPopupPositioner = nullptr;
 	xdg_popup *xdgPopup = nullptr;
 	zwlr_layer_surface_v1 *layerSurface = nullptr;
-	std::unique_ptr<XdgSurfaceListenerWrapper> xdgSurfaceListenerWrapper = std::make_unique<Window::XdgSurfaceListenerWrapper>();
-	std::unique_ptr<XdgToplevelListenerWrapper> xdgToplevelListenerWrapper = std::make_unique<Window::XdgToplevelListenerWrapper>();
-	std::unique_ptr<XdgPopupListenerWrapper> xdgPopupListenerWrapper = std::make_unique<Window::XdgPopupListenerWrapper>();
-	std::unique_ptr<ZwlrLayerSurfaceListenerWrapper> zwlrLayerSurfaceListenerWrapper = std::make_unique<Window::ZwlrLayerSurfaceListenerWrapper>();
+	wp_viewport *viewport = nullptr;
+	wp_fractional_scale_v1 *fractionalScale = nullptr;
 
-	uint32_t width = 1280;
-	uint32_t height = 720;
+	// Configured size and scale, handed over with the next snapshot
+	uint32_t configuredWidth = defaultWindowWidth;
+	uint32_t configuredHeight = defaultWindowHeight;
+	Scale configuredScale;
+	uint64_t surfaceGeneration = 0;
 	uint32_t newWidth = 0;
 	uint32_t newHeight = 0;
+	Scale pendingScale;
+	// Outputs the surface is on, used for the integer scale when there is no fractional scale
+	std::vector<wl_output*> enteredOutputs;
+	uint32_t outputRemovedSubscription = 0;
 
-	RendererPtr renderer;
+	// Visibility known to the main thread
+	uint32_t hiddenReasons = 0;
+	// Outputs generation of Core when the layer surface was closed or last reopened
+	uint64_t closedOutputsGeneration = 0;
+
+	// Handoff
+	TripleBuffer<Snapshot> snapshots;
+	TripleBuffer<RenderState> renderStates;
+	WidgetSnapshot widgets;
+	uint64_t pendingInputTime = 0;
+	// Input time of the last snapshot the render thread took, the main thread's pending one is done then
+	std::atomic<uint64_t> takenInputTime = 0;
+	// Wakes the render thread while it waits hidden, and the event loop when there's a new render state
+	int wakeFd = -1;
+	int renderStateFd = -1;
+	std::thread renderThread;
+	std::atomic<bool> stopping = false;
+	std::atomic<RenderStatus> renderStatus = RenderStarting;
+	// Last render state
+	HitIndex hitIndex;
+	VkExtent2D drawnExtent = {};
+	Scale drawnScale;
+	uint32_t drawnHiddenReasons = 0;
+	OnResizeCallbackType onResize;
+
+	// Input, positions in device pixels
+	OnInputCallbackType onInput;
+	int32_t pointerX = 0;
+	int32_t pointerY = 0;
+	uint64_t pointerTime = 0;
+	uint32_t hoveredRegion = 0;
+	uint32_t pressedRegion = 0;
+	uint32_t pressedButton = 0;
+	int32_t touchX = 0;
+	int32_t touchY = 0;
+	uint32_t touchRegion = 0;
 
-	// bitfield
+	// bitfield, main thread only
 	bool resize : 1 = false;
 	bool readyToResize : 1 = false;
 	bool isGoingToClose : 1 = false;
+	bool snapshotDirty : 1 = true;
+	bool pointerInside : 1 = false;
+	bool pointerMoved : 1 = false;
+
+	// ==== Render thread ====
+	RendererPtr renderer;
+	OnWidgetsCallbackType onWidgets;
+	OnFrameCallbackType onFrame;
+	bool continuous = false;
+	// A snapshot was taken, the bar was hidden or the window just started since the last frame
+	bool redrawNeeded = true;
+	// The surface and wp_presentation on the render thread's queue, the objects they create come on it
+	wl_event_queue *eventQueue = nullptr;
+	wl_surface *queueSurface = nullptr;
+	wp_presentation *queuePresentation = nullptr;
+	wl_callback *frameCallback = nullptr;
+	// When the pending frame callback was requested, on the presentation clock
+	uint64_t frameCallbackTime = 0;
+	Snapshot drawnSnapshot;
+	uint32_t width = defaultWindowWidth;
+	uint32_t height = defaultWindowHeight;
+	Scale scale;
+	uint64_t drawnSurfaceGeneration = 0;
+	uint32_t renderHiddenReasons = 0;
+	// What the last published render state was made of
+	uint64_t publishedRegionsGeneration = 0;
+	VkExtent2D publishedExtent = {};
+	Scale publishedScale;
+	uint32_t publishedHiddenReasons = 0;
+
+	// Presentation timings
+	std::array<PresentationFeedback, presentationFeedbacksCount> presentationFeedbacks;
+	FrameStats frameStats;
+	uint64_t updateTime = 0;
+	uint64_t frameInputTime = 0;
+	bool surfaceStateDirty = true;
 };
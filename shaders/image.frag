@@ -0,0 +1,33 @@
+#version 450
+
+// Pipeline variant, as in quad.frag
+layout(constant_id = 0) const bool rounded = false;
+
+layout(push_constant) uniform PushConstants {
+	vec4 rect;
+	vec4 color;
+	vec2 viewport;
+	float radius;
+} pushConstants;
+
+// Straight alpha RGBA
+layout(set = 0, binding = 0) uniform sampler2D image;
+
+layout(location = 0) in vec2 inLocal;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	float coverage = 1.0;
+	if (rounded) {
+		vec2 halfSize = pushConstants.rect.zw * 0.5;
+		vec2 q = abs(inLocal) - halfSize + pushConstants.radius;
+		float distance = length(max(q, 0.0)) + min(max(q.x, q.y), 0.0) - pushConstants.radius;
+		coverage = clamp(0.5 - distance, 0.0, 1.0);
+	}
+	vec2 uv = inLocal / pushConstants.rect.zw + 0.5;
+	vec4 texel = texture(image, uv) * pushConstants.color;
+	float alpha = texel.a * coverage;
+	outColor = vec4(texel.rgb * alpha, alpha);
+}
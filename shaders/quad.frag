@@ -0,0 +1,30 @@
+#version 450
+
+// Pipeline variant: plain rectangles skip the corner distance entirely
+layout(constant_id = 0) const bool rounded = false;
+
+layout(push_constant) uniform PushConstants {
+	vec4 rect;
+	vec4 color;
+	vec2 viewport;
+	float radius;
+} pushConstants;
+
+layout(location = 0) in vec2 inLocal;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	float coverage = 1.0;
+	if (rounded) {
+		// Signed distance to the rounded rectangle, one pixel of antialiasing on the edge
+		vec2 halfSize = pushConstants.rect.zw * 0.5;
+		vec2 q = abs(inLocal) - halfSize + pushConstants.radius;
+		float distance = length(max(q, 0.0)) + min(max(q.x, q.y), 0.0) - pushConstants.radius;
+		coverage = clamp(0.5 - distance, 0.0, 1.0);
+	}
+	// The swapchain is composited as premultiplied alpha
+	float alpha = pushConstants.color.a * coverage;
+	outColor = vec4(pushConstants.color.rgb * alpha, alpha);
+}
@@ -0,0 +1,20 @@
+#version 450
+
+// Rectangle in framebuffer pixels, drawn as a 4 vertex triangle strip without vertex buffers
+layout(push_constant) uniform PushConstants {
+	vec4 rect;
+	vec4 color;
+	vec2 viewport;
+	float radius;
+} pushConstants;
+
+// Position relative to the center of the rectangle, in pixels
+layout(location = 0) out vec2 outLocal;
+
+void main()
+{
+	vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+	vec2 position = pushConstants.rect.xy + corner * pushConstants.rect.zw;
+	outLocal = (corner - 0.5) * pushConstants.rect.zw;
+	gl_Position = vec4(position / pushConstants.viewport * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,58 @@
+#include "allocationCounter.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+	std::atomic<uint64_t> allocationsCount = 0;
+}
+
+uint64_t AllocationCounter::GetCount()
+{
+	return allocationsCount.load(std::memory_order_relaxed);
+}
+
+#ifdef NCBAR_TRACK_ALLOCATIONS
+// The array and nothrow forms of the standard library call these, so replacing them covers every form
+void* operator new(std::size_t size)
+{
+	allocationsCount.fetch_add(1, std::memory_order_relaxed);
+	if (void *pointer = std::malloc(size ? size : 1))
+		return pointer;
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	allocationsCount.fetch_add(1, std::memory_order_relaxed);
+	const auto align = static_cast<std::size_t>(alignment);
+	// aligned_alloc wants the size to be a multiple of the alignment
+	if (void *pointer = std::aligned_alloc(align, (size + align - 1) / align * align))
+		return pointer;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t size) noexcept
+{
+	(void)size;
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t alignment) noexcept
+{
+	(void)alignment;
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t size, std::align_val_t alignment) noexcept
+{
+	(void)size;
+	(void)alignment;
+	std::free(pointer);
+}
+#endif
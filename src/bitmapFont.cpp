@@ -0,0 +1,99 @@
+#include "bitmapFont.hpp"
+#include <algorithm>
+
+namespace {
+	constexpr char firstCharacter = ' ';
+	constexpr char lastCharacter = '~';
+	constexpr char replacementCharacter = '?';
+
+	// Columns left to right, the least significant bit is the top row
+	constexpr uint8_t glyphs[][5] = {
+		{ 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5f, 0x00, 0x00 }, { 0x00, 0x07, 0x00, 0x07, 0x00 }, // ' ' ! "
+		{ 0x14, 0x7f, 0x14, 0x7f, 0x14 }, { 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 }, // # $ %
+		{ 0x36, 0x49, 0x56, 0x20, 0x50 }, { 0x00, 0x08, 0x07, 0x03, 0x00 }, { 0x00, 0x1c, 0x22, 0x41, 0x00 }, // & ' (
+		{ 0x00, 0x41, 0x22, 0x1c, 0x00 }, { 0x2a, 0x1c, 0x7f, 0x1c, 0x2a }, { 0x08, 0x08, 0x3e, 0x08, 0x08 }, // ) * +
+		{ 0x00, 0x80, 0x70, 0x30, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 }, { 0x00, 0x00, 0x60, 0x60, 0x00 }, // , - .
+		{ 0x20, 0x10, 0x08, 0x04, 0x02 }, { 0x3e, 0x51, 0x49, 0x45, 0x3e }, { 0x00, 0x42, 0x7f, 0x40, 0x00 }, // / 0 1
+		{ 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4b, 0x31 }, { 0x18, 0x14, 0x12, 0x7f, 0x10 }, // 2 3 4
+		{ 0x27, 0x45, 0x45, 0x45, 0x39 }, { 0x3c, 0x4a, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 }, // 5 6 7
+		{ 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1e }, { 0x00, 0x00, 0x14, 0x00, 0x00 }, // 8 9 :
+		{ 0x00, 0x40, 0x34, 0x00, 0x00 }, { 0x00, 0x08, 0x14, 0x22, 0x41 }, { 0x14, 0x14, 0x14, 0x14, 0x14 }, // ; < =
+		{ 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x59, 0x09, 0x06 }, { 0x3e, 0x41, 0x5d, 0x59, 0x4e }, // > ? @
+		{ 0x7c, 0x12, 0x11, 0x12, 0x7c }, { 0x7f, 0x49, 0x49, 0x49, 0x36 }, { 0x3e, 0x41, 0x41, 0x41, 0x22 }, // A B C
+		{ 0x7f, 0x41, 0x41, 0x41, 0x3e }, { 0x7f, 0x49, 0x49, 0x49, 0x41 }, { 0x7f, 0x09, 0x09, 0x09, 0x01 }, // D E F
+		{ 0x3e, 0x41, 0x41, 0x51, 0x73 }, { 0x7f, 0x08, 0x08, 0x08, 0x7f }, { 0x00, 0x41, 0x7f, 0x41, 0x00 }, // G H I
+		{ 0x20, 0x40, 0x41, 0x3f, 0x01 }, { 0x7f, 0x08, 0x14, 0x22, 0x41 }, { 0x7f, 0x40, 0x40, 0x40, 0x40 }, // J K L
+		{ 0x7f, 0x02, 0x1c, 0x02, 0x7f }, { 0x7f, 0x04, 0x08, 0x10, 0x7f }, { 0x3e, 0x41, 0x41, 0x41, 0x3e }, // M N O
+		{ 0x7f, 0x09, 0x09, 0x09, 0x06 }, { 0x3e, 0x41, 0x51, 0x21, 0x5e }, { 0x7f, 0x09, 0x19, 0x29, 0x46 }, // P Q R
+		{ 0x26, 0x49, 0x49, 0x49, 0x32 }, { 0x03, 0x01, 0x7f, 0x01, 0x03 }, { 0x3f, 0x40, 0x40, 0x40, 0x3f }, // S T U
+		{ 0x1f, 0x20, 0x40, 0x20, 0x1f }, { 0x3f, 0x40, 0x38, 0x40, 0x3f }, { 0x63, 0x14, 0x08, 0x14, 0x63 }, // V W X
+		{ 0x03, 0x04, 0x78, 0x04, 0x03 }, { 0x61, 0x59, 0x49, 0x4d, 0x43 }, { 0x00, 0x7f, 0x41, 0x41, 0x41 }, // Y Z [
+		{ 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x41, 0x7f }, { 0x04, 0x02, 0x01, 0x02, 0x04 }, // \ ] ^
+		{ 0x40, 0x40, 0x40, 0x40, 0x40 }, { 0x00, 0x03, 0x07, 0x08, 0x00 }, { 0x20, 0x54, 0x54, 0x78, 0x40 }, // _ ` a
+		{ 0x7f, 0x28, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x28 }, { 0x38, 0x44, 0x44, 0x28, 0x7f }, // b c d
+		{ 0x38, 0x54, 0x54, 0x54, 0x18 }, { 0x00, 0x08, 0x7e, 0x09, 0x02 }, { 0x18, 0xa4, 0xa4, 0x9c, 0x78 }, // e f g
+		{ 0x7f, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7d, 0x40, 0x00 }, { 0x20, 0x40, 0x40, 0x3d, 0x00 }, // h i j
+		{ 0x7f, 0x10, 0x28, 0x44, 0x00 }, { 0x00, 0x41, 0x7f, 0x40, 0x00 }, { 0x7c, 0x04, 0x78, 0x04, 0x78 }, // k l m
+		{ 0x7c, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 }, { 0xfc, 0x18, 0x24, 0x24, 0x18 }, // n o p
+		{ 0x18, 0x24, 0x24, 0x18, 0xfc }, { 0x7c, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x24 }, // q r s
+		{ 0x04, 0x04, 0x3f, 0x44, 0x24 }, { 0x3c, 0x40, 0x40, 0x20, 0x7c }, { 0x1c, 0x20, 0x40, 0x20, 0x1c }, // t u v
+		{ 0x3c, 0x40, 0x30, 0x40, 0x3c }, { 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x4c, 0x90, 0x90, 0x90, 0x7c }, // w x y
+		{ 0x44, 0x64, 0x54, 0x4c, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 }, { 0x00, 0x00, 0x77, 0x00, 0x00 }, // z { |
+		{ 0x00, 0x41, 0x36, 0x08, 0x00 }, { 0x02, 0x01, 0x02, 0x04, 0x02 }                                    // } ~
+	};
+	static_assert(std::size(glyphs) == lastCharacter - firstCharacter + 1);
+
+	bool isContinuationByte(char byte)
+	{
+		return (static_cast<unsigned char>(byte) & 0xc0) == 0x80;
+	}
+
+	const uint8_t* findGlyph(char character)
+	{
+		if (character < firstCharacter || character > lastCharacter)
+			character = replacementCharacter;
+		return glyphs[character - firstCharacter];
+	}
+
+	std::size_t countCharacters(std::string_view text)
+	{
+		return static_cast<std::size_t>(std::count_if(text.begin(), text.end(), [](char byte) { return !isContinuationByte(byte); }));
+	}
+}
+
+uint32_t BitmapFont::GetWidth(std::string_view text, uint32_t pixelSize)
+{
+	// No spacing after the last glyph
+	const std::size_t characters = countCharacters(text);
+	return characters ? static_cast<uint32_t>(characters * cellWidth - 1) * pixelSize : 0;
+}
+
+void BitmapFont::Render(std::string_view text, uint32_t pixelSize, std::array<uint8_t, 4> color, ImageDecoder::Image &image)
+{
+	image.width = GetWidth(text, pixelSize);
+	image.height = image.width ? GetHeight(pixelSize) : 0;
+	image.pixels.assign(static_cast<std::size_t>(image.width) * image.height * 4, 0);
+	if (!image.width)
+		return;
+
+	const std::size_t stride = static_cast<std::size_t>(image.width) * 4;
+	uint32_t left = 0;
+	for (char character : text) {
+		if (isContinuationByte(character))
+			continue;
+		const uint8_t *glyph = findGlyph(character);
+		for (uint32_t column = 0; column < std::size(glyphs[0]); column++) {
+			for (uint32_t row = 0; row < cellHeight; row++) {
+				if (!(glyph[column] & (1u << row)))
+					continue;
+				// One font pixel is a square of device pixels, filled a row at a time
+				uint8_t *square = image.pixels.data() + static_cast<std::size_t>(row * pixelSize) * stride + static_cast<std::size_t>(left + column * pixelSize) * 4;
+				for (uint32_t y = 0; y < pixelSize; y++, square += stride) {
+					for (uint32_t x = 0; x < pixelSize; x++)
+						std::copy(color.begin(), color.end(), square + x * 4);
+				}
+			}
+		}
+		left += cellWidth * pixelSize;
+	}
+}
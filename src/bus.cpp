@@ -0,0 +1,345 @@
+#include "bus.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+	void onReplyNotify(DBusPendingCall *pending, void *data)
+	{
+		auto callback = static_cast<Bus::ReplyCallbackType*>(data);
+		DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+		if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+			dbus_message_unref(reply);
+			reply = nullptr;
+		}
+		(*callback)(reply);
+		if (reply)
+			dbus_message_unref(reply);
+	}
+
+	void freeReplyCallback(void *data)
+	{
+		delete static_cast<Bus::ReplyCallbackType*>(data);
+	}
+}
+
+Bus::~Bus()
+{
+	if (connection) {
+		if (filterAdded)
+			dbus_connection_remove_filter(connection, OnMessage, this);
+		// Pending calls are dropped with their callbacks, they may capture modules that are gone already
+		dbus_connection_set_watch_functions(connection, nullptr, nullptr, nullptr, nullptr, nullptr);
+		dbus_connection_set_timeout_functions(connection, nullptr, nullptr, nullptr, nullptr, nullptr);
+		dbus_connection_set_dispatch_status_function(connection, nullptr, nullptr, nullptr);
+		dbus_connection_close(connection);
+		dbus_connection_unref(connection);
+		connection = nullptr;
+	}
+	for (const auto &[fd, watches] : watchesByFd)
+		core->RemoveFd(fd);
+	watchesByFd.clear();
+	for (const auto &[timeout, fd] : timeoutFds) {
+		core->RemoveFd(fd);
+		close(fd);
+	}
+	timeoutFds.clear();
+	if (dispatchFd >= 0) {
+		core->RemoveFd(dispatchFd);
+		close(dispatchFd);
+		dispatchFd = -1;
+	}
+}
+
+bool Bus::Init(CorePtr core)
+{
+	this->core = core;
+
+	dispatchFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (dispatchFd < 0) {
+		NCBAR_LOG_ERROR << "D-Bus: Failed to create eventfd: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(dispatchFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		uint64_t count;
+		if (read(dispatchFd, &count, sizeof(count)) < 0)
+			return;
+		this->Dispatch();
+	}))
+		return false;
+
+	// The only blocking part: authentication and Hello, once at startup
+	DBusError error;
+	dbus_error_init(&error);
+	connection = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+	if (!connection) {
+		NCBAR_LOG_ERROR << "D-Bus: Failed to connect to the session bus: " << error.message;
+		dbus_error_free(&error);
+		return false;
+	}
+	dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+	if (!dbus_connection_set_watch_functions(connection, OnAddWatch, OnRemoveWatch, OnToggleWatch, this, nullptr) ||
+		!dbus_connection_set_timeout_functions(connection, OnAddTimeout, OnRemoveTimeout, OnToggleTimeout, this, nullptr)) {
+		NCBAR_LOG_ERROR << "D-Bus: Failed to hook into the event loop";
+		return false;
+	}
+	dbus_connection_set_dispatch_status_function(connection, OnDispatchStatus, this, nullptr);
+	if (!dbus_connection_add_filter(connection, OnMessage, this, nullptr)) {
+		NCBAR_LOG_ERROR << "D-Bus: Failed to add filter";
+		return false;
+	}
+	filterAdded = true;
+
+	// Signals may have arrived along with the reply to Hello
+	if (dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS)
+		OnDispatchStatus(connection, DBUS_DISPATCH_DATA_REMAINS, this);
+	return true;
+}
+
+bool Bus::Call(DBusMessage *message, ReplyCallbackType callback, int timeout)
+{
+	DBusPendingCall *pending = nullptr;
+	const bool sent = dbus_connection_send_with_reply(connection, message, &pending, timeout) && pending;
+	dbus_message_unref(message);
+	if (!sent) {
+		NCBAR_LOG_ERROR << "D-Bus: Failed to send a call";
+		return false;
+	}
+	// Called right away if the reply is there already
+	if (!dbus_pending_call_set_notify(pending, onReplyNotify, new ReplyCallbackType(std::move(callback)), freeReplyCallback)) {
+		dbus_pending_call_cancel(pending);
+		dbus_pending_call_unref(pending);
+		return false;
+	}
+	dbus_pending_call_unref(pending);
+	return true;
+}
+
+bool Bus::Send(DBusMessage *message)
+{
+	const bool sent = dbus_connection_send(connection, message, nullptr);
+	dbus_message_unref(message);
+	return sent;
+}
+
+uint32_t Bus::AddFilter(FilterCallbackType filter)
+{
+	filters.emplace_back(++lastFilterId, std::move(filter));
+	return lastFilterId;
+}
+
+void Bus::RemoveFilter(uint32_t id)
+{
+	if (filtering) {
+		// The filter may be the one that is running, so it's removed after the message
+		for (auto &filter : filters) {
+			if (filter.first == id)
+				filter.first = 0;
+		}
+		return;
+	}
+	std::erase_if(filters, [id](const auto &filter) { return filter.first == id; });
+}
+
+void Bus::AddMatch(const std::string &rule)
+{
+	// Without an error the bus daemon's reply isn't waited for
+	dbus_bus_add_match(connection, rule.c_str(), nullptr);
+}
+
+void Bus::RemoveMatch(const std::string &rule)
+{
+	if (connection)
+		dbus_bus_remove_match(connection, rule.c_str(), nullptr);
+}
+
+void Bus::UpdateFdEvents(int fd)
+{
+	auto it = watchesByFd.find(fd);
+	if (it == watchesByFd.end())
+		return;
+	uint32_t events = 0;
+	for (auto watch : it->second.watches) {
+		if (!dbus_watch_get_enabled(watch))
+			continue;
+		const auto flags = dbus_watch_get_flags(watch);
+		if (flags & DBUS_WATCH_READABLE)
+			events |= EPOLLIN;
+		if (flags & DBUS_WATCH_WRITABLE)
+			events |= EPOLLOUT;
+	}
+	if (events != it->second.events) {
+		it->second.events = events;
+		core->ModifyFd(fd, events);
+	}
+}
+
+void Bus::OnFdEvents(int fd, uint32_t events)
+{
+	NCBAR_TRACE_SCOPE("source", "Bus::OnFdEvents");
+	unsigned int flags = 0;
+	if (events & EPOLLIN)
+		flags |= DBUS_WATCH_READABLE;
+	if (events & EPOLLOUT)
+		flags |= DBUS_WATCH_WRITABLE;
+	if (events & EPOLLHUP)
+		flags |= DBUS_WATCH_HANGUP;
+	if (events & EPOLLERR)
+		flags |= DBUS_WATCH_ERROR;
+
+	auto it = watchesByFd.find(fd);
+	if (it == watchesByFd.end())
+		return;
+	// Handling may add or remove watches
+	const auto watches = it->second.watches;
+	for (auto watch : watches) {
+		if (!dbus_watch_get_enabled(watch))
+			continue;
+		const auto watchFlags = flags & (dbus_watch_get_flags(watch) | DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR);
+		if (watchFlags)
+			dbus_watch_handle(watch, watchFlags);
+		// Only one of the watches of an fd gets the hangup
+		flags &= ~(DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR);
+		if (!watchesByFd.contains(fd))
+			break;
+	}
+	Dispatch();
+}
+
+void Bus::Dispatch()
+{
+	dbus_connection_ref(connection);
+	while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS) {}
+	dbus_connection_unref(connection);
+}
+
+dbus_bool_t Bus::OnAddWatch(DBusWatch *watch, void *data)
+{
+	auto bus = static_cast<Bus*>(data);
+	const int fd = dbus_watch_get_unix_fd(watch);
+	auto [it, added] = bus->watchesByFd.try_emplace(fd);
+	it->second.watches.push_back(watch);
+	if (added) {
+		if (!bus->core->AddFd(fd, 0, [bus, fd](uint32_t events) {
+			bus->OnFdEvents(fd, events);
+		})) {
+			bus->watchesByFd.erase(it);
+			return FALSE;
+		}
+	}
+	bus->UpdateFdEvents(fd);
+	return TRUE;
+}
+
+void Bus::OnRemoveWatch(DBusWatch *watch, void *data)
+{
+	auto bus = static_cast<Bus*>(data);
+	const int fd = dbus_watch_get_unix_fd(watch);
+	auto it = bus->watchesByFd.find(fd);
+	if (it == bus->watchesByFd.end())
+		return;
+	std::erase(it->second.watches, watch);
+	if (it->second.watches.empty()) {
+		bus->core->RemoveFd(fd);
+		bus->watchesByFd.erase(it);
+	}
+	else
+		bus->UpdateFdEvents(fd);
+}
+
+void Bus::OnToggleWatch(DBusWatch *watch, void *data)
+{
+	static_cast<Bus*>(data)->UpdateFdEvents(dbus_watch_get_unix_fd(watch));
+}
+
+dbus_bool_t Bus::OnAddTimeout(DBusTimeout *timeout, void *data)
+{
+	auto bus = static_cast<Bus*>(data);
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return FALSE;
+	if (!bus->core->AddFd(fd, EPOLLIN, [bus, fd, timeout](uint32_t events) {
+		(void)events;
+		uint64_t expirations;
+		if (read(fd, &expirations, sizeof(expirations)) < 0)
+			return;
+		dbus_timeout_handle(timeout);
+		bus->Dispatch();
+	})) {
+		close(fd);
+		return FALSE;
+	}
+	bus->timeoutFds[timeout] = fd;
+	bus->ArmTimeout(timeout);
+	return TRUE;
+}
+
+void Bus::OnRemoveTimeout(DBusTimeout *timeout, void *data)
+{
+	auto bus = static_cast<Bus*>(data);
+	auto it = bus->timeoutFds.find(timeout);
+	if (it == bus->timeoutFds.end())
+		return;
+	bus->core->RemoveFd(it->second);
+	close(it->second);
+	bus->timeoutFds.erase(it);
+}
+
+void Bus::OnToggleTimeout(DBusTimeout *timeout, void *data)
+{
+	static_cast<Bus*>(data)->ArmTimeout(timeout);
+}
+
+void Bus::ArmTimeout(DBusTimeout *timeout)
+{
+	auto it = timeoutFds.find(timeout);
+	if (it == timeoutFds.end())
+		return;
+	// libdbus timeouts repeat until they are removed or disabled
+	itimerspec timer = {};
+	if (dbus_timeout_get_enabled(timeout)) {
+		const int interval = dbus_timeout_get_interval(timeout);
+		timer.it_value.tv_sec = interval / 1000;
+		timer.it_value.tv_nsec = (interval % 1000) * 1'000'000 + 1;
+		timer.it_interval = timer.it_value;
+	}
+	timerfd_settime(it->second, 0, &timer, nullptr);
+}
+
+void Bus::OnDispatchStatus(DBusConnection *connection, DBusDispatchStatus status, void *data)
+{
+	(void)connection;
+	// Dispatching from here isn't allowed, it's done on the next loop iteration
+	if (status == DBUS_DISPATCH_DATA_REMAINS) {
+		const uint64_t one = 1;
+		if (write(static_cast<Bus*>(data)->dispatchFd, &one, sizeof(one)) < 0)
+			NCBAR_LOG_ERROR << "D-Bus: Failed to schedule dispatch: " << strerror(errno);
+	}
+}
+
+DBusHandlerResult Bus::OnMessage(DBusConnection *connection, DBusMessage *message, void *data)
+{
+	(void)connection;
+	auto bus = static_cast<Bus*>(data);
+	bool handled = false;
+	bus->filtering = true;
+	for (auto &[id, filter] : bus->filters) {
+		if (id && filter && filter(message)) {
+			handled = true;
+			break;
+		}
+	}
+	bus->filtering = false;
+	// Drop the ones removed from their callbacks
+	std::erase_if(bus->filters, [](const auto &filter) { return filter.first == 0; });
+	return handled ? DBUS_HANDLER_RESULT_HANDLED : DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
@@ -0,0 +1,334 @@
+#include "clock.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "widgetStore.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+	constexpr const char *timezoneDirectory = "/etc";
+	constexpr std::string_view timezoneFile = "localtime";
+	constexpr int64_t resolutionSeconds[] = { 1, 60, 60 * 60, 24 * 60 * 60 };
+
+	void appendNumber(std::string &value, int64_t number, int width, char padding)
+	{
+		char digits[24];
+		const auto end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+		const int length = static_cast<int>(end - digits);
+		if (length < width)
+			value.append(static_cast<std::size_t>(width - length), padding);
+		value.append(digits, end);
+	}
+
+	int64_t floorDivide(int64_t number, int64_t divisor)
+	{
+		return number / divisor - (number % divisor < 0 ? 1 : 0);
+	}
+
+	// First boundary of `unit` local seconds after `now` with a UTC offset of `offset`
+	time_t nextBoundary(time_t now, long offset, int64_t unit)
+	{
+		return static_cast<time_t>((floorDivide(static_cast<int64_t>(now) + offset, unit) + 1) * unit - offset);
+	}
+}
+
+Clock::~Clock()
+{
+	if (inotifyFd >= 0) {
+		core->RemoveFd(inotifyFd);
+		close(inotifyFd);
+		inotifyFd = -1;
+	}
+	if (timerFd >= 0) {
+		core->RemoveFd(timerFd);
+		close(timerFd);
+		timerFd = -1;
+	}
+}
+
+bool Clock::Init(CorePtr core)
+{
+	this->core = core;
+
+	// Loads the timezone once, localtime_r doesn't look at it again
+	tzset();
+	char name[64];
+	tm names = {};
+	for (int day = 0; day < 7; day++) {
+		names.tm_wday = day;
+		weekdayNames[0][day].assign(name, strftime(name, sizeof(name), "%a", &names));
+		weekdayNames[1][day].assign(name, strftime(name, sizeof(name), "%A", &names));
+	}
+	for (int month = 0; month < 12; month++) {
+		names.tm_mon = month;
+		monthNames[0][month].assign(name, strftime(name, sizeof(name), "%b", &names));
+		monthNames[1][month].assign(name, strftime(name, sizeof(name), "%B", &names));
+	}
+	for (int half = 0; half < 2; half++) {
+		names.tm_hour = half * 12;
+		amPmNames[half].assign(name, strftime(name, sizeof(name), "%p", &names));
+	}
+
+	timerFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0) {
+		NCBAR_LOG_ERROR << "Clock: Failed to create timer: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(timerFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnTimer();
+	}))
+		return false;
+
+	// Best effort, without it a new timezone shows up after a restart
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0 || inotify_add_watch(inotifyFd, timezoneDirectory, IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+		NCBAR_LOG_ERROR << "Clock: Failed to watch " << timezoneDirectory << ": " << strerror(errno);
+		if (inotifyFd >= 0)
+			close(inotifyFd);
+		inotifyFd = -1;
+	}
+	else if (!core->AddFd(inotifyFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnTimezone();
+	})) {
+		close(inotifyFd);
+		inotifyFd = -1;
+	}
+	return true;
+}
+
+void Clock::AddFormat(std::string_view key, std::string_view format)
+{
+	auto it = std::find_if(formats.begin(), formats.end(), [key](const Format &format) { return format.key == key; });
+	if (it == formats.end()) {
+		it = formats.emplace(formats.end());
+		it->key = key;
+	}
+	Compile(format, *it);
+	Tick();
+}
+
+void Clock::RemoveFormat(std::string_view key)
+{
+	auto it = std::find_if(formats.begin(), formats.end(), [key](const Format &format) { return format.key == key; });
+	if (it == formats.end())
+		return;
+	core->GetWidgetStore().Set(key, {});
+	formats.erase(it);
+	Tick();
+}
+
+Clock::Resolution Clock::GetResolution(std::string_view format)
+{
+	Format compiled;
+	Compile(format, compiled);
+	return compiled.resolution;
+}
+
+void Clock::Compile(std::string_view format, Format &compiled)
+{
+	compiled.text.clear();
+	compiled.steps.clear();
+	compiled.resolution = ResolutionDay;
+
+	auto literal = [&compiled](std::string_view text) {
+		// Consecutive literals are one step
+		if (compiled.steps.empty() || compiled.steps.back().field != Field::Literal)
+			compiled.steps.push_back(Step{ .field = Field::Literal, .offset = static_cast<uint32_t>(compiled.text.size()), .length = 0 });
+		compiled.text.append(text);
+		compiled.steps.back().length += static_cast<uint32_t>(text.size());
+	};
+	auto field = [&compiled](Field field, Resolution resolution) {
+		compiled.steps.push_back(Step{ .field = field, .offset = 0, .length = 0 });
+		compiled.resolution = std::min(compiled.resolution, resolution);
+	};
+
+	for (std::size_t i = 0; i < format.size(); i++) {
+		if (format[i] != '%' || i + 1 == format.size()) {
+			literal(format.substr(i, 1));
+			continue;
+		}
+		const std::size_t start = i++;
+		switch (format[i]) {
+		case 'Y': field(Field::Year, ResolutionDay); break;
+		case 'y': field(Field::ShortYear, ResolutionDay); break;
+		case 'm': field(Field::Month, ResolutionDay); break;
+		case 'd': field(Field::Day, ResolutionDay); break;
+		case 'e': field(Field::PaddedDay, ResolutionDay); break;
+		case 'H': field(Field::Hour, ResolutionHour); break;
+		case 'I': field(Field::Hour12, ResolutionHour); break;
+		case 'M': field(Field::Minute, ResolutionMinute); break;
+		case 'S': field(Field::Second, ResolutionSecond); break;
+		case 'p': field(Field::AmPm, ResolutionHour); break;
+		case 'a': field(Field::ShortWeekday, ResolutionDay); break;
+		case 'A': field(Field::Weekday, ResolutionDay); break;
+		case 'b':
+		case 'h': field(Field::ShortMonth, ResolutionDay); break;
+		case 'B': field(Field::MonthName, ResolutionDay); break;
+		case 'j': field(Field::YearDay, ResolutionDay); break;
+		case 'u': field(Field::MondayWeekday, ResolutionDay); break;
+		case 'w': field(Field::SundayWeekday, ResolutionDay); break;
+		case 's': field(Field::Epoch, ResolutionSecond); break;
+		// Both change only with daylight saving time, which switches on an hour
+		case 'Z': field(Field::ZoneName, ResolutionHour); break;
+		case 'z': field(Field::ZoneOffset, ResolutionHour); break;
+		case 'T':
+			field(Field::Hour, ResolutionHour);
+			literal(":");
+			field(Field::Minute, ResolutionMinute);
+			literal(":");
+			field(Field::Second, ResolutionSecond);
+			break;
+		case 'R':
+			field(Field::Hour, ResolutionHour);
+			literal(":");
+			field(Field::Minute, ResolutionMinute);
+			break;
+		case 'F':
+			field(Field::Year, ResolutionDay);
+			literal("-");
+			field(Field::Month, ResolutionDay);
+			literal("-");
+			field(Field::Day, ResolutionDay);
+			break;
+		case 'D':
+			field(Field::Month, ResolutionDay);
+			literal("/");
+			field(Field::Day, ResolutionDay);
+			literal("/");
+			field(Field::ShortYear, ResolutionDay);
+			break;
+		case 'n': literal("\n"); break;
+		case 't': literal("\t"); break;
+		case '%': literal("%"); break;
+		default: {
+			// Flags, widths and E/O modifiers come before the conversion character
+			while (i + 1 < format.size() && std::strchr("_-0^#EO123456789", format[i]))
+				i++;
+			const auto offset = static_cast<uint32_t>(compiled.text.size());
+			compiled.text.append(format.substr(start, i + 1 - start));
+			compiled.steps.push_back(Step{ .field = Field::Other, .offset = offset, .length = static_cast<uint32_t>(i + 1 - start) });
+			compiled.resolution = ResolutionSecond;
+			break;
+		}
+		}
+	}
+}
+
+void Clock::Render(Format &format, time_t now, const tm &local)
+{
+	auto &value = format.value;
+	value.clear();
+	for (const auto &step : format.steps) {
+		switch (step.field) {
+		case Field::Literal: value.append(format.text, step.offset, step.length); break;
+		case Field::Year: appendNumber(value, local.tm_year + 1900, 1, '0'); break;
+		case Field::ShortYear: appendNumber(value, (local.tm_year + 1900) % 100, 2, '0'); break;
+		case Field::Month: appendNumber(value, local.tm_mon + 1, 2, '0'); break;
+		case Field::Day: appendNumber(value, local.tm_mday, 2, '0'); break;
+		case Field::PaddedDay: appendNumber(value, local.tm_mday, 2, ' '); break;
+		case Field::Hour: appendNumber(value, local.tm_hour, 2, '0'); break;
+		case Field::Hour12: appendNumber(value, local.tm_hour % 12 ? local.tm_hour % 12 : 12, 2, '0'); break;
+		case Field::Minute: appendNumber(value, local.tm_min, 2, '0'); break;
+		case Field::Second: appendNumber(value, local.tm_sec, 2, '0'); break;
+		case Field::AmPm: value.append(amPmNames[local.tm_hour >= 12]); break;
+		case Field::ShortWeekday: value.append(weekdayNames[0][local.tm_wday]); break;
+		case Field::Weekday: value.append(weekdayNames[1][local.tm_wday]); break;
+		case Field::ShortMonth: value.append(monthNames[0][local.tm_mon]); break;
+		case Field::MonthName: value.append(monthNames[1][local.tm_mon]); break;
+		case Field::YearDay: appendNumber(value, local.tm_yday + 1, 3, '0'); break;
+		case Field::MondayWeekday: appendNumber(value, local.tm_wday ? local.tm_wday : 7, 1, '0'); break;
+		case Field::SundayWeekday: appendNumber(value, local.tm_wday, 1, '0'); break;
+		case Field::Epoch: appendNumber(value, static_cast<int64_t>(now), 1, '0'); break;
+		case Field::ZoneName:
+			if (local.tm_zone)
+				value.append(local.tm_zone);
+			break;
+		case Field::ZoneOffset: {
+			const long offset = local.tm_gmtoff;
+			value.push_back(offset < 0 ? '-' : '+');
+			const long minutes = (offset < 0 ? -offset : offset) / 60;
+			appendNumber(value, minutes / 60 * 100 + minutes % 60, 4, '0');
+			break;
+		}
+		case Field::Other: {
+			char conversion[32] = {};
+			char result[128];
+			std::memcpy(conversion, format.text.data() + step.offset, std::min<std::size_t>(step.length, sizeof(conversion) - 1));
+			value.append(result, strftime(result, sizeof(result), conversion, &local));
+			break;
+		}
+		}
+	}
+	core->GetWidgetStore().Set(format.key, value);
+}
+
+void Clock::OnTimer()
+{
+	NCBAR_TRACE_SCOPE("source", "Clock::OnTimer");
+	uint64_t expirations;
+	// ECANCELED when the time was set, everything is formatted again either way
+	if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != ECANCELED)
+		return;
+	Tick();
+}
+
+void Clock::OnTimezone()
+{
+	NCBAR_TRACE_SCOPE("source", "Clock::OnTimezone");
+	alignas(inotify_event) char buffer[4096];
+	bool changed = false;
+	while (true) {
+		const ssize_t size = read(inotifyFd, buffer, sizeof(buffer));
+		if (size <= 0)
+			break;
+		for (ssize_t offset = 0; offset < size;) {
+			const auto *event = reinterpret_cast<const inotify_event*>(buffer + offset);
+			if (event->len && std::string_view(event->name) == timezoneFile)
+				changed = true;
+			offset += sizeof(inotify_event) + event->len;
+		}
+	}
+	if (!changed)
+		return;
+	// Reads /etc/localtime again since it changed
+	tzset();
+	Tick();
+}
+
+void Clock::Tick()
+{
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	tm local;
+	localtime_r(&now.tv_sec, &local);
+	Resolution resolution = ResolutionDay;
+	for (auto &format : formats) {
+		Render(format, now.tv_sec, local);
+		resolution = std::min(resolution, format.resolution);
+	}
+
+	itimerspec timer = {};
+	if (!formats.empty()) {
+		const int64_t unit = resolutionSeconds[resolution];
+		time_t next = nextBoundary(now.tv_sec, local.tm_gmtoff, unit);
+		// Local hours and midnights move when the offset changes before them
+		if (resolution >= ResolutionHour) {
+			tm then;
+			localtime_r(&next, &then);
+			if (then.tm_gmtoff != local.tm_gmtoff)
+				next = nextBoundary(now.tv_sec, then.tm_gmtoff, unit);
+		}
+		timer.it_value.tv_sec = next;
+	}
+	if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &timer, nullptr) < 0)
+		NCBAR_LOG_ERROR << "Clock: Failed to set timer: " << strerror(errno);
+}
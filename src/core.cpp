@@ -1,38 +1,20 @@
 #define __WAYLAND_CORE__
 #include "core.hpp"
 #include "globals.hpp"
+#include "log.hpp"
+#include "trace.hpp"
 #include "vulkanHelper.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
 #include <cstring>
-#include <iostream>
 #include <ranges>
 #include <string_view>
 #include <vector>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 namespace {
-	// Wayland
-	void wlRegistryOnGlobalListener(void *data, wl_registry *registry, uint32_t name, const char* interface, uint32_t version)
-	{
-		std::cout << "Wayland: " << interface << " version " << version << std::endl;
-		if (data) {
-			if (auto onGlobal = reinterpret_cast<Core::WlRegistryListenerWrapper*>(data)->onGlobal)
-				onGlobal(registry, name, interface, version);
-		}
-	}
-	const wl_registry_listener wlRegistryListener = {
-		.global = wlRegistryOnGlobalListener,
-		.global_remove = nullptr
-	};
-	void xdgWmBasePingListener(void *data, xdg_wm_base *shell, uint32_t serial)
-	{
-		if (data) {
-			if (auto onPing = reinterpret_cast<Core::XdgWmBaseListenerWrapper*>(data)->onPing)
-				onPing(shell, serial);
-		}
-	};
-	const xdg_wm_base_listener xdgWmBaseListener = {
-		.ping = xdgWmBasePingListener
-	};
-
 	// Vulkan
 	constexpr const char* const instanceExtensionNames[] = {
 		"VK_EXT_debug_utils",
@@ -80,16 +62,44 @@ namespace {
 			}
 		};
 
-		std::cout << "Vulkan " << typeName(type) << " (" << severityName(severity) << "): " << data->pMessage << std::endl;
+		// Called on whatever thread made the call, often the render loop, which the ring keeps from waiting
+		Log::Level level = Log::LevelDebug;
+		if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
+			level = Log::LevelError;
+		else if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT)
+			level = Log::LevelWarning;
+		else if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT)
+			level = Log::LevelInfo;
+		if (Log::IsEnabled(level))
+			Log::Line(level) << "Vulkan " << typeName(type) << " (" << severityName(severity) << "): " << data->pMessage;
 
 		return VK_FALSE;
 	}
 }
 
-Core::Core(const Core::Private&)
+const wl_registry_listener Core::wlRegistryListener = {
+	.global = BindListener<&Core::OnRegistryGlobal>,
+	.global_remove = BindListener<&Core::OnRegistryGlobalRemove>
+};
+const xdg_wm_base_listener Core::xdgWmBaseListener = {
+	.ping = BindListener<&Core::OnXdgWmBasePing>
+};
+const wp_presentation_listener Core::wpPresentationListener = {
+	.clock_id = BindListener<&Core::OnPresentationClockId>
+};
+const wl_output_listener Core::Output::listener = {
+	.geometry = IgnoreListener,
+	.mode = IgnoreListener,
+	.done = BindListener<&Core::Output::OnDone>,
+	.scale = BindListener<&Core::Output::OnScale>
+};
+const zwlr_output_power_v1_listener Core::Output::powerListener = {
+	.mode = BindListener<&Core::Output::OnPowerMode>,
+	.failed = BindListener<&Core::Output::OnPowerFailed>
+};
+
+Core::Core(const Core::Private&, const Settings &settings) : settings(settings)
 {
-	wlRegistryListenerWrapper = std::make_unique<Core::WlRegistryListenerWrapper>();
-	xdgWmBaseListenerWrapper = std::make_unique<Core::XdgWmBaseListenerWrapper>();
 }
 
 Core::~Core()
@@ -107,6 +117,43 @@ Core::~Core()
 		vkDestroyInstance(instance, nullptr);
 		instance = nullptr;
 	}
+	taskbar.reset();
+	seat.reset();
+	for (auto &output : outputs) {
+		if (output->power)
+			zwlr_output_power_v1_destroy(output->power);
+		wl_output_destroy(output->output);
+	}
+	outputs.clear();
+	if (outputPowerManager) {
+		zwlr_output_power_manager_v1_destroy(outputPowerManager);
+		outputPowerManager = nullptr;
+	}
+	if (screencopyManager) {
+		zwlr_screencopy_manager_v1_destroy(screencopyManager);
+		screencopyManager = nullptr;
+	}
+	if (shm) {
+		wl_shm_destroy(shm);
+		shm = nullptr;
+	}
+	if (fractionalScaleManager) {
+		wp_fractional_scale_manager_v1_destroy(fractionalScaleManager);
+		fractionalScaleManager = nullptr;
+	}
+	if (viewporter) {
+		wp_viewporter_destroy(viewporter);
+		viewporter = nullptr;
+	}
+	if (presentation) {
+		wp_presentation_destroy(presentation);
+		presentation = nullptr;
+	}
+	fdCallbacks.clear();
+	if (epollFd >= 0) {
+		close(epollFd);
+		epollFd = -1;
+	}
 }
 
 bool Core::Init()
@@ -115,66 +162,331 @@ bool Core::Init()
 	// Connect to the wl_display
 	display = wl_display_connect(nullptr);
 	if (!display) {
-		std::cerr << "Wayland: Failed to connect to display" << std::endl;
+		NCBAR_LOG_ERROR << "Wayland: Failed to connect to display";
+		return false;
+	}
+
+	// Event loop
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0) {
+		NCBAR_LOG_ERROR << "Failed to create epoll: " << strerror(errno);
+		return false;
+	}
+	epoll_event displayEvent = {
+		.events = EPOLLIN,
+		.data = { .fd = wl_display_get_fd(display) }
+	};
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, displayEvent.data.fd, &displayEvent) < 0) {
+		NCBAR_LOG_ERROR << "Failed to watch the Wayland display: " << strerror(errno);
 		return false;
 	}
 
 	// Get the registry
-	wl_registry *registry = wl_display_get_registry(display);
+	registry = wl_display_get_registry(display);
 	// Add the listener to get the compositor and shell
-	wlRegistryListenerWrapper->onGlobal = [this](wl_registry *registry, uint32_t name, const char* interface, uint32_t version) {
-		(void)version;
-		if (strcmp(interface, wl_compositor_interface.name) == 0) {
-			this->compositor = reinterpret_cast<wl_compositor*>(wl_registry_bind(registry, name, &wl_compositor_interface, 1));
-		}
-		else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
-			this->shell = reinterpret_cast<xdg_wm_base*>(wl_registry_bind(registry, name, &xdg_wm_base_interface, 1));
-		}
-		else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
-			this->layerShell = reinterpret_cast<zwlr_layer_shell_v1*>(wl_registry_bind(registry, name, &zwlr_layer_shell_v1_interface, 1));
-		}
-	};
-	wl_registry_add_listener(registry, &wlRegistryListener, wlRegistryListenerWrapper.get());
+	wl_registry_add_listener(registry, &wlRegistryListener, this);
 
 	wl_display_roundtrip(display);
 
 	if (!compositor) {
-		std::cerr << "Wayland: Failed to get compositor" << std::endl;
+		NCBAR_LOG_ERROR << "Wayland: Failed to get compositor";
 		return false;
 	}
 	if (!shell) {
-		std::cerr << "Wayland: Failed to get xdg_wm_base" << std::endl;
+		NCBAR_LOG_ERROR << "Wayland: Failed to get xdg_wm_base";
 		return false;
 	}
 	if (!layerShell) {
-		std::cerr << "Wayland: Failed to get zwlr_layer_shell_v1" << std::endl;
+		NCBAR_LOG_ERROR << "Wayland: Failed to get zwlr_layer_shell_v1";
 		return false;
 	}
+	if (!presentation) {
+		NCBAR_LOG_WARNING << "Wayland: wp_presentation is not available, frame timings won't be collected";
+	}
 
 	// Add the ping listener to the shell
-	xdgWmBaseListenerWrapper->onPing = [this](xdg_wm_base *shell, uint32_t serial) {
-		xdg_wm_base_pong(shell, serial);
-	};
-	xdg_wm_base_add_listener(shell, &xdgWmBaseListener, xdgWmBaseListenerWrapper.get());
+	xdg_wm_base_add_listener(shell, &xdgWmBaseListener, this);
 
 	// ==== Graphics ====
-	TryInitVulkan();
+	// Vulkan is initialized by the first window, once it has shown the startup snapshot
+
+	return true;
+}
+bool Core::AddFd(int fd, uint32_t events, FdCallbackType callback)
+{
+	epoll_event event = {
+		.events = events,
+		.data = { .fd = fd }
+	};
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		NCBAR_LOG_ERROR << "Failed to watch fd " << fd << ": " << strerror(errno);
+		return false;
+	}
+	fdCallbacks[fd] = std::make_shared<FdCallbackType>(std::move(callback));
+	return true;
+}
+
+bool Core::ModifyFd(int fd, uint32_t events)
+{
+	epoll_event event = {
+		.events = events,
+		.data = { .fd = fd }
+	};
+	if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0) {
+		NCBAR_LOG_ERROR << "Failed to modify watch of fd " << fd << ": " << strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+void Core::RemoveFd(int fd)
+{
+	if (fdCallbacks.erase(fd))
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+bool Core::Dispatch(int timeout)
+{
+	NCBAR_TRACE_PHASES(phases, "loop");
+	NCBAR_TRACE_PHASE(phases, "Wait");
+	// Standard dance of reading Wayland events alongside other fds
+	while (wl_display_prepare_read(display) != 0) {
+		if (wl_display_dispatch_pending(display) < 0)
+			return false;
+	}
+	if (wl_display_flush(display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(display);
+		NCBAR_LOG_ERROR << "Wayland: Failed to flush display: " << strerror(errno);
+		return false;
+	}
+
+	std::array<epoll_event, 32> events;
+	int eventsCount = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), timeout);
+	if (eventsCount < 0) {
+		wl_display_cancel_read(display);
+		return errno == EINTR;
+	}
+
+	NCBAR_TRACE_PHASE(phases, "Wayland events");
+	const int displayFd = wl_display_get_fd(display);
+	bool displayReadable = false;
+	for (int i = 0; i < eventsCount; i++) {
+		if (events[i].data.fd == displayFd)
+			displayReadable = true;
+	}
+	if (displayReadable) {
+		if (wl_display_read_events(display) < 0) {
+			NCBAR_LOG_ERROR << "Wayland: Failed to read events: " << strerror(errno);
+			return false;
+		}
+	}
+	else {
+		wl_display_cancel_read(display);
+	}
+	if (wl_display_dispatch_pending(display) < 0)
+		return false;
+
+	NCBAR_TRACE_PHASE(phases, "Fd callbacks");
+	for (int i = 0; i < eventsCount; i++) {
+		if (events[i].data.fd == displayFd)
+			continue;
+		auto it = fdCallbacks.find(events[i].data.fd);
+		if (it == fdCallbacks.end())
+			continue;
+		auto callback = it->second;
+		if (*callback)
+			(*callback)(events[i].events);
+	}
+
+	return true;
+}
+
+void Core::OnRegistryGlobal(wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+{
+	NCBAR_LOG_DEBUG << "Wayland: " << interface << " version " << version;
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		// Version 3 brings wl_surface.set_buffer_scale
+		compositor = reinterpret_cast<wl_compositor*>(wl_registry_bind(registry, name, &wl_compositor_interface, std::min(version, 4u)));
+	}
+	else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		shell = reinterpret_cast<xdg_wm_base*>(wl_registry_bind(registry, name, &xdg_wm_base_interface, 1));
+	}
+	else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
+		layerShell = reinterpret_cast<zwlr_layer_shell_v1*>(wl_registry_bind(registry, name, &zwlr_layer_shell_v1_interface, 1));
+	}
+	else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		presentation = reinterpret_cast<wp_presentation*>(wl_registry_bind(registry, name, &wp_presentation_interface, 1));
+		// clock_id is sent right after binding, so the listener has to be there before the next dispatch
+		wp_presentation_add_listener(presentation, &wpPresentationListener, this);
+	}
+	else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		viewporter = reinterpret_cast<wp_viewporter*>(wl_registry_bind(registry, name, &wp_viewporter_interface, 1));
+	}
+	else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+		fractionalScaleManager = reinterpret_cast<wp_fractional_scale_manager_v1*>(wl_registry_bind(registry, name, &wp_fractional_scale_manager_v1_interface, 1));
+	}
+	else if (strcmp(interface, wl_output_interface.name) == 0) {
+		AddOutput(registry, name, version);
+	}
+	else if (strcmp(interface, zwlr_output_power_manager_v1_interface.name) == 0) {
+		outputPowerManager = reinterpret_cast<zwlr_output_power_manager_v1*>(wl_registry_bind(registry, name, &zwlr_output_power_manager_v1_interface, 1));
+		// Outputs announced before the manager
+		for (auto &output : outputs)
+			WatchOutputPower(*output);
+	}
+	else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		shm = reinterpret_cast<wl_shm*>(wl_registry_bind(registry, name, &wl_shm_interface, 1));
+	}
+	else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+		// Version 2 brings copy_with_damage, version 3 the buffer_done event
+		screencopyManager = reinterpret_cast<zwlr_screencopy_manager_v1*>(wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface, std::min(version, 3u)));
+	}
+	else if (strcmp(interface, zwlr_foreign_toplevel_manager_v1_interface.name) == 0) {
+		// Version 3 brings the parent event, which is ignored, but it's the version the listener is generated for
+		auto manager = reinterpret_cast<zwlr_foreign_toplevel_manager_v1*>(wl_registry_bind(registry, name, &zwlr_foreign_toplevel_manager_v1_interface, std::min(version, 3u)));
+		taskbar = Taskbar::Create(manager, widgetStore);
+	}
+	else if (strcmp(interface, wl_seat_interface.name) == 0 && !seat) {
+		// Version 8 brings axis_value120 for high resolution wheels
+		seat = Seat::Create(reinterpret_cast<wl_seat*>(wl_registry_bind(registry, name, &wl_seat_interface, std::min(version, 8u))));
+		seatName = name;
+	}
+}
+
+void Core::OnRegistryGlobalRemove(wl_registry *registry, uint32_t name)
+{
+	(void)registry;
+	if (seat && name == seatName)
+		seat.reset();
+	std::erase_if(outputs, [this, name](const std::unique_ptr<Output> &output) {
+		if (output->name != name)
+			return false;
+		if (taskbar)
+			taskbar->ForgetOutput(output->output);
+		for (const auto &subscriber : outputRemovedSubscribers)
+			subscriber.second(output->output);
+		if (output->power)
+			zwlr_output_power_v1_destroy(output->power);
+		wl_output_destroy(output->output);
+		return true;
+	});
+}
+
+void Core::OnXdgWmBasePing(xdg_wm_base *shell, uint32_t serial)
+{
+	xdg_wm_base_pong(shell, serial);
+}
+
+void Core::OnPresentationClockId(wp_presentation *presentation, uint32_t clockId)
+{
+	(void)presentation;
+	presentationClock = static_cast<clockid_t>(clockId);
+}
+
+void Core::AddOutput(wl_registry *registry, uint32_t name, uint32_t version)
+{
+	auto output = std::make_unique<Output>();
+	// Version 2 brings the scale and done events
+	output->output = reinterpret_cast<wl_output*>(wl_registry_bind(registry, name, &wl_output_interface, std::min(version, 2u)));
+	output->name = name;
+	wl_output_add_listener(output->output, &Output::listener, output.get());
+	WatchOutputPower(*output);
+	outputs.push_back(std::move(output));
+	outputsGeneration++;
+}
+
+void Core::WatchOutputPower(Output &output)
+{
+	if (!outputPowerManager || output.power)
+		return;
+	output.power = zwlr_output_power_manager_v1_get_output_power(outputPowerManager, output.output);
+	zwlr_output_power_v1_add_listener(output.power, &Output::powerListener, &output);
+}
+
+void Core::Output::OnPowerMode(zwlr_output_power_v1 *power, uint32_t mode)
+{
+	(void)power;
+	powered = mode == ZWLR_OUTPUT_POWER_V1_MODE_ON;
+}
+
+void Core::Output::OnPowerFailed(zwlr_output_power_v1 *power)
+{
+	// Another client controls the output's power, its state isn't known anymore
+	zwlr_output_power_v1_destroy(power);
+	this->power = nullptr;
+	powered = true;
+}
+
+void Core::Output::OnScale(wl_output *output, int32_t factor)
+{
+	(void)output;
+	pendingScale = factor;
+}
+
+void Core::Output::OnDone(wl_output *output)
+{
+	(void)output;
+	scale = pendingScale;
+}
+
+uint32_t Core::SubscribeOutputRemoved(OnOutputRemovedCallbackType onOutputRemoved)
+{
+	outputRemovedSubscribers.emplace_back(++lastOutputRemovedSubscriberId, std::move(onOutputRemoved));
+	return lastOutputRemovedSubscriberId;
+}
 
+void Core::UnsubscribeOutputRemoved(uint32_t id)
+{
+	std::erase_if(outputRemovedSubscribers, [id](const auto &subscriber) { return subscriber.first == id; });
+}
+
+bool Core::HasOutput(wl_output *output) const
+{
+	for (const auto &currentOutput : outputs) {
+		if (currentOutput->output == output)
+			return true;
+	}
+	return false;
+}
+
+int32_t Core::GetOutputScale(wl_output *output) const
+{
+	for (const auto &currentOutput : outputs) {
+		if (currentOutput->output == output)
+			return currentOutput->scale;
+	}
+	return 1;
+}
+
+bool Core::IsOutputPowered(wl_output *output) const
+{
+	for (const auto &currentOutput : outputs) {
+		if (currentOutput->output == output)
+			return currentOutput->powered;
+	}
 	return true;
 }
+
+uint64_t Core::GetPresentationTime() const
+{
+	timespec time{};
+	clock_gettime(presentationClock, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1'000'000'000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+
 void Core::TryInitVulkan()
 {
 	if (!vulkanInitialized) {
 		if (!InitVkInstance()) {
-			std::cerr << "Vulkan: Failed to create Vulkan instance" << std::endl;
+			NCBAR_LOG_ERROR << "Vulkan: Failed to create Vulkan instance";
 			return;
 		}
 		if (!InitVkMessenger()) {
-			std::cerr << "Vulkan: Failed to create Vulkan debug messenger" << std::endl;
+			NCBAR_LOG_ERROR << "Vulkan: Failed to create Vulkan debug messenger";
 			return;
 		}
 		if (!InitVkDevice()) {
-			std::cerr << "Failed to create Vulkan device" << std::endl;
+			NCBAR_LOG_ERROR << "Failed to create Vulkan device";
 			return;
 		}
 		vulkanInitialized = true;
@@ -182,6 +494,13 @@ void Core::TryInitVulkan()
 }
 bool Core::InitVkInstance()
 {
+	// A 1.0 loader refuses any other version, so the instance gets 1.3 only when the loader has it
+	uint32_t loaderVersion = VK_API_VERSION_1_0;
+	auto enumerateInstanceVersion = reinterpret_cast<PFN_vkEnumerateInstanceVersion>(vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion"));
+	if (enumerateInstanceVersion)
+		CHECK_VK_RESULT(enumerateInstanceVersion(&loaderVersion));
+	instanceVersion = settings.vulkan13 && loaderVersion >= VK_API_VERSION_1_3 ? VK_API_VERSION_1_3 : VK_API_VERSION_1_0;
+
 	VkApplicationInfo appInfo {
 		.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
 		.pNext = nullptr,
@@ -189,7 +508,7 @@ bool Core::InitVkInstance()
 		.applicationVersion = VK_MAKE_API_VERSION(0, 0, 1, 0),
 		.pEngineName = appName,
 		.engineVersion = VK_MAKE_API_VERSION(0, 0, 1, 0),
-		.apiVersion = VK_API_VERSION_1_0
+		.apiVersion = instanceVersion
 	};
 	VkInstanceCreateInfo createInfo {
 		.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -238,7 +557,7 @@ bool Core::InitVkMessenger()
 	};
 	auto func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
 	if (!func) {
-		std::cerr << "Vulkan: Failed to get create debug messenger function" << std::endl;
+		NCBAR_LOG_ERROR << "Vulkan: Failed to get create debug messenger function";
 		return false;
 	}
 	CHECK_VK_RESULT(func(instance, &createInfo, nullptr, &messenger));
@@ -251,7 +570,7 @@ bool Core::InitVkDevice()
 	std::vector<VkPhysicalDevice> physicalDevices(physicalDevicesCount);
 	CHECK_VK_RESULT(vkEnumeratePhysicalDevices(instance, &physicalDevicesCount, physicalDevices.data()));
 	if (physicalDevices.empty()) {
-		std::cerr << "Vulkan: Failed to get physical devices" << std::endl;
+		NCBAR_LOG_ERROR << "Vulkan: Failed to get physical devices";
 		return false;
 	}
 
@@ -283,7 +602,7 @@ bool Core::InitVkDevice()
 		}
 
 		if (!bestScore) {
-			std::cerr << "Vulkan: Failed to select physical device" << std::endl;
+			NCBAR_LOG_ERROR << "Vulkan: Failed to select physical device";
 			return false;
 		}
 	}
@@ -307,6 +626,33 @@ bool Core::InitVkDevice()
 		i++;
 	}
 	
+	// Everything the 1.3 path needs is core in 1.3, timeline semaphores since 1.2
+	bool useVulkan13 = false;
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	auto getFeatures2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2>(vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2"));
+	if (instanceVersion >= VK_API_VERSION_1_3 && properties.apiVersion >= VK_API_VERSION_1_3 && getFeatures2) {
+		VkPhysicalDeviceVulkan12Features supported12 = {};
+		supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		VkPhysicalDeviceVulkan13Features supported13 = {};
+		supported13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+		supported13.pNext = &supported12;
+		VkPhysicalDeviceFeatures2 supported = {};
+		supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		supported.pNext = &supported13;
+		getFeatures2(physicalDevice, &supported);
+		useVulkan13 = supported13.dynamicRendering && supported13.synchronization2 && supported12.timelineSemaphore;
+	}
+	// Only what the path uses is enabled
+	VkPhysicalDeviceVulkan12Features enabled12 = {};
+	enabled12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	enabled12.timelineSemaphore = VK_TRUE;
+	VkPhysicalDeviceVulkan13Features enabled13 = {};
+	enabled13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+	enabled13.pNext = &enabled12;
+	enabled13.dynamicRendering = VK_TRUE;
+	enabled13.synchronization2 = VK_TRUE;
+
 	float priority = 1;
 	VkDeviceQueueCreateInfo queueCreateInfo {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
@@ -318,7 +664,7 @@ bool Core::InitVkDevice()
 	};
 	VkDeviceCreateInfo createInfo {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-		.pNext = nullptr,
+		.pNext = useVulkan13 ? &enabled13 : nullptr,
 		.flags = 0,
 		.queueCreateInfoCount = 1,
 		.pQueueCreateInfos = &queueCreateInfo,
@@ -352,6 +698,19 @@ bool Core::InitVkDevice()
 	}
 
 	CHECK_VK_RESULT(vkCreateDevice(physicalDevice, &createInfo, nullptr, &device));
+	if (!device)
+		return false;
+
+	if (useVulkan13) {
+		vulkan13.cmdBeginRendering = reinterpret_cast<PFN_vkCmdBeginRendering>(vkGetDeviceProcAddr(device, "vkCmdBeginRendering"));
+		vulkan13.cmdEndRendering = reinterpret_cast<PFN_vkCmdEndRendering>(vkGetDeviceProcAddr(device, "vkCmdEndRendering"));
+		vulkan13.cmdPipelineBarrier2 = reinterpret_cast<PFN_vkCmdPipelineBarrier2>(vkGetDeviceProcAddr(device, "vkCmdPipelineBarrier2"));
+		vulkan13.queueSubmit2 = reinterpret_cast<PFN_vkQueueSubmit2>(vkGetDeviceProcAddr(device, "vkQueueSubmit2"));
+		vulkan13.waitSemaphores = reinterpret_cast<PFN_vkWaitSemaphores>(vkGetDeviceProcAddr(device, "vkWaitSemaphores"));
+		if (!vulkan13.cmdBeginRendering || !vulkan13.cmdEndRendering || !vulkan13.cmdPipelineBarrier2 || !vulkan13.queueSubmit2 || !vulkan13.waitSemaphores)
+			vulkan13 = {};
+	}
+	NCBAR_LOG_INFO << "Vulkan: " << properties.deviceName << ", " << (GetVulkan13() ? "1.3 path" : "1.0 path");
 
-	return device != nullptr;
+	return true;
 }
@@ -0,0 +1,325 @@
+#include "devices.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "widgetStore.hpp"
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <linux/netlink.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+	// A uevent is at most 2 KiB of environment after its `action@devpath` header
+	constexpr std::size_t receiveBufferSize = 8 * 1024;
+	// Docking a laptop sends a burst of events, most of them for subsystems we drop
+	constexpr int socketBufferSize = 256 * 1024;
+	// Multicast group of the events sent by the kernel, udev rebroadcasts them to group 2 after processing
+	constexpr uint32_t kernelEventsGroup = 1;
+	const std::string powerSupplyDir = "/sys/class/power_supply/";
+	const std::string backlightDir = "/sys/class/backlight/";
+	const std::string drmDir = "/sys/class/drm/";
+
+	// First line of a sysfs attribute, empty if it can't be read
+	std::string readAttribute(const std::string &path)
+	{
+		std::ifstream file(path);
+		std::string line;
+		std::getline(file, line);
+		return line;
+	}
+
+	std::set<std::string, std::less<>> listDir(const std::string &path)
+	{
+		std::set<std::string, std::less<>> names;
+		std::error_code error;
+		for (const auto &entry : std::filesystem::directory_iterator(path, error))
+			names.insert(entry.path().filename().string());
+		return names;
+	}
+
+	uint64_t parseNumber(std::string_view text)
+	{
+		uint64_t number = 0;
+		std::from_chars(text.data(), text.data() + text.size(), number);
+		return number;
+	}
+}
+
+Devices::~Devices()
+{
+	if (timerFd >= 0) {
+		core->RemoveFd(timerFd);
+		close(timerFd);
+		timerFd = -1;
+	}
+	if (ueventFd >= 0) {
+		core->RemoveFd(ueventFd);
+		close(ueventFd);
+		ueventFd = -1;
+	}
+}
+
+bool Devices::Init(CorePtr core)
+{
+	this->core = core;
+
+	ueventFd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (ueventFd < 0) {
+		NCBAR_LOG_ERROR << "Devices: Failed to create uevent socket: " << strerror(errno);
+		return false;
+	}
+	// Best effort, the default buffer still works and overflows are recovered with a rescan
+	setsockopt(ueventFd, SOL_SOCKET, SO_RCVBUF, &socketBufferSize, sizeof(socketBufferSize));
+	sockaddr_nl address = {};
+	address.nl_family = AF_NETLINK;
+	address.nl_groups = kernelEventsGroup;
+	if (bind(ueventFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+		NCBAR_LOG_ERROR << "Devices: Failed to bind uevent socket: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(ueventFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnReadable();
+	}))
+		return false;
+
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0) {
+		NCBAR_LOG_ERROR << "Devices: Failed to create timer: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(timerFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnTimer();
+	}))
+		return false;
+
+	receiveBuffer.resize(receiveBufferSize);
+	// Subscribed first, so nothing that changes while reading is missed
+	Rescan();
+	changes = ChangedNothing;
+	return true;
+}
+
+void Devices::SetOnChange(OnChangeCallbackType onChange)
+{
+	this->onChange = onChange;
+}
+
+void Devices::OnReadable()
+{
+	NCBAR_TRACE_SCOPE("source", "Devices::OnReadable");
+	while (true) {
+		sockaddr_nl sender = {};
+		socklen_t senderSize = sizeof(sender);
+		ssize_t size = recvfrom(ueventFd, receiveBuffer.data(), receiveBuffer.size(), 0, reinterpret_cast<sockaddr*>(&sender), &senderSize);
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				NCBAR_LOG_WARNING << "Devices: Uevent socket overflowed, rescanning";
+				Rescan();
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				NCBAR_LOG_ERROR << "Devices: Failed to read uevent socket: " << strerror(errno);
+			break;
+		}
+		// Only the kernel is trusted
+		if (sender.nl_pid != 0)
+			continue;
+
+		// `action@devpath`, then zero separated KEY=value pairs
+		std::string_view message(receiveBuffer.data(), static_cast<std::size_t>(size));
+		if (message.find('@') >= message.find('\0'))
+			continue;
+		std::string_view action, devpath, subsystem;
+		for (auto end = message.find('\0'); end != std::string_view::npos; end = message.find('\0')) {
+			auto field = message.substr(0, end);
+			message.remove_prefix(end + 1);
+			if (field.starts_with("ACTION="))
+				action = field.substr(7);
+			else if (field.starts_with("DEVPATH="))
+				devpath = field.substr(8);
+			else if (field.starts_with("SUBSYSTEM="))
+				subsystem = field.substr(10);
+		}
+		const auto slash = devpath.rfind('/');
+		if (action.empty() || slash == std::string_view::npos)
+			continue;
+		HandleEvent(action, subsystem, devpath.substr(slash + 1));
+	}
+
+	if (changes != ChangedNothing && onChange)
+		onChange(changes);
+	changes = ChangedNothing;
+}
+
+void Devices::OnTimer()
+{
+	uint64_t expirations;
+	if (read(timerFd, &expirations, sizeof(expirations)) < 0)
+		return;
+	// Updating may find a battery gone and change the set
+	const std::vector<std::string> names(batteries.begin(), batteries.end());
+	for (const auto &name : names)
+		UpdatePowerSupply(name, false);
+
+	if (changes != ChangedNothing && onChange)
+		onChange(changes);
+	changes = ChangedNothing;
+}
+
+void Devices::HandleEvent(std::string_view action, std::string_view subsystem, std::string_view name)
+{
+	// Everything else (input, usb, block...) is dropped right here, uevents are rare enough not to need a
+	// socket filter
+	const bool removed = action == "remove";
+	if (subsystem == "power_supply")
+		UpdatePowerSupply(std::string(name), removed);
+	else if (subsystem == "backlight")
+		UpdateBacklight(std::string(name), removed);
+	else if (subsystem == "drm")
+		UpdateDisplays();
+}
+
+void Devices::Rescan()
+{
+	// Known ones that aren't listed anymore are updated too, that removes them
+	auto names = listDir(powerSupplyDir);
+	names.insert(powerSupplies.begin(), powerSupplies.end());
+	for (const auto &name : names)
+		UpdatePowerSupply(name, false);
+
+	names = listDir(backlightDir);
+	names.insert(backlights.begin(), backlights.end());
+	for (const auto &name : names)
+		UpdateBacklight(name, false);
+
+	UpdateDisplays();
+}
+
+void Devices::UpdatePowerSupply(const std::string &name, bool removed)
+{
+	const std::string dir = powerSupplyDir + name + '/';
+	const std::string type = removed ? std::string() : readAttribute(dir + "type");
+	bool changed = false;
+	// A supply without a type went away without a `remove` we saw
+	if (type.empty()) {
+		if (!powerSupplies.contains(name))
+			return;
+		for (const auto field : { "type", "capacity", "status", "online" })
+			changed |= PublishValue("power.", name, field, {});
+		powerSupplies.erase(name);
+		batteries.erase(name);
+	}
+	else {
+		changed |= PublishValue("power.", name, "type", type);
+		powerSupplies.insert(name);
+		if (type == "Battery") {
+			batteries.insert(name);
+			changed |= PublishValue("power.", name, "capacity", readAttribute(dir + "capacity"));
+			changed |= PublishValue("power.", name, "status", readAttribute(dir + "status"));
+		}
+		else
+			changed |= PublishValue("power.", name, "online", readAttribute(dir + "online"));
+	}
+	if (changed)
+		changes |= ChangedPower;
+	UpdateAc();
+	UpdateSafetyPoll();
+}
+
+void Devices::UpdateAc()
+{
+	auto &widgetStore = core->GetWidgetStore();
+	bool online = false;
+	for (const auto &name : powerSupplies) {
+		if (batteries.contains(name))
+			continue;
+		keyBuffer.assign("power.");
+		keyBuffer.append(name);
+		keyBuffer.append(".online");
+		if (auto value = widgetStore.Get(keyBuffer); value && *value == "1")
+			online = true;
+	}
+	// Empty where nothing reports it, like on most desktops
+	std::string_view value = powerSupplies.size() > batteries.size() ? (online ? "1" : "0") : "";
+	if (widgetStore.Set("power.ac", value))
+		changes |= ChangedPower;
+}
+
+void Devices::UpdateBacklight(const std::string &name, bool removed)
+{
+	const std::string dir = backlightDir + name + '/';
+	std::string value;
+	if (!removed) {
+		// actual_brightness is what the hardware has, it differs from brightness while the firmware overrides it
+		auto brightness = readAttribute(dir + "actual_brightness");
+		if (brightness.empty())
+			brightness = readAttribute(dir + "brightness");
+		const auto maxBrightness = parseNumber(readAttribute(dir + "max_brightness"));
+		if (!brightness.empty() && maxBrightness)
+			value = std::to_string((parseNumber(brightness) * 100 + maxBrightness / 2) / maxBrightness);
+	}
+	if (value.empty() && !backlights.erase(name))
+		return;
+	if (!value.empty())
+		backlights.insert(name);
+	if (PublishValue("backlight.", name, "brightness", value))
+		changes |= ChangedBacklight;
+}
+
+void Devices::UpdateDisplays()
+{
+	std::set<std::string, std::less<>> newConnectors;
+	for (const auto &name : listDir(drmDir)) {
+		// card0-HDMI-A-1, the cards and render nodes themselves have no dash
+		if (name.find('-') == std::string::npos)
+			continue;
+		const auto status = readAttribute(drmDir + name + "/status");
+		if (status.empty())
+			continue;
+		if (PublishValue("display.", name, "status", status))
+			changes |= ChangedDisplays;
+		newConnectors.insert(name);
+	}
+	for (const auto &name : connectors) {
+		if (!newConnectors.contains(name) && PublishValue("display.", name, "status", {}))
+			changes |= ChangedDisplays;
+	}
+	connectors = std::move(newConnectors);
+}
+
+void Devices::UpdateSafetyPoll()
+{
+	const bool needed = !batteries.empty();
+	if (needed == safetyPollArmed)
+		return;
+	itimerspec timer = {};
+	if (needed) {
+		timer.it_value.tv_sec = safetyPollInterval / 1'000'000'000;
+		timer.it_value.tv_nsec = safetyPollInterval % 1'000'000'000;
+		timer.it_interval = timer.it_value;
+	}
+	if (timerfd_settime(timerFd, 0, &timer, nullptr) < 0) {
+		NCBAR_LOG_ERROR << "Devices: Failed to set timer: " << strerror(errno);
+		return;
+	}
+	safetyPollArmed = needed;
+}
+
+bool Devices::PublishValue(std::string_view prefix, std::string_view name, std::string_view field, std::string_view value)
+{
+	keyBuffer.assign(prefix);
+	keyBuffer.append(name);
+	keyBuffer.push_back('.');
+	keyBuffer.append(field);
+	return core->GetWidgetStore().Set(keyBuffer, value);
+}
@@ -0,0 +1,56 @@
+#include "frameArena.hpp"
+#include <algorithm>
+#include <cstdint>
+
+FrameArena::FrameArena(std::size_t blockSize) : blockSize(blockSize), initialBlockSize(blockSize)
+{
+	block = std::make_unique<std::byte[]>(blockSize);
+	current = block.get();
+	currentSize = blockSize;
+}
+
+void* FrameArena::Allocate(std::size_t size, std::size_t alignment)
+{
+	auto address = reinterpret_cast<std::uintptr_t>(current) + offset;
+	std::size_t padding = (alignment - address % alignment) % alignment;
+	if (offset + padding + size > currentSize) {
+		// Rare by design, the merged block on the next Reset() makes the frame fit
+		const std::size_t newBlockSize = std::max(size + alignment, blockSize);
+		overflowBlocks.emplace_back(std::make_unique<std::byte[]>(newBlockSize), newBlockSize);
+		overflowSize += newBlockSize;
+		current = overflowBlocks.back().first.get();
+		currentSize = newBlockSize;
+		offset = 0;
+		address = reinterpret_cast<std::uintptr_t>(current);
+		padding = (alignment - address % alignment) % alignment;
+	}
+	void *pointer = current + offset + padding;
+	offset += padding + size;
+	usedSize += padding + size;
+	return pointer;
+}
+
+void FrameArena::Reset()
+{
+	if (!overflowBlocks.empty()) {
+		blockSize += overflowSize;
+		block = std::make_unique<std::byte[]>(blockSize);
+		overflowBlocks.clear();
+		overflowSize = 0;
+	}
+	current = block.get();
+	currentSize = blockSize;
+	offset = 0;
+	usedSize = 0;
+}
+
+void FrameArena::Shrink()
+{
+	overflowBlocks.clear();
+	overflowSize = 0;
+	if (blockSize != initialBlockSize) {
+		blockSize = initialBlockSize;
+		block = std::make_unique<std::byte[]>(blockSize);
+	}
+	Reset();
+}
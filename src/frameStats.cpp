@@ -0,0 +1,98 @@
+#include "frameStats.hpp"
+#include <bit>
+#include <iomanip>
+
+namespace {
+	constexpr double toMilliseconds(uint64_t nanoseconds)
+	{
+		return static_cast<double>(nanoseconds) / 1'000'000.0;
+	}
+}
+
+void LatencyHistogram::Add(uint64_t nanoseconds)
+{
+	uint64_t microseconds = nanoseconds / 1000;
+	std::size_t bucket = microseconds ? std::bit_width(microseconds) : 0;
+	if (bucket >= bucketsCount)
+		bucket = bucketsCount - 1;
+	buckets[bucket]++;
+	count++;
+	sum += nanoseconds;
+	if (nanoseconds < min)
+		min = nanoseconds;
+	if (nanoseconds > max)
+		max = nanoseconds;
+}
+
+uint64_t LatencyHistogram::GetPercentile(double percentile) const
+{
+	if (!count)
+		return 0;
+	uint64_t target = static_cast<uint64_t>(static_cast<double>(count) * percentile / 100.0);
+	if (target >= count)
+		target = count - 1;
+	uint64_t seen = 0;
+	for (std::size_t i = 0; i < bucketsCount; i++) {
+		seen += buckets[i];
+		if (seen > target) {
+			uint64_t upperBound = (uint64_t(1) << i) * 1000;
+			return upperBound < max ? upperBound : max;
+		}
+	}
+	return max;
+}
+
+void LatencyHistogram::Dump(std::ostream &out, const char *name) const
+{
+	out << name << ": ";
+	if (!count) {
+		out << "no samples" << std::endl;
+		return;
+	}
+	out << std::fixed << std::setprecision(3)
+		<< "count " << count
+		<< ", min " << toMilliseconds(GetMin()) << "ms"
+		<< ", avg " << toMilliseconds(GetAverage()) << "ms"
+		<< ", p50 <" << toMilliseconds(GetPercentile(50)) << "ms"
+		<< ", p99 <" << toMilliseconds(GetPercentile(99)) << "ms"
+		<< ", max " << toMilliseconds(GetMax()) << "ms" << std::endl;
+	for (std::size_t i = 0; i < bucketsCount; i++) {
+		if (!buckets[i])
+			continue;
+		out << "  <" << std::setw(10) << toMilliseconds((uint64_t(1) << i) * 1000) << "ms: " << buckets[i] << std::endl;
+	}
+}
+
+void FrameStats::OnPresented(uint64_t updateTime, uint64_t inputTime, uint64_t presentTime, uint32_t refresh, uint64_t sequence, bool consecutive)
+{
+	presentedFrames++;
+	if (!consecutive) {
+		lastSequence = 0;
+		lastPresentTime = 0;
+	}
+	if (updateTime && presentTime > updateTime)
+		updateToPresent.Add(presentTime - updateTime);
+	if (sequence && lastSequence && sequence > lastSequence)
+		missedFrames += sequence - lastSequence - 1;
+	if (inputTime && presentTime > inputTime)
+		inputToPhoton.Add(presentTime - inputTime);
+	if (lastPresentTime && presentTime > lastPresentTime)
+		presentInterval.Add(presentTime - lastPresentTime);
+	lastPresentTime = presentTime;
+	lastSequence = sequence;
+	lastRefresh = refresh;
+}
+
+void FrameStats::Dump(std::ostream &out) const
+{
+	out << "Frames: presented " << presentedFrames
+		<< ", discarded " << discardedFrames
+		<< ", missed " << missedFrames
+		<< ", untracked " << untrackedFrames;
+	if (lastRefresh)
+		out << ", refresh " << std::fixed << std::setprecision(3) << toMilliseconds(lastRefresh) << "ms";
+	out << std::endl;
+	updateToPresent.Dump(out, "Update to present");
+	inputToPhoton.Dump(out, "Input to photon");
+	presentInterval.Dump(out, "Present interval");
+}
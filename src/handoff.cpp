@@ -0,0 +1,356 @@
+#include "handoff.hpp"
+#include "core.hpp"
+#include "ipcServer.hpp"
+#include "log.hpp"
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+	constexpr char stateMagic[8] = { 'n', 'c', 'b', 'a', 'r', 's', 't', '1' };
+
+	// Keys of built-in modules. They come back provisional, shown until the module publishes its state again, and
+	// the keys of windows, interfaces or devices that are gone by then are emptied after provisionalTimeout
+	constexpr std::string_view moduleKeyPrefixes[] = {
+		"taskbar.",
+		"clock.",
+		"network.",
+		"power.",
+		"backlight.",
+		"display.",
+		"tray.",
+		"media.",
+		"text.",
+		"script."
+	};
+
+	enum SectionTag : uint32_t {
+		SectionWidgets = 1,
+		SectionIcons = 2,
+		SectionModuleWidgets = 3
+	};
+
+	// Native endianness, both ends are builds of the same program on the same machine
+	template<typename Type>
+	void writeValue(std::string &data, Type value)
+	{
+		data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	void writeString(std::string &data, std::string_view string)
+	{
+		writeValue(data, static_cast<uint32_t>(string.size()));
+		data.append(string);
+	}
+
+	class StateReader
+	{
+	public:
+		explicit StateReader(std::string_view data) : data(data) {}
+
+		template<typename Type>
+		bool ReadValue(Type &value)
+		{
+			if (data.size() < sizeof(value))
+				return false;
+			std::memcpy(&value, data.data(), sizeof(value));
+			data.remove_prefix(sizeof(value));
+			return true;
+		}
+		bool ReadString(std::string_view &string)
+		{
+			uint32_t size;
+			if (!ReadValue(size) || data.size() < size)
+				return false;
+			string = data.substr(0, size);
+			data.remove_prefix(size);
+			return true;
+		}
+		bool ReadBytes(std::size_t size, std::string_view &bytes)
+		{
+			if (data.size() < size)
+				return false;
+			bytes = data.substr(0, size);
+			data.remove_prefix(size);
+			return true;
+		}
+		bool IsEmpty() const { return data.empty(); }
+
+	private:
+		std::string_view data;
+	};
+
+	// Section with its size written in front, once the payload is known
+	template<typename Function>
+	void writeSection(std::string &data, SectionTag tag, Function &&writePayload)
+	{
+		writeValue(data, static_cast<uint32_t>(tag));
+		const auto sizeOffset = data.size();
+		writeValue(data, uint64_t(0));
+		writePayload();
+		const uint64_t size = data.size() - sizeOffset - sizeof(uint64_t);
+		std::memcpy(data.data() + sizeOffset, &size, sizeof(size));
+	}
+
+	bool waitForInput(int fd, std::chrono::steady_clock::time_point deadline)
+	{
+		while (true) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (left <= 0)
+				return false;
+			pollfd pollFd = { .fd = fd, .events = POLLIN, .revents = 0 };
+			int result = poll(&pollFd, 1, static_cast<int>(left));
+			if (result < 0 && errno == EINTR)
+				continue;
+			return result > 0;
+		}
+	}
+}
+
+Handoff::~Handoff()
+{
+	if (connectionFd >= 0) {
+		close(connectionFd);
+		connectionFd = -1;
+	}
+}
+
+bool Handoff::Init(CorePtr core, const std::string &socketPath)
+{
+	const auto path = socketPath.empty() ? IpcServer::GetDefaultSocketPath() : socketPath;
+	if (path.empty()) {
+		NCBAR_LOG_ERROR << "Handoff: XDG_RUNTIME_DIR is not set, pass --socket";
+		return false;
+	}
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		NCBAR_LOG_ERROR << "Handoff: Socket path is too long: " << path;
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	connectionFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connectionFd < 0) {
+		NCBAR_LOG_ERROR << "Handoff: Failed to create socket: " << strerror(errno);
+		return false;
+	}
+	if (connect(connectionFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+		NCBAR_LOG_ERROR << "Handoff: No running instance on " << path;
+		return false;
+	}
+	// The state it sends becomes ours
+	if (!IpcServer::IsPeerTrusted(connectionFd)) {
+		NCBAR_LOG_ERROR << "Handoff: " << path << " belongs to another user";
+		return false;
+	}
+
+	static constexpr std::string_view request = "handoff\n";
+	if (send(connectionFd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+		NCBAR_LOG_ERROR << "Handoff: Failed to send request: " << strerror(errno);
+		return false;
+	}
+
+	// The running instance may be streaming other replies, only `handofffd <size>` matters
+	std::string line;
+	int fd = -1;
+	while (true) {
+		if (!ReadLine(line, &fd)) {
+			NCBAR_LOG_ERROR << "Handoff: Running instance didn't hand over its state";
+			return false;
+		}
+		if (line.starts_with("handofffd "))
+			break;
+		if (line.starts_with("error ")) {
+			NCBAR_LOG_ERROR << "Handoff: Running instance failed: " << line;
+			return false;
+		}
+		if (fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) {
+		NCBAR_LOG_ERROR << "Handoff: No state fd was passed";
+		return false;
+	}
+
+	std::string_view sizeString = std::string_view(line).substr(10);
+	std::size_t size = 0;
+	auto [end, error] = std::from_chars(sizeString.data(), sizeString.data() + sizeString.size(), size);
+	if (error != std::errc() || size > maxStateSize) {
+		NCBAR_LOG_ERROR << "Handoff: Bad state size";
+		close(fd);
+		return false;
+	}
+	bool restored = false;
+	const bool read = IpcServer::ReadFd(fd, size, [&core, &restored](std::string_view state) { restored = Restore(*core, state); });
+	close(fd);
+	if (!read) {
+		NCBAR_LOG_ERROR << "Handoff: Failed to read the state";
+		return false;
+	}
+	if (!restored) {
+		NCBAR_LOG_ERROR << "Handoff: Failed to restore the state";
+		return false;
+	}
+
+	return true;
+}
+
+bool Handoff::Finish()
+{
+	static constexpr std::string_view request = "quit\n";
+	if (send(connectionFd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+		NCBAR_LOG_ERROR << "Handoff: Failed to send quit: " << strerror(errno);
+		return false;
+	}
+
+	// The connection is closed after the socket is unlinked, so the socket is free once it's closed
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	char buffer[4096];
+	while (true) {
+		if (!waitForInput(connectionFd, deadline)) {
+			NCBAR_LOG_ERROR << "Handoff: Previous instance didn't quit";
+			return false;
+		}
+		ssize_t result = recv(connectionFd, buffer, sizeof(buffer), 0);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+	}
+	close(connectionFd);
+	connectionFd = -1;
+
+	return true;
+}
+
+bool Handoff::ReadLine(std::string &line, int *fd)
+{
+	*fd = -1;
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	while (true) {
+		auto end = input.find('\n');
+		if (end != std::string::npos) {
+			line.assign(input, 0, end);
+			input.erase(0, end + 1);
+			return true;
+		}
+		if (!waitForInput(connectionFd, deadline))
+			return false;
+
+		char buffer[4096];
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		iovec iov = {
+			.iov_base = buffer,
+			.iov_len = sizeof(buffer)
+		};
+		msghdr message = {};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		ssize_t result = recvmsg(connectionFd, &message, MSG_CMSG_CLOEXEC);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+
+		// The server sends an fd together with the first byte of its line and stops there, so one line gets one fd
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			int receivedFd;
+			std::memcpy(&receivedFd, CMSG_DATA(cmsg), sizeof(int));
+			if (*fd >= 0)
+				close(*fd);
+			*fd = receivedFd;
+		}
+		input.append(buffer, static_cast<std::size_t>(result));
+	}
+}
+
+void Handoff::Serialize(Core &core, std::string &data)
+{
+	data.assign(stateMagic, sizeof(stateMagic));
+
+	const auto isModuleKey = [](std::string_view key) {
+		for (const auto prefix : moduleKeyPrefixes) {
+			if (key.starts_with(prefix))
+				return true;
+		}
+		return false;
+	};
+	writeSection(data, SectionWidgets, [&core, &data, &isModuleKey]() {
+		core.GetWidgetStore().ForEach([&data, &isModuleKey](std::string_view key, std::string_view value) {
+			if (isModuleKey(key))
+				return;
+			writeString(data, key);
+			writeString(data, value);
+		});
+	});
+	// Empty values are removed keys
+	writeSection(data, SectionModuleWidgets, [&core, &data, &isModuleKey]() {
+		core.GetWidgetStore().ForEach([&data, &isModuleKey](std::string_view key, std::string_view value) {
+			if (!isModuleKey(key) || value.empty())
+				return;
+			writeString(data, key);
+			writeString(data, value);
+		});
+	});
+	if (auto taskbar = core.GetTaskbar()) {
+		writeSection(data, SectionIcons, [taskbar, &data]() {
+			taskbar->ForEachIcon([&data](std::string_view appId, std::string_view icon) {
+				writeString(data, appId);
+				writeString(data, icon);
+			});
+		});
+	}
+}
+
+bool Handoff::Restore(Core &core, std::string_view data)
+{
+	if (!data.starts_with(std::string_view(stateMagic, sizeof(stateMagic)))) {
+		NCBAR_LOG_ERROR << "Handoff: State is of an incompatible version";
+		return false;
+	}
+	StateReader reader(data.substr(sizeof(stateMagic)));
+
+	while (!reader.IsEmpty()) {
+		uint32_t tag;
+		uint64_t size;
+		std::string_view payload;
+		if (!reader.ReadValue(tag) || !reader.ReadValue(size) || !reader.ReadBytes(size, payload))
+			return false;
+
+		StateReader section(payload);
+		std::string_view first;
+		std::string_view second;
+		switch (tag) {
+		case SectionWidgets:
+			while (section.ReadString(first) && section.ReadString(second))
+				core.GetWidgetStore().Set(first, second);
+			break;
+		case SectionModuleWidgets:
+			while (section.ReadString(first) && section.ReadString(second))
+				core.GetWidgetStore().SetProvisional(first, second);
+			break;
+		case SectionIcons:
+			if (auto taskbar = core.GetTaskbar()) {
+				while (section.ReadString(first) && section.ReadString(second))
+					taskbar->AddIcon(first, second);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,38 @@
+#include "hitIndex.hpp"
+#include <algorithm>
+
+void HitIndex::Clear()
+{
+	entries.clear();
+	reach.clear();
+}
+
+void HitIndex::Add(uint32_t id, int32_t x, int32_t y, uint32_t width, uint32_t height)
+{
+	if (!id || !width || !height)
+		return;
+	entries.push_back(Entry{ .x0 = x, .x1 = x + static_cast<int32_t>(width), .y0 = y, .y1 = y + static_cast<int32_t>(height), .id = id });
+}
+
+void HitIndex::Build()
+{
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.x0 < b.x0; });
+	reach.resize(entries.size());
+	int32_t maxX1 = INT32_MIN;
+	for (std::size_t i = 0; i < entries.size(); i++) {
+		maxX1 = std::max(maxX1, entries[i].x1);
+		reach[i] = maxX1;
+	}
+}
+
+uint32_t HitIndex::Find(int32_t x, int32_t y) const
+{
+	auto it = std::upper_bound(entries.begin(), entries.end(), x, [](int32_t x, const Entry &entry) { return x < entry.x0; });
+	uint32_t found = 0;
+	for (auto i = it - entries.begin(); i-- > 0 && reach[i] > x;) {
+		const auto &entry = entries[i];
+		if (x < entry.x1 && y >= entry.y0 && y < entry.y1)
+			found = std::max(found, entry.id);
+	}
+	return found;
+}
@@ -0,0 +1,297 @@
+#include "imageDecoder.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#ifdef NCBAR_HAVE_PNG
+#include <png.h>
+#endif
+#ifdef NCBAR_HAVE_JPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+
+namespace {
+	constexpr uint8_t pngSignature[] = { 0x89, 'P', 'N', 'G' };
+	constexpr uint8_t jpegSignature[] = { 0xff, 0xd8, 0xff };
+
+	struct FileCloser {
+		void operator()(FILE *file) const { fclose(file); }
+	};
+	typedef std::unique_ptr<FILE, FileCloser> FilePtr;
+
+#ifdef NCBAR_HAVE_PNG
+	bool decodePng(const std::string &path, ImageDecoder::Image &image)
+	{
+		png_image png = {};
+		png.version = PNG_IMAGE_VERSION;
+		if (!png_image_begin_read_from_file(&png, path.c_str()))
+			return false;
+		png.format = PNG_FORMAT_RGBA;
+		if (static_cast<uint64_t>(png.width) * png.height > ImageDecoder::maxPixels) {
+			png_image_free(&png);
+			return false;
+		}
+		image.width = png.width;
+		image.height = png.height;
+		try {
+			image.pixels.resize(PNG_IMAGE_SIZE(png));
+		}
+		catch (const std::bad_alloc&) {
+			png_image_free(&png);
+			return false;
+		}
+		if (!png_image_finish_read(&png, nullptr, image.pixels.data(), 0, nullptr)) {
+			png_image_free(&png);
+			return false;
+		}
+		return true;
+	}
+#endif
+
+#ifdef NCBAR_HAVE_JPEG
+	struct JpegError {
+		jpeg_error_mgr manager;
+		std::jmp_buf jump;
+	};
+
+	void onJpegError(j_common_ptr info)
+	{
+		std::longjmp(reinterpret_cast<JpegError*>(info->err)->jump, 1);
+	}
+
+	void onJpegMessage(j_common_ptr info)
+	{
+		(void)info;
+	}
+
+	// Everything with a destructor lives outside of the setjmp scope, libjpeg reports errors by jumping back
+	bool decodeJpeg(FILE *file, uint32_t height, ImageDecoder::Image &image, std::vector<uint8_t> &row)
+	{
+		jpeg_decompress_struct info;
+		JpegError error;
+		info.err = jpeg_std_error(&error.manager);
+		error.manager.error_exit = onJpegError;
+		error.manager.output_message = onJpegMessage;
+		if (setjmp(error.jump)) {
+			jpeg_destroy_decompress(&info);
+			return false;
+		}
+		jpeg_create_decompress(&info);
+		jpeg_stdio_src(&info, file);
+		jpeg_read_header(&info, TRUE);
+		info.out_color_space = JCS_RGB;
+		// The DCT scales by 1/2, 1/4 or 1/8 almost for free, the box filter does the rest
+		info.scale_num = 1;
+		info.scale_denom = 1;
+		while (info.scale_denom < 8 && info.image_height / (info.scale_denom * 2) >= height)
+			info.scale_denom *= 2;
+		jpeg_start_decompress(&info);
+		if (static_cast<uint64_t>(info.output_width) * info.output_height > ImageDecoder::maxPixels) {
+			jpeg_destroy_decompress(&info);
+			return false;
+		}
+
+		image.width = info.output_width;
+		image.height = info.output_height;
+		try {
+			image.pixels.resize(static_cast<std::size_t>(image.width) * image.height * 4);
+			row.resize(static_cast<std::size_t>(image.width) * 3);
+		}
+		catch (const std::bad_alloc&) {
+			jpeg_destroy_decompress(&info);
+			return false;
+		}
+		while (info.output_scanline < info.output_height) {
+			uint8_t *destination = image.pixels.data() + static_cast<std::size_t>(info.output_scanline) * image.width * 4;
+			JSAMPROW rowPointer = row.data();
+			jpeg_read_scanlines(&info, &rowPointer, 1);
+			for (uint32_t x = 0; x < image.width; x++) {
+				destination[x * 4] = row[x * 3];
+				destination[x * 4 + 1] = row[x * 3 + 1];
+				destination[x * 4 + 2] = row[x * 3 + 2];
+				destination[x * 4 + 3] = 255;
+			}
+		}
+		jpeg_finish_decompress(&info);
+		jpeg_destroy_decompress(&info);
+		return true;
+	}
+#endif
+
+	// Box filter, every destination pixel averages the source pixels it covers. Averaged premultiplied, so
+	// transparent pixels don't darken the edges
+	void scaleDown(const ImageDecoder::Image &source, uint32_t height, ImageDecoder::Image &destination)
+	{
+		destination.height = height;
+		destination.width = std::max<uint32_t>(1, static_cast<uint32_t>((static_cast<uint64_t>(source.width) * height + source.height / 2) / source.height));
+		destination.pixels.resize(static_cast<std::size_t>(destination.width) * destination.height * 4);
+		for (uint32_t y = 0; y < destination.height; y++) {
+			const uint32_t sourceY0 = static_cast<uint32_t>(static_cast<uint64_t>(y) * source.height / destination.height);
+			const uint32_t sourceY1 = std::max(sourceY0 + 1, static_cast<uint32_t>(static_cast<uint64_t>(y + 1) * source.height / destination.height));
+			for (uint32_t x = 0; x < destination.width; x++) {
+				const uint32_t sourceX0 = static_cast<uint32_t>(static_cast<uint64_t>(x) * source.width / destination.width);
+				const uint32_t sourceX1 = std::max(sourceX0 + 1, static_cast<uint32_t>(static_cast<uint64_t>(x + 1) * source.width / destination.width));
+				uint64_t sum[4] = {};
+				for (uint32_t sourceY = sourceY0; sourceY < sourceY1; sourceY++) {
+					const uint8_t *pixel = source.pixels.data() + (static_cast<std::size_t>(sourceY) * source.width + sourceX0) * 4;
+					for (uint32_t sourceX = sourceX0; sourceX < sourceX1; sourceX++, pixel += 4) {
+						sum[0] += pixel[0] * pixel[3];
+						sum[1] += pixel[1] * pixel[3];
+						sum[2] += pixel[2] * pixel[3];
+						sum[3] += pixel[3];
+					}
+				}
+				uint8_t *pixel = destination.pixels.data() + (static_cast<std::size_t>(y) * destination.width + x) * 4;
+				const uint64_t count = static_cast<uint64_t>(sourceX1 - sourceX0) * (sourceY1 - sourceY0);
+				for (int channel = 0; channel < 3; channel++)
+					pixel[channel] = sum[3] ? static_cast<uint8_t>((sum[channel] + sum[3] / 2) / sum[3]) : 0;
+				pixel[3] = static_cast<uint8_t>((sum[3] + count / 2) / count);
+			}
+		}
+	}
+}
+
+ImageDecoder::~ImageDecoder()
+{
+	if (worker.joinable()) {
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_one();
+		worker.join();
+	}
+	if (eventFd >= 0) {
+		core->RemoveFd(eventFd);
+		close(eventFd);
+		eventFd = -1;
+	}
+}
+
+bool ImageDecoder::Init(CorePtr core)
+{
+	this->core = core;
+
+	eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventFd < 0) {
+		NCBAR_LOG_ERROR << "ImageDecoder: Failed to create eventfd: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(eventFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnReadable();
+	}))
+		return false;
+
+	worker = std::thread(&ImageDecoder::Run, this);
+	return true;
+}
+
+void ImageDecoder::SetOnDecoded(OnDecodedCallbackType onDecoded)
+{
+	this->onDecoded = onDecoded;
+}
+
+void ImageDecoder::Decode(const std::string &path, uint32_t height)
+{
+	{
+		std::lock_guard lock(mutex);
+		for (const auto &request : requests) {
+			if (request.path == path && request.height == height)
+				return;
+		}
+		requests.push_back(Request{ .path = path, .height = height, .image = nullptr });
+	}
+	wakeUp.notify_one();
+}
+
+ImageDecoder::ImagePtr ImageDecoder::DecodeFile(const std::string &path, uint32_t height)
+{
+	NCBAR_TRACE_SCOPE("decode", "ImageDecoder::DecodeFile");
+	if (!height)
+		return nullptr;
+	FilePtr file(fopen(path.c_str(), "rb"));
+	if (!file)
+		return nullptr;
+	uint8_t signature[4] = {};
+	const auto signatureSize = fread(signature, 1, sizeof(signature), file.get());
+	rewind(file.get());
+
+	auto decoded = std::make_shared<Image>();
+	bool ok = false;
+	if (signatureSize >= sizeof(pngSignature) && std::equal(std::begin(pngSignature), std::end(pngSignature), signature)) {
+#ifdef NCBAR_HAVE_PNG
+		file.reset();
+		ok = decodePng(path, *decoded);
+#endif
+	}
+	else if (signatureSize >= sizeof(jpegSignature) && std::equal(std::begin(jpegSignature), std::end(jpegSignature), signature)) {
+#ifdef NCBAR_HAVE_JPEG
+		std::vector<uint8_t> row;
+		ok = decodeJpeg(file.get(), height, *decoded, row);
+#endif
+	}
+	if (!ok || !decoded->width || !decoded->height)
+		return nullptr;
+	if (decoded->height <= height)
+		return decoded;
+
+	auto scaled = std::make_shared<Image>();
+	scaleDown(*decoded, height, *scaled);
+	return scaled;
+}
+
+void ImageDecoder::Run()
+{
+	Trace::SetThreadName("imageDecoder");
+	std::unique_lock lock(mutex);
+	while (true) {
+		wakeUp.wait(lock, [this]() { return stopping || !requests.empty(); });
+		if (stopping)
+			return;
+		Request request = std::move(requests.front());
+		requests.pop_front();
+
+		lock.unlock();
+		// Within the pixel budget memory can still run out, the image just fails then
+		try {
+			request.image = DecodeFile(request.path, request.height);
+		}
+		catch (const std::bad_alloc&) {
+			NCBAR_LOG_WARNING << "ImageDecoder: Out of memory decoding " << request.path;
+			request.image = nullptr;
+		}
+		lock.lock();
+
+		results.push_back(std::move(request));
+		const uint64_t one = 1;
+		if (write(eventFd, &one, sizeof(one)) < 0)
+			NCBAR_LOG_ERROR << "ImageDecoder: Failed to signal the event loop: " << strerror(errno);
+	}
+}
+
+void ImageDecoder::OnReadable()
+{
+	NCBAR_TRACE_SCOPE("source", "ImageDecoder::OnReadable");
+	uint64_t count;
+	if (read(eventFd, &count, sizeof(count)) < 0)
+		return;
+	std::vector<Request> decoded;
+	{
+		std::lock_guard lock(mutex);
+		decoded.swap(results);
+	}
+	for (auto &result : decoded) {
+		if (onDecoded)
+			onDecoded(result.path, result.height, std::move(result.image));
+	}
+}
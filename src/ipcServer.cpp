@@ -0,0 +1,492 @@
+#include "ipcServer.hpp"
+#include "core.hpp"
+#include "handoff.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+	// Splits "word rest of line" into "word" and "rest of line"
+	std::pair<std::string_view, std::string_view> splitWord(std::string_view line)
+	{
+		auto space = line.find(' ');
+		if (space == std::string_view::npos)
+			return { line, {} };
+		return { line.substr(0, space), line.substr(space + 1) };
+	}
+
+	int createSealedMemfd(std::string_view data)
+	{
+		int fd = memfd_create("ncbar-ipc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (fd < 0)
+			return -1;
+		std::size_t written = 0;
+		while (written < data.size()) {
+			ssize_t result = write(fd, data.data() + written, data.size() - written);
+			if (result < 0) {
+				if (errno == EINTR)
+					continue;
+				close(fd);
+				return -1;
+			}
+			written += static_cast<std::size_t>(result);
+		}
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+		return fd;
+	}
+}
+
+IpcServer::~IpcServer()
+{
+	if (subscriptionId) {
+		core->GetWidgetStore().Unsubscribe(subscriptionId);
+		subscriptionId = 0;
+	}
+	// Unlinked first: a successor waiting for its connection to close binds the same path right after
+	if (listenFd >= 0) {
+		core->RemoveFd(listenFd);
+		close(listenFd);
+		listenFd = -1;
+		unlink(socketPath.c_str());
+	}
+	for (auto &client : clients) {
+		CloseClient(client.get());
+	}
+	clients.clear();
+}
+
+bool IpcServer::ReadFd(int fd, std::size_t size, const std::function<void(std::string_view)> &consume)
+{
+	struct stat fdStat;
+	if (fstat(fd, &fdStat) < 0 || static_cast<std::size_t>(fdStat.st_size) < size)
+		return false;
+	if (!size) {
+		consume({});
+		return true;
+	}
+
+	const int seals = fcntl(fd, F_GET_SEALS);
+	if (seals >= 0 && (seals & F_SEAL_SHRINK)) {
+		void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+		consume(std::string_view(static_cast<const char*>(data), size));
+		munmap(data, size);
+		return true;
+	}
+
+	std::string copy(size, '\0');
+	std::size_t offset = 0;
+	while (offset < size) {
+		ssize_t result = pread(fd, copy.data() + offset, size - offset, static_cast<off_t>(offset));
+		if (result < 0 && errno == EINTR)
+			continue;
+		// Truncated meanwhile
+		if (result <= 0)
+			return false;
+		offset += static_cast<std::size_t>(result);
+	}
+	consume(copy);
+	return true;
+}
+
+std::string IpcServer::GetDefaultSocketPath()
+{
+	const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+	const char *waylandDisplay = getenv("WAYLAND_DISPLAY");
+	if (!runtimeDir || !*runtimeDir)
+		return {};
+	std::string path = runtimeDir;
+	path += "/ncbar-";
+	path += waylandDisplay ? waylandDisplay : "wayland-0";
+	path += ".sock";
+	return path;
+}
+
+bool IpcServer::IsPeerTrusted(int fd)
+{
+	ucred credentials = {};
+	socklen_t size = sizeof(credentials);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) < 0 || size != sizeof(credentials))
+		return false;
+	return credentials.uid == getuid();
+}
+
+bool IpcServer::Init(CorePtr core, const std::string &socketPath)
+{
+	this->core = core;
+	this->socketPath = socketPath.empty() ? GetDefaultSocketPath() : socketPath;
+	if (this->socketPath.empty()) {
+		NCBAR_LOG_ERROR << "IPC: XDG_RUNTIME_DIR is not set, pass --socket or --no-ipc";
+		return false;
+	}
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (this->socketPath.size() >= sizeof(address.sun_path)) {
+		NCBAR_LOG_ERROR << "IPC: Socket path is too long: " << this->socketPath;
+		return false;
+	}
+	std::memcpy(address.sun_path, this->socketPath.c_str(), this->socketPath.size() + 1);
+
+	// A socket left by a crashed instance is replaced, a live one is not
+	{
+		int probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (probeFd >= 0) {
+			bool alive = connect(probeFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+			close(probeFd);
+			if (alive) {
+				NCBAR_LOG_ERROR << "IPC: Another instance is listening on " << this->socketPath;
+				return false;
+			}
+		}
+		unlink(this->socketPath.c_str());
+	}
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd < 0) {
+		NCBAR_LOG_ERROR << "IPC: Failed to create socket: " << strerror(errno);
+		return false;
+	}
+	// Created as 0600, so there is no moment in which another user can connect
+	const mode_t previousMask = umask(077);
+	const int bound = bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+	umask(previousMask);
+	if (bound < 0) {
+		NCBAR_LOG_ERROR << "IPC: Failed to bind " << this->socketPath << ": " << strerror(errno);
+		return false;
+	}
+	if (chmod(this->socketPath.c_str(), 0600) < 0) {
+		NCBAR_LOG_ERROR << "IPC: Failed to restrict " << this->socketPath << ": " << strerror(errno);
+		return false;
+	}
+	if (listen(listenFd, 16) < 0) {
+		NCBAR_LOG_ERROR << "IPC: Failed to listen: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(listenFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnAccept();
+	}))
+		return false;
+
+	subscriptionId = core->GetWidgetStore().Subscribe([this](std::string_view key, std::string_view value) {
+		this->OnChange(key, value);
+	});
+
+	return true;
+}
+
+void IpcServer::OnAccept()
+{
+	while (true) {
+		int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				NCBAR_LOG_ERROR << "IPC: Failed to accept: " << strerror(errno);
+			return;
+		}
+		if (clients.size() >= maxClientsCount) {
+			close(fd);
+			continue;
+		}
+		// A path given with --socket may be in a directory others can reach
+		if (!IsPeerTrusted(fd)) {
+			NCBAR_LOG_WARNING << "IPC: Refused a connection from another user";
+			close(fd);
+			continue;
+		}
+
+		auto client = std::make_unique<Client>();
+		client->fd = fd;
+		auto clientPtr = client.get();
+		if (!core->AddFd(fd, EPOLLIN, [this, clientPtr](uint32_t events) { this->OnClientEvents(clientPtr, events); })) {
+			close(fd);
+			continue;
+		}
+		clients.push_back(std::move(client));
+	}
+}
+
+void IpcServer::OnClientEvents(Client *client, uint32_t events)
+{
+	handlingClient = true;
+	if (!client->closing && (events & EPOLLIN)) {
+		if (!ReadClient(client))
+			client->closing = true;
+	}
+	else if (events & (EPOLLHUP | EPOLLERR)) {
+		client->closing = true;
+	}
+	if (!client->closing) {
+		if (!FlushClient(client))
+			client->closing = true;
+		else
+			UpdateClientEvents(client);
+	}
+	handlingClient = false;
+
+	ReapClients();
+}
+
+bool IpcServer::ReadClient(Client *client)
+{
+	char buffer[4096];
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 8)];
+	while (true) {
+		iovec iov = {
+			.iov_base = buffer,
+			.iov_len = sizeof(buffer)
+		};
+		msghdr message = {};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		ssize_t result = recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			std::size_t fdsCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (std::size_t i = 0; i < fdsCount; i++) {
+				int fd;
+				std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				client->receivedFds.push_back(fd);
+			}
+		}
+		if (client->receivedFds.size() > 16 || (message.msg_flags & MSG_CTRUNC))
+			return false;
+		if (result == 0)
+			return false;
+
+		client->input.append(buffer, static_cast<std::size_t>(result));
+		std::size_t start = 0;
+		std::size_t end;
+		while (!client->closing && (end = client->input.find('\n', start)) != std::string::npos) {
+			std::string_view line(client->input.data() + start, end - start);
+			if (!line.empty() && line.back() == '\r')
+				line.remove_suffix(1);
+			HandleLine(client, line);
+			start = end + 1;
+		}
+		client->input.erase(0, start);
+		if (client->input.size() > maxLineSize) {
+			NCBAR_LOG_WARNING << "IPC: Client sent a too long line";
+			return false;
+		}
+		if (client->closing)
+			return false;
+	}
+}
+
+void IpcServer::HandleLine(Client *client, std::string_view line)
+{
+	NCBAR_TRACE_SCOPE("source", "IpcServer::HandleLine");
+	auto &widgetStore = core->GetWidgetStore();
+	auto [command, arguments] = splitWord(line);
+
+	if (command == "set") {
+		auto [key, value] = splitWord(arguments);
+		if (key.empty()) {
+			client->output += "error missing key\n";
+			return;
+		}
+		widgetStore.Set(key, value);
+	}
+	else if (command == "setfd") {
+		auto [key, sizeString] = splitWord(arguments);
+		std::size_t size = 0;
+		auto [end, error] = std::from_chars(sizeString.data(), sizeString.data() + sizeString.size(), size);
+		if (key.empty() || error != std::errc() || size > maxPayloadSize) {
+			client->output += "error bad setfd arguments\n";
+			return;
+		}
+		if (client->receivedFds.empty()) {
+			client->output += "error no fd was passed\n";
+			return;
+		}
+		int fd = client->receivedFds.front();
+		client->receivedFds.pop_front();
+
+		const bool read = ReadFd(fd, size, [&widgetStore, key](std::string_view value) { widgetStore.Set(key, value); });
+		close(fd);
+		if (!read)
+			client->output += "error failed to read the fd\n";
+	}
+	else if (command == "get") {
+		if (auto value = widgetStore.Get(arguments))
+			QueueValue(client, "value", arguments, *value);
+		else
+			client->output += "error unknown key\n";
+	}
+	else if (command == "list" || command == "subscribe") {
+		if (command == "subscribe") {
+			client->subscribed = true;
+			client->subscriptionPrefix.assign(arguments);
+		}
+		widgetStore.ForEach([this, client, prefix = arguments](std::string_view key, std::string_view value) {
+			if (key.starts_with(prefix))
+				this->QueueValue(client, "value", key, value);
+		});
+		client->output += "end\n";
+	}
+	else if (command == "handoff") {
+		std::string state;
+		Handoff::Serialize(*core, state);
+		int fd = createSealedMemfd(state);
+		if (fd < 0) {
+			client->output += "error failed to create memfd\n";
+			return;
+		}
+		client->outputFds.emplace_back(client->output.size(), fd);
+		client->output.append("handofffd ").append(std::to_string(state.size())).append("\n");
+	}
+	else if (command == "quit") {
+		quitRequested = true;
+	}
+	else if (!command.empty()) {
+		client->output += "error unknown command\n";
+	}
+}
+
+void IpcServer::OnChange(std::string_view key, std::string_view value)
+{
+	for (auto &client : clients) {
+		if (!client->subscribed || client->closing || !key.starts_with(client->subscriptionPrefix))
+			continue;
+		QueueValue(client.get(), "changed", key, value);
+		if (!FlushClient(client.get()))
+			client->closing = true;
+		else
+			UpdateClientEvents(client.get());
+	}
+
+	// A change that comes from a client's `set` is reaped after that client is handled
+	if (!handlingClient)
+		ReapClients();
+}
+
+void IpcServer::QueueValue(Client *client, std::string_view tag, std::string_view key, std::string_view value)
+{
+	if (value.size() > largeValueSize || value.find('\n') != std::string_view::npos) {
+		int fd = createSealedMemfd(value);
+		if (fd < 0) {
+			client->output += "error failed to create memfd\n";
+			return;
+		}
+		char size[24];
+		auto [end, error] = std::to_chars(size, size + sizeof(size), value.size());
+		(void)error;
+		client->outputFds.emplace_back(client->output.size(), fd);
+		client->output.append(tag).append("fd ").append(key).append(" ").append(size, end).append("\n");
+	}
+	else {
+		client->output.append(tag).append(" ").append(key).append(" ").append(value).append("\n");
+	}
+
+	if (client->output.size() > maxOutputSize)
+		client->closing = true;
+}
+
+bool IpcServer::FlushClient(Client *client)
+{
+	while (!client->output.empty()) {
+		std::size_t length = client->output.size();
+		int fd = -1;
+		if (!client->outputFds.empty()) {
+			// A fd goes with the first byte of its line, so the send stops right before the next one
+			if (client->outputFds.front().first == 0)
+				fd = client->outputFds.front().second;
+			else
+				length = client->outputFds.front().first;
+		}
+
+		iovec iov = {
+			.iov_base = client->output.data(),
+			.iov_len = length
+		};
+		msghdr message = {};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		if (fd >= 0) {
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+			cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+
+		ssize_t result = sendmsg(client->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		std::size_t sent = static_cast<std::size_t>(result);
+		if (fd >= 0) {
+			close(fd);
+			client->outputFds.pop_front();
+		}
+		client->output.erase(0, sent);
+		for (auto &outputFd : client->outputFds)
+			outputFd.first -= sent;
+	}
+	return true;
+}
+
+void IpcServer::UpdateClientEvents(Client *client)
+{
+	bool wantsOutput = !client->output.empty();
+	if (wantsOutput == client->watchingOutput)
+		return;
+	client->watchingOutput = wantsOutput;
+	core->ModifyFd(client->fd, wantsOutput ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+void IpcServer::CloseClient(Client *client)
+{
+	if (client->fd < 0)
+		return;
+	core->RemoveFd(client->fd);
+	close(client->fd);
+	client->fd = -1;
+	for (int fd : client->receivedFds)
+		close(fd);
+	client->receivedFds.clear();
+	for (auto &outputFd : client->outputFds)
+		close(outputFd.second);
+	client->outputFds.clear();
+}
+
+void IpcServer::ReapClients()
+{
+	std::erase_if(clients, [this](const std::unique_ptr<Client> &client) {
+		if (!client->closing)
+			return false;
+		this->CloseClient(client.get());
+		return true;
+	});
+}
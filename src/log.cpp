@@ -0,0 +1,204 @@
+#include "log.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+struct Log::Slot {
+	// Bounded MPMC queue of Dmitry Vyukov: `position` while free, `position + 1` once the line is written
+	std::atomic<uint64_t> sequence = 0;
+	Level level = LevelInfo;
+	uint16_t length = 0;
+	char text[slotSize - sizeof(std::atomic<uint64_t>) - sizeof(uint16_t) - sizeof(Level)];
+};
+
+namespace {
+	static_assert((Log::slotsCount & (Log::slotsCount - 1)) == 0, "Slots count must be a power of two");
+
+	class Logger
+	{
+	public:
+		Logger()
+		{
+			for (std::size_t i = 0; i < Log::slotsCount; i++)
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		~Logger()
+		{
+			if (!flusher.joinable())
+				return;
+			stopping.store(true, std::memory_order_release);
+			Wake();
+			flusher.join();
+		}
+
+		Log::Slot* Claim(uint64_t &position)
+		{
+			std::call_once(started, [this]() { flusher = std::thread(&Logger::Run, this); });
+			position = enqueuePosition.load(std::memory_order_relaxed);
+			while (true) {
+				auto &slot = slots[position & (Log::slotsCount - 1)];
+				const auto difference = static_cast<int64_t>(slot.sequence.load(std::memory_order_acquire) - position);
+				if (difference == 0) {
+					if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						return &slot;
+				}
+				else if (difference < 0) {
+					// Full, the flusher is behind the terminal
+					dropped.fetch_add(1, std::memory_order_relaxed);
+					return nullptr;
+				}
+				else
+					position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+		void Publish(Log::Slot *slot, uint64_t position)
+		{
+			slot->sequence.store(position + 1, std::memory_order_release);
+			Wake();
+		}
+		void Flush()
+		{
+			const uint64_t target = enqueuePosition.load(std::memory_order_acquire);
+			if (!flusher.joinable())
+				return;
+			uint64_t done = written.load(std::memory_order_acquire);
+			while (done < target) {
+				written.wait(done, std::memory_order_acquire);
+				done = written.load(std::memory_order_acquire);
+			}
+		}
+
+	private:
+		// Batches of lines per stream, one write each
+		struct Output {
+			int fd = -1;
+			std::array<char, 1 << 16> buffer;
+			std::size_t length = 0;
+
+			void Append(std::string_view text)
+			{
+				if (length + text.size() > buffer.size())
+					Write();
+				text = text.substr(0, std::min(text.size(), buffer.size()));
+				std::memcpy(buffer.data() + length, text.data(), text.size());
+				length += text.size();
+			}
+			void Write()
+			{
+				std::size_t offset = 0;
+				while (offset < length) {
+					const ssize_t result = write(fd, buffer.data() + offset, length - offset);
+					if (result < 0 && errno == EINTR)
+						continue;
+					// Nobody to tell if the terminal is gone
+					if (result <= 0)
+						break;
+					offset += static_cast<std::size_t>(result);
+				}
+				length = 0;
+			}
+		};
+
+		void Wake()
+		{
+			wakeups.fetch_add(1, std::memory_order_release);
+			wakeups.notify_one();
+		}
+		void Run()
+		{
+			while (true) {
+				const uint32_t seen = wakeups.load(std::memory_order_acquire);
+				bool drained = false;
+				while (true) {
+					auto &slot = slots[dequeuePosition & (Log::slotsCount - 1)];
+					if (slot.sequence.load(std::memory_order_acquire) != dequeuePosition + 1)
+						break;
+					auto &output = slot.level >= Log::LevelWarning ? errorOutput : infoOutput;
+					output.Append(std::string_view(slot.text, slot.length));
+					output.Append("\n");
+					slot.sequence.store(dequeuePosition + Log::slotsCount, std::memory_order_release);
+					dequeuePosition++;
+					drained = true;
+				}
+				if (const uint64_t count = dropped.exchange(0, std::memory_order_relaxed)) {
+					char digits[24];
+					const auto end = std::to_chars(digits, digits + sizeof(digits), count).ptr;
+					errorOutput.Append("Log: Dropped ");
+					errorOutput.Append(std::string_view(digits, static_cast<std::size_t>(end - digits)));
+					errorOutput.Append(" lines, the output can't keep up\n");
+				}
+				if (drained) {
+					infoOutput.Write();
+					errorOutput.Write();
+					written.store(dequeuePosition, std::memory_order_release);
+					written.notify_all();
+					continue;
+				}
+				if (stopping.load(std::memory_order_acquire))
+					break;
+				wakeups.wait(seen, std::memory_order_acquire);
+			}
+		}
+
+		std::array<Log::Slot, Log::slotsCount> slots;
+		std::atomic<uint64_t> enqueuePosition = 0;
+		std::atomic<uint64_t> dropped = 0;
+		std::atomic<uint32_t> wakeups = 0;
+		std::atomic<uint64_t> written = 0;
+		std::atomic<bool> stopping = false;
+		// Only touched by the flusher
+		uint64_t dequeuePosition = 0;
+		Output infoOutput = { .fd = STDOUT_FILENO, .buffer = {}, .length = 0 };
+		Output errorOutput = { .fd = STDERR_FILENO, .buffer = {}, .length = 0 };
+		std::once_flag started;
+		std::thread flusher;
+	};
+
+	Logger logger;
+}
+
+Log::Line::Line(Level level)
+{
+	if (!IsEnabled(level))
+		return;
+	slot = logger.Claim(position);
+	if (!slot)
+		return;
+	slot->level = level;
+	slot->length = 0;
+}
+
+Log::Line::~Line()
+{
+	if (slot)
+		logger.Publish(slot, position);
+}
+
+Log::Line& Log::Line::operator<<(std::string_view text)
+{
+	if (!slot)
+		return *this;
+	const std::size_t size = std::min(text.size(), sizeof(slot->text) - slot->length);
+	if (size) {
+		std::memcpy(slot->text + slot->length, text.data(), size);
+		slot->length = static_cast<uint16_t>(slot->length + size);
+	}
+	return *this;
+}
+
+Log::Line& Log::Line::operator<<(double number)
+{
+	char digits[32];
+	const auto end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+	return *this << std::string_view(digits, static_cast<std::size_t>(end - digits));
+}
+
+void Log::Flush()
+{
+	logger.Flush();
+}
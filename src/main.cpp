@@ -1,66 +1,988 @@
+#include "allocationCounter.hpp"
+#include "bitmapFont.hpp"
+#include "bus.hpp"
+#include "clock.hpp"
 #include "core.hpp"
+#include "devices.hpp"
+#include "handoff.hpp"
+#include "ipcServer.hpp"
+#include "log.hpp"
+#include "media.hpp"
+#include "network.hpp"
+#include "previews.hpp"
 #include "renderer.hpp"
+#include "scripts.hpp"
+#include "settings.hpp"
+#include "startupSnapshot.hpp"
+#include "taskbar.hpp"
+#include "textWidgets.hpp"
+#include "trace.hpp"
+#include "tray.hpp"
 #include "vulkanInclude.hpp"
 #include "window.hpp"
 #include <argparse/argparse.hpp>
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
+#include <linux/input-event-codes.h>
+#include <mutex>
+#include <unistd.h>
 
+namespace {
+	volatile std::sig_atomic_t stopRequested = 0;
+	void onStopSignal(int signal)
+	{
+		(void)signal;
+		stopRequested = 1;
+	}
+	volatile std::sig_atomic_t traceDumpRequested = 0;
+	void onTraceDumpSignal(int signal)
+	{
+		(void)signal;
+		traceDumpRequested = 1;
+	}
+
+	// SIGUSR1 writes the last seconds of the trace to a new $XDG_RUNTIME_DIR/ncbar-trace-<pid>-<n>.json. Nothing
+	// without XDG_RUNTIME_DIR, a shared directory like /tmp would let other users take the path first
+	constexpr uint64_t traceDumpSeconds = 10;
+	void dumpRecentTrace()
+	{
+		static uint32_t dumps = 0;
+		const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+		if (!runtimeDir || !*runtimeDir) {
+			NCBAR_LOG_ERROR << "Trace: XDG_RUNTIME_DIR is not set, no trace written";
+			return;
+		}
+		std::string path = runtimeDir;
+		path += "/ncbar-trace-" + std::to_string(getpid()) + "-" + std::to_string(++dumps) + ".json";
+		std::vector<Trace::Event> events;
+		Trace::CollectSince(Trace::Now() - traceDumpSeconds * 1'000'000'000ull, events);
+		if (Trace::WriteChromeJson(path, events))
+			NCBAR_LOG_INFO << "Trace: Wrote the last " << traceDumpSeconds << " seconds to " << path;
+		else
+			NCBAR_LOG_ERROR << "Trace: Failed to write " << path;
+	}
+
+	// Events a trace of the whole run buffers before they are appended to its file
+	constexpr std::size_t traceFlushEvents = 16384;
+
+	// Frames that fill the caches (regions of every frame in flight, swapchain) before the benchmark expects a steady state
+	constexpr uint64_t benchmarkWarmupFrames = 60;
+
+	// Taskbar entries in logical pixels, slot N is the region N + 1
+	constexpr uint32_t taskbarFirstRegion = 1;
+	constexpr uint32_t taskbarEntryWidth = 160;
+	constexpr uint32_t taskbarEntryHeight = 28;
+	constexpr uint32_t taskbarSpacing = 4;
+	constexpr uint32_t taskbarEntryRadius = 6;
+
+	// Network indicator at the right end, after every taskbar slot
+	constexpr uint32_t networkRegion = 1 << 16;
+	constexpr uint32_t networkWidth = 40;
+	// Rate that fills a throughput bar, the bars are logarithmic from 1 byte per second
+	constexpr double networkFullRate = 1e9;
+
+	// Tray icons right to left from the network indicator, slot N is the region trayFirstRegion + N and image N
+	constexpr uint32_t trayFirstRegion = networkRegion + 1;
+	constexpr uint32_t trayIconSize = 22;
+	constexpr uint32_t trayIconPadding = 3;
+
+	// Media player in the middle of the bar: the cover, then the progress of the track along the bottom
+	constexpr uint32_t mediaRegion = networkRegion - 1;
+	constexpr uint32_t mediaArtImage = 1 << 16;
+	constexpr uint32_t mediaWidth = 200;
+	constexpr uint32_t mediaProgressHeight = 3;
+
+	// Live thumbnail of the output of the hovered taskbar entry's window, at the right end of the entry
+	constexpr uint32_t previewImage = mediaArtImage + 1;
+	constexpr uint32_t previewPadding = 3;
+
+	// Texts of store keys left to right after the media widget, label N is the region labelFirstRegion + N and the
+	// image labelFirstImage + N. A font pixel is labelFontPixel logical pixels
+	constexpr uint32_t labelFirstRegion = 1 << 24;
+	constexpr uint32_t labelFirstImage = previewImage + 1;
+	constexpr uint32_t labelFontPixel = 2;
+	constexpr uint32_t labelPadding = 6;
+	constexpr std::array<uint8_t, 4> labelColor = { 220, 220, 220, 255 };
+
+	void clearArea(VkCommandBuffer commandBuffer, const VkRect2D &area, VkClearColorValue color)
+	{
+		VkClearAttachment clearAttachment = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.colorAttachment = 0,
+			.clearValue = VkClearValue{ .color = color }
+		};
+		VkClearRect clearRect = {
+			.rect = area,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		};
+		vkCmdClearAttachments(commandBuffer, 1, &clearAttachment, 1, &clearRect);
+	}
+
+	// For region callbacks, they are recorded again when the hover enters or leaves their region
+	bool isHovered(Renderer *renderer, uint32_t region)
+	{
+		Window::Ptr window = renderer->GetWindow();
+		return window && window->GetHoveredRegion() == region;
+	}
+
+	// For region callbacks, the widgets of the snapshot being drawn; they never read a module
+	const WidgetSnapshot& drawnWidgets(Renderer *renderer)
+	{
+		static const WidgetSnapshot empty;
+		Window::Ptr window = renderer->GetWindow();
+		return window ? window->GetWidgets() : empty;
+	}
+
+	bool fitsIn(const VkRect2D &area, VkExtent2D extent)
+	{
+		return area.offset.x >= 0 && area.offset.y >= 0 && area.offset.x + area.extent.width <= extent.width && area.offset.y + area.extent.height <= extent.height;
+	}
+
+	VkRect2D networkArea(VkExtent2D extent, Scale scale)
+	{
+		const uint32_t width = scale.ToDevice(networkWidth);
+		const uint32_t spacing = scale.ToDevice(taskbarSpacing);
+		return VkRect2D{
+			.offset = VkOffset2D{ .x = static_cast<int32_t>(extent.width) - static_cast<int32_t>(width + spacing), .y = static_cast<int32_t>(spacing) },
+			.extent = VkExtent2D{ .width = width, .height = scale.ToDevice(taskbarEntryHeight) }
+		};
+	}
+
+	VkRect2D mediaArea(VkExtent2D extent, Scale scale)
+	{
+		const uint32_t width = scale.ToDevice(mediaWidth);
+		return VkRect2D{
+			.offset = VkOffset2D{ .x = (static_cast<int32_t>(extent.width) - static_cast<int32_t>(width)) / 2, .y = static_cast<int32_t>(scale.ToDevice(taskbarSpacing)) },
+			.extent = VkExtent2D{ .width = width, .height = scale.ToDevice(taskbarEntryHeight) }
+		};
+	}
+
+	// Thumbnail of the open preview, copied when the hover changes and after every capture
+	void copyPreview(WidgetSnapshot &widgets, Previews *previews)
+	{
+		const auto output = previews->GetOpenOutput();
+		widgets.preview = output ? previews->GetThumbnail(output) : nullptr;
+	}
+
+	// Clicks and scrolling on the widgets, the compositor picks the seat's focus for activations
+	void handleInput(const InputEvent &event, Core *core, Window *window, Tray *tray, Media *media, Previews *previews)
+	{
+		// The render thread draws the hover of the snapshot it takes, only previews follow it here. The last thumbnail
+		// of the output is shown until the first capture is there
+		if (event.type == InputEvent::TypeEnter || event.type == InputEvent::TypeLeave) {
+			auto taskbar = core->GetTaskbar();
+			if (!previews || !taskbar || event.region < taskbarFirstRegion || event.region >= mediaRegion)
+				return;
+			const uint32_t slot = event.region - taskbarFirstRegion;
+			auto &widgets = window->EditWidgets();
+			if (event.type == InputEvent::TypeEnter && slot < taskbar->GetSlotsCount()) {
+				previews->Open(taskbar->GetToplevel(slot).output);
+				widgets.previewSlot = slot;
+			}
+			else
+				previews->Close();
+			copyPreview(widgets, previews);
+			return;
+		}
+		if (event.region >= taskbarFirstRegion && event.region < mediaRegion) {
+			auto taskbar = core->GetTaskbar();
+			const uint32_t slot = event.region - taskbarFirstRegion;
+			if (event.type == InputEvent::TypeClick && event.button == BTN_LEFT && taskbar && core->GetSeat() && slot < taskbar->GetSlotsCount())
+				taskbar->Activate(slot, core->GetSeat()->GetSeat());
+		}
+		else if (event.region == mediaRegion && media) {
+			if (event.type == InputEvent::TypeScroll) {
+				if (!event.horizontal && event.steps > 0)
+					media->Next();
+				else if (!event.horizontal && event.steps < 0)
+					media->Previous();
+			}
+			else if (event.button == BTN_LEFT)
+				media->PlayPause();
+			else if (event.button == BTN_MIDDLE)
+				media->Next();
+		}
+		else if (event.region >= trayFirstRegion && event.region < labelFirstRegion && tray) {
+			const uint32_t slot = event.region - trayFirstRegion;
+			// Items want a position to open their menus at, the bar only knows its own
+			const auto scale = window->GetDrawnScale();
+			const int32_t x = static_cast<int32_t>(event.x / scale.ToFloat());
+			const int32_t y = static_cast<int32_t>(event.y / scale.ToFloat());
+			if (event.type == InputEvent::TypeScroll)
+				tray->Scroll(slot, event.steps, event.horizontal);
+			else if (event.button == BTN_LEFT)
+				tray->Activate(slot, x, y);
+			else if (event.button == BTN_MIDDLE)
+				tray->SecondaryActivate(slot, x, y);
+			else if (event.button == BTN_RIGHT)
+				tray->ContextMenu(slot, x, y);
+		}
+	}
+
+	// ==== Main thread: modules into the widgets of the next snapshot ====
+	void copyTaskbarEntry(WidgetSnapshot &widgets, Taskbar *taskbar, uint32_t slot)
+	{
+		if (widgets.taskbar.size() < taskbar->GetSlotsCount())
+			widgets.taskbar.resize(taskbar->GetSlotsCount());
+		const auto &toplevel = taskbar->GetToplevel(slot);
+		widgets.taskbar[slot] = WidgetSnapshot::TaskbarEntry{ .announced = toplevel.announced, .states = toplevel.states };
+	}
+
+	void copyNetwork(WidgetSnapshot &widgets, Network *network)
+	{
+		widgets.hasNetwork = true;
+		widgets.networkUp = network->IsDefaultInterfaceUp();
+		widgets.rxRate = network->GetRxRate();
+		widgets.txRate = network->GetTxRate();
+	}
+
+	// The icon is copied only when it changes, into an image of its own that the render thread uploads
+	void copyTrayItem(WidgetSnapshot &widgets, Tray *tray, uint32_t slot, bool iconChanged)
+	{
+		if (widgets.tray.size() < tray->GetSlotsCount())
+			widgets.tray.resize(tray->GetSlotsCount());
+		auto &entry = widgets.tray[slot];
+		const auto &item = tray->GetItem(slot);
+		entry.announced = item.announced;
+		entry.needsAttention = item.status == "NeedsAttention";
+		if (!item.announced || item.iconPixels.empty())
+			entry.icon = nullptr;
+		else if (iconChanged || !entry.icon)
+			entry.icon = std::make_shared<const ImageDecoder::Image>(ImageDecoder::Image{ .width = item.iconWidth, .height = item.iconHeight, .pixels = item.iconPixels });
+	}
+
+	void copyMedia(WidgetSnapshot &widgets, Media *media)
+	{
+		widgets.hasMedia = true;
+		widgets.hasPlayer = media->HasPlayer();
+		widgets.playing = media->IsPlaying();
+		widgets.progress = media->GetProgress();
+		widgets.mediaArt = media->GetArt();
+	}
+
+	// Rendered again only when the store reports a new value of its key, or for a new scale
+	void copyLabel(WidgetSnapshot &widgets, uint32_t slot, std::string_view text, Scale scale)
+	{
+		if (text.empty()) {
+			widgets.labels[slot] = nullptr;
+			return;
+		}
+		auto image = std::make_shared<ImageDecoder::Image>();
+		BitmapFont::Render(text, std::max(1u, scale.ToDevice(labelFontPixel)), labelColor, *image);
+		widgets.labels[slot] = std::move(image);
+	}
+
+	void copyLabels(WidgetSnapshot &widgets, const WidgetStore &widgetStore, const std::vector<std::string> &keys, Scale scale)
+	{
+		widgets.labels.resize(keys.size());
+		for (uint32_t slot = 0; slot < keys.size(); slot++) {
+			const auto value = widgetStore.Get(keys[slot]);
+			copyLabel(widgets, slot, value ? std::string_view(*value) : std::string_view(), scale);
+		}
+	}
+
+	// Sizes the modules prepare their data for, from the extent the render thread draws at
+	void updateNetworkSize(Network *network, VkExtent2D extent, Scale scale)
+	{
+		// The counters are read only while the bars are on screen
+		network->SetThroughputVisible(fitsIn(networkArea(extent, scale), extent));
+	}
+
+	void updateMediaSize(Media *media, VkExtent2D extent, Scale scale)
+	{
+		const auto area = mediaArea(extent, scale);
+		media->SetArtHeight(area.extent.height);
+		if (media->HasPlayer() && fitsIn(area, extent))
+			media->SetProgressWidth(area.extent.width - area.extent.height - scale.ToDevice(taskbarSpacing));
+		else
+			media->SetProgressWidth(0);
+	}
+
+	// ==== Render thread: widgets into regions ====
+	// Slots keep their place, so an entry is laid out on its own and the others aren't touched
+	void layoutTaskbarEntry(Renderer *renderer, const WidgetSnapshot &widgets, uint32_t slot)
+	{
+		Window::Ptr window = renderer->GetWindow();
+		if (!window)
+			return;
+		const auto scale = window->GetScale();
+		const VkRect2D entryArea = {
+			.offset = VkOffset2D{ .x = static_cast<int32_t>(scale.ToDevice(taskbarSpacing + slot * (taskbarEntryWidth + taskbarSpacing))), .y = static_cast<int32_t>(scale.ToDevice(taskbarSpacing)) },
+			.extent = VkExtent2D{ .width = scale.ToDevice(taskbarEntryWidth), .height = scale.ToDevice(taskbarEntryHeight) }
+		};
+		if (slot >= widgets.taskbar.size() || !widgets.taskbar[slot].announced || !fitsIn(entryArea, renderer->GetExtent())) {
+			renderer->RemoveRegion(taskbarFirstRegion + slot);
+			return;
+		}
+		const float radius = static_cast<float>(scale.ToDevice(taskbarEntryRadius));
+		const uint32_t padding = scale.ToDevice(previewPadding);
+		renderer->SetRegion(taskbarFirstRegion + slot, entryArea, [slot, radius, padding](VkCommandBuffer commandBuffer, const VkRect2D &area, Renderer *renderer) {
+			const auto &widgets = drawnWidgets(renderer);
+			const auto &taskbar = widgets.taskbar;
+			const auto states = slot < taskbar.size() ? taskbar[slot].states : 0;
+			if (states & Taskbar::StateActivated)
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.25f, 0.35f, 0.55f, 1.0f } }, radius);
+			else if (isHovered(renderer, taskbarFirstRegion + slot))
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.26f, 0.26f, 0.26f, 1.0f } }, radius);
+			else if (states & Taskbar::StateMinimized)
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.12f, 0.12f, 0.12f, 1.0f } }, radius);
+			else
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.18f, 0.18f, 0.18f, 1.0f } }, radius);
+
+			if (!widgets.preview || widgets.previewSlot != slot || !renderer->HasImage(previewImage) || area.extent.height <= 2 * padding)
+				return;
+			// Keeps the aspect of the output, narrower if the entry is
+			const uint32_t height = area.extent.height - 2 * padding;
+			const uint32_t width = std::min(area.extent.width - 2 * padding, static_cast<uint32_t>(static_cast<uint64_t>(height) * widgets.preview->width / widgets.preview->height));
+			const VkRect2D thumbnail = {
+				.offset = VkOffset2D{ .x = area.offset.x + static_cast<int32_t>(area.extent.width - padding - width), .y = area.offset.y + static_cast<int32_t>(padding) },
+				.extent = VkExtent2D{ .width = width, .height = height }
+			};
+			renderer->DrawImage(commandBuffer, thumbnail, previewImage, radius / 2.0f);
+		});
+	}
+
+	// Link state of the default route and a receive and a transmit bar
+	void layoutNetwork(Renderer *renderer)
+	{
+		Window::Ptr window = renderer->GetWindow();
+		if (!window)
+			return;
+		const auto scale = window->GetScale();
+		const auto area = networkArea(renderer->GetExtent(), scale);
+		if (!fitsIn(area, renderer->GetExtent())) {
+			renderer->RemoveRegion(networkRegion);
+			return;
+		}
+		const uint32_t spacing = scale.ToDevice(taskbarSpacing);
+		const float radius = static_cast<float>(scale.ToDevice(taskbarEntryRadius));
+		renderer->SetRegion(networkRegion, area, [radius, spacing](VkCommandBuffer commandBuffer, const VkRect2D &area, Renderer *renderer) {
+			const auto &widgets = drawnWidgets(renderer);
+			if (widgets.networkUp)
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.15f, 0.3f, 0.2f, 1.0f } }, radius);
+			else
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.35f, 0.15f, 0.15f, 1.0f } }, radius);
+
+			const uint32_t barWidth = (area.extent.width - 3 * spacing) / 2;
+			const uint32_t maxHeight = area.extent.height - 2 * spacing;
+			const uint64_t rates[] = { widgets.rxRate, widgets.txRate };
+			for (uint32_t i = 0; i < std::size(rates); i++) {
+				const double fill = std::clamp(std::log10(static_cast<double>(rates[i]) + 1.0) / std::log10(networkFullRate), 0.0, 1.0);
+				const uint32_t height = static_cast<uint32_t>(fill * maxHeight);
+				if (!height || !barWidth)
+					continue;
+				const VkRect2D bar = {
+					.offset = VkOffset2D{ .x = area.offset.x + static_cast<int32_t>(spacing + i * (barWidth + spacing)), .y = area.offset.y + static_cast<int32_t>(spacing + maxHeight - height) },
+					.extent = VkExtent2D{ .width = barWidth, .height = height }
+				};
+				renderer->DrawQuad(commandBuffer, bar, VkClearColorValue{ .float32 = { 0.6f, 0.75f, 0.9f, 1.0f } });
+			}
+		});
+	}
+
+	// The progress bar is redrawn when its fill moves by a pixel, Media's timer knows when that is
+	void layoutMedia(Renderer *renderer, const WidgetSnapshot &widgets)
+	{
+		Window::Ptr window = renderer->GetWindow();
+		if (!window)
+			return;
+		const auto scale = window->GetScale();
+		const auto area = mediaArea(renderer->GetExtent(), scale);
+		if (!widgets.hasPlayer || !fitsIn(area, renderer->GetExtent())) {
+			renderer->RemoveRegion(mediaRegion);
+			return;
+		}
+		const uint32_t artWidth = area.extent.height;
+		const uint32_t progressHeight = scale.ToDevice(mediaProgressHeight);
+		const uint32_t spacing = scale.ToDevice(taskbarSpacing);
+		const float radius = static_cast<float>(scale.ToDevice(taskbarEntryRadius));
+		renderer->SetRegion(mediaRegion, area, [artWidth, progressHeight, spacing, radius](VkCommandBuffer commandBuffer, const VkRect2D &area, Renderer *renderer) {
+			renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.18f, 0.18f, 0.18f, 1.0f } }, radius);
+			const VkRect2D art = {
+				.offset = area.offset,
+				.extent = VkExtent2D{ .width = artWidth, .height = area.extent.height }
+			};
+			if (renderer->HasImage(mediaArtImage))
+				renderer->DrawImage(commandBuffer, art, mediaArtImage, radius);
+
+			const auto &widgets = drawnWidgets(renderer);
+			const uint32_t progressWidth = area.extent.width - artWidth - spacing;
+			const uint32_t fill = static_cast<uint32_t>(std::clamp(widgets.progress, 0.0, 1.0) * progressWidth);
+			if (!fill)
+				return;
+			const VkRect2D progress = {
+				.offset = VkOffset2D{ .x = area.offset.x + static_cast<int32_t>(artWidth + spacing), .y = area.offset.y + static_cast<int32_t>(area.extent.height - progressHeight) },
+				.extent = VkExtent2D{ .width = fill, .height = progressHeight }
+			};
+			if (widgets.playing)
+				renderer->DrawQuad(commandBuffer, progress, VkClearColorValue{ .float32 = { 0.6f, 0.75f, 0.9f, 1.0f } });
+			else
+				renderer->DrawQuad(commandBuffer, progress, VkClearColorValue{ .float32 = { 0.4f, 0.4f, 0.4f, 1.0f } });
+		});
+	}
+
+	// Status items draw their pixmap, or a placeholder, and a highlight while they need attention
+	void layoutTrayItem(Renderer *renderer, const WidgetSnapshot &widgets, uint32_t slot)
+	{
+		Window::Ptr window = renderer->GetWindow();
+		if (!window)
+			return;
+		const auto scale = window->GetScale();
+		const auto extent = renderer->GetExtent();
+		const uint32_t spacing = scale.ToDevice(taskbarSpacing);
+		const uint32_t size = scale.ToDevice(trayIconSize + 2 * trayIconPadding);
+		const int32_t right = static_cast<int32_t>(extent.width) - static_cast<int32_t>(scale.ToDevice(networkWidth) + 2 * spacing);
+		const VkRect2D itemArea = {
+			.offset = VkOffset2D{ .x = right - static_cast<int32_t>((slot + 1) * (size + spacing)), .y = static_cast<int32_t>(spacing) },
+			.extent = VkExtent2D{ .width = size, .height = size }
+		};
+		if (slot >= widgets.tray.size() || !widgets.tray[slot].announced || !fitsIn(itemArea, extent)) {
+			renderer->RemoveRegion(trayFirstRegion + slot);
+			return;
+		}
+		const uint32_t padding = scale.ToDevice(trayIconPadding);
+		const float radius = static_cast<float>(scale.ToDevice(taskbarEntryRadius));
+		renderer->SetRegion(trayFirstRegion + slot, itemArea, [slot, padding, radius](VkCommandBuffer commandBuffer, const VkRect2D &area, Renderer *renderer) {
+			const auto &tray = drawnWidgets(renderer).tray;
+			if (slot < tray.size() && tray[slot].needsAttention)
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.45f, 0.25f, 0.1f, 1.0f } }, radius);
+			else if (isHovered(renderer, trayFirstRegion + slot))
+				renderer->DrawQuad(commandBuffer, area, VkClearColorValue{ .float32 = { 0.26f, 0.26f, 0.26f, 1.0f } }, radius);
+			const VkRect2D icon = {
+				.offset = VkOffset2D{ .x = area.offset.x + static_cast<int32_t>(padding), .y = area.offset.y + static_cast<int32_t>(padding) },
+				.extent = VkExtent2D{ .width = area.extent.width - 2 * padding, .height = area.extent.height - 2 * padding }
+			};
+			// Items with only a themed icon name get a placeholder, there is no icon theme lookup
+			if (renderer->HasImage(slot))
+				renderer->DrawImage(commandBuffer, icon, slot);
+			else
+				renderer->DrawQuad(commandBuffer, icon, VkClearColorValue{ .float32 = { 0.5f, 0.5f, 0.5f, 1.0f } }, radius);
+		});
+	}
+
+	// Every label after a changed one moves, so they are laid out together. The text is drawn 1:1 from its image
+	void layoutLabels(Renderer *renderer, const WidgetSnapshot &widgets)
+	{
+		Window::Ptr window = renderer->GetWindow();
+		if (!window)
+			return;
+		const auto scale = window->GetScale();
+		const auto extent = renderer->GetExtent();
+		const auto media = mediaArea(extent, scale);
+		const uint32_t spacing = scale.ToDevice(taskbarSpacing);
+		const uint32_t padding = scale.ToDevice(labelPadding);
+		int32_t left = media.offset.x + static_cast<int32_t>(media.extent.width + spacing);
+		for (uint32_t slot = 0; slot < widgets.labels.size(); slot++) {
+			const auto &image = widgets.labels[slot];
+			const VkRect2D labelArea = {
+				.offset = VkOffset2D{ .x = left, .y = static_cast<int32_t>(spacing) },
+				.extent = VkExtent2D{ .width = image ? image->width + 2 * padding : 0, .height = scale.ToDevice(taskbarEntryHeight) }
+			};
+			if (!image || !fitsIn(labelArea, extent)) {
+				renderer->RemoveRegion(labelFirstRegion + slot);
+				continue;
+			}
+			left += static_cast<int32_t>(labelArea.extent.width + spacing);
+			renderer->SetRegion(labelFirstRegion + slot, labelArea, [slot, padding](VkCommandBuffer commandBuffer, const VkRect2D &area, Renderer *renderer) {
+				const auto &labels = drawnWidgets(renderer).labels;
+				if (slot >= labels.size() || !labels[slot] || !renderer->HasImage(labelFirstImage + slot))
+					return;
+				const uint32_t height = std::min(labels[slot]->height, area.extent.height);
+				const VkRect2D text = {
+					.offset = VkOffset2D{ .x = area.offset.x + static_cast<int32_t>(padding), .y = area.offset.y + static_cast<int32_t>((area.extent.height - height) / 2) },
+					.extent = VkExtent2D{ .width = labels[slot]->width, .height = height }
+				};
+				renderer->DrawImage(commandBuffer, text, labelFirstImage + slot);
+			});
+		}
+	}
+
+	// Uploads a changed image, a missing one is removed
+	void updateImage(Renderer *renderer, uint32_t id, const WidgetSnapshot::ImagePtr &image)
+	{
+		if (!image || !renderer->SetImage(id, image->width, image->height, image->pixels))
+			renderer->RemoveImage(id);
+	}
+
+	// What changed between two snapshots is laid out or recorded again, nothing else
+	void updateWidgets(const WidgetSnapshot &previous, const WidgetSnapshot &current, Renderer *renderer)
+	{
+		const WidgetSnapshot::TaskbarEntry noEntry;
+		for (uint32_t slot = 0; slot < std::max(previous.taskbar.size(), current.taskbar.size()); slot++) {
+			const auto &before = slot < previous.taskbar.size() ? previous.taskbar[slot] : noEntry;
+			const auto &after = slot < current.taskbar.size() ? current.taskbar[slot] : noEntry;
+			if (before.announced != after.announced)
+				layoutTaskbarEntry(renderer, current, slot);
+			else if (before != after)
+				renderer->InvalidateRegion(taskbarFirstRegion + slot);
+		}
+		// Thumbnails are a few KB, one upload per capture while a preview is open; it waits for the frames in flight,
+		// so no frame samples a half-written one
+		if (previous.preview != current.preview) {
+			updateImage(renderer, previewImage, current.preview);
+			renderer->InvalidateRegion(taskbarFirstRegion + previous.previewSlot);
+			renderer->InvalidateRegion(taskbarFirstRegion + current.previewSlot);
+		}
+
+		if (current.hasNetwork && (previous.networkUp != current.networkUp || previous.rxRate != current.rxRate || previous.txRate != current.txRate))
+			renderer->InvalidateRegion(networkRegion);
+
+		const WidgetSnapshot::TrayItem noItem;
+		for (uint32_t slot = 0; slot < std::max(previous.tray.size(), current.tray.size()); slot++) {
+			const auto &before = slot < previous.tray.size() ? previous.tray[slot] : noItem;
+			const auto &after = slot < current.tray.size() ? current.tray[slot] : noItem;
+			// A new size invalidates the layout, which places every item again
+			if (before.icon != after.icon)
+				updateImage(renderer, slot, after.icon);
+			if (before.announced != after.announced)
+				layoutTrayItem(renderer, current, slot);
+			else if (before != after)
+				renderer->InvalidateRegion(trayFirstRegion + slot);
+		}
+
+		if (current.hasMedia) {
+			// Covers are already scaled to the bar's height, so this is one small upload per track
+			if (previous.mediaArt != current.mediaArt)
+				updateImage(renderer, mediaArtImage, current.mediaArt);
+			if (previous.hasPlayer != current.hasPlayer)
+				layoutMedia(renderer, current);
+			else if (previous.playing != current.playing || previous.progress != current.progress || previous.mediaArt != current.mediaArt)
+				renderer->InvalidateRegion(mediaRegion);
+		}
+
+		// A text of the same size is updated in place and the recorded region draws it with the next frame, only one
+		// that appears, disappears or changes its width moves the others
+		bool labelsMoved = false;
+		for (uint32_t slot = 0; slot < std::max(previous.labels.size(), current.labels.size()); slot++) {
+			const auto &before = slot < previous.labels.size() ? previous.labels[slot] : nullptr;
+			const auto &after = slot < current.labels.size() ? current.labels[slot] : nullptr;
+			if (before == after)
+				continue;
+			updateImage(renderer, labelFirstImage + slot, after);
+			if (!before || !after || before->width != after->width || before->height != after->height)
+				labelsMoved = true;
+		}
+		if (labelsMoved)
+			layoutLabels(renderer, current);
+	}
+}
 
 int main(int argc, char *argv[]) {
 	auto parser = argparse::ArgumentParser(argc, argv).add_help(false);
 
 	parser.add_argument("--help", "-h").action("help").help("show help and exit");
 	parser.add_argument("--version", "-v").action("version").version("1.0");
+	parser.add_argument("--stats").action("store_true").help("print frame timings on exit");
+	parser.add_argument("--frames-in-flight").metavar("COUNT").help("frames recorded ahead of the GPU: 1 for the lowest latency, 2 for throughput (default)");
+	parser.add_argument("--legacy-vulkan").action("store_true").help("render with render passes and fences even if the device has Vulkan 1.3");
+	parser.add_argument("--socket").metavar("PATH").help("path of the control socket (default: $XDG_RUNTIME_DIR/ncbar-$WAYLAND_DISPLAY.sock)");
+	parser.add_argument("--no-ipc").action("store_true").help("don't open the control socket");
+	parser.add_argument("--snapshot").metavar("PATH").help("file of the last frame, shown at startup until the first one is rendered (default: $XDG_CACHE_HOME/ncbar-$WAYLAND_DISPLAY.frame)");
+	parser.add_argument("--no-snapshot").action("store_true").help("neither show nor save the last frame");
+	parser.add_argument("--clock-format").metavar("FORMAT").help("strftime format of clock.time (default: %H:%M)");
+	parser.add_argument("--date-format").metavar("FORMAT").help("strftime format of clock.date (default: %a %d %b)");
+	parser.add_argument("--text").metavar("NAME=TEMPLATE").action("append").help("publish text.NAME from other keys, e.g. \"{cpu:>3} {mem_used:.1f}G\" (can be given more than once)");
+	parser.add_argument("--script").metavar("NAME[:INTERVAL[:TIMEOUT]]=COMMAND").action("append").help("publish the first line of COMMAND as script.NAME every INTERVAL seconds (default: 10), or every line it prints with an INTERVAL of tail (can be given more than once)");
+	parser.add_argument("--max-scripts").metavar("COUNT").help("interval scripts that may run at once (default: 4)");
+	parser.add_argument("--trace").metavar("PATH").help("record a trace of the whole run into PATH in the Chrome trace format (SIGUSR1 dumps the last seconds at any time)");
+	parser.add_argument("--replace").action("store_true").help("take over the state of the running instance and replace it without a gap");
+	parser.add_argument("--benchmark").metavar("FRAMES").help("render FRAMES frames, print frame timings and exit");
+	parser.add_argument("--expect-no-allocations").action("store_true").help("with --benchmark, fail if a frame allocates after the warmup (needs a build with NCBAR_TRACK_ALLOCATIONS)");
 
 	const auto args = parser.parse_args();
 
-	auto core = Core::Create();
+	const bool printStats = args.get<bool>("stats");
+	const uint64_t benchmarkFrames = args.exists("benchmark") ? args.get<uint64_t>("benchmark") : 0;
+	const bool expectNoAllocations = args.get<bool>("expect-no-allocations");
+	if (expectNoAllocations && (!benchmarkFrames || !AllocationCounter::enabled)) {
+		NCBAR_LOG_ERROR << "--expect-no-allocations needs --benchmark and a build with NCBAR_TRACK_ALLOCATIONS";
+		return 1;
+	}
+
+	const std::string tracePath = args.exists("trace") ? args.get<std::string>("trace") : std::string();
+	if (!tracePath.empty() && !Trace::enabled) {
+		NCBAR_LOG_ERROR << "--trace needs a build with NCBAR_TRACING";
+		return 1;
+	}
+
+	std::signal(SIGINT, onStopSignal);
+	std::signal(SIGTERM, onStopSignal);
+	if (Trace::enabled) {
+		Trace::SetThreadName("main");
+		std::signal(SIGUSR1, onTraceDumpSignal);
+	}
+
+	Settings settings;
+	if (args.exists("frames-in-flight"))
+		settings.framesInFlight = args.get<uint32_t>("frames-in-flight");
+	settings.vulkan13 = !args.get<bool>("legacy-vulkan");
+	if (args.exists("socket"))
+		settings.ipcSocketPath = args.get<std::string>("socket");
+	settings.ipcEnabled = !args.get<bool>("no-ipc");
+	if (args.exists("snapshot"))
+		settings.snapshotPath = args.get<std::string>("snapshot");
+	settings.snapshotEnabled = !args.get<bool>("no-snapshot");
+	if (args.exists("clock-format"))
+		settings.clockFormat = args.get<std::string>("clock-format");
+	if (args.exists("date-format"))
+		settings.dateFormat = args.get<std::string>("date-format");
+	if (args.exists("max-scripts"))
+		settings.maxRunningScripts = args.get<uint32_t>("max-scripts");
+	if (settings.framesInFlight < 1 || settings.framesInFlight > 3) {
+		NCBAR_LOG_ERROR << "Frames in flight must be 1, 2 or 3";
+		return 1;
+	}
+
+	auto core = Core::Create(settings);
 	if (!core) {
-		std::cerr << "Failed to create wayland core" << std::endl;
+		NCBAR_LOG_ERROR << "Failed to create wayland core";
 		return 1;
 	}
-	auto window1 = Window::Create(core);
+	// Warm state from the running instance, which stays on screen until our first frame is there
+	Handoff::Ptr handoff;
+	if (args.get<bool>("replace")) {
+		handoff = Handoff::Create(core, settings.ipcSocketPath);
+		if (!handoff)
+			NCBAR_LOG_WARNING << "Nothing to replace, starting cold";
+	}
+
+	// Without a previous instance on screen, the last frame of the previous run is shown until the first one is
+	// rendered, and the values scripts pushed come back with it
+	StartupSnapshot::Ptr snapshot;
+	if (!handoff && settings.snapshotEnabled) {
+		snapshot = StartupSnapshot::Create(settings.snapshotPath);
+		if (snapshot && !Handoff::Restore(*core, snapshot->GetState()))
+			NCBAR_LOG_WARNING << "Snapshot: Failed to restore the state";
+	}
+	// Module values of the previous instance are shown until the modules publish theirs, the ones they don't are
+	// emptied after a while
+	std::chrono::steady_clock::time_point provisionalDeadline = {};
+	if (handoff || snapshot)
+		provisionalDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(Handoff::provisionalTimeout);
+
+	// Written by the render thread until it stops, declared before the window so they outlive it
+	uint64_t renderedFrames = 0;
+	uint64_t steadyAllocations = 0;
+	uint64_t steadyFramesWithAllocations = 0;
+	uint64_t maxFrameAllocations = 0;
+	uint64_t frameAllocationsStart = 0;
+	std::vector<Trace::Event> traceEvents;
+	uint64_t lostTraceEvents = 0;
+	Trace::Stream traceStream;
+	if (!tracePath.empty()) {
+		if (!traceStream.Open(tracePath)) {
+			NCBAR_LOG_ERROR << "Trace: Failed to open " << tracePath;
+			return 1;
+		}
+		traceEvents.reserve(traceFlushEvents);
+	}
+	// Drained by the render thread after every frame and by this one after every event, so only a thread recording more
+	// than a ring holds in between loses events of a trace of the whole run. Appended to the file in batches, the mutex
+	// guards the events and the stream
+	std::mutex traceMutex;
+	auto drainTrace = [&]() {
+		std::lock_guard lock(traceMutex);
+		lostTraceEvents += Trace::CollectNew(traceEvents);
+		if (traceEvents.size() < traceFlushEvents)
+			return;
+		NCBAR_TRACE_SCOPE("loop", "Trace::Stream::Append");
+		if (!traceStream.Append(traceEvents))
+			NCBAR_LOG_ERROR << "Trace: Failed to write " << tracePath;
+		traceEvents.clear();
+	};
+	// Before the modules, so the snapshot is on screen while they start and Vulkan is initialized
+	auto window1 = Window::Create(core, snapshot.get());
 	if (!window1) {
-		std::cerr << "Window1 creation failed" << std::endl;
+		NCBAR_LOG_ERROR << "Window1 creation failed";
 		return 1;
 	}
+	snapshot.reset();
 
-	auto startTime = std::chrono::high_resolution_clock::now();
-	window1->SetOnPresent([appCore = core, startTime](uint32_t frameIndex, Renderer *renderer)->bool {
-		auto now = std::chrono::high_resolution_clock::now();
-		auto elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(now - startTime).count();
-		(void)elapsedTime;
-		Window::Ptr window = renderer->GetWindow();
-		if (!window)
-			return false;
-
-		VkClearValue clearColor = { 0.0f, 0.0f, 0.0f, 0.0f };
-		VkRenderPassBeginInfo renderPassBeginInfo = {
-			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-			.pNext = nullptr,
-			.renderPass = renderer->GetRenderPass(),
-			.framebuffer = renderer->GetCurrentFrameFramebuffer(frameIndex),
-			.renderArea = {
-				.offset = VkOffset2D{ .x = 0, .y = 0 },
-				.extent = VkExtent2D{ .width = static_cast<uint32_t>(window->GetWidth()), .height = static_cast<uint32_t>(window->GetHeight()) }
-			},
-			.clearValueCount = 1,
-			.pClearValues = &clearColor
-		};
+	// Optional, the bar works without it where netlink isn't available
+	auto network = Network::Create(core);
+	if (!network)
+		NCBAR_LOG_WARNING << "Network module is disabled";
+
+	// Every output reads the same keys, so one timer serves them all
+	auto clock = Clock::Create(core);
+	if (clock) {
+		clock->AddFormat("clock.time", settings.clockFormat);
+		clock->AddFormat("clock.date", settings.dateFormat);
+	}
+	else
+		NCBAR_LOG_WARNING << "Clock module is disabled";
+
+	auto devices = Devices::Create(core);
+	if (!devices)
+		NCBAR_LOG_WARNING << "Devices module is disabled";
+
+	// Also optional, there's no session bus outside of a desktop session
+	auto bus = Bus::Create(core);
+	Tray::Ptr tray;
+	if (bus)
+		tray = Tray::Create(core, bus);
+	if (!tray)
+		NCBAR_LOG_WARNING << "Tray module is disabled";
+	Media::Ptr media;
+	if (bus)
+		media = Media::Create(core, bus);
+	if (!media)
+		NCBAR_LOG_WARNING << "Media module is disabled";
 
-		vkCmdBeginRenderPass(renderer->GetCurrentFrameCommandBuffer(frameIndex), &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-		vkCmdEndRenderPass(renderer->GetCurrentFrameCommandBuffer(frameIndex));
+	// Needs wlr-screencopy, captures nothing until an entry is hovered
+	auto previews = Previews::Create(core);
+	if (!previews)
+		NCBAR_LOG_WARNING << "Previews module is disabled";
 
-		return true;
+	auto scripts = Scripts::Create(core, settings.maxRunningScripts);
+	if (!scripts)
+		NCBAR_LOG_WARNING << "Scripts module is disabled";
+	else if (args.exists("script")) {
+		for (const auto &script : args.get<std::vector<std::string>>("script")) {
+			std::string name;
+			std::string command;
+			Scripts::Options options;
+			if (!Scripts::Parse(script, name, command, options)) {
+				NCBAR_LOG_ERROR << "--script needs NAME[:INTERVAL[:TIMEOUT]]=COMMAND, got \"" << script << "\"";
+				return 1;
+			}
+			if (!scripts->Add(name, command, options))
+				return 1;
+		}
+	}
+
+	// Added after the modules, so the first texts already have their values. Each one is drawn as a label
+	auto textWidgets = TextWidgets::Create(core);
+	std::vector<std::string> labelKeys;
+	if (args.exists("text")) {
+		for (const auto &text : args.get<std::vector<std::string>>("text")) {
+			const auto separator = text.find('=');
+			if (separator == std::string::npos) {
+				NCBAR_LOG_ERROR << "--text needs NAME=TEMPLATE, got \"" << text << "\"";
+				return 1;
+			}
+			if (!textWidgets->Add(std::string_view(text).substr(0, separator), std::string_view(text).substr(separator + 1)))
+				return 1;
+			labelKeys.push_back(std::string(TextWidgets::keyPrefix).append(std::string_view(text).substr(0, separator)));
+		}
+	}
+	// The clock ends the row, its labels change only when the store gets a new time or date
+	if (clock) {
+		labelKeys.emplace_back("clock.date");
+		labelKeys.emplace_back("clock.time");
+	}
+
+	window1->SetOnLayout([](VkExtent2D extent, Renderer *renderer) {
+		// Background
+		renderer->SetRegion(0, VkRect2D{ .offset = VkOffset2D{ .x = 0, .y = 0 }, .extent = extent }, [](VkCommandBuffer commandBuffer, const VkRect2D &area, Renderer *renderer) {
+			(void)renderer;
+			clearArea(commandBuffer, area, VkClearColorValue{ .float32 = { 0.09f, 0.09f, 0.09f, 0.9f } });
+		});
+		const auto &widgets = drawnWidgets(renderer);
+		for (uint32_t slot = 0; slot < widgets.taskbar.size(); slot++)
+			layoutTaskbarEntry(renderer, widgets, slot);
+		if (widgets.hasNetwork)
+			layoutNetwork(renderer);
+		for (uint32_t slot = 0; slot < widgets.tray.size(); slot++)
+			layoutTrayItem(renderer, widgets, slot);
+		if (widgets.hasMedia)
+			layoutMedia(renderer, widgets);
+		layoutLabels(renderer, widgets);
+	});
+	window1->SetOnWidgets(updateWidgets);
+	window1->SetOnResize([weakWindow = std::weak_ptr<Window>(window1), &widgetStore = core->GetWidgetStore(), labelKeys, network = network.get(), tray = tray.get(), media = media.get(), previews = previews.get()](VkExtent2D extent, Scale scale) {
+		if (auto window = weakWindow.lock(); window && !labelKeys.empty())
+			copyLabels(window->EditWidgets(), widgetStore, labelKeys, scale);
+		if (previews)
+			previews->SetThumbnailHeight(scale.ToDevice(taskbarEntryHeight - 2 * previewPadding));
+		if (network)
+			updateNetworkSize(network, extent, scale);
+		if (tray)
+			tray->SetIconSize(scale.ToDevice(trayIconSize));
+		if (media)
+			updateMediaSize(media, extent, scale);
 	});
 
-	while (!window1->IsGoingToClose()) {
-		if (!window1->Render())
-			return 1;
+	// The modules as they are now, then every change of theirs
+	{
+		auto &widgets = window1->EditWidgets();
+		if (auto taskbar = core->GetTaskbar()) {
+			for (uint32_t slot = 0; slot < taskbar->GetSlotsCount(); slot++)
+				copyTaskbarEntry(widgets, taskbar, slot);
+		}
+		if (network)
+			copyNetwork(widgets, network.get());
+		if (tray) {
+			for (uint32_t slot = 0; slot < tray->GetSlotsCount(); slot++)
+				copyTrayItem(widgets, tray.get(), slot, true);
+		}
+		if (media)
+			copyMedia(widgets, media.get());
+		copyLabels(widgets, core->GetWidgetStore(), labelKeys, window1->GetDrawnScale());
+	}
+	if (auto taskbar = core->GetTaskbar()) {
+		// Weak, the core outlives the window and must not keep it alive
+		taskbar->SetOnChange([weakWindow = std::weak_ptr<Window>(window1), taskbar](uint32_t slot, uint32_t changes) {
+			(void)changes;
+			if (auto window = weakWindow.lock())
+				copyTaskbarEntry(window->EditWidgets(), taskbar, slot);
+		});
+	}
+
+	if (network) {
+		network->SetOnChange([weakWindow = std::weak_ptr<Window>(window1), network = network.get()](uint32_t changes) {
+			(void)changes;
+			if (auto window = weakWindow.lock())
+				copyNetwork(window->EditWidgets(), network);
+		});
+	}
+
+	if (tray) {
+		tray->SetOnChange([weakWindow = std::weak_ptr<Window>(window1), tray = tray.get()](uint32_t slot, uint32_t changes) {
+			if (auto window = weakWindow.lock())
+				copyTrayItem(window->EditWidgets(), tray, slot, (changes & Tray::ChangedIcon) != 0);
+		});
+	}
+
+	if (media) {
+		media->SetOnChange([weakWindow = std::weak_ptr<Window>(window1), media = media.get()](uint32_t changes) {
+			auto window = weakWindow.lock();
+			if (!window)
+				return;
+			copyMedia(window->EditWidgets(), media);
+			if (changes & Media::ChangedPlayer)
+				updateMediaSize(media, window->GetDrawnExtent(), window->GetDrawnScale());
+		});
+	}
+
+	if (!labelKeys.empty()) {
+		core->GetWidgetStore().Subscribe([weakWindow = std::weak_ptr<Window>(window1), labelKeys](std::string_view key, std::string_view value) {
+			const auto it = std::find(labelKeys.begin(), labelKeys.end(), key);
+			if (it == labelKeys.end())
+				return;
+			if (auto window = weakWindow.lock())
+				copyLabel(window->EditWidgets(), static_cast<uint32_t>(it - labelKeys.begin()), value, window->GetDrawnScale());
+		});
+	}
+
+	if (previews) {
+		previews->SetOnChange([weakWindow = std::weak_ptr<Window>(window1), previews = previews.get()](wl_output *output) {
+			auto window = weakWindow.lock();
+			if (window && output == previews->GetOpenOutput())
+				copyPreview(window->EditWidgets(), previews);
+		});
+	}
+
+	window1->SetOnInput([weakWindow = std::weak_ptr<Window>(window1), appCore = core, tray = tray.get(), media = media.get(), previews = previews.get()](const InputEvent &event) {
+		if (auto window = weakWindow.lock())
+			handleInput(event, appCore.get(), window.get(), tray, media, previews);
+	});
+
+	// A benchmark draws every frame the compositor allows, the bar otherwise only draws when something changed
+	window1->SetContinuous(benchmarkFrames != 0);
+	frameAllocationsStart = AllocationCounter::GetCount();
+	window1->SetOnFrame([&]() -> bool {
+		if (traceStream.IsOpen())
+			drainTrace();
+		if (!benchmarkFrames)
+			return true;
+		// Of every thread, the main one handles the events that the frame shows
+		const uint64_t allocations = AllocationCounter::GetCount();
+		const uint64_t frameAllocations = allocations - frameAllocationsStart;
+		frameAllocationsStart = allocations;
+		if (renderedFrames >= benchmarkWarmupFrames && frameAllocations) {
+			steadyAllocations += frameAllocations;
+			steadyFramesWithAllocations++;
+			maxFrameAllocations = std::max(maxFrameAllocations, frameAllocations);
+		}
+		return ++renderedFrames < benchmarkFrames;
+	});
+	window1->Start();
 
-		// wl_display_dispatch(core->GetDisplay());
+	if (handoff) {
+		window1->WaitForFirstFrame();
+		if (window1->HasFailed())
+			return 1;
+		// Make sure the compositor has our frame before the previous instance takes its surfaces down
 		wl_display_roundtrip(core->GetDisplay());
+		if (!handoff->Finish())
+			return 1;
+		handoff.reset();
+	}
+
+	// Opened after the handoff, the previous instance holds the socket until it exits
+	IpcServer::Ptr ipcServer;
+	if (settings.ipcEnabled) {
+		ipcServer = IpcServer::Create(core, settings.ipcSocketPath);
+		if (!ipcServer) {
+			NCBAR_LOG_ERROR << "Failed to create control socket";
+			return 1;
+		}
+	}
+
+	// The render thread draws on its own, this one sleeps until an event comes and hands over what it changed
+	while (window1->IsRendering() && !window1->IsGoingToClose() && !stopRequested && !(ipcServer && ipcServer->IsQuitRequested())) {
+		int timeout = -1;
+		if (provisionalDeadline != std::chrono::steady_clock::time_point()) {
+			const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(provisionalDeadline - std::chrono::steady_clock::now()).count();
+			timeout = static_cast<int>(std::max<decltype(remaining)>(remaining, 0));
+		}
+		if (!core->Dispatch(timeout))
+			return 1;
+		if (!timeout) {
+			core->GetWidgetStore().ClearProvisional();
+			provisionalDeadline = {};
+		}
+		if (!window1->Publish())
+			return 1;
+		if (traceStream.IsOpen())
+			drainTrace();
+		if (traceDumpRequested) {
+			traceDumpRequested = 0;
+			dumpRecentTrace();
+		}
+	}
+	window1->Stop();
+	if (window1->HasFailed())
+		return 1;
+
+	if (benchmarkFrames) {
+		// The report comes after what the run logged
+		Log::Flush();
+		std::cout << "Benchmark: " << renderedFrames << " frames, " << settings.framesInFlight << " in flight, "
+			<< window1->GetRenderer()->GetRecordedRegionsCount() << " region recordings" << std::endl;
+		if (AllocationCounter::enabled) {
+			std::cout << "Allocations after " << benchmarkWarmupFrames << " warmup frames: " << steadyAllocations << " in "
+				<< steadyFramesWithAllocations << " frames, at most " << maxFrameAllocations << " per frame" << std::endl;
+		}
+	}
+	if (!tracePath.empty()) {
+		lostTraceEvents += Trace::CollectNew(traceEvents);
+		if (!traceStream.Append(traceEvents) || !traceStream.Close()) {
+			NCBAR_LOG_ERROR << "Trace: Failed to write " << tracePath;
+			return 1;
+		}
+		if (lostTraceEvents)
+			NCBAR_LOG_INFO << "Trace: Wrote " << traceStream.GetEventsCount() << " events to " << tracePath << ", " << lostTraceEvents << " were lost";
+		else
+			NCBAR_LOG_INFO << "Trace: Wrote " << traceStream.GetEventsCount() << " events to " << tracePath;
+	}
+	if (printStats || benchmarkFrames)
+		window1->GetFrameStats().Dump(std::cout);
+	// A hidden window has no frame to capture, the snapshot of an earlier exit stays then
+	if (settings.snapshotEnabled && !benchmarkFrames && window1->IsVisible()) {
+		if (!StartupSnapshot::Save(settings.snapshotPath, *window1, *core))
+			NCBAR_LOG_DEBUG << "Snapshot: No frame to save";
+	}
+	if (expectNoAllocations && steadyAllocations) {
+		NCBAR_LOG_ERROR << "Steady state frames allocated " << steadyAllocations << " times";
+		return 1;
 	}
 
 	return 0;
@@ -0,0 +1,626 @@
+#include "media.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "widgetStore.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+	constexpr const char *playerPrefix = "org.mpris.MediaPlayer2.";
+	constexpr const char *playerPath = "/org/mpris/MediaPlayer2";
+	constexpr const char *playerInterface = "org.mpris.MediaPlayer2.Player";
+	constexpr const char *propertiesInterface = "org.freedesktop.DBus.Properties";
+	constexpr const char *busName = "org.freedesktop.DBus";
+	constexpr const char *busPath = "/org/freedesktop/DBus";
+	// Some players report Rate 0 or nothing while stopped, a bar that would move faster than this is redrawn at it
+	constexpr uint64_t minProgressInterval = 16'000'000;
+
+	uint64_t now()
+	{
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return static_cast<uint64_t>(time.tv_sec) * 1'000'000'000 + static_cast<uint64_t>(time.tv_nsec);
+	}
+
+	std::string readString(DBusMessageIter *variant)
+	{
+		const int type = dbus_message_iter_get_arg_type(variant);
+		if (type != DBUS_TYPE_STRING && type != DBUS_TYPE_OBJECT_PATH)
+			return {};
+		const char *value = nullptr;
+		dbus_message_iter_get_basic(variant, &value);
+		return value ? value : "";
+	}
+
+	// The spec says x, players send whatever integer they like
+	int64_t readInteger(DBusMessageIter *variant)
+	{
+		DBusBasicValue value;
+		switch (dbus_message_iter_get_arg_type(variant)) {
+		case DBUS_TYPE_INT64:
+			dbus_message_iter_get_basic(variant, &value);
+			return value.i64;
+		case DBUS_TYPE_UINT64:
+			dbus_message_iter_get_basic(variant, &value);
+			return static_cast<int64_t>(value.u64);
+		case DBUS_TYPE_INT32:
+			dbus_message_iter_get_basic(variant, &value);
+			return value.i32;
+		case DBUS_TYPE_UINT32:
+			dbus_message_iter_get_basic(variant, &value);
+			return value.u32;
+		case DBUS_TYPE_DOUBLE:
+			dbus_message_iter_get_basic(variant, &value);
+			return static_cast<int64_t>(value.dbl);
+		default:
+			return 0;
+		}
+	}
+
+	double readDouble(DBusMessageIter *variant)
+	{
+		if (dbus_message_iter_get_arg_type(variant) != DBUS_TYPE_DOUBLE)
+			return static_cast<double>(readInteger(variant));
+		double value = 0.0;
+		dbus_message_iter_get_basic(variant, &value);
+		return value;
+	}
+
+	// xesam:artist is a list, joined with commas
+	std::string readStrings(DBusMessageIter *variant)
+	{
+		if (dbus_message_iter_get_arg_type(variant) != DBUS_TYPE_ARRAY)
+			return readString(variant);
+		std::string joined;
+		DBusMessageIter array;
+		dbus_message_iter_recurse(variant, &array);
+		while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING) {
+			if (!joined.empty())
+				joined.append(", ");
+			joined.append(readString(&array));
+			dbus_message_iter_next(&array);
+		}
+		return joined;
+	}
+
+	// file:///home/me/My%20Music/cover.jpg to /home/me/My Music/cover.jpg, empty for anything not local
+	std::string localPath(std::string_view url)
+	{
+		constexpr std::string_view scheme = "file://";
+		if (!url.starts_with(scheme))
+			return {};
+		url.remove_prefix(scheme.size());
+		std::string path;
+		path.reserve(url.size());
+		auto hex = [](char digit) -> int {
+			if (digit >= '0' && digit <= '9')
+				return digit - '0';
+			if (digit >= 'a' && digit <= 'f')
+				return digit - 'a' + 10;
+			if (digit >= 'A' && digit <= 'F')
+				return digit - 'A' + 10;
+			return -1;
+		};
+		for (std::size_t i = 0; i < url.size(); i++) {
+			if (url[i] == '%' && i + 2 < url.size() && hex(url[i + 1]) >= 0 && hex(url[i + 2]) >= 0) {
+				path.push_back(static_cast<char>(hex(url[i + 1]) * 16 + hex(url[i + 2])));
+				i += 2;
+			}
+			else
+				path.push_back(url[i]);
+		}
+		return path;
+	}
+}
+
+Media::~Media()
+{
+	if (filterId) {
+		bus->RemoveFilter(filterId);
+		filterId = 0;
+	}
+	if (timerFd >= 0) {
+		core->RemoveFd(timerFd);
+		close(timerFd);
+		timerFd = -1;
+	}
+}
+
+bool Media::Init(CorePtr core, Bus::Ptr bus)
+{
+	this->core = core;
+	this->bus = bus;
+	if (!bus) {
+		NCBAR_LOG_ERROR << "Media: Failed to get the session bus";
+		return false;
+	}
+
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0) {
+		NCBAR_LOG_ERROR << "Media: Failed to create timer: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(timerFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnTimer();
+	}))
+		return false;
+
+	// Without it there are no covers, the rest still works
+	decoder = ImageDecoder::Create(core);
+	if (decoder) {
+		decoder->SetOnDecoded([this](const std::string &path, uint32_t height, ImageDecoder::ImagePtr image) {
+			this->OnDecoded(path, height, std::move(image));
+		});
+	}
+
+	filterId = bus->AddFilter([this](DBusMessage *message) {
+		return this->OnMessage(message);
+	});
+	bus->AddMatch("type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0namespace='org.mpris.MediaPlayer2'");
+	bus->AddMatch(std::string("type='signal',interface='") + propertiesInterface + "',member='PropertiesChanged',path='" + playerPath + "',arg0='" + playerInterface + "'");
+	bus->AddMatch(std::string("type='signal',interface='") + playerInterface + "',member='Seeked',path='" + playerPath + "'");
+
+	// Players that run already
+	DBusMessage *message = dbus_message_new_method_call(busName, busPath, busName, "ListNames");
+	if (!message)
+		return false;
+	bus->Call(message, [this, bus](DBusMessage *reply) {
+		DBusMessageIter iter, array;
+		if (!reply || !dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+			return;
+		dbus_message_iter_recurse(&iter, &array);
+		for (; dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING; dbus_message_iter_next(&array)) {
+			auto name = readString(&array);
+			if (!name.starts_with(playerPrefix))
+				continue;
+			DBusMessage *ownerMessage = dbus_message_new_method_call(busName, busPath, busName, "GetNameOwner");
+			if (!ownerMessage)
+				continue;
+			const char *nameValue = name.c_str();
+			dbus_message_append_args(ownerMessage, DBUS_TYPE_STRING, &nameValue, DBUS_TYPE_INVALID);
+			bus->Call(ownerMessage, [this, name](DBusMessage *ownerReply) {
+				const char *owner = nullptr;
+				if (ownerReply && dbus_message_get_args(ownerReply, nullptr, DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID))
+					AddPlayer(name, owner);
+			});
+		}
+	});
+	return true;
+}
+
+void Media::SetOnChange(OnChangeCallbackType onChange)
+{
+	this->onChange = onChange;
+}
+
+void Media::SetArtHeight(uint32_t height)
+{
+	if (height == artHeight)
+		return;
+	artHeight = height;
+	// The cover of the current track is looked up again at the new size
+	artPath.clear();
+	uint32_t changes = ChangedNothing;
+	UpdateArt(changes);
+	if (changes != ChangedNothing && onChange)
+		onChange(changes);
+}
+
+void Media::SetProgressWidth(uint32_t width)
+{
+	if (width == progressWidth)
+		return;
+	progressWidth = width;
+	ArmProgressTimer();
+}
+
+bool Media::IsPlaying() const
+{
+	return active >= 0 && players[active].status == "Playing";
+}
+
+double Media::GetProgress() const
+{
+	if (active < 0 || players[active].length <= 0)
+		return 0.0;
+	const auto &player = players[active];
+	return static_cast<double>(GetPosition(player)) / static_cast<double>(player.length);
+}
+
+void Media::PlayPause()
+{
+	CallPlayer("PlayPause");
+}
+
+void Media::Next()
+{
+	CallPlayer("Next");
+}
+
+void Media::Previous()
+{
+	CallPlayer("Previous");
+}
+
+void Media::AddPlayer(const std::string &busName, const std::string &owner)
+{
+	const auto index = FindPlayer(busName);
+	if (index >= 0)
+		players[index].owner = owner;
+	else {
+		Player player;
+		player.busName = busName;
+		player.owner = owner;
+		player.lastChange = ++changeCounter;
+		players.push_back(std::move(player));
+	}
+	FetchProperties(busName);
+}
+
+void Media::RemovePlayer(const std::string &busName)
+{
+	const auto index = FindPlayer(busName);
+	if (index < 0)
+		return;
+	players.erase(players.begin() + index);
+	Update(-1, ChangedNothing);
+}
+
+void Media::FetchProperties(const std::string &busName)
+{
+	DBusMessage *message = dbus_message_new_method_call(busName.c_str(), playerPath, propertiesInterface, "GetAll");
+	if (!message)
+		return;
+	const char *interface = playerInterface;
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID);
+	bus->Call(message, [this, busName](DBusMessage *reply) {
+		DBusMessageIter iter;
+		const auto index = FindPlayer(busName);
+		if (!reply || index < 0 || !dbus_message_iter_init(reply, &iter))
+			return;
+		const auto changes = ReadProperties(players[index], &iter);
+		Update(index, changes);
+	});
+}
+
+void Media::FetchPosition(const std::string &busName)
+{
+	DBusMessage *message = dbus_message_new_method_call(busName.c_str(), playerPath, propertiesInterface, "Get");
+	if (!message)
+		return;
+	const char *interface = playerInterface;
+	const char *property = "Position";
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+	bus->Call(message, [this, busName](DBusMessage *reply) {
+		DBusMessageIter iter, variant;
+		const auto index = FindPlayer(busName);
+		if (!reply || index < 0 || !dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+			return;
+		dbus_message_iter_recurse(&iter, &variant);
+		auto &player = players[index];
+		player.position = readInteger(&variant);
+		player.positionTime = now();
+		Update(index, ChangedProgress);
+	});
+}
+
+uint32_t Media::ReadProperties(Player &player, DBusMessageIter *dictionary)
+{
+	if (dbus_message_iter_get_arg_type(dictionary) != DBUS_TYPE_ARRAY)
+		return ChangedNothing;
+	uint32_t changes = ChangedNothing;
+	bool positionRead = false;
+	const uint64_t time = now();
+	// Re-anchored before the status or the rate change, so the interpolation doesn't jump
+	auto anchor = [this, &player, time]() {
+		player.position = GetPosition(player);
+		player.positionTime = time;
+	};
+
+	DBusMessageIter entries;
+	dbus_message_iter_recurse(dictionary, &entries);
+	for (; dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&entries)) {
+		DBusMessageIter entry, variant;
+		dbus_message_iter_recurse(&entries, &entry);
+		const auto key = readString(&entry);
+		dbus_message_iter_next(&entry);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+			continue;
+		dbus_message_iter_recurse(&entry, &variant);
+
+		if (key == "PlaybackStatus") {
+			auto status = readString(&variant);
+			if (status != player.status) {
+				anchor();
+				player.status = std::move(status);
+				changes |= ChangedStatus | ChangedProgress;
+			}
+		}
+		else if (key == "Rate") {
+			const double rate = readDouble(&variant);
+			if (rate != player.rate) {
+				anchor();
+				player.rate = rate;
+				changes |= ChangedProgress;
+			}
+		}
+		else if (key == "Position") {
+			player.position = readInteger(&variant);
+			player.positionTime = time;
+			positionRead = true;
+			changes |= ChangedProgress;
+		}
+		else if (key == "Metadata" && dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_ARRAY) {
+			std::string trackId, title, artist, album, artUrl;
+			int64_t length = 0;
+			DBusMessageIter metadata;
+			dbus_message_iter_recurse(&variant, &metadata);
+			for (; dbus_message_iter_get_arg_type(&metadata) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&metadata)) {
+				DBusMessageIter field, value;
+				dbus_message_iter_recurse(&metadata, &field);
+				const auto name = readString(&field);
+				dbus_message_iter_next(&field);
+				if (dbus_message_iter_get_arg_type(&field) != DBUS_TYPE_VARIANT)
+					continue;
+				dbus_message_iter_recurse(&field, &value);
+				if (name == "mpris:trackid")
+					trackId = readString(&value);
+				else if (name == "mpris:length")
+					length = readInteger(&value);
+				else if (name == "mpris:artUrl")
+					artUrl = readString(&value);
+				else if (name == "xesam:title")
+					title = readString(&value);
+				else if (name == "xesam:artist")
+					artist = readStrings(&value);
+				else if (name == "xesam:album")
+					album = readString(&value);
+			}
+			const bool newTrack = trackId != player.trackId || title != player.title;
+			if (newTrack || artist != player.artist || album != player.album || artUrl != player.artUrl || length != player.length) {
+				if (newTrack && !positionRead) {
+					// The real position comes with the reply to FetchPosition
+					player.position = 0;
+					player.positionTime = time;
+					FetchPosition(player.busName);
+				}
+				player.trackId = std::move(trackId);
+				player.title = std::move(title);
+				player.artist = std::move(artist);
+				player.album = std::move(album);
+				player.artUrl = std::move(artUrl);
+				player.length = length;
+				changes |= ChangedTrack | ChangedProgress;
+			}
+		}
+	}
+	// Seeks while paused aren't always signalled
+	if ((changes & ChangedStatus) && !positionRead)
+		FetchPosition(player.busName);
+	if (changes != ChangedNothing)
+		player.lastChange = ++changeCounter;
+	return changes;
+}
+
+int32_t Media::FindPlayer(const std::string &busName) const
+{
+	for (std::size_t i = 0; i < players.size(); i++) {
+		if (players[i].busName == busName)
+			return static_cast<int32_t>(i);
+	}
+	return -1;
+}
+
+int64_t Media::GetPosition(const Player &player) const
+{
+	int64_t position = player.position;
+	if (player.status == "Playing" && player.positionTime) {
+		const double elapsed = static_cast<double>(now() - player.positionTime) / 1000.0;
+		position += static_cast<int64_t>(elapsed * player.rate);
+	}
+	if (player.length > 0)
+		position = std::min(position, player.length);
+	return std::max<int64_t>(position, 0);
+}
+
+void Media::CallPlayer(const char *method)
+{
+	if (active < 0)
+		return;
+	DBusMessage *message = dbus_message_new_method_call(players[active].busName.c_str(), playerPath, playerInterface, method);
+	if (!message)
+		return;
+	dbus_message_set_no_reply(message, TRUE);
+	bus->Send(message);
+}
+
+bool Media::OnMessage(DBusMessage *message)
+{
+	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return false;
+
+	if (dbus_message_is_signal(message, busName, "NameOwnerChanged")) {
+		const char *name = nullptr, *oldOwner = nullptr, *newOwner = nullptr;
+		if (!dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID))
+			return false;
+		if (!std::string_view(name).starts_with(playerPrefix))
+			return false;
+		NCBAR_TRACE_SCOPE("source", "Media::OnNameOwnerChanged");
+		if (*newOwner)
+			AddPlayer(name, newOwner);
+		else
+			RemovePlayer(name);
+		return false;
+	}
+
+	const char *sender = dbus_message_get_sender(message);
+	const char *path = dbus_message_get_path(message);
+	if (!sender || !path || strcmp(path, playerPath) != 0)
+		return false;
+	const bool propertiesChanged = dbus_message_is_signal(message, propertiesInterface, "PropertiesChanged");
+	const bool seeked = dbus_message_is_signal(message, playerInterface, "Seeked");
+	if (!propertiesChanged && !seeked)
+		return false;
+	NCBAR_TRACE_SCOPE("source", "Media::OnSignal");
+
+	// A player may own more than one name, e.g. vlc and vlc.instance1234
+	for (std::size_t i = 0; i < players.size(); i++) {
+		auto &player = players[i];
+		if (player.owner != sender)
+			continue;
+		uint32_t changes = ChangedNothing;
+		DBusMessageIter iter;
+		if (!dbus_message_iter_init(message, &iter))
+			return false;
+		if (seeked) {
+			player.position = readInteger(&iter);
+			player.positionTime = now();
+			changes = ChangedProgress;
+		}
+		else {
+			// Interface name, then the changed and the invalidated properties
+			if (readString(&iter) != playerInterface || !dbus_message_iter_next(&iter))
+				continue;
+			changes = ReadProperties(player, &iter);
+			if (dbus_message_iter_next(&iter) && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY) {
+				DBusMessageIter invalidated;
+				dbus_message_iter_recurse(&iter, &invalidated);
+				if (dbus_message_iter_get_arg_type(&invalidated) == DBUS_TYPE_STRING)
+					FetchProperties(player.busName);
+			}
+		}
+		Update(static_cast<int32_t>(i), changes);
+	}
+	return false;
+}
+
+void Media::OnTimer()
+{
+	uint64_t expirations;
+	if (read(timerFd, &expirations, sizeof(expirations)) < 0)
+		return;
+	if (active < 0)
+		return;
+	ArmProgressTimer();
+	if (onChange)
+		onChange(ChangedProgress);
+}
+
+void Media::OnDecoded(const std::string &path, uint32_t height, ImageDecoder::ImagePtr image)
+{
+	// Failures are cached too, a broken cover isn't decoded again every time its track comes back
+	std::erase_if(artCache, [&path, height](const ArtEntry &entry) { return entry.path == path && entry.height == height; });
+	artCache.push_front(ArtEntry{ .path = path, .height = height, .image = image });
+	if (artCache.size() > artCacheCapacity)
+		artCache.pop_back();
+
+	if (path != artPath || height != artHeight)
+		return;
+	art = std::move(image);
+	if (onChange)
+		onChange(ChangedArt);
+}
+
+void Media::Update(int32_t index, uint32_t changes)
+{
+	// Playing beats paused, then the latest change wins
+	int32_t newActive = -1;
+	for (std::size_t i = 0; i < players.size(); i++) {
+		if (newActive < 0) {
+			newActive = static_cast<int32_t>(i);
+			continue;
+		}
+		const auto &player = players[i];
+		const auto &best = players[newActive];
+		const bool playing = player.status == "Playing";
+		const bool bestPlaying = best.status == "Playing";
+		if ((playing && !bestPlaying) || (playing == bestPlaying && player.lastChange > best.lastChange))
+			newActive = static_cast<int32_t>(i);
+	}
+	active = newActive;
+	const std::string newName = active >= 0 ? players[active].busName : std::string();
+	if (newName != activeName) {
+		activeName = newName;
+		changes = ChangedPlayer | ChangedStatus | ChangedTrack | ChangedProgress;
+	}
+	else if (index != active)
+		changes = ChangedNothing;
+
+	if (changes & (ChangedPlayer | ChangedTrack))
+		UpdateArt(changes);
+	if (changes & (ChangedPlayer | ChangedStatus | ChangedTrack))
+		Publish();
+	if (changes & ChangedProgress)
+		ArmProgressTimer();
+	if (changes != ChangedNothing && onChange)
+		onChange(changes);
+}
+
+void Media::UpdateArt(uint32_t &changes)
+{
+	const auto path = active >= 0 ? localPath(players[active].artUrl) : std::string();
+	if (path == artPath)
+		return;
+	artPath = path;
+	if (art) {
+		art = nullptr;
+		changes |= ChangedArt;
+	}
+	if (path.empty() || !artHeight || !decoder)
+		return;
+
+	auto it = std::find_if(artCache.begin(), artCache.end(), [this](const ArtEntry &entry) {
+		return entry.path == artPath && entry.height == artHeight;
+	});
+	if (it != artCache.end()) {
+		artCache.splice(artCache.begin(), artCache, it);
+		art = it->image;
+		changes |= ChangedArt;
+		return;
+	}
+	decoder->Decode(path, artHeight);
+}
+
+void Media::ArmProgressTimer()
+{
+	// Next time the fill crosses a pixel boundary of the bar
+	itimerspec timer = {};
+	if (active >= 0 && progressWidth && IsPlaying() && players[active].length > 0 && players[active].rate > 0.0) {
+		const auto &player = players[active];
+		const int64_t position = GetPosition(player);
+		const int64_t pixel = position * progressWidth / player.length;
+		const int64_t boundary = ((pixel + 1) * player.length + progressWidth - 1) / progressWidth;
+		if (boundary <= player.length) {
+			const auto delay = std::max(static_cast<uint64_t>(static_cast<double>(boundary - position) * 1000.0 / player.rate), minProgressInterval);
+			timer.it_value.tv_sec = static_cast<time_t>(delay / 1'000'000'000);
+			timer.it_value.tv_nsec = static_cast<long>(delay % 1'000'000'000);
+		}
+	}
+	if (timerfd_settime(timerFd, 0, &timer, nullptr) < 0)
+		NCBAR_LOG_ERROR << "Media: Failed to set timer: " << strerror(errno);
+}
+
+void Media::Publish()
+{
+	auto &widgetStore = core->GetWidgetStore();
+	if (active < 0) {
+		for (const auto key : { "media.player", "media.status", "media.title", "media.artist", "media.album", "media.art_url", "media.length" })
+			widgetStore.Set(key, {});
+		return;
+	}
+	const auto &player = players[active];
+	widgetStore.Set("media.player", std::string_view(player.busName).substr(std::strlen(playerPrefix)));
+	widgetStore.Set("media.status", player.status);
+	widgetStore.Set("media.title", player.title);
+	widgetStore.Set("media.artist", player.artist);
+	widgetStore.Set("media.album", player.album);
+	widgetStore.Set("media.art_url", player.artUrl);
+	widgetStore.Set("media.length", player.length > 0 ? std::to_string(player.length / 1'000'000) : std::string());
+}
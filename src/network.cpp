@@ -0,0 +1,623 @@
+#include "network.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "widgetStore.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <arpa/inet.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+	// Large enough for the biggest message batch the kernel sends in one dump
+	constexpr std::size_t receiveBufferSize = 64 * 1024;
+	// Notifications are dropped when the socket overflows, a burst of them (like a VPN going up) should fit
+	constexpr int socketBufferSize = 1024 * 1024;
+
+	uint64_t getMonotonicTime()
+	{
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return static_cast<uint64_t>(time.tv_sec) * 1'000'000'000 + static_cast<uint64_t>(time.tv_nsec);
+	}
+
+	// Attributes that follow a fixed header of `headerSize` bytes in a netlink message
+	template<typename Function>
+	void forEachAttribute(const nlmsghdr *message, std::size_t headerSize, Function &&function)
+	{
+		const std::size_t offset = NLMSG_SPACE(headerSize);
+		if (message->nlmsg_len < offset)
+			return;
+		const auto *data = reinterpret_cast<const char*>(message) + offset;
+		std::size_t size = message->nlmsg_len - offset;
+		while (size >= sizeof(rtattr)) {
+			const auto *attribute = reinterpret_cast<const rtattr*>(data);
+			if (attribute->rta_len < sizeof(rtattr) || attribute->rta_len > size)
+				return;
+			function(attribute->rta_type, std::string_view(static_cast<const char*>(RTA_DATA(attribute)), attribute->rta_len - RTA_LENGTH(0)));
+			const std::size_t next = std::min<std::size_t>(RTA_ALIGN(attribute->rta_len), size);
+			data += next;
+			size -= next;
+		}
+	}
+
+	template<typename T>
+	bool readAttribute(std::string_view payload, T &value)
+	{
+		if (payload.size() < sizeof(T))
+			return false;
+		// Attributes are 4-byte aligned only
+		std::memcpy(&value, payload.data(), sizeof(T));
+		return true;
+	}
+
+	// Without the terminating zero the kernel puts into strings
+	std::string_view stringAttribute(std::string_view payload)
+	{
+		return payload.substr(0, payload.find('\0'));
+	}
+
+	void appendNumber(std::string &string, uint64_t number)
+	{
+		char buffer[24];
+		auto result = std::to_chars(std::begin(buffer), std::end(buffer), number);
+		string.append(buffer, result.ptr);
+	}
+}
+
+Network::~Network()
+{
+	if (timerFd >= 0) {
+		core->RemoveFd(timerFd);
+		close(timerFd);
+		timerFd = -1;
+	}
+	if (netlinkFd >= 0) {
+		core->RemoveFd(netlinkFd);
+		close(netlinkFd);
+		netlinkFd = -1;
+	}
+}
+
+bool Network::Init(CorePtr core)
+{
+	this->core = core;
+
+	netlinkFd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (netlinkFd < 0) {
+		NCBAR_LOG_ERROR << "Network: Failed to create netlink socket: " << strerror(errno);
+		return false;
+	}
+	// Best effort, the default buffer still works and overflows are recovered with a dump
+	setsockopt(netlinkFd, SOL_SOCKET, SO_RCVBUF, &socketBufferSize, sizeof(socketBufferSize));
+	sockaddr_nl address = {};
+	address.nl_family = AF_NETLINK;
+	address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+	if (bind(netlinkFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+		NCBAR_LOG_ERROR << "Network: Failed to bind netlink socket: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(netlinkFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnReadable();
+	}))
+		return false;
+
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0) {
+		NCBAR_LOG_ERROR << "Network: Failed to create timer: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(timerFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnTimer();
+	}))
+		return false;
+
+	receiveBuffer.resize(receiveBufferSize);
+	// Links first, addresses and routes of an interface we don't know yet are dropped
+	RequestDumps(DumpLinks | DumpAddresses | DumpRoutes);
+	return true;
+}
+
+void Network::SetOnChange(OnChangeCallbackType onChange)
+{
+	this->onChange = onChange;
+}
+
+void Network::SetThroughputVisible(bool visible)
+{
+	if (visible == throughputVisible)
+		return;
+	throughputVisible = visible;
+
+	itimerspec timer = {};
+	if (visible) {
+		// The first dump right away only takes the counters, the rates come with the next one
+		timer.it_value.tv_nsec = 1;
+		timer.it_interval.tv_sec = throughputInterval / 1'000'000'000;
+		timer.it_interval.tv_nsec = throughputInterval % 1'000'000'000;
+	}
+	if (timerfd_settime(timerFd, 0, &timer, nullptr) < 0)
+		NCBAR_LOG_ERROR << "Network: Failed to set timer: " << strerror(errno);
+	if (visible)
+		return;
+
+	// Stale rates would look like a stalled link
+	sampleTime = 0;
+	rxRate = 0;
+	txRate = 0;
+	for (auto &[index, interface] : interfaces) {
+		interface.sampled = false;
+		interface.rxRate = 0;
+		interface.txRate = 0;
+		interface.dirty |= ChangedThroughput;
+	}
+	changes |= ChangedThroughput;
+	Publish();
+}
+
+int32_t Network::GetDefaultInterface() const
+{
+	const DefaultRoute *best = nullptr;
+	for (const auto &route : defaultRoutes) {
+		if (!best || std::pair(route.family != AF_INET, route.priority) < std::pair(best->family != AF_INET, best->priority))
+			best = &route;
+	}
+	return best ? best->interface : 0;
+}
+
+bool Network::IsDefaultInterfaceUp() const
+{
+	auto it = interfaces.find(GetDefaultInterface());
+	return it != interfaces.end() && it->second.up;
+}
+
+void Network::RequestDumps(uint32_t dumps)
+{
+	pendingDumps |= dumps;
+	SendNextDump();
+}
+
+bool Network::SendNextDump()
+{
+	if (runningDump || !pendingDumps)
+		return true;
+	const uint32_t dump = pendingDumps & -pendingDumps;
+	pendingDumps &= ~dump;
+
+	// Every request header starts with the family, zero (AF_UNSPEC) asks for all of them
+	struct {
+		nlmsghdr header;
+		ifinfomsg payload;
+	} request = {};
+	std::size_t payloadSize = 0;
+	switch (dump) {
+	case DumpLinks:
+		request.header.nlmsg_type = RTM_GETLINK;
+		payloadSize = sizeof(ifinfomsg);
+		break;
+	case DumpAddresses:
+		request.header.nlmsg_type = RTM_GETADDR;
+		payloadSize = sizeof(ifaddrmsg);
+		break;
+	case DumpRoutes:
+		request.header.nlmsg_type = RTM_GETROUTE;
+		payloadSize = sizeof(rtmsg);
+		break;
+	}
+	request.header.nlmsg_len = NLMSG_LENGTH(payloadSize);
+	request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.header.nlmsg_seq = ++dumpSequence;
+
+	sockaddr_nl kernel = {};
+	kernel.nl_family = AF_NETLINK;
+	if (sendto(netlinkFd, &request, request.header.nlmsg_len, 0, reinterpret_cast<sockaddr*>(&kernel), sizeof(kernel)) < 0) {
+		NCBAR_LOG_ERROR << "Network: Failed to request a dump: " << strerror(errno);
+		return false;
+	}
+	runningDump = dump;
+	dumpInterrupted = false;
+	generation++;
+	return true;
+}
+
+void Network::OnReadable()
+{
+	NCBAR_TRACE_SCOPE("source", "Network::OnReadable");
+	while (true) {
+		sockaddr_nl sender = {};
+		socklen_t senderSize = sizeof(sender);
+		ssize_t size = recvfrom(netlinkFd, receiveBuffer.data(), receiveBuffer.size(), MSG_TRUNC, reinterpret_cast<sockaddr*>(&sender), &senderSize);
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				// Notifications were lost, the state is read again from scratch
+				NCBAR_LOG_WARNING << "Network: Netlink socket overflowed, resynchronizing";
+				RequestDumps(DumpLinks | DumpAddresses | DumpRoutes);
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				NCBAR_LOG_ERROR << "Network: Failed to read netlink socket: " << strerror(errno);
+			break;
+		}
+		if (static_cast<std::size_t>(size) > receiveBuffer.size()) {
+			NCBAR_LOG_ERROR << "Network: Netlink message is too large: " << size << " bytes";
+			continue;
+		}
+		// Only the kernel is trusted
+		if (sender.nl_pid != 0)
+			continue;
+
+		const auto *data = receiveBuffer.data();
+		std::size_t remaining = static_cast<std::size_t>(size);
+		while (remaining >= sizeof(nlmsghdr)) {
+			const auto *message = reinterpret_cast<const nlmsghdr*>(data);
+			if (message->nlmsg_len < sizeof(nlmsghdr) || message->nlmsg_len > remaining)
+				break;
+			HandleMessage(message);
+			const std::size_t next = std::min<std::size_t>(NLMSG_ALIGN(message->nlmsg_len), remaining);
+			data += next;
+			remaining -= next;
+		}
+	}
+	Publish();
+}
+
+void Network::OnTimer()
+{
+	uint64_t expirations;
+	if (read(timerFd, &expirations, sizeof(expirations)) < 0)
+		return;
+	// A dump that is late still gives the right rates, they are divided by the real time between the samples
+	if ((runningDump | pendingDumps) & DumpLinks)
+		return;
+	RequestDumps(DumpLinks);
+}
+
+void Network::HandleMessage(const nlmsghdr *message)
+{
+	const bool ofDump = runningDump && message->nlmsg_seq == dumpSequence;
+	if (ofDump && (message->nlmsg_flags & NLM_F_DUMP_INTR))
+		dumpInterrupted = true;
+
+	switch (message->nlmsg_type) {
+	case NLMSG_DONE:
+		if (!ofDump)
+			break;
+		if (dumpInterrupted)
+			pendingDumps |= runningDump;
+		else
+			FinishDump();
+		runningDump = 0;
+		SendNextDump();
+		break;
+	case NLMSG_ERROR:
+		if (!ofDump)
+			break;
+		if (message->nlmsg_len >= NLMSG_LENGTH(sizeof(nlmsgerr))) {
+			const auto *error = static_cast<const nlmsgerr*>(NLMSG_DATA(message));
+			if (error->error)
+				NCBAR_LOG_ERROR << "Network: Dump failed: " << strerror(-error->error);
+		}
+		runningDump = 0;
+		SendNextDump();
+		break;
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		HandleLink(message);
+		break;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		HandleAddress(message);
+		break;
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		HandleRoute(message);
+		break;
+	}
+}
+
+void Network::HandleLink(const nlmsghdr *message)
+{
+	if (message->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg)))
+		return;
+	const auto *link = static_cast<const ifinfomsg*>(NLMSG_DATA(message));
+	if (message->nlmsg_type == RTM_DELLINK) {
+		auto it = interfaces.find(link->ifi_index);
+		if (it != interfaces.end())
+			RemoveInterface(it);
+		return;
+	}
+
+	std::string_view name;
+	rtnl_link_stats64 stats64 = {};
+	rtnl_link_stats stats = {};
+	bool hasStats64 = false;
+	bool hasStats = false;
+	forEachAttribute(message, sizeof(ifinfomsg), [&](uint16_t type, std::string_view payload) {
+		if (type == IFLA_IFNAME)
+			name = stringAttribute(payload);
+		else if (type == IFLA_STATS64)
+			hasStats64 = readAttribute(payload, stats64);
+		else if (type == IFLA_STATS)
+			hasStats = readAttribute(payload, stats);
+	});
+	if (name.empty())
+		return;
+
+	auto [it, added] = interfaces.try_emplace(link->ifi_index);
+	auto &interface = it->second;
+	if (interface.name != name) {
+		if (!added)
+			PublishInterface(interface, ChangedLink | ChangedAddresses | ChangedThroughput, true);
+		interface.name = name;
+		interface.dirty |= ChangedLink | ChangedAddresses | ChangedThroughput;
+	}
+	// IFF_RUNNING follows the operational state, so a cable or a veth peer going down counts as down
+	const bool up = (link->ifi_flags & IFF_UP) && (link->ifi_flags & IFF_RUNNING);
+	if (added || interface.up != up) {
+		interface.up = up;
+		interface.dirty |= ChangedLink;
+	}
+	interface.loopback = link->ifi_flags & IFF_LOOPBACK;
+	if (hasStats64) {
+		interface.rxBytes = stats64.rx_bytes;
+		interface.txBytes = stats64.tx_bytes;
+	}
+	else if (hasStats) {
+		interface.rxBytes = stats.rx_bytes;
+		interface.txBytes = stats.tx_bytes;
+	}
+	interface.generation = generation;
+	if (interface.dirty)
+		changes |= ChangedLink;
+}
+
+void Network::HandleAddress(const nlmsghdr *message)
+{
+	if (message->nlmsg_len < NLMSG_LENGTH(sizeof(ifaddrmsg)))
+		return;
+	const auto *header = static_cast<const ifaddrmsg*>(NLMSG_DATA(message));
+	if (header->ifa_family != AF_INET && header->ifa_family != AF_INET6)
+		return;
+	auto it = interfaces.find(static_cast<int32_t>(header->ifa_index));
+	if (it == interfaces.end())
+		return;
+
+	// IFA_LOCAL is the own address on point-to-point links, where IFA_ADDRESS is the peer
+	std::string_view local, address;
+	forEachAttribute(message, sizeof(ifaddrmsg), [&](uint16_t type, std::string_view payload) {
+		if (type == IFA_LOCAL)
+			local = payload;
+		else if (type == IFA_ADDRESS)
+			address = payload;
+	});
+	if (!local.empty())
+		address = local;
+	const std::size_t addressSize = header->ifa_family == AF_INET ? 4 : 16;
+	if (address.size() != addressSize)
+		return;
+
+	Address entry;
+	entry.family = header->ifa_family;
+	entry.prefixLength = header->ifa_prefixlen;
+	std::memcpy(entry.bytes.data(), address.data(), addressSize);
+	entry.generation = generation;
+
+	auto &interface = it->second;
+	auto existing = std::find(interface.addresses.begin(), interface.addresses.end(), entry);
+	if (message->nlmsg_type == RTM_DELADDR) {
+		if (existing == interface.addresses.end())
+			return;
+		interface.addresses.erase(existing);
+	}
+	else if (existing != interface.addresses.end()) {
+		existing->generation = generation;
+		return;
+	}
+	else
+		interface.addresses.push_back(entry);
+	interface.dirty |= ChangedAddresses;
+	changes |= ChangedAddresses;
+}
+
+void Network::HandleRoute(const nlmsghdr *message)
+{
+	if (message->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg)))
+		return;
+	const auto *header = static_cast<const rtmsg*>(NLMSG_DATA(message));
+	if (header->rtm_dst_len != 0 || header->rtm_type != RTN_UNICAST)
+		return;
+
+	uint32_t table = header->rtm_table;
+	uint32_t interface = 0;
+	uint32_t priority = 0;
+	forEachAttribute(message, sizeof(rtmsg), [&](uint16_t type, std::string_view payload) {
+		if (type == RTA_TABLE)
+			readAttribute(payload, table);
+		else if (type == RTA_OIF)
+			readAttribute(payload, interface);
+		else if (type == RTA_PRIORITY)
+			readAttribute(payload, priority);
+	});
+	// Policy routing tables and multipath routes without a single interface aren't shown
+	if (table != RT_TABLE_MAIN || !interface)
+		return;
+
+	auto existing = std::find_if(defaultRoutes.begin(), defaultRoutes.end(), [&](const DefaultRoute &route) {
+		return route.family == header->rtm_family && route.interface == static_cast<int32_t>(interface) && route.priority == priority;
+	});
+	if (message->nlmsg_type == RTM_DELROUTE) {
+		if (existing != defaultRoutes.end())
+			defaultRoutes.erase(existing);
+	}
+	else if (existing != defaultRoutes.end())
+		existing->generation = generation;
+	else
+		defaultRoutes.push_back(DefaultRoute{ .family = header->rtm_family, .interface = static_cast<int32_t>(interface), .priority = priority, .generation = generation });
+}
+
+void Network::FinishDump()
+{
+	switch (runningDump) {
+	case DumpLinks:
+		for (auto it = interfaces.begin(); it != interfaces.end();) {
+			auto next = std::next(it);
+			if (it->second.generation < generation)
+				RemoveInterface(it);
+			it = next;
+		}
+		if (throughputVisible)
+			SampleThroughput();
+		break;
+	case DumpAddresses:
+		for (auto &[index, interface] : interfaces) {
+			auto removed = std::erase_if(interface.addresses, [this](const Address &address) { return address.generation < generation; });
+			if (removed) {
+				interface.dirty |= ChangedAddresses;
+				changes |= ChangedAddresses;
+			}
+		}
+		break;
+	case DumpRoutes:
+		std::erase_if(defaultRoutes, [this](const DefaultRoute &route) { return route.generation < generation; });
+		break;
+	}
+}
+
+void Network::RemoveInterface(std::map<int32_t, Interface>::iterator it)
+{
+	PublishInterface(it->second, ChangedLink | ChangedAddresses | ChangedThroughput, true);
+	std::erase_if(defaultRoutes, [index = it->first](const DefaultRoute &route) { return route.interface == index; });
+	interfaces.erase(it);
+	changes |= ChangedLink;
+}
+
+void Network::SampleThroughput()
+{
+	const uint64_t now = getMonotonicTime();
+	const uint64_t elapsed = sampleTime ? now - sampleTime : 0;
+	sampleTime = now;
+
+	uint64_t newRxRate = 0;
+	uint64_t newTxRate = 0;
+	for (auto &[index, interface] : interfaces) {
+		uint64_t interfaceRxRate = 0;
+		uint64_t interfaceTxRate = 0;
+		// Counters start over when a driver is reloaded, that sample is skipped
+		if (interface.sampled && elapsed && interface.rxBytes >= interface.sampleRxBytes && interface.txBytes >= interface.sampleTxBytes) {
+			interfaceRxRate = static_cast<uint64_t>(static_cast<double>(interface.rxBytes - interface.sampleRxBytes) * 1e9 / static_cast<double>(elapsed));
+			interfaceTxRate = static_cast<uint64_t>(static_cast<double>(interface.txBytes - interface.sampleTxBytes) * 1e9 / static_cast<double>(elapsed));
+		}
+		interface.sampled = true;
+		interface.sampleRxBytes = interface.rxBytes;
+		interface.sampleTxBytes = interface.txBytes;
+		if (interface.rxRate != interfaceRxRate || interface.txRate != interfaceTxRate) {
+			interface.rxRate = interfaceRxRate;
+			interface.txRate = interfaceTxRate;
+			interface.dirty |= ChangedThroughput;
+		}
+		if (!interface.loopback) {
+			newRxRate += interfaceRxRate;
+			newTxRate += interfaceTxRate;
+		}
+	}
+	if (newRxRate != rxRate || newTxRate != txRate) {
+		rxRate = newRxRate;
+		txRate = newTxRate;
+		changes |= ChangedThroughput;
+	}
+}
+
+void Network::Publish()
+{
+	for (auto &[index, interface] : interfaces) {
+		if (interface.dirty) {
+			PublishInterface(interface, interface.dirty);
+			interface.dirty = ChangedNothing;
+		}
+	}
+
+	auto &widgetStore = core->GetWidgetStore();
+	const auto defaultInterface = GetDefaultInterface();
+	if (defaultInterface != publishedDefaultInterface || (changes & ChangedLink)) {
+		auto it = interfaces.find(defaultInterface);
+		widgetStore.Set("network.default", it != interfaces.end() ? std::string_view(it->second.name) : std::string_view());
+		if (defaultInterface != publishedDefaultInterface)
+			changes |= ChangedDefaultRoute;
+		publishedDefaultInterface = defaultInterface;
+	}
+	if (changes & ChangedThroughput) {
+		std::string value;
+		if (throughputVisible)
+			appendNumber(value, rxRate);
+		widgetStore.Set("network.rx_rate", value);
+		value.clear();
+		if (throughputVisible)
+			appendNumber(value, txRate);
+		widgetStore.Set("network.tx_rate", value);
+	}
+
+	if (changes != ChangedNothing && onChange)
+		onChange(changes);
+	changes = ChangedNothing;
+}
+
+void Network::PublishInterface(const Interface &interface, uint32_t fields, bool removed)
+{
+	std::string value;
+	if (fields & ChangedLink) {
+		if (!removed)
+			value = interface.up ? "up" : "down";
+		PublishValue(interface.name, "state", value);
+	}
+	if (fields & ChangedAddresses) {
+		for (const auto family : { AF_INET, AF_INET6 }) {
+			value.clear();
+			for (const auto &address : interface.addresses) {
+				if (removed || address.family != family)
+					continue;
+				char text[INET6_ADDRSTRLEN];
+				if (!inet_ntop(family, address.bytes.data(), text, sizeof(text)))
+					continue;
+				if (!value.empty())
+					value.push_back(' ');
+				value.append(text);
+				value.push_back('/');
+				appendNumber(value, address.prefixLength);
+			}
+			PublishValue(interface.name, family == AF_INET ? "ipv4" : "ipv6", value);
+		}
+	}
+	if (fields & ChangedThroughput) {
+		value.clear();
+		if (!removed && throughputVisible)
+			appendNumber(value, interface.rxRate);
+		PublishValue(interface.name, "rx_rate", value);
+		value.clear();
+		if (!removed && throughputVisible)
+			appendNumber(value, interface.txRate);
+		PublishValue(interface.name, "tx_rate", value);
+	}
+}
+
+void Network::PublishValue(std::string_view name, std::string_view field, std::string_view value)
+{
+	keyBuffer.assign("network.");
+	keyBuffer.append(name);
+	keyBuffer.push_back('.');
+	keyBuffer.append(field);
+	core->GetWidgetStore().Set(keyBuffer, value);
+}
@@ -0,0 +1,557 @@
+#include "previews.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+	// wl_shm formats are little-endian, ARGB8888 is stored B, G, R, A and ABGR8888 R, G, B, A
+	bool isBgr(uint32_t format)
+	{
+		return format == WL_SHM_FORMAT_ARGB8888 || format == WL_SHM_FORMAT_XRGB8888;
+	}
+
+	// Source pixels a thumbnail pixel averages, the same spans ImageDecoder scales covers down with
+	uint32_t spanStart(uint32_t index, uint32_t size, uint32_t thumbnailSize)
+	{
+		return static_cast<uint32_t>(static_cast<uint64_t>(index) * size / thumbnailSize);
+	}
+
+	uint32_t spanEnd(uint32_t index, uint32_t size, uint32_t thumbnailSize)
+	{
+		return std::max(spanStart(index, size, thumbnailSize) + 1, spanStart(index + 1, size, thumbnailSize));
+	}
+
+	// Thumbnail pixels whose spans overlap [first, first + count) of the source, a few more at most
+	void coveredRange(uint32_t first, uint32_t count, uint32_t size, uint32_t thumbnailSize, uint32_t &begin, uint32_t &end)
+	{
+		begin = static_cast<uint32_t>(static_cast<uint64_t>(first) * thumbnailSize / size);
+		end = std::min(thumbnailSize, static_cast<uint32_t>((static_cast<uint64_t>(first + count) * thumbnailSize + size - 1) / size));
+	}
+
+	// Adds a row of `columns` pixels to their per channel sums
+	void addRow(const uint8_t *row, uint32_t columns, uint32_t *sums)
+	{
+		uint32_t i = 0;
+#ifdef __SSE2__
+		// Four pixels at a time, widened to 16 and then 32 bits
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= columns * 4; i += 16) {
+			const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+			const __m128i low = _mm_unpacklo_epi8(pixels, zero);
+			const __m128i high = _mm_unpackhi_epi8(pixels, zero);
+			__m128i *sum = reinterpret_cast<__m128i*>(sums + i);
+			_mm_storeu_si128(sum, _mm_add_epi32(_mm_loadu_si128(sum), _mm_unpacklo_epi16(low, zero)));
+			_mm_storeu_si128(sum + 1, _mm_add_epi32(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi16(low, zero)));
+			_mm_storeu_si128(sum + 2, _mm_add_epi32(_mm_loadu_si128(sum + 2), _mm_unpacklo_epi16(high, zero)));
+			_mm_storeu_si128(sum + 3, _mm_add_epi32(_mm_loadu_si128(sum + 3), _mm_unpackhi_epi16(high, zero)));
+		}
+#endif
+		for (; i < columns * 4; i++)
+			sums[i] += row[i];
+	}
+
+	// Averages `columns` column sums of `rows` rows each into an opaque RGBA pixel
+	void averageSpan(const uint32_t *sums, uint32_t columns, uint32_t rows, bool bgr, uint8_t *destination)
+	{
+		uint8_t channels[4];
+#ifdef __SSE2__
+		// One pixel is one vector, the sums stay below 2^24 so floats hold them exactly
+		__m128i total = _mm_setzero_si128();
+		for (uint32_t x = 0; x < columns; x++)
+			total = _mm_add_epi32(total, _mm_loadu_si128(reinterpret_cast<const __m128i*>(sums + x * 4)));
+		const __m128 average = _mm_mul_ps(_mm_cvtepi32_ps(total), _mm_set1_ps(1.0f / static_cast<float>(columns * rows)));
+		const __m128i rounded = _mm_cvtps_epi32(average);
+		const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(rounded, rounded), rounded);
+		const uint32_t value = static_cast<uint32_t>(_mm_cvtsi128_si32(packed));
+		std::memcpy(channels, &value, sizeof(channels));
+#else
+		uint32_t total[4] = {};
+		for (uint32_t x = 0; x < columns; x++) {
+			for (int channel = 0; channel < 4; channel++)
+				total[channel] += sums[x * 4 + channel];
+		}
+		const uint32_t count = columns * rows;
+		for (int channel = 0; channel < 4; channel++)
+			channels[channel] = static_cast<uint8_t>((total[channel] + count / 2) / count);
+#endif
+		destination[0] = bgr ? channels[2] : channels[0];
+		destination[1] = channels[1];
+		destination[2] = bgr ? channels[0] : channels[2];
+		// X formats leave alpha undefined, and an output is opaque anyway
+		destination[3] = 255;
+	}
+}
+
+const zwlr_screencopy_frame_v1_listener Previews::frameListener = {
+	.buffer = BindListener<&Previews::OnBuffer>,
+	.flags = BindListener<&Previews::OnFlags>,
+	.ready = BindListener<&Previews::OnReady>,
+	.failed = BindListener<&Previews::OnFailed>,
+	.damage = BindListener<&Previews::OnDamage>,
+	.linux_dmabuf = IgnoreListener,
+	.buffer_done = BindListener<&Previews::OnBufferDone>
+};
+
+Previews::~Previews()
+{
+	Close();
+	if (outputRemovedSubscription) {
+		core->UnsubscribeOutputRemoved(outputRemovedSubscription);
+		outputRemovedSubscription = 0;
+	}
+	if (worker.joinable()) {
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_one();
+		worker.join();
+	}
+	ReleaseBuffer();
+	if (eventFd >= 0) {
+		core->RemoveFd(eventFd);
+		close(eventFd);
+		eventFd = -1;
+	}
+	if (timerFd >= 0) {
+		core->RemoveFd(timerFd);
+		close(timerFd);
+		timerFd = -1;
+	}
+}
+
+bool Previews::Init(CorePtr core)
+{
+	this->core = core;
+	if (!core->GetScreencopyManager() || !core->GetShm())
+		return false;
+
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0) {
+		NCBAR_LOG_ERROR << "Previews: Failed to create timer: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(timerFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnTimer();
+	}))
+		return false;
+
+	eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventFd < 0) {
+		NCBAR_LOG_ERROR << "Previews: Failed to create eventfd: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(eventFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnReadable();
+	}))
+		return false;
+	outputRemovedSubscription = core->SubscribeOutputRemoved([this](wl_output *output) { ForgetOutput(output); });
+	return true;
+}
+
+void Previews::SetOnChange(OnChangeCallbackType onChange)
+{
+	this->onChange = onChange;
+}
+
+void Previews::SetThumbnailHeight(uint32_t height)
+{
+	thumbnailHeight = height;
+}
+
+void Previews::Open(wl_output *output)
+{
+	if (output == openOutput)
+		return;
+	Close();
+	if (!output || !thumbnailHeight || !core->HasOutput(output))
+		return;
+	if (!worker.joinable())
+		worker = std::thread(&Previews::Run, this);
+	openOutput = output;
+	openCaptured = false;
+	generation++;
+	Capture();
+}
+
+void Previews::Close()
+{
+	if (!openOutput)
+		return;
+	openOutput = nullptr;
+	generation++;
+	DestroyFrame();
+	const itimerspec disarm = {};
+	timerfd_settime(timerFd, 0, &disarm, nullptr);
+	// Otherwise OnReadable() gives it back once the worker is done with it
+	if (!downscaling)
+		ReleaseBuffer();
+}
+
+Previews::ImagePtr Previews::GetThumbnail(wl_output *output) const
+{
+	for (const auto &thumbnail : thumbnails) {
+		if (thumbnail.output == output)
+			return thumbnail.image;
+	}
+	return nullptr;
+}
+
+void Previews::Downscale(const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t stride, uint32_t format, bool yInvert, const Damage &damage, ImageDecoder::Image &thumbnail, std::vector<uint32_t> &sums)
+{
+	NCBAR_TRACE_SCOPE("decode", "Previews::Downscale");
+	const uint32_t damageX = std::min(damage.x, width);
+	const uint32_t damageY = std::min(damage.y, height);
+	const uint32_t damageWidth = std::min(damage.width, width - damageX);
+	const uint32_t damageHeight = std::min(damage.height, height - damageY);
+	if (!thumbnail.width || !thumbnail.height || !damageWidth || !damageHeight)
+		return;
+
+	// Damage is in the rows of the buffer, which is upside down with Y_INVERT
+	uint32_t firstRow, endRow, firstColumn, endColumn;
+	coveredRange(yInvert ? height - damageY - damageHeight : damageY, damageHeight, height, thumbnail.height, firstRow, endRow);
+	coveredRange(damageX, damageWidth, width, thumbnail.width, firstColumn, endColumn);
+	const uint32_t sourceX = spanStart(firstColumn, width, thumbnail.width);
+	const uint32_t columns = spanEnd(endColumn - 1, width, thumbnail.width) - sourceX;
+	const bool bgr = isBgr(format);
+
+	// Vertical pass into one sum per source column and channel, then a horizontal one per thumbnail pixel
+	sums.resize(static_cast<std::size_t>(columns) * 4);
+	for (uint32_t y = firstRow; y < endRow; y++) {
+		const uint32_t sourceY0 = spanStart(y, height, thumbnail.height);
+		const uint32_t sourceY1 = spanEnd(y, height, thumbnail.height);
+		std::fill(sums.begin(), sums.end(), 0);
+		for (uint32_t sourceY = sourceY0; sourceY < sourceY1; sourceY++) {
+			const uint32_t bufferY = yInvert ? height - 1 - sourceY : sourceY;
+			addRow(pixels + static_cast<std::size_t>(bufferY) * stride + static_cast<std::size_t>(sourceX) * 4, columns, sums.data());
+		}
+		uint8_t *destination = thumbnail.pixels.data() + (static_cast<std::size_t>(y) * thumbnail.width + firstColumn) * 4;
+		for (uint32_t x = firstColumn; x < endColumn; x++, destination += 4) {
+			const uint32_t sourceX0 = spanStart(x, width, thumbnail.width);
+			const uint32_t sourceX1 = spanEnd(x, width, thumbnail.width);
+			averageSpan(sums.data() + static_cast<std::size_t>(sourceX0 - sourceX) * 4, sourceX1 - sourceX0, sourceY1 - sourceY0, bgr, destination);
+		}
+	}
+}
+
+uint32_t Previews::GetThumbnailWidth(uint32_t width, uint32_t height, uint32_t thumbnailHeight)
+{
+	if (!height)
+		return 0;
+	return std::max<uint32_t>(1, static_cast<uint32_t>((static_cast<uint64_t>(width) * thumbnailHeight + height / 2) / height));
+}
+
+bool Previews::IsFormatSupported(uint32_t format)
+{
+	return format == WL_SHM_FORMAT_ARGB8888 || format == WL_SHM_FORMAT_XRGB8888 || format == WL_SHM_FORMAT_ABGR8888 || format == WL_SHM_FORMAT_XBGR8888;
+}
+
+void Previews::Run()
+{
+	Trace::SetThreadName("previews");
+	std::unique_lock lock(mutex);
+	while (true) {
+		wakeUp.wait(lock, [this]() { return stopping || jobPending; });
+		if (stopping)
+			return;
+		Job current = std::move(job);
+		jobPending = false;
+
+		lock.unlock();
+		auto image = current.previous ? std::make_shared<ImageDecoder::Image>(*current.previous) : std::make_shared<ImageDecoder::Image>();
+		Damage damage = current.damage;
+		if (!current.previous) {
+			image->height = current.thumbnailHeight;
+			image->width = GetThumbnailWidth(current.width, current.height, current.thumbnailHeight);
+			image->pixels.resize(static_cast<std::size_t>(image->width) * image->height * 4);
+			damage = Damage{ .x = 0, .y = 0, .width = current.width, .height = current.height };
+		}
+		Downscale(current.pixels, current.width, current.height, current.stride, current.format, current.yInvert, damage, *image, sums);
+		current.previous.reset();
+		current.result = std::move(image);
+		lock.lock();
+
+		job = std::move(current);
+		jobDone = true;
+		const uint64_t one = 1;
+		if (write(eventFd, &one, sizeof(one)) < 0)
+			NCBAR_LOG_ERROR << "Previews: Failed to signal the event loop: " << strerror(errno);
+	}
+}
+
+void Previews::OnReadable()
+{
+	NCBAR_TRACE_SCOPE("source", "Previews::OnReadable");
+	uint64_t count;
+	if (read(eventFd, &count, sizeof(count)) < 0)
+		return;
+	Job done;
+	{
+		std::lock_guard lock(mutex);
+		if (!jobDone)
+			return;
+		jobDone = false;
+		done = std::move(job);
+	}
+	downscaling = false;
+
+	// A thumbnail of an output that is still there is kept, even if its preview was closed meanwhile
+	if (downscaledOutput) {
+		auto thumbnail = FindThumbnail(done.output);
+		if (!thumbnail) {
+			thumbnails.push_front(Thumbnail{ .output = done.output, .sourceWidth = 0, .sourceHeight = 0, .image = nullptr });
+			if (thumbnails.size() > thumbnailsCapacity)
+				thumbnails.pop_back();
+			thumbnail = &thumbnails.front();
+		}
+		thumbnail->sourceWidth = done.width;
+		thumbnail->sourceHeight = done.height;
+		thumbnail->image = std::move(done.result);
+		if (onChange)
+			onChange(done.output);
+	}
+
+	if (!openOutput) {
+		ReleaseBuffer();
+		return;
+	}
+	if (done.generation != generation) {
+		// Another output was opened while this one was downscaled
+		Capture();
+		return;
+	}
+	openCaptured = true;
+	const itimerspec timer = {
+		.it_interval = {},
+		.it_value = { .tv_sec = 0, .tv_nsec = static_cast<long>(refreshInterval) }
+	};
+	if (timerfd_settime(timerFd, 0, &timer, nullptr) < 0)
+		NCBAR_LOG_ERROR << "Previews: Failed to set timer: " << strerror(errno);
+}
+
+void Previews::OnTimer()
+{
+	NCBAR_TRACE_SCOPE("source", "Previews::OnTimer");
+	uint64_t expirations;
+	if (read(timerFd, &expirations, sizeof(expirations)) < 0)
+		return;
+	Capture();
+}
+
+void Previews::Capture()
+{
+	if (!openOutput || frame || downscaling)
+		return;
+	if (!core->HasOutput(openOutput)) {
+		Close();
+		return;
+	}
+	frame = zwlr_screencopy_manager_v1_capture_output(core->GetScreencopyManager(), 0, openOutput);
+	zwlr_screencopy_frame_v1_add_listener(frame, &frameListener, this);
+	frameFormat = 0;
+	frameWidth = 0;
+	frameHeight = 0;
+	frameStride = 0;
+	frameYInvert = false;
+	frameHasDamage = false;
+	frameDamage = Damage();
+}
+
+void Previews::StartCopy()
+{
+	if (!frameFormat) {
+		NCBAR_LOG_WARNING << "Previews: The compositor offers no supported shm format, previews are disabled";
+		DestroyFrame();
+		return;
+	}
+	if (!PrepareBuffer()) {
+		DestroyFrame();
+		return;
+	}
+
+	// A thumbnail that doesn't fit the capture is made again from all of it, otherwise only damage is copied and
+	// downscaled. The compositor holds a damage copy back until something changed
+	const auto thumbnail = FindThumbnail(openOutput);
+	frameFullCopy = !openCaptured || !thumbnail || !thumbnail->image
+		|| thumbnail->sourceWidth != frameWidth || thumbnail->sourceHeight != frameHeight
+		|| thumbnail->image->height != std::min(thumbnailHeight, frameHeight)
+		|| zwlr_screencopy_frame_v1_get_version(frame) < 2;
+	if (frameFullCopy)
+		zwlr_screencopy_frame_v1_copy(frame, buffer.buffer);
+	else
+		zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer.buffer);
+}
+
+bool Previews::PrepareBuffer()
+{
+	if (buffer.buffer && buffer.format == frameFormat && buffer.width == frameWidth && buffer.height == frameHeight && buffer.stride == frameStride)
+		return true;
+	ReleaseBuffer();
+
+	const std::size_t size = static_cast<std::size_t>(frameStride) * frameHeight;
+	int fd = memfd_create("ncbar-preview", MFD_CLOEXEC);
+	if (fd < 0) {
+		NCBAR_LOG_ERROR << "Previews: Failed to create shm file: " << strerror(errno);
+		return false;
+	}
+	if (ftruncate(fd, static_cast<off_t>(size)) < 0) {
+		NCBAR_LOG_ERROR << "Previews: Failed to size shm file: " << strerror(errno);
+		close(fd);
+		return false;
+	}
+	// Only the compositor writes, the worker reads
+	void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		NCBAR_LOG_ERROR << "Previews: Failed to map shm file: " << strerror(errno);
+		close(fd);
+		return false;
+	}
+	// The buffer keeps the pool's memory alive
+	auto pool = wl_shm_create_pool(core->GetShm(), fd, static_cast<int32_t>(size));
+	buffer.buffer = wl_shm_pool_create_buffer(pool, 0, static_cast<int32_t>(frameWidth), static_cast<int32_t>(frameHeight), static_cast<int32_t>(frameStride), frameFormat);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	buffer.data = static_cast<uint8_t*>(data);
+	buffer.size = size;
+	buffer.format = frameFormat;
+	buffer.width = frameWidth;
+	buffer.height = frameHeight;
+	buffer.stride = frameStride;
+	return true;
+}
+
+void Previews::ReleaseBuffer()
+{
+	if (buffer.buffer)
+		wl_buffer_destroy(buffer.buffer);
+	if (buffer.data)
+		munmap(buffer.data, buffer.size);
+	buffer = Buffer();
+}
+
+void Previews::DestroyFrame()
+{
+	if (frame) {
+		zwlr_screencopy_frame_v1_destroy(frame);
+		frame = nullptr;
+	}
+}
+
+Previews::Thumbnail* Previews::FindThumbnail(wl_output *output)
+{
+	for (auto it = thumbnails.begin(); it != thumbnails.end(); ++it) {
+		if (it->output != output)
+			continue;
+		thumbnails.splice(thumbnails.begin(), thumbnails, it);
+		return &thumbnails.front();
+	}
+	return nullptr;
+}
+
+void Previews::ForgetOutput(wl_output *output)
+{
+	if (output == openOutput)
+		Close();
+	std::erase_if(thumbnails, [output](const Thumbnail &thumbnail) { return thumbnail.output == output; });
+	if (downscaling && downscaledOutput == output)
+		downscaledOutput = nullptr;
+}
+
+void Previews::OnBuffer(zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride)
+{
+	// Version 3 may offer several, the first supported one is taken
+	if (!frameFormat && IsFormatSupported(format) && width && height && stride >= width * 4) {
+		frameFormat = format;
+		frameWidth = width;
+		frameHeight = height;
+		frameStride = stride;
+	}
+	// Before version 3 there is a single buffer event and no buffer_done
+	if (zwlr_screencopy_frame_v1_get_version(frame) < 3)
+		StartCopy();
+}
+
+void Previews::OnFlags(zwlr_screencopy_frame_v1 *frame, uint32_t flags)
+{
+	(void)frame;
+	frameYInvert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+void Previews::OnReady(zwlr_screencopy_frame_v1 *frame, uint32_t tvSecHi, uint32_t tvSecLo, uint32_t tvNsec)
+{
+	(void)frame;
+	(void)tvSecHi;
+	(void)tvSecLo;
+	(void)tvNsec;
+	NCBAR_TRACE_SCOPE("source", "Previews::OnReady");
+	DestroyFrame();
+
+	const auto thumbnail = frameFullCopy ? nullptr : FindThumbnail(openOutput);
+	{
+		std::lock_guard lock(mutex);
+		job = Job{
+			.output = openOutput,
+			.pixels = buffer.data,
+			.generation = generation,
+			.format = buffer.format,
+			.width = buffer.width,
+			.height = buffer.height,
+			.stride = buffer.stride,
+			.yInvert = frameYInvert,
+			.damage = frameHasDamage ? frameDamage : Damage{ .x = 0, .y = 0, .width = buffer.width, .height = buffer.height },
+			.thumbnailHeight = std::min(thumbnailHeight, buffer.height),
+			.previous = thumbnail ? thumbnail->image : nullptr,
+			.result = nullptr
+		};
+		jobPending = true;
+	}
+	downscaling = true;
+	downscaledOutput = openOutput;
+	wakeUp.notify_one();
+}
+
+void Previews::OnFailed(zwlr_screencopy_frame_v1 *frame)
+{
+	(void)frame;
+	// Nothing is captured again until the next Open()
+	NCBAR_LOG_WARNING << "Previews: Failed to capture an output";
+	DestroyFrame();
+}
+
+void Previews::OnDamage(zwlr_screencopy_frame_v1 *frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	(void)frame;
+	if (!frameHasDamage) {
+		frameDamage = Damage{ .x = x, .y = y, .width = width, .height = height };
+		frameHasDamage = true;
+		return;
+	}
+	// One box around all of it, the downscale is per rows and columns anyway
+	const uint32_t right = std::max(frameDamage.x + frameDamage.width, x + width);
+	const uint32_t bottom = std::max(frameDamage.y + frameDamage.height, y + height);
+	frameDamage.x = std::min(frameDamage.x, x);
+	frameDamage.y = std::min(frameDamage.y, y);
+	frameDamage.width = right - frameDamage.x;
+	frameDamage.height = bottom - frameDamage.y;
+}
+
+void Previews::OnBufferDone(zwlr_screencopy_frame_v1 *frame)
+{
+	(void)frame;
+	StartCopy();
+}
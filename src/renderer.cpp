@@ -1,20 +1,33 @@
 #include "globals.hpp"
 #include "core.hpp"
+#include "log.hpp"
 #include "renderer.hpp"
+#include "trace.hpp"
 #include "vulkanHelper.hpp"
 #include "window.hpp"
+#include <algorithm>
 #include <cstddef>
-#include <iostream>
+#include <cstring>
+#include <mutex>
+#include <utility>
 #include <vector>
 
+namespace {
+	// Tray icons and the like, each one has a descriptor set of its own
+	constexpr uint32_t maxImages = 64;
+}
+
 Renderer::~Renderer()
 {
-	CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
-	DestroySwapchain();
-	if (commandPool) {
-		vkDestroyCommandPool(core->GetDevice(), commandPool, nullptr);
-		commandPool = nullptr;
+	{
+		std::lock_guard lock(core->GetQueueMutex());
+		CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
 	}
+	DestroySwapchain();
+	DestroyPipelines();
+	DestroyImages();
+	DestroyRegions();
+	DestroyFrames();
 	if (surface) {
 		vkDestroySurfaceKHR(core->GetInstance(), surface, nullptr);
 		surface = nullptr;
@@ -25,19 +38,28 @@ bool Renderer::Init(WindowPtr window)
 {
 	core = window->core;
 	windowWeak = window;
+	useVulkan13 = core->GetVulkan13() != nullptr;
 
 	if (!InitSurface(window)) {
-		std::cerr << "Vulkan: Failed to get create wayland surface" << std::endl;
+		NCBAR_LOG_ERROR << "Vulkan: Failed to get create wayland surface";
 		return false;
 	}
 
 	InitGraphicsQueue(window);
-	if (!InitCommandPool()) {
-		std::cerr << "Vulkan: Failed to create command pool" << std::endl;
+	if (!InitFrames()) {
+		NCBAR_LOG_ERROR << "Vulkan: Failed to create frame resources";
+		return false;
+	}
+	if (!InitRegions()) {
+		NCBAR_LOG_ERROR << "Vulkan: Failed to create region command pool";
+		return false;
+	}
+	if (!InitImages()) {
+		NCBAR_LOG_ERROR << "Vulkan: Failed to create image descriptors";
 		return false;
 	}
 	if (!InitSwapchain()) {
-		std::cerr << "Vulkan: Failed to create swapchain" << std::endl;
+		NCBAR_LOG_ERROR << "Vulkan: Failed to create swapchain";
 		return false;
 	}
 
@@ -62,24 +84,106 @@ bool Renderer::InitSurface(WindowPtr window)
 
 	return surface != nullptr;
 }
-bool Renderer::InitCommandPool()
+bool Renderer::InitFrames()
 {
-	VkCommandPoolCreateInfo createInfo = {
-		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-		.pNext = nullptr,
-		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-		.queueFamilyIndex = core->GetQueueFamilyIndex()
-	};
-	CHECK_VK_RESULT(vkCreateCommandPool(core->GetDevice(), &createInfo, nullptr, &commandPool));
+	framesInFlight = core->GetSettings().framesInFlight ? core->GetSettings().framesInFlight : 1;
+	frameResources.resize(framesInFlight);
+
+	for (auto &currentFrameResource : frameResources) {
+		VkCommandPoolCreateInfo poolCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+			.pNext = nullptr,
+			.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+			.queueFamilyIndex = core->GetQueueFamilyIndex()
+		};
+		CHECK_VK_RESULT(vkCreateCommandPool(core->GetDevice(), &poolCreateInfo, nullptr, &currentFrameResource.commandPool));
+		if (!currentFrameResource.commandPool)
+			return false;
+
+		VkCommandBufferAllocateInfo cbAllocInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			.pNext = nullptr,
+			.commandPool = currentFrameResource.commandPool,
+			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			.commandBufferCount = 1
+		};
+		CHECK_VK_RESULT(vkAllocateCommandBuffers(core->GetDevice(), &cbAllocInfo, &currentFrameResource.commandBuffer));
 
-	return commandPool != nullptr;
+		VkSemaphoreCreateInfo semaphoreCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			.pNext = nullptr,
+			.flags = 0
+		};
+		CHECK_VK_RESULT(vkCreateSemaphore(core->GetDevice(), &semaphoreCreateInfo, nullptr, &currentFrameResource.acquireSemaphore));
+
+		if (!useVulkan13) {
+			VkFenceCreateInfo fenceCreateInfo = {
+				.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+				.pNext = nullptr,
+				.flags = VK_FENCE_CREATE_SIGNALED_BIT
+			};
+			CHECK_VK_RESULT(vkCreateFence(core->GetDevice(), &fenceCreateInfo, nullptr, &currentFrameResource.fence));
+			if (!currentFrameResource.fence)
+				return false;
+		}
+
+		if (!currentFrameResource.commandBuffer || !currentFrameResource.acquireSemaphore)
+			return false;
+	}
+	currentFrame = 0;
+
+	if (useVulkan13) {
+		// Counts submitted frames, a frame's resources are free once it reaches the frame's value
+		VkSemaphoreTypeCreateInfo typeCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+			.pNext = nullptr,
+			.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+			.initialValue = 0
+		};
+		VkSemaphoreCreateInfo timelineCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			.pNext = &typeCreateInfo,
+			.flags = 0
+		};
+		CHECK_VK_RESULT(vkCreateSemaphore(core->GetDevice(), &timelineCreateInfo, nullptr, &frameTimeline));
+		if (!frameTimeline)
+			return false;
+		frameTimelineValue = 0;
+	}
+
+	return true;
+}
+void Renderer::DestroyFrames()
+{
+	for (auto &frameResource : frameResources) {
+		if (frameResource.fence) {
+			vkDestroyFence(core->GetDevice(), frameResource.fence, nullptr);
+			frameResource.fence = nullptr;
+		}
+		if (frameResource.acquireSemaphore) {
+			vkDestroySemaphore(core->GetDevice(), frameResource.acquireSemaphore, nullptr);
+			frameResource.acquireSemaphore = nullptr;
+		}
+		if (frameResource.commandPool) {
+			// Frees the command buffer as well
+			vkDestroyCommandPool(core->GetDevice(), frameResource.commandPool, nullptr);
+			frameResource.commandPool = nullptr;
+			frameResource.commandBuffer = nullptr;
+		}
+	}
+	frameResources.clear();
+	if (frameTimeline) {
+		vkDestroySemaphore(core->GetDevice(), frameTimeline, nullptr);
+		frameTimeline = VK_NULL_HANDLE;
+	}
+	frameTimelineValue = 0;
 }
 
 bool Renderer::InitSwapchain()
 {
 	VkFormat format = VK_FORMAT_UNDEFINED;
-	int32_t width = 1920;
-	int32_t height = 1080;
+	uint32_t width = 0;
+	uint32_t height = 0;
 
 	{
 		VkSurfaceCapabilitiesKHR capabilities;
@@ -98,26 +202,35 @@ bool Renderer::InitSwapchain()
 
 		format = chosenFormat.format;
 
-		framesCount = (capabilities.minImageCount + 1) < capabilities.maxImageCount ? capabilities.minImageCount + 1 : capabilities.maxImageCount;
+		// maxImageCount of 0 means there is no limit
+		imagesCount = capabilities.minImageCount + 1;
+		if (capabilities.maxImageCount && imagesCount > capabilities.maxImageCount)
+			imagesCount = capabilities.maxImageCount;
 
-		width = ~capabilities.currentExtent.width ? capabilities.currentExtent.width : capabilities.maxImageExtent.width;
-		height = ~capabilities.currentExtent.height ? capabilities.currentExtent.height : capabilities.maxImageExtent.height;
-		if (auto window = GetWindow(); window && window->GetWidth() && window->GetHeight()) {
-			width = window->GetWidth();
-			height = window->GetHeight();
+		// On Wayland the surface size is defined by the buffer, so it's the window's size in device pixels
+		width = capabilities.currentExtent.width;
+		height = capabilities.currentExtent.height;
+		if (auto window = GetWindow(); window && window->GetBufferWidth() && window->GetBufferHeight()) {
+			width = window->GetBufferWidth();
+			height = window->GetBufferHeight();
 		}
+		width = std::clamp(width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
+		height = std::clamp(height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
+		extent = VkExtent2D{ .width = width, .height = height };
+		// Copying out may cost the images their compression, so it's only asked for when a snapshot is taken on exit
+		swapchainReadable = core->GetSettings().snapshotEnabled && (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
 
 		VkSwapchainCreateInfoKHR createInfo = {
 			.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
 			.pNext = nullptr,
 			.flags = 0,
 			.surface = surface,
-			.minImageCount = framesCount,
+			.minImageCount = imagesCount,
 			.imageFormat = chosenFormat.format,
 			.imageColorSpace = chosenFormat.colorSpace,
-			.imageExtent = VkExtent2D{ .width = static_cast<uint32_t>(width), .height = static_cast<uint32_t>(height) },
+			.imageExtent = extent,
 			.imageArrayLayers = 1,
-			.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+			.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (swapchainReadable ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : 0u),
 			.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
 			.queueFamilyIndexCount = 0,
 			.pQueueFamilyIndices = nullptr,
@@ -130,7 +243,8 @@ bool Renderer::InitSwapchain()
 		CHECK_VK_RESULT(vkCreateSwapchainKHR(core->GetDevice(), &createInfo, nullptr, &swapchain));
 	}
 
-	{
+	// Dynamic rendering needs neither a render pass nor framebuffers, a resize only recreates the swapchain and its views
+	if (!useVulkan13) {
 		VkAttachmentDescription attachments = {
 			.flags = 0,
 			.format = format,
@@ -172,24 +286,23 @@ bool Renderer::InitSwapchain()
 		CHECK_VK_RESULT(vkCreateRenderPass(core->GetDevice(), &createInfo, nullptr, &renderPass));
 	}
 
-	CHECK_VK_RESULT(vkGetSwapchainImagesKHR(core->GetDevice(), swapchain, &framesCount, nullptr));
-	std::vector<VkImage> images(framesCount);
-	CHECK_VK_RESULT(vkGetSwapchainImagesKHR(core->GetDevice(), swapchain, &framesCount, images.data()));
-	swapchainResources.resize(framesCount);
+	if (format != pipelinesFormat) {
+		DestroyPipelines();
+		if (!InitPipelines(format)) {
+			NCBAR_LOG_ERROR << "Vulkan: Failed to create pipelines";
+			return false;
+		}
+		pipelinesFormat = format;
+	}
+
+	CHECK_VK_RESULT(vkGetSwapchainImagesKHR(core->GetDevice(), swapchain, &imagesCount, nullptr));
+	std::vector<VkImage> images(imagesCount);
+	CHECK_VK_RESULT(vkGetSwapchainImagesKHR(core->GetDevice(), swapchain, &imagesCount, images.data()));
+	swapchainResources.resize(imagesCount);
 
 	for (std::size_t i = 0; i < images.size(); i++) {
 		auto &currentSwapchainResource = swapchainResources[i];
 
-		VkCommandBufferAllocateInfo cbAllocInfo = {
-			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-			.pNext = nullptr,
-			.commandPool = commandPool,
-			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-			.commandBufferCount = 1
-		};
-		std::vector<VkCommandBuffer> commandBuffers(framesCount);
-		CHECK_VK_RESULT(vkAllocateCommandBuffers(core->GetDevice(), &cbAllocInfo, &currentSwapchainResource.commandBuffer));
-
 		currentSwapchainResource.image = images[i];
 
 		VkImageViewCreateInfo ivCreateInfo = {
@@ -215,40 +328,27 @@ bool Renderer::InitSwapchain()
 		};
 		CHECK_VK_RESULT(vkCreateImageView(core->GetDevice(), &ivCreateInfo, nullptr, &currentSwapchainResource.imageView));
 
-		VkFramebufferCreateInfo fbCreateInfo = {
-			.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-			.pNext = nullptr,
-			.flags = 0,
-			.renderPass = renderPass,
-			.attachmentCount = 1,
-			.pAttachments = &currentSwapchainResource.imageView,
-			.width = static_cast<uint32_t>(width),
-			.height = static_cast<uint32_t>(height),
-			.layers = 1
-		};
-		CHECK_VK_RESULT(vkCreateFramebuffer(core->GetDevice(), &fbCreateInfo, nullptr, &currentSwapchainResource.framebuffer));
+		if (!useVulkan13) {
+			VkFramebufferCreateInfo fbCreateInfo = {
+				.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+				.pNext = nullptr,
+				.flags = 0,
+				.renderPass = renderPass,
+				.attachmentCount = 1,
+				.pAttachments = &currentSwapchainResource.imageView,
+				.width = width,
+				.height = height,
+				.layers = 1
+			};
+			CHECK_VK_RESULT(vkCreateFramebuffer(core->GetDevice(), &fbCreateInfo, nullptr, &currentSwapchainResource.framebuffer));
+		}
 
-		VkSemaphoreCreateInfo beginSemaphoreCreateInfo = {
-			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-			.pNext = nullptr,
-			.flags = 0
-		};
-		CHECK_VK_RESULT(vkCreateSemaphore(core->GetDevice(), &beginSemaphoreCreateInfo, nullptr, &currentSwapchainResource.startSemaphore));
-		VkSemaphoreCreateInfo endSemaphoreCreateInfo = {
+		VkSemaphoreCreateInfo presentSemaphoreCreateInfo = {
 			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
 			.pNext = nullptr,
 			.flags = 0
 		};
-		CHECK_VK_RESULT(vkCreateSemaphore(core->GetDevice(), &endSemaphoreCreateInfo, nullptr, &currentSwapchainResource.endSemaphore));
-
-		VkFenceCreateInfo fenceCreateInfo = {
-			.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-			.pNext = nullptr,
-			.flags = VK_FENCE_CREATE_SIGNALED_BIT
-		};
-		CHECK_VK_RESULT(vkCreateFence(core->GetDevice(), &fenceCreateInfo, nullptr, &currentSwapchainResource.fence));
-
-		currentSwapchainResource.lastFence = VK_NULL_HANDLE;
+		CHECK_VK_RESULT(vkCreateSemaphore(core->GetDevice(), &presentSemaphoreCreateInfo, nullptr, &currentSwapchainResource.presentSemaphore));
 	}
 
 	return true;
@@ -256,17 +356,9 @@ bool Renderer::InitSwapchain()
 void Renderer::DestroySwapchain()
 {
 	for (auto &swapchainResource : swapchainResources) {
-		if (swapchainResource.fence) {
-			vkDestroyFence(core->GetDevice(), swapchainResource.fence, nullptr);
-			swapchainResource.fence = nullptr;
-		}
-		if (swapchainResource.startSemaphore) {
-			vkDestroySemaphore(core->GetDevice(), swapchainResource.startSemaphore, nullptr);
-			swapchainResource.startSemaphore = nullptr;
-		}
-		if (swapchainResource.endSemaphore) {
-			vkDestroySemaphore(core->GetDevice(), swapchainResource.endSemaphore, nullptr);
-			swapchainResource.endSemaphore = nullptr;
+		if (swapchainResource.presentSemaphore) {
+			vkDestroySemaphore(core->GetDevice(), swapchainResource.presentSemaphore, nullptr);
+			swapchainResource.presentSemaphore = nullptr;
 		}
 		if (swapchainResource.framebuffer) {
 			vkDestroyFramebuffer(core->GetDevice(), swapchainResource.framebuffer, nullptr);
@@ -276,10 +368,6 @@ void Renderer::DestroySwapchain()
 			vkDestroyImageView(core->GetDevice(), swapchainResource.imageView, nullptr);
 			swapchainResource.imageView = nullptr;
 		}
-		if (swapchainResource.commandBuffer) {
-			vkFreeCommandBuffers(core->GetDevice(), commandPool, 1, &swapchainResource.commandBuffer);
-			swapchainResource.commandBuffer = nullptr;
-		}
 	}
 	swapchainResources.clear();
 	if (renderPass) {
@@ -292,69 +380,874 @@ void Renderer::DestroySwapchain()
 	}
 }
 
+bool Renderer::InitPipelines(VkFormat format)
+{
+	VkPushConstantRange pushConstantRange = {
+		.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+		.offset = 0,
+		.size = sizeof(QuadPushConstants)
+	};
+	VkPipelineLayoutCreateInfo layoutCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		// Set 0 is only read by image.frag, quads leave it unbound
+		.setLayoutCount = 1,
+		.pSetLayouts = &imageSetLayout,
+		.pushConstantRangeCount = 1,
+		.pPushConstantRanges = &pushConstantRange
+	};
+	CHECK_VK_RESULT(vkCreatePipelineLayout(core->GetDevice(), &layoutCreateInfo, nullptr, &pipelineLayout));
+	if (!pipelineLayout)
+		return false;
+
+	// Straight from the embedded arrays, no files involved
+	VkShaderModule vertexModule = VK_NULL_HANDLE;
+	VkShaderModule fragmentModule = VK_NULL_HANDLE;
+	VkShaderModule imageFragmentModule = VK_NULL_HANDLE;
+	VkShaderModuleCreateInfo vertexCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.codeSize = sizeof(quadVertSpirv),
+		.pCode = quadVertSpirv
+	};
+	CHECK_VK_RESULT(vkCreateShaderModule(core->GetDevice(), &vertexCreateInfo, nullptr, &vertexModule));
+	VkShaderModuleCreateInfo fragmentCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.codeSize = sizeof(quadFragSpirv),
+		.pCode = quadFragSpirv
+	};
+	CHECK_VK_RESULT(vkCreateShaderModule(core->GetDevice(), &fragmentCreateInfo, nullptr, &fragmentModule));
+	VkShaderModuleCreateInfo imageFragmentCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.codeSize = sizeof(imageFragSpirv),
+		.pCode = imageFragSpirv
+	};
+	CHECK_VK_RESULT(vkCreateShaderModule(core->GetDevice(), &imageFragmentCreateInfo, nullptr, &imageFragmentModule));
+
+	bool created = vertexModule && fragmentModule && imageFragmentModule;
+	for (uint32_t variant = 0; created && variant < QuadVariantsCount; variant++) {
+		quadPipelines[variant] = CreatePipeline(vertexModule, fragmentModule, static_cast<QuadVariant>(variant), format);
+		imagePipelines[variant] = CreatePipeline(vertexModule, imageFragmentModule, static_cast<QuadVariant>(variant), format);
+		created = quadPipelines[variant] && imagePipelines[variant];
+	}
+
+	if (vertexModule)
+		vkDestroyShaderModule(core->GetDevice(), vertexModule, nullptr);
+	if (fragmentModule)
+		vkDestroyShaderModule(core->GetDevice(), fragmentModule, nullptr);
+	if (imageFragmentModule)
+		vkDestroyShaderModule(core->GetDevice(), imageFragmentModule, nullptr);
+	return created;
+}
+VkPipeline Renderer::CreatePipeline(VkShaderModule vertexModule, VkShaderModule fragmentModule, QuadVariant variant, VkFormat format)
+{
+	// constant_id 0 of quad.frag and image.frag: rounded corners
+	const VkBool32 rounded = variant == QuadVariantRounded;
+	VkSpecializationMapEntry specializationEntry = {
+		.constantID = 0,
+		.offset = 0,
+		.size = sizeof(rounded)
+	};
+	VkSpecializationInfo specializationInfo = {
+		.mapEntryCount = 1,
+		.pMapEntries = &specializationEntry,
+		.dataSize = sizeof(rounded),
+		.pData = &rounded
+	};
+	VkPipelineShaderStageCreateInfo stages[] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.pNext = nullptr,
+			.flags = 0,
+			.stage = VK_SHADER_STAGE_VERTEX_BIT,
+			.module = vertexModule,
+			.pName = "main",
+			.pSpecializationInfo = nullptr
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.pNext = nullptr,
+			.flags = 0,
+			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.module = fragmentModule,
+			.pName = "main",
+			.pSpecializationInfo = &specializationInfo
+		}
+	};
+	// Vertices come from gl_VertexIndex
+	VkPipelineVertexInputStateCreateInfo vertexInputState = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.vertexBindingDescriptionCount = 0,
+		.pVertexBindingDescriptions = nullptr,
+		.vertexAttributeDescriptionCount = 0,
+		.pVertexAttributeDescriptions = nullptr
+	};
+	VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
+		.primitiveRestartEnable = VK_FALSE
+	};
+	VkPipelineViewportStateCreateInfo viewportState = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.viewportCount = 1,
+		.pViewports = nullptr,
+		.scissorCount = 1,
+		.pScissors = nullptr
+	};
+	VkPipelineRasterizationStateCreateInfo rasterizationState = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.depthClampEnable = VK_FALSE,
+		.rasterizerDiscardEnable = VK_FALSE,
+		.polygonMode = VK_POLYGON_MODE_FILL,
+		.cullMode = VK_CULL_MODE_NONE,
+		.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+		.depthBiasEnable = VK_FALSE,
+		.depthBiasConstantFactor = 0.0f,
+		.depthBiasClamp = 0.0f,
+		.depthBiasSlopeFactor = 0.0f,
+		.lineWidth = 1.0f
+	};
+	VkPipelineMultisampleStateCreateInfo multisampleState = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+		.sampleShadingEnable = VK_FALSE,
+		.minSampleShading = 0.0f,
+		.pSampleMask = nullptr,
+		.alphaToCoverageEnable = VK_FALSE,
+		.alphaToOneEnable = VK_FALSE
+	};
+	// Premultiplied "over"
+	VkPipelineColorBlendAttachmentState blendAttachment = {
+		.blendEnable = VK_TRUE,
+		.srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
+		.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+		.colorBlendOp = VK_BLEND_OP_ADD,
+		.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+		.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+		.alphaBlendOp = VK_BLEND_OP_ADD,
+		.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT
+	};
+	VkPipelineColorBlendStateCreateInfo colorBlendState = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.logicOpEnable = VK_FALSE,
+		.logicOp = VK_LOGIC_OP_COPY,
+		.attachmentCount = 1,
+		.pAttachments = &blendAttachment,
+		.blendConstants = { 0.0f, 0.0f, 0.0f, 0.0f }
+	};
+	const VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.dynamicStateCount = static_cast<uint32_t>(std::size(dynamicStates)),
+		.pDynamicStates = dynamicStates
+	};
+	// Dynamic rendering only needs the attachment format, the 1.0 path the render pass
+	VkPipelineRenderingCreateInfo renderingCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
+		.pNext = nullptr,
+		.viewMask = 0,
+		.colorAttachmentCount = 1,
+		.pColorAttachmentFormats = &format,
+		.depthAttachmentFormat = VK_FORMAT_UNDEFINED,
+		.stencilAttachmentFormat = VK_FORMAT_UNDEFINED
+	};
+	VkGraphicsPipelineCreateInfo createInfo = {
+		.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+		.pNext = useVulkan13 ? &renderingCreateInfo : nullptr,
+		.flags = 0,
+		.stageCount = static_cast<uint32_t>(std::size(stages)),
+		.pStages = stages,
+		.pVertexInputState = &vertexInputState,
+		.pInputAssemblyState = &inputAssemblyState,
+		.pTessellationState = nullptr,
+		.pViewportState = &viewportState,
+		.pRasterizationState = &rasterizationState,
+		.pMultisampleState = &multisampleState,
+		.pDepthStencilState = nullptr,
+		.pColorBlendState = &colorBlendState,
+		.pDynamicState = &dynamicState,
+		.layout = pipelineLayout,
+		.renderPass = useVulkan13 ? VK_NULL_HANDLE : renderPass,
+		.subpass = 0,
+		.basePipelineHandle = VK_NULL_HANDLE,
+		.basePipelineIndex = -1
+	};
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	CHECK_VK_RESULT(vkCreateGraphicsPipelines(core->GetDevice(), VK_NULL_HANDLE, 1, &createInfo, nullptr, &pipeline));
+	return pipeline;
+}
+void Renderer::DestroyPipelines()
+{
+	for (auto pipelines : { &quadPipelines, &imagePipelines }) {
+		for (auto &pipeline : *pipelines) {
+			if (pipeline) {
+				vkDestroyPipeline(core->GetDevice(), pipeline, nullptr);
+				pipeline = VK_NULL_HANDLE;
+			}
+		}
+	}
+	if (pipelineLayout) {
+		vkDestroyPipelineLayout(core->GetDevice(), pipelineLayout, nullptr);
+		pipelineLayout = VK_NULL_HANDLE;
+	}
+	pipelinesFormat = VK_FORMAT_UNDEFINED;
+}
+
+bool Renderer::InitImages()
+{
+	VkDescriptorSetLayoutBinding binding = {
+		.binding = 0,
+		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.descriptorCount = 1,
+		.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+		.pImmutableSamplers = nullptr
+	};
+	VkDescriptorSetLayoutCreateInfo layoutCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.bindingCount = 1,
+		.pBindings = &binding
+	};
+	CHECK_VK_RESULT(vkCreateDescriptorSetLayout(core->GetDevice(), &layoutCreateInfo, nullptr, &imageSetLayout));
+
+	// One set per image, freed with the image
+	VkDescriptorPoolSize poolSize = {
+		.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.descriptorCount = maxImages
+	};
+	VkDescriptorPoolCreateInfo poolCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+		.maxSets = maxImages,
+		.poolSizeCount = 1,
+		.pPoolSizes = &poolSize
+	};
+	CHECK_VK_RESULT(vkCreateDescriptorPool(core->GetDevice(), &poolCreateInfo, nullptr, &imageDescriptorPool));
+
+	VkSamplerCreateInfo samplerCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.magFilter = VK_FILTER_LINEAR,
+		.minFilter = VK_FILTER_LINEAR,
+		.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+		.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.mipLodBias = 0.0f,
+		.anisotropyEnable = VK_FALSE,
+		.maxAnisotropy = 1.0f,
+		.compareEnable = VK_FALSE,
+		.compareOp = VK_COMPARE_OP_ALWAYS,
+		.minLod = 0.0f,
+		.maxLod = 0.0f,
+		.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+		.unnormalizedCoordinates = VK_FALSE
+	};
+	CHECK_VK_RESULT(vkCreateSampler(core->GetDevice(), &samplerCreateInfo, nullptr, &imageSampler));
+
+	return imageSetLayout && imageDescriptorPool && imageSampler;
+}
+void Renderer::DestroyImages()
+{
+	for (auto &image : images)
+		DestroyImage(image);
+	images.clear();
+	if (imageSampler) {
+		vkDestroySampler(core->GetDevice(), imageSampler, nullptr);
+		imageSampler = VK_NULL_HANDLE;
+	}
+	if (imageDescriptorPool) {
+		// Frees the sets as well
+		vkDestroyDescriptorPool(core->GetDevice(), imageDescriptorPool, nullptr);
+		imageDescriptorPool = VK_NULL_HANDLE;
+	}
+	if (imageSetLayout) {
+		vkDestroyDescriptorSetLayout(core->GetDevice(), imageSetLayout, nullptr);
+		imageSetLayout = VK_NULL_HANDLE;
+	}
+}
+void Renderer::DestroyImage(Renderer::Image &image)
+{
+	if (image.descriptorSet) {
+		vkFreeDescriptorSets(core->GetDevice(), imageDescriptorPool, 1, &image.descriptorSet);
+		image.descriptorSet = VK_NULL_HANDLE;
+	}
+	if (image.imageView) {
+		vkDestroyImageView(core->GetDevice(), image.imageView, nullptr);
+		image.imageView = VK_NULL_HANDLE;
+	}
+	if (image.image) {
+		vkDestroyImage(core->GetDevice(), image.image, nullptr);
+		image.image = VK_NULL_HANDLE;
+	}
+	if (image.memory) {
+		vkFreeMemory(core->GetDevice(), image.memory, nullptr);
+		image.memory = VK_NULL_HANDLE;
+	}
+}
+bool Renderer::CreateImage(Renderer::Image &image)
+{
+	VkImageCreateInfo createInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = VK_FORMAT_R8G8B8A8_UNORM,
+		.extent = { .width = image.width, .height = image.height, .depth = 1 },
+		.mipLevels = 1,
+		.arrayLayers = 1,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = 0,
+		.pQueueFamilyIndices = nullptr,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+	};
+	CHECK_VK_RESULT(vkCreateImage(core->GetDevice(), &createInfo, nullptr, &image.image));
+	if (!image.image)
+		return false;
+
+	VkMemoryRequirements requirements;
+	vkGetImageMemoryRequirements(core->GetDevice(), image.image, &requirements);
+	const uint32_t memoryType = FindMemoryType(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	if (memoryType == UINT32_MAX)
+		return false;
+	VkMemoryAllocateInfo allocateInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = nullptr,
+		.allocationSize = requirements.size,
+		.memoryTypeIndex = memoryType
+	};
+	CHECK_VK_RESULT(vkAllocateMemory(core->GetDevice(), &allocateInfo, nullptr, &image.memory));
+	if (!image.memory)
+		return false;
+	CHECK_VK_RESULT(vkBindImageMemory(core->GetDevice(), image.image, image.memory, 0));
+
+	VkImageViewCreateInfo viewCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.image = image.image,
+		.viewType = VK_IMAGE_VIEW_TYPE_2D,
+		.format = VK_FORMAT_R8G8B8A8_UNORM,
+		.components = VkComponentMapping{
+			.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+			.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+			.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+			.a = VK_COMPONENT_SWIZZLE_IDENTITY
+		},
+		.subresourceRange = VkImageSubresourceRange{
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		}
+	};
+	CHECK_VK_RESULT(vkCreateImageView(core->GetDevice(), &viewCreateInfo, nullptr, &image.imageView));
+	if (!image.imageView)
+		return false;
+
+	VkDescriptorSetAllocateInfo setAllocateInfo = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+		.pNext = nullptr,
+		.descriptorPool = imageDescriptorPool,
+		.descriptorSetCount = 1,
+		.pSetLayouts = &imageSetLayout
+	};
+	CHECK_VK_RESULT(vkAllocateDescriptorSets(core->GetDevice(), &setAllocateInfo, &image.descriptorSet));
+	if (!image.descriptorSet)
+		return false;
+	VkDescriptorImageInfo imageInfo = {
+		.sampler = imageSampler,
+		.imageView = image.imageView,
+		.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+	};
+	VkWriteDescriptorSet write = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.pNext = nullptr,
+		.dstSet = image.descriptorSet,
+		.dstBinding = 0,
+		.dstArrayElement = 0,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.pImageInfo = &imageInfo,
+		.pBufferInfo = nullptr,
+		.pTexelBufferView = nullptr
+	};
+	vkUpdateDescriptorSets(core->GetDevice(), 1, &write, 0, nullptr);
+	return true;
+}
+bool Renderer::UploadImage(Renderer::Image &image, std::span<const uint8_t> pixels)
+{
+	// Icons are a few KiB and change rarely, a staging buffer per upload is simpler than keeping one around
+	VkBuffer stagingBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory stagingMemory = VK_NULL_HANDLE;
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	bool uploaded = false;
+	do {
+		VkBufferCreateInfo bufferCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+			.pNext = nullptr,
+			.flags = 0,
+			.size = pixels.size(),
+			.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+			.queueFamilyIndexCount = 0,
+			.pQueueFamilyIndices = nullptr
+		};
+		CHECK_VK_RESULT(vkCreateBuffer(core->GetDevice(), &bufferCreateInfo, nullptr, &stagingBuffer));
+		if (!stagingBuffer)
+			break;
+		VkMemoryRequirements requirements;
+		vkGetBufferMemoryRequirements(core->GetDevice(), stagingBuffer, &requirements);
+		const uint32_t memoryType = FindMemoryType(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		if (memoryType == UINT32_MAX)
+			break;
+		VkMemoryAllocateInfo allocateInfo = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.pNext = nullptr,
+			.allocationSize = requirements.size,
+			.memoryTypeIndex = memoryType
+		};
+		CHECK_VK_RESULT(vkAllocateMemory(core->GetDevice(), &allocateInfo, nullptr, &stagingMemory));
+		if (!stagingMemory)
+			break;
+		CHECK_VK_RESULT(vkBindBufferMemory(core->GetDevice(), stagingBuffer, stagingMemory, 0));
+		void *mapped = nullptr;
+		CHECK_VK_RESULT(vkMapMemory(core->GetDevice(), stagingMemory, 0, pixels.size(), 0, &mapped));
+		if (!mapped)
+			break;
+		std::memcpy(mapped, pixels.data(), pixels.size());
+		vkUnmapMemory(core->GetDevice(), stagingMemory);
+
+		VkCommandBufferAllocateInfo cbAllocInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			.pNext = nullptr,
+			.commandPool = regionCommandPool,
+			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			.commandBufferCount = 1
+		};
+		CHECK_VK_RESULT(vkAllocateCommandBuffers(core->GetDevice(), &cbAllocInfo, &commandBuffer));
+		if (!commandBuffer)
+			break;
+		VkCommandBufferBeginInfo beginInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+			.pNext = nullptr,
+			.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+			.pInheritanceInfo = nullptr
+		};
+		CHECK_VK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+		const VkImageSubresourceRange range = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		};
+		// The old contents are overwritten entirely, so they're discarded
+		VkImageMemoryBarrier toTransfer = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.pNext = nullptr,
+			.srcAccessMask = 0,
+			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = image.image,
+			.subresourceRange = range
+		};
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toTransfer);
+		VkBufferImageCopy region = {
+			.bufferOffset = 0,
+			.bufferRowLength = 0,
+			.bufferImageHeight = 0,
+			.imageSubresource = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.mipLevel = 0,
+				.baseArrayLayer = 0,
+				.layerCount = 1
+			},
+			.imageOffset = { .x = 0, .y = 0, .z = 0 },
+			.imageExtent = { .width = image.width, .height = image.height, .depth = 1 }
+		};
+		vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+		VkImageMemoryBarrier toShader = toTransfer;
+		toShader.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		toShader.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		toShader.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		toShader.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toShader);
+		CHECK_VK_RESULT(vkEndCommandBuffer(commandBuffer));
+
+		VkFenceCreateInfo fenceCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+			.pNext = nullptr,
+			.flags = 0
+		};
+		CHECK_VK_RESULT(vkCreateFence(core->GetDevice(), &fenceCreateInfo, nullptr, &fence));
+		if (!fence)
+			break;
+		VkSubmitInfo submitInfo = {
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			.pNext = nullptr,
+			.waitSemaphoreCount = 0,
+			.pWaitSemaphores = nullptr,
+			.pWaitDstStageMask = nullptr,
+			.commandBufferCount = 1,
+			.pCommandBuffers = &commandBuffer,
+			.signalSemaphoreCount = 0,
+			.pSignalSemaphores = nullptr
+		};
+		{
+			std::lock_guard lock(core->GetQueueMutex());
+			CHECK_VK_RESULT(vkQueueSubmit(graphicsQueue, 1, &submitInfo, fence));
+		}
+		uploaded = vkWaitForFences(core->GetDevice(), 1, &fence, VK_TRUE, std::numeric_limits<uint64_t>::max()) == VK_SUCCESS;
+	} while (false);
+
+	if (fence)
+		vkDestroyFence(core->GetDevice(), fence, nullptr);
+	if (commandBuffer)
+		vkFreeCommandBuffers(core->GetDevice(), regionCommandPool, 1, &commandBuffer);
+	if (stagingBuffer)
+		vkDestroyBuffer(core->GetDevice(), stagingBuffer, nullptr);
+	if (stagingMemory)
+		vkFreeMemory(core->GetDevice(), stagingMemory, nullptr);
+	return uploaded;
+}
+bool Renderer::CaptureFrame(std::vector<uint8_t> &pixels, VkExtent2D &capturedExtent)
+{
+	if (!swapchain || !swapchainReadable)
+		return false;
+	// wl_shm's ARGB8888 is BGRA in memory, RGBA images are swizzled while copying out
+	bool swizzle = false;
+	switch (pipelinesFormat) {
+	case VK_FORMAT_B8G8R8A8_UNORM:
+	case VK_FORMAT_B8G8R8A8_SRGB:
+		break;
+	case VK_FORMAT_R8G8B8A8_UNORM:
+	case VK_FORMAT_R8G8B8A8_SRGB:
+		swizzle = true;
+		break;
+	default:
+		return false;
+	}
+
+	const VkDeviceSize size = static_cast<VkDeviceSize>(extent.width) * extent.height * 4;
+	bool copied = false;
+	do {
+		VkBufferCreateInfo bufferCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+			.pNext = nullptr,
+			.flags = 0,
+			.size = size,
+			.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+			.queueFamilyIndexCount = 0,
+			.pQueueFamilyIndices = nullptr
+		};
+		CHECK_VK_RESULT(vkCreateBuffer(core->GetDevice(), &bufferCreateInfo, nullptr, &captureBuffer));
+		if (!captureBuffer)
+			break;
+		VkMemoryRequirements requirements;
+		vkGetBufferMemoryRequirements(core->GetDevice(), captureBuffer, &requirements);
+		const uint32_t memoryType = FindMemoryType(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		if (memoryType == UINT32_MAX)
+			break;
+		VkMemoryAllocateInfo allocateInfo = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.pNext = nullptr,
+			.allocationSize = requirements.size,
+			.memoryTypeIndex = memoryType
+		};
+		CHECK_VK_RESULT(vkAllocateMemory(core->GetDevice(), &allocateInfo, nullptr, &captureMemory));
+		if (!captureMemory)
+			break;
+		CHECK_VK_RESULT(vkBindBufferMemory(core->GetDevice(), captureBuffer, captureMemory, 0));
+
+		captureExtent = extent;
+		captured = false;
+		const bool rendered = Render();
+		WaitFrames();
+		if (!rendered || !captured)
+			break;
+
+		void *mapped = nullptr;
+		CHECK_VK_RESULT(vkMapMemory(core->GetDevice(), captureMemory, 0, size, 0, &mapped));
+		if (!mapped)
+			break;
+		pixels.resize(size);
+		std::memcpy(pixels.data(), mapped, size);
+		vkUnmapMemory(core->GetDevice(), captureMemory);
+		if (swizzle) {
+			for (std::size_t i = 0; i < pixels.size(); i += 4)
+				std::swap(pixels[i], pixels[i + 2]);
+		}
+		capturedExtent = captureExtent;
+		copied = true;
+	} while (false);
+
+	if (captureBuffer)
+		vkDestroyBuffer(core->GetDevice(), captureBuffer, nullptr);
+	if (captureMemory)
+		vkFreeMemory(core->GetDevice(), captureMemory, nullptr);
+	captureBuffer = VK_NULL_HANDLE;
+	captureMemory = VK_NULL_HANDLE;
+	captured = false;
+	return copied;
+}
+
+uint32_t Renderer::FindMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const
+{
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	vkGetPhysicalDeviceMemoryProperties(core->GetPhysicalDevice(), &memoryProperties);
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+		if ((typeBits & (1u << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
+			return i;
+	}
+	return UINT32_MAX;
+}
+void Renderer::WaitFrames()
+{
+	if (useVulkan13) {
+		WaitTimeline(frameTimelineValue);
+		return;
+	}
+	for (auto &frameResource : frameResources) {
+		CHECK_VK_RESULT(vkWaitForFences(core->GetDevice(), 1, &frameResource.fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+	}
+}
+
+void Renderer::WaitTimeline(uint64_t value)
+{
+	// 0 is the initial value, nothing was submitted yet
+	if (!value)
+		return;
+	VkSemaphoreWaitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.pNext = nullptr,
+		.flags = 0,
+		.semaphoreCount = 1,
+		.pSemaphores = &frameTimeline,
+		.pValues = &value
+	};
+	CHECK_VK_RESULT(core->GetVulkan13()->waitSemaphores(core->GetDevice(), &waitInfo, std::numeric_limits<uint64_t>::max()));
+}
+
+bool Renderer::InitRegions()
+{
+	// Regions are re-recorded one by one, so they need individually resettable buffers
+	VkCommandPoolCreateInfo createInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.pNext = nullptr,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+		.queueFamilyIndex = core->GetQueueFamilyIndex()
+	};
+	CHECK_VK_RESULT(vkCreateCommandPool(core->GetDevice(), &createInfo, nullptr, &regionCommandPool));
+
+	return regionCommandPool != nullptr;
+}
+void Renderer::DestroyRegions()
+{
+	regions.clear();
+	regionsGeneration++;
+	regionCommandBuffers = {};
+	if (regionCommandPool) {
+		// Frees all the region buffers as well
+		vkDestroyCommandPool(core->GetDevice(), regionCommandPool, nullptr);
+		regionCommandPool = nullptr;
+	}
+}
+bool Renderer::RecordRegions()
+{
+	regionCommandBuffers = frameArena.AllocateArray<VkCommandBuffer>(regions.size());
+	std::size_t regionIndex = 0;
+	for (auto &region : regions) {
+		auto &cache = region.caches[currentFrame];
+		if (!cache.commandBuffer) {
+			VkCommandBufferAllocateInfo cbAllocInfo = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+				.pNext = nullptr,
+				.commandPool = regionCommandPool,
+				.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+				.commandBufferCount = 1
+			};
+			CHECK_VK_RESULT(vkAllocateCommandBuffers(core->GetDevice(), &cbAllocInfo, &cache.commandBuffer));
+			if (!cache.commandBuffer)
+				return false;
+		}
+
+		if (cache.layoutGeneration != layoutGeneration || cache.contentGeneration != region.contentGeneration) {
+			// No framebuffer, so the same buffer is valid for every swapchain image
+			VkCommandBufferInheritanceRenderingInfo renderingInfo = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+				.pNext = nullptr,
+				.flags = 0,
+				.viewMask = 0,
+				.colorAttachmentCount = 1,
+				.pColorAttachmentFormats = &pipelinesFormat,
+				.depthAttachmentFormat = VK_FORMAT_UNDEFINED,
+				.stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+				.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT
+			};
+			VkCommandBufferInheritanceInfo inheritanceInfo = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+				.pNext = useVulkan13 ? &renderingInfo : nullptr,
+				.renderPass = renderPass,
+				.subpass = 0,
+				.framebuffer = VK_NULL_HANDLE,
+				.occlusionQueryEnable = VK_FALSE,
+				.queryFlags = 0,
+				.pipelineStatistics = 0
+			};
+			VkCommandBufferBeginInfo beginInfo = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+				.pNext = nullptr,
+				.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+				.pInheritanceInfo = &inheritanceInfo
+			};
+			CHECK_VK_RESULT(vkBeginCommandBuffer(cache.commandBuffer, &beginInfo));
+			if (region.record)
+				region.record(cache.commandBuffer, region.area, this);
+			CHECK_VK_RESULT(vkEndCommandBuffer(cache.commandBuffer));
+
+			cache.layoutGeneration = layoutGeneration;
+			cache.contentGeneration = region.contentGeneration;
+			recordedRegionsCount++;
+		}
+
+		regionCommandBuffers[regionIndex++] = cache.commandBuffer;
+	}
+
+	return true;
+}
+
 bool Renderer::Render()
 {
-	// Wait for previous frame
-	auto &currentSwapchainResource = swapchainResources[currentFrame];
+	NCBAR_TRACE_PHASES(phases, "render");
+	NCBAR_TRACE_PHASE(phases, "Acquire");
+	// Back from Trim(), the regions are recorded again for the new swapchain
+	if (!swapchain && !OnResize())
+		return false;
+	// Wait until the GPU is done with the previous use of this frame's resources
+	auto &currentFrameResource = frameResources[currentFrame];
 
-	CHECK_VK_RESULT(vkWaitForFences(core->GetDevice(), 1, &currentSwapchainResource.fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
-	VkResult result = vkAcquireNextImageKHR(core->GetDevice(), swapchain, std::numeric_limits<uint64_t>::max(), currentSwapchainResource.startSemaphore, VK_NULL_HANDLE, &nextFrame);
-	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
-		CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
+	if (useVulkan13)
+		WaitTimeline(currentFrameResource.timelineValue);
+	else
+		CHECK_VK_RESULT(vkWaitForFences(core->GetDevice(), 1, &currentFrameResource.fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+	VkResult result = vkAcquireNextImageKHR(core->GetDevice(), swapchain, std::numeric_limits<uint64_t>::max(), currentFrameResource.acquireSemaphore, VK_NULL_HANDLE, &currentImage);
+	if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+		// Nothing was acquired, so the semaphore stays unsignalled and the fence untouched
+		{
+			std::lock_guard lock(core->GetQueueMutex());
+			CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
+		}
 		return OnResize();
 	}
 	else if (result < VK_SUCCESS) {
 		CHECK_VK_RESULT(result);
+		return false;
 	}
+	// VK_SUBOPTIMAL_KHR still signals the semaphore, so the frame is finished and the swapchain is recreated after presenting
+	bool suboptimal = result == VK_SUBOPTIMAL_KHR;
 
-	auto &nextSwapchainResource = swapchainResources[nextFrame];
-	if (nextSwapchainResource.lastFence) {
-		CHECK_VK_RESULT(vkWaitForFences(core->GetDevice(), 1, &nextSwapchainResource.lastFence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
-	}
-	nextSwapchainResource.lastFence = currentSwapchainResource.fence;
+	auto &currentSwapchainResource = swapchainResources[currentImage];
 
-	CHECK_VK_RESULT(vkResetFences(core->GetDevice(), 1, &currentSwapchainResource.fence));
+	NCBAR_TRACE_PHASE(phases, "Record");
+	CHECK_VK_RESULT(vkResetCommandPool(core->GetDevice(), currentFrameResource.commandPool, 0));
+	frameArena.Reset();
 	VkCommandBufferBeginInfo beginInfo {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
 		.pNext = nullptr,
 		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
 		.pInheritanceInfo = nullptr
 	};
-	CHECK_VK_RESULT(vkBeginCommandBuffer(nextSwapchainResource.commandBuffer, &beginInfo));
+	CHECK_VK_RESULT(vkBeginCommandBuffer(currentFrameResource.commandBuffer, &beginInfo));
 
-	// Prepare the current frame
-	if (callbackOnPresent) {
-		if (!callbackOnPresent(nextFrame, this))
-			return false;
+	if (laidOutGeneration != layoutGeneration) {
+		laidOutGeneration = layoutGeneration;
+		if (callbackOnLayout)
+			callbackOnLayout(extent, this);
 	}
 
+	if (!RecordRegions()) {
+		DiscardFrame();
+		return false;
+	}
+
+	// The primary buffer only replays the cached regions
+	BeginRendering(currentFrameResource.commandBuffer);
+	if (!regionCommandBuffers.empty())
+		vkCmdExecuteCommands(currentFrameResource.commandBuffer, static_cast<uint32_t>(regionCommandBuffers.size()), regionCommandBuffers.data());
+	EndRendering(currentFrameResource.commandBuffer);
+	if (captureBuffer)
+		RecordCapture(currentFrameResource.commandBuffer);
+
 	// Present the current frame
-	CHECK_VK_RESULT(vkEndCommandBuffer(nextSwapchainResource.commandBuffer));
-	const VkPipelineStageFlags waitStageFlag = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	VkSubmitInfo submitInfo = {
-		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-		.pNext = nullptr,
-		.waitSemaphoreCount = 1,
-		.pWaitSemaphores = &currentSwapchainResource.startSemaphore,
-		.pWaitDstStageMask = &waitStageFlag,
-		.commandBufferCount = 1,
-		.pCommandBuffers = &nextSwapchainResource.commandBuffer,
-		.signalSemaphoreCount = 1,
-		.pSignalSemaphores = &currentSwapchainResource.endSemaphore
-	};
-	CHECK_VK_RESULT(vkQueueSubmit(graphicsQueue, 1, &submitInfo, currentSwapchainResource.fence));
+	NCBAR_TRACE_PHASE(phases, "Submit");
+	CHECK_VK_RESULT(vkEndCommandBuffer(currentFrameResource.commandBuffer));
+	if (!Submit()) {
+		DiscardFrame();
+		return false;
+	}
 	VkPresentInfoKHR presentInfo = {
 		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
 		.pNext = nullptr,
 		.waitSemaphoreCount = 1,
-		.pWaitSemaphores = &currentSwapchainResource.endSemaphore,
+		.pWaitSemaphores = &currentSwapchainResource.presentSemaphore,
 		.swapchainCount = 1,
 		.pSwapchains = &swapchain,
-		.pImageIndices = &nextFrame,
+		.pImageIndices = &currentImage,
 		.pResults = nullptr
 	};
-	result = vkQueuePresentKHR(graphicsQueue, &presentInfo);
-	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+	NCBAR_TRACE_PHASE(phases, "Present");
+	if (auto window = GetWindow()) {
+		window->ApplySurfaceState();
+		window->RequestPresentationFeedback();
+		window->RequestFrameCallback();
+	}
+	{
+		// Mailbox presents don't block, the lock is held for a moment
+		std::lock_guard lock(core->GetQueueMutex());
+		result = vkQueuePresentKHR(graphicsQueue, &presentInfo);
+	}
+
+	currentFrame = (currentFrame + 1) % framesInFlight;
+	NCBAR_TRACE_END(phases);
+
+	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || suboptimal) {
+		{
+			std::lock_guard lock(core->GetQueueMutex());
+			CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
+		}
 		if (!OnResize())
 			return false;
 	}
@@ -362,23 +1255,523 @@ bool Renderer::Render()
 		CHECK_VK_RESULT(result);
 	}
 
-	currentFrame = (currentFrame + 1) % framesCount;
+	return true;
+}
 
+void Renderer::BeginRendering(VkCommandBuffer commandBuffer)
+{
+	const auto &swapchainResource = swapchainResources[currentImage];
+	VkClearValue clearValue = { .color = clearColor };
+	const VkRect2D renderArea = {
+		.offset = VkOffset2D{ .x = 0, .y = 0 },
+		.extent = extent
+	};
+	if (!useVulkan13) {
+		VkRenderPassBeginInfo renderPassBeginInfo = {
+			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+			.pNext = nullptr,
+			.renderPass = renderPass,
+			.framebuffer = swapchainResource.framebuffer,
+			.renderArea = renderArea,
+			.clearValueCount = 1,
+			.pClearValues = &clearValue
+		};
+		vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		return;
+	}
+
+	// The image is cleared, so whatever it held is discarded. The transition waits for the acquire semaphore, which
+	// the submit waits for at the same stage
+	VkImageMemoryBarrier2 barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+		.pNext = nullptr,
+		.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+		.srcAccessMask = VK_ACCESS_2_NONE,
+		.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+		.dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = swapchainResource.image,
+		.subresourceRange = VkImageSubresourceRange{
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		}
+	};
+	VkDependencyInfo dependencyInfo = {
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.pNext = nullptr,
+		.dependencyFlags = 0,
+		.memoryBarrierCount = 0,
+		.pMemoryBarriers = nullptr,
+		.bufferMemoryBarrierCount = 0,
+		.pBufferMemoryBarriers = nullptr,
+		.imageMemoryBarrierCount = 1,
+		.pImageMemoryBarriers = &barrier
+	};
+	core->GetVulkan13()->cmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+
+	VkRenderingAttachmentInfo colorAttachment = {
+		.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+		.pNext = nullptr,
+		.imageView = swapchainResource.imageView,
+		.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+		.resolveMode = VK_RESOLVE_MODE_NONE,
+		.resolveImageView = VK_NULL_HANDLE,
+		.resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+		.clearValue = clearValue
+	};
+	VkRenderingInfo renderingInfo = {
+		.sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+		.pNext = nullptr,
+		.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
+		.renderArea = renderArea,
+		.layerCount = 1,
+		.viewMask = 0,
+		.colorAttachmentCount = 1,
+		.pColorAttachments = &colorAttachment,
+		.pDepthAttachment = nullptr,
+		.pStencilAttachment = nullptr
+	};
+	core->GetVulkan13()->cmdBeginRendering(commandBuffer, &renderingInfo);
+}
+
+void Renderer::EndRendering(VkCommandBuffer commandBuffer)
+{
+	if (!useVulkan13) {
+		vkCmdEndRenderPass(commandBuffer);
+		return;
+	}
+
+	core->GetVulkan13()->cmdEndRendering(commandBuffer);
+	// Nothing in this submit touches the image afterwards, the present semaphore carries the dependency
+	VkImageMemoryBarrier2 barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+		.pNext = nullptr,
+		.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+		.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+		.dstStageMask = VK_PIPELINE_STAGE_2_NONE,
+		.dstAccessMask = VK_ACCESS_2_NONE,
+		.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+		.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = swapchainResources[currentImage].image,
+		.subresourceRange = VkImageSubresourceRange{
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		}
+	};
+	VkDependencyInfo dependencyInfo = {
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.pNext = nullptr,
+		.dependencyFlags = 0,
+		.memoryBarrierCount = 0,
+		.pMemoryBarriers = nullptr,
+		.bufferMemoryBarrierCount = 0,
+		.pBufferMemoryBarriers = nullptr,
+		.imageMemoryBarrierCount = 1,
+		.pImageMemoryBarriers = &barrier
+	};
+	core->GetVulkan13()->cmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+void Renderer::RecordCapture(VkCommandBuffer commandBuffer)
+{
+	// A resize on acquire, the frame doesn't fit the buffer
+	if (extent.width != captureExtent.width || extent.height != captureExtent.height)
+		return;
+
+	// Both rendering paths leave the image ready to present, it goes back to that layout after the copy
+	VkImageMemoryBarrier toTransfer = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.pNext = nullptr,
+		.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = swapchainResources[currentImage].image,
+		.subresourceRange = VkImageSubresourceRange{
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		}
+	};
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toTransfer);
+	VkBufferImageCopy region = {
+		.bufferOffset = 0,
+		.bufferRowLength = 0,
+		.bufferImageHeight = 0,
+		.imageSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.mipLevel = 0,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		},
+		.imageOffset = { .x = 0, .y = 0, .z = 0 },
+		.imageExtent = { .width = extent.width, .height = extent.height, .depth = 1 }
+	};
+	vkCmdCopyImageToBuffer(commandBuffer, toTransfer.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, captureBuffer, 1, &region);
+
+	VkImageMemoryBarrier toPresent = toTransfer;
+	toPresent.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	toPresent.dstAccessMask = 0;
+	toPresent.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	toPresent.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	VkBufferMemoryBarrier toHost = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		.pNext = nullptr,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.buffer = captureBuffer,
+		.offset = 0,
+		.size = VK_WHOLE_SIZE
+	};
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &toHost, 1, &toPresent);
+	captured = true;
+}
+
+bool Renderer::Submit()
+{
+	auto &frameResource = frameResources[currentFrame];
+	auto &swapchainResource = swapchainResources[currentImage];
+	if (!useVulkan13) {
+		const VkPipelineStageFlags waitStageFlag = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		VkSubmitInfo submitInfo = {
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			.pNext = nullptr,
+			.waitSemaphoreCount = 1,
+			.pWaitSemaphores = &frameResource.acquireSemaphore,
+			.pWaitDstStageMask = &waitStageFlag,
+			.commandBufferCount = 1,
+			.pCommandBuffers = &frameResource.commandBuffer,
+			.signalSemaphoreCount = 1,
+			.pSignalSemaphores = &swapchainResource.presentSemaphore
+		};
+		// Reset only now, callbacks that remove regions or images wait for every frame's fence while recording
+		CHECK_VK_RESULT(vkResetFences(core->GetDevice(), 1, &frameResource.fence));
+		std::lock_guard lock(core->GetQueueMutex());
+		const VkResult result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, frameResource.fence);
+		CHECK_VK_RESULT(result);
+		return result == VK_SUCCESS;
+	}
+
+	VkSemaphoreSubmitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.pNext = nullptr,
+		.semaphore = frameResource.acquireSemaphore,
+		.value = 0,
+		.stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+		.deviceIndex = 0
+	};
+	// The present transition is the last command, so both wait for everything
+	VkSemaphoreSubmitInfo signalInfos[] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.pNext = nullptr,
+			.semaphore = swapchainResource.presentSemaphore,
+			.value = 0,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			.deviceIndex = 0
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.pNext = nullptr,
+			.semaphore = frameTimeline,
+			.value = frameTimelineValue + 1,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			.deviceIndex = 0
+		}
+	};
+	VkCommandBufferSubmitInfo commandBufferInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+		.pNext = nullptr,
+		.commandBuffer = frameResource.commandBuffer,
+		.deviceMask = 0
+	};
+	VkSubmitInfo2 submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+		.pNext = nullptr,
+		.flags = 0,
+		.waitSemaphoreInfoCount = 1,
+		.pWaitSemaphoreInfos = &waitInfo,
+		.commandBufferInfoCount = 1,
+		.pCommandBufferInfos = &commandBufferInfo,
+		.signalSemaphoreInfoCount = static_cast<uint32_t>(std::size(signalInfos)),
+		.pSignalSemaphoreInfos = signalInfos
+	};
+	std::lock_guard lock(core->GetQueueMutex());
+	const VkResult result = core->GetVulkan13()->queueSubmit2(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+	CHECK_VK_RESULT(result);
+	if (result != VK_SUCCESS)
+		return false;
+	// A value that never gets signalled would be waited for forever, so it's taken only once submitted
+	frameResource.timelineValue = ++frameTimelineValue;
 	return true;
 }
 
+void Renderer::DiscardFrame()
+{
+	auto &frameResource = frameResources[currentFrame];
+	if (!useVulkan13) {
+		const VkPipelineStageFlags waitStageFlag = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+		VkSubmitInfo submitInfo = {
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			.pNext = nullptr,
+			.waitSemaphoreCount = 1,
+			.pWaitSemaphores = &frameResource.acquireSemaphore,
+			.pWaitDstStageMask = &waitStageFlag,
+			.commandBufferCount = 0,
+			.pCommandBuffers = nullptr,
+			.signalSemaphoreCount = 0,
+			.pSignalSemaphores = nullptr
+		};
+		// The fence may be reset already if the frame's own submit failed
+		CHECK_VK_RESULT(vkResetFences(core->GetDevice(), 1, &frameResource.fence));
+		std::lock_guard lock(core->GetQueueMutex());
+		CHECK_VK_RESULT(vkQueueSubmit(graphicsQueue, 1, &submitInfo, frameResource.fence));
+		return;
+	}
+
+	VkSemaphoreSubmitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.pNext = nullptr,
+		.semaphore = frameResource.acquireSemaphore,
+		.value = 0,
+		.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+		.deviceIndex = 0
+	};
+	VkSemaphoreSubmitInfo signalInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.pNext = nullptr,
+		.semaphore = frameTimeline,
+		.value = frameTimelineValue + 1,
+		.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+		.deviceIndex = 0
+	};
+	VkSubmitInfo2 submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+		.pNext = nullptr,
+		.flags = 0,
+		.waitSemaphoreInfoCount = 1,
+		.pWaitSemaphoreInfos = &waitInfo,
+		.commandBufferInfoCount = 0,
+		.pCommandBufferInfos = nullptr,
+		.signalSemaphoreInfoCount = 1,
+		.pSignalSemaphoreInfos = &signalInfo
+	};
+	std::lock_guard lock(core->GetQueueMutex());
+	const VkResult result = core->GetVulkan13()->queueSubmit2(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+	CHECK_VK_RESULT(result);
+	if (result == VK_SUCCESS)
+		frameResource.timelineValue = ++frameTimelineValue;
+}
+
 bool Renderer::OnResize()
 {
+	NCBAR_TRACE_SCOPE("render", "Renderer::OnResize");
 	DestroySwapchain();
 	if (!InitSwapchain())
 		return false;
 
-	currentFrame = 0;
+	// Cached regions refer to the old render pass and old sizes
+	layoutGeneration++;
+
+	return true;
+}
+
+void Renderer::Trim()
+{
+	if (!swapchain)
+		return;
+	NCBAR_TRACE_SCOPE("render", "Renderer::Trim");
+	{
+		std::lock_guard lock(core->GetQueueMutex());
+		CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
+	}
+	DestroySwapchain();
+
+	// Secondary buffers go back to the pool, they are allocated and recorded again on the first visible frame
+	regionCommandBuffers = {};
+	for (auto &region : regions) {
+		for (auto &cache : region.caches) {
+			if (cache.commandBuffer)
+				vkFreeCommandBuffers(core->GetDevice(), regionCommandPool, 1, &cache.commandBuffer);
+			cache = {};
+		}
+	}
+	if (regionCommandPool)
+		CHECK_VK_RESULT(vkResetCommandPool(core->GetDevice(), regionCommandPool, VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT));
+	for (auto &frameResource : frameResources) {
+		if (frameResource.commandPool)
+			CHECK_VK_RESULT(vkResetCommandPool(core->GetDevice(), frameResource.commandPool, VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT));
+	}
+	frameArena.Shrink();
+	layoutGeneration++;
+}
+
+void Renderer::SetOnLayout(OnLayoutCallbackType onLayout)
+{
+	callbackOnLayout = onLayout;
+	layoutGeneration++;
+}
+
+void Renderer::SetRegion(uint32_t id, VkRect2D area, RecordRegionCallbackType record)
+{
+	auto it = std::lower_bound(regions.begin(), regions.end(), id, [](const Region &region, uint32_t id) { return region.id < id; });
+	if (it == regions.end() || it->id != id) {
+		it = regions.insert(it, Region{ .id = id, .area = {}, .record = nullptr, .contentGeneration = 1, .caches = std::vector<Region::Cache>(framesInFlight) });
+		regionsGeneration++;
+	}
+	else if (it->area.offset.x != area.offset.x || it->area.offset.y != area.offset.y || it->area.extent.width != area.extent.width || it->area.extent.height != area.extent.height) {
+		regionsGeneration++;
+	}
+	it->area = area;
+	it->record = record;
+	it->contentGeneration++;
+}
+
+void Renderer::RemoveRegion(uint32_t id)
+{
+	auto it = std::lower_bound(regions.begin(), regions.end(), id, [](const Region &region, uint32_t id) { return region.id < id; });
+	if (it == regions.end() || it->id != id)
+		return;
+
+	// Buffers of every frame in flight may still be pending
+	WaitFrames();
+	for (auto &cache : it->caches) {
+		if (cache.commandBuffer)
+			vkFreeCommandBuffers(core->GetDevice(), regionCommandPool, 1, &cache.commandBuffer);
+	}
+	regions.erase(it);
+	regionsGeneration++;
+}
+
+void Renderer::DrawQuad(VkCommandBuffer commandBuffer, const VkRect2D &rect, VkClearColorValue color, float radius)
+{
+	const auto variant = radius > 0.0f ? QuadVariantRounded : QuadVariantPlain;
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, quadPipelines[variant]);
+	VkViewport viewport = {
+		.x = 0.0f,
+		.y = 0.0f,
+		.width = static_cast<float>(extent.width),
+		.height = static_cast<float>(extent.height),
+		.minDepth = 0.0f,
+		.maxDepth = 1.0f
+	};
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+	vkCmdSetScissor(commandBuffer, 0, 1, &rect);
+	QuadPushConstants pushConstants = {
+		.rect = { static_cast<float>(rect.offset.x), static_cast<float>(rect.offset.y), static_cast<float>(rect.extent.width), static_cast<float>(rect.extent.height) },
+		.color = { color.float32[0], color.float32[1], color.float32[2], color.float32[3] },
+		.viewport = { static_cast<float>(extent.width), static_cast<float>(extent.height) },
+		.radius = radius
+	};
+	vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(pushConstants), &pushConstants);
+	vkCmdDraw(commandBuffer, 4, 1, 0, 0);
+}
 
+void Renderer::InvalidateRegion(uint32_t id)
+{
+	auto it = std::lower_bound(regions.begin(), regions.end(), id, [](const Region &region, uint32_t id) { return region.id < id; });
+	if (it != regions.end() && it->id == id)
+		it->contentGeneration++;
+}
+
+bool Renderer::SetImage(uint32_t id, uint32_t width, uint32_t height, std::span<const uint8_t> pixels)
+{
+	NCBAR_TRACE_SCOPE("render", "Renderer::SetImage");
+	if (!width || !height || pixels.size() != static_cast<std::size_t>(width) * height * 4)
+		return false;
+	auto it = std::lower_bound(images.begin(), images.end(), id, [](const Image &image, uint32_t id) { return image.id < id; });
+	const bool existing = it != images.end() && it->id == id;
+	if (!existing && images.size() >= maxImages) {
+		NCBAR_LOG_ERROR << "Vulkan: Too many images";
+		return false;
+	}
+
+	// Frames in flight may still sample the old contents
+	WaitFrames();
+	if (existing && it->width == width && it->height == height)
+		return UploadImage(*it, pixels);
+
+	if (existing)
+		DestroyImage(*it);
+	else {
+		Image image;
+		image.id = id;
+		it = images.insert(it, image);
+	}
+	it->width = width;
+	it->height = height;
+	// Recorded regions refer to the old descriptor set
+	InvalidateLayout();
+	if (!CreateImage(*it) || !UploadImage(*it, pixels)) {
+		NCBAR_LOG_ERROR << "Vulkan: Failed to create image";
+		DestroyImage(*it);
+		images.erase(it);
+		return false;
+	}
 	return true;
 }
 
-void Renderer::SetOnPresent(OnPresentCallbackType onPresent)
+void Renderer::RemoveImage(uint32_t id)
 {
-	callbackOnPresent = onPresent;
+	auto it = std::lower_bound(images.begin(), images.end(), id, [](const Image &image, uint32_t id) { return image.id < id; });
+	if (it == images.end() || it->id != id)
+		return;
+	WaitFrames();
+	DestroyImage(*it);
+	images.erase(it);
+	InvalidateLayout();
+}
+
+bool Renderer::HasImage(uint32_t id) const
+{
+	auto it = std::lower_bound(images.begin(), images.end(), id, [](const Image &image, uint32_t id) { return image.id < id; });
+	return it != images.end() && it->id == id;
+}
+
+void Renderer::DrawImage(VkCommandBuffer commandBuffer, const VkRect2D &rect, uint32_t id, float radius)
+{
+	auto it = std::lower_bound(images.begin(), images.end(), id, [](const Image &image, uint32_t id) { return image.id < id; });
+	if (it == images.end() || it->id != id)
+		return;
+	const auto variant = radius > 0.0f ? QuadVariantRounded : QuadVariantPlain;
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imagePipelines[variant]);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &it->descriptorSet, 0, nullptr);
+	VkViewport viewport = {
+		.x = 0.0f,
+		.y = 0.0f,
+		.width = static_cast<float>(extent.width),
+		.height = static_cast<float>(extent.height),
+		.minDepth = 0.0f,
+		.maxDepth = 1.0f
+	};
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+	vkCmdSetScissor(commandBuffer, 0, 1, &rect);
+	// White leaves the texels as they are
+	QuadPushConstants pushConstants = {
+		.rect = { static_cast<float>(rect.offset.x), static_cast<float>(rect.offset.y), static_cast<float>(rect.extent.width), static_cast<float>(rect.extent.height) },
+		.color = { 1.0f, 1.0f, 1.0f, 1.0f },
+		.viewport = { static_cast<float>(extent.width), static_cast<float>(extent.height) },
+		.radius = radius
+	};
+	vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(pushConstants), &pushConstants);
+	vkCmdDraw(commandBuffer, 4, 1, 0, 0);
 }
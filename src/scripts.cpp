@@ -0,0 +1,373 @@
+#include "scripts.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "widgetStore.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+	// FNV-1a
+	uint64_t hashText(std::string_view text)
+	{
+		uint64_t hash = 0xcbf29ce484222325;
+		for (char c : text) {
+			hash ^= static_cast<unsigned char>(c);
+			hash *= 0x100000001b3;
+		}
+		return hash;
+	}
+
+	std::string_view trimEnd(std::string_view text)
+	{
+		const auto end = text.find_last_not_of(" \t\r\n");
+		return end == std::string_view::npos ? std::string_view() : text.substr(0, end + 1);
+	}
+
+	bool parseSeconds(std::string_view text, uint64_t &nanoseconds)
+	{
+		double seconds = 0.0;
+		const auto result = std::from_chars(text.data(), text.data() + text.size(), seconds);
+		if (result.ec != std::errc() || result.ptr != text.data() + text.size() || !(seconds > 0.0) || seconds > 1e9)
+			return false;
+		nanoseconds = static_cast<uint64_t>(seconds * 1e9);
+		return true;
+	}
+}
+
+Scripts::~Scripts()
+{
+	for (auto &script : scripts) {
+		if (script->pid < 0)
+			continue;
+		kill(-script->pid, SIGKILL);
+		CloseOutput(*script);
+		waitpid(script->pid, nullptr, 0);
+		script->pid = -1;
+	}
+	if (timerFd >= 0) {
+		core->RemoveFd(timerFd);
+		close(timerFd);
+		timerFd = -1;
+	}
+}
+
+bool Scripts::Init(CorePtr core, uint32_t maxRunning)
+{
+	this->core = core;
+	this->maxRunning = std::max(maxRunning, 1u);
+	random.seed(static_cast<uint32_t>(GetTime() ^ static_cast<uint64_t>(getpid())));
+
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0) {
+		NCBAR_LOG_ERROR << "Scripts: Failed to create timer: " << strerror(errno);
+		return false;
+	}
+	if (!core->AddFd(timerFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnTimer();
+	}))
+		return false;
+	return true;
+}
+
+bool Scripts::Parse(std::string_view text, std::string &name, std::string &command, Options &options)
+{
+	const auto separator = text.find('=');
+	if (separator == std::string_view::npos)
+		return false;
+	command = text.substr(separator + 1);
+	auto spec = text.substr(0, separator);
+
+	options = Options();
+	const auto intervalStart = spec.find(':');
+	name = spec.substr(0, intervalStart);
+	if (intervalStart == std::string_view::npos)
+		return !name.empty() && !command.empty();
+	spec.remove_prefix(intervalStart + 1);
+	const auto timeoutStart = spec.find(':');
+	const auto interval = spec.substr(0, timeoutStart);
+	if (interval == "tail")
+		options.tail = true;
+	else if (!parseSeconds(interval, options.interval))
+		return false;
+	if (timeoutStart != std::string_view::npos && (options.tail || !parseSeconds(spec.substr(timeoutStart + 1), options.timeout)))
+		return false;
+	return !name.empty() && !command.empty();
+}
+
+bool Scripts::Add(std::string_view name, std::string_view command, const Options &options)
+{
+	auto script = std::make_unique<Script>();
+	script->key.reserve(keyPrefix.size() + name.size());
+	script->key.append(keyPrefix).append(name);
+	if (name.empty() || command.empty() || !options.interval) {
+		NCBAR_LOG_ERROR << "Scripts: Failed to add \"" << name << "\"";
+		return false;
+	}
+	if (std::any_of(scripts.begin(), scripts.end(), [&script](const auto &other) { return other->key == script->key; })) {
+		NCBAR_LOG_ERROR << "Scripts: Failed to add \"" << name << "\", it already exists";
+		return false;
+	}
+	script->command = command;
+	script->options = options;
+	if (!script->options.timeout)
+		script->options.timeout = options.interval;
+	script->line.reserve(maxLineLength);
+	script->text.reserve(maxLineLength);
+
+	// A random phase, so that scripts added together don't stay in step
+	const uint64_t spread = std::min(startSpread, options.interval);
+	script->due = GetTime() + std::uniform_int_distribution<uint64_t>(0, spread)(random);
+	core->GetWidgetStore().Set(script->key, {});
+	scripts.push_back(std::move(script));
+	Schedule();
+	return true;
+}
+
+bool Scripts::Start(Script &script, uint64_t now)
+{
+	NCBAR_TRACE_SCOPE("source", "Scripts::Start");
+	script.due = 0;
+	script.started = now;
+
+	// Only our end is non-blocking, the script writes as usual
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		NCBAR_LOG_ERROR << "Scripts: Failed to create pipe: " << strerror(errno);
+		script.due = NextRun(script, now);
+		return false;
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+	// Own process group, so a timeout kills what the shell started too. Signal handlers and the mask of the bar
+	// aren't the script's business
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+	flags |= POSIX_SPAWN_USEVFORK;
+#endif
+	posix_spawnattr_setflags(&attributes, flags);
+	posix_spawnattr_setpgroup(&attributes, 0);
+	sigset_t signals;
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attributes, &signals);
+	sigfillset(&signals);
+	posix_spawnattr_setsigdefault(&attributes, &signals);
+
+	char shell[] = "/bin/sh";
+	char option[] = "-c";
+	char *arguments[] = { shell, option, script.command.data(), nullptr };
+	pid_t pid = -1;
+	const int result = posix_spawn(&pid, shell, &actions, &attributes, arguments, environ);
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+	if (result != 0) {
+		NCBAR_LOG_ERROR << "Scripts: Failed to start \"" << script.command << "\": " << strerror(result);
+		close(fds[0]);
+		script.due = NextRun(script, now);
+		return false;
+	}
+
+	script.pid = pid;
+	script.deadline = script.options.tail ? 0 : now + script.options.timeout;
+	script.line.clear();
+	script.lineComplete = false;
+	script.timedOut = false;
+	if (!script.options.tail)
+		running++;
+	Script *scriptPtr = &script;
+	if (!core->AddFd(fds[0], EPOLLIN, [this, scriptPtr](uint32_t events) { this->OnOutput(scriptPtr, events); })) {
+		close(fds[0]);
+		Kill(script);
+		return false;
+	}
+	script.outputFd = fds[0];
+	return true;
+}
+
+void Scripts::OnOutput(Script *script, uint32_t events)
+{
+	(void)events;
+	NCBAR_TRACE_SCOPE("source", "Scripts::OnOutput");
+	bool newLine = false;
+	bool closed = false;
+	char buffer[4096];
+	while (true) {
+		const ssize_t size = read(script->outputFd, buffer, sizeof(buffer));
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (size <= 0) {
+			closed = true;
+			break;
+		}
+
+		std::string_view data(buffer, static_cast<std::size_t>(size));
+		while (!data.empty() && !script->lineComplete) {
+			const auto end = data.find('\n');
+			const auto part = data.substr(0, end);
+			script->line.append(part.substr(0, maxLineLength - std::min(maxLineLength, script->line.size())));
+			if (end == std::string_view::npos)
+				break;
+			data.remove_prefix(end + 1);
+			script->text.swap(script->line);
+			script->line.clear();
+			newLine = true;
+			// The rest of an interval script's output is read and dropped
+			script->lineComplete = !script->options.tail;
+		}
+	}
+
+	if (newLine && script->options.tail)
+		Publish(*script);
+	if (!closed)
+		return;
+
+	CloseOutput(*script);
+	// Output without a final newline still counts, and an interval script without output publishes an empty text
+	const bool partialLine = !script->lineComplete && (!script->line.empty() || !script->options.tail);
+	if (partialLine) {
+		script->text.swap(script->line);
+		script->line.clear();
+	}
+	if ((partialLine || script->lineComplete) && !script->timedOut)
+		Publish(*script);
+	if (!TryReap(*script, GetTime()))
+		script->reaping = true;
+	Schedule();
+}
+
+void Scripts::Publish(Script &script)
+{
+	const auto text = trimEnd(script.text);
+	const uint64_t hash = hashText(text);
+	if (hash == script.publishedHash)
+		return;
+	script.publishedHash = hash;
+	core->GetWidgetStore().Set(script.key, text);
+}
+
+void Scripts::CloseOutput(Script &script)
+{
+	if (script.outputFd < 0)
+		return;
+	core->RemoveFd(script.outputFd);
+	close(script.outputFd);
+	script.outputFd = -1;
+}
+
+bool Scripts::TryReap(Script &script, uint64_t now)
+{
+	int status = 0;
+	const pid_t result = waitpid(script.pid, &status, WNOHANG);
+	if (result == 0 || (result < 0 && errno == EINTR))
+		return false;
+	if (script.options.tail)
+		NCBAR_LOG_WARNING << "Scripts: \"" << script.command << "\" exited, starting it again";
+	else
+		running--;
+	script.pid = -1;
+	script.reaping = false;
+	script.deadline = 0;
+	script.due = NextRun(script, now);
+	return true;
+}
+
+void Scripts::Kill(Script &script)
+{
+	kill(-script.pid, SIGKILL);
+	script.timedOut = true;
+	script.deadline = 0;
+	CloseOutput(script);
+	script.reaping = true;
+}
+
+void Scripts::OnTimer()
+{
+	uint64_t expirations = 0;
+	if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		NCBAR_LOG_ERROR << "Scripts: Failed to read timer: " << strerror(errno);
+	Schedule();
+}
+
+void Scripts::Schedule()
+{
+	const uint64_t now = GetTime();
+	dueScripts.clear();
+	for (auto &script : scripts) {
+		if (script->reaping)
+			TryReap(*script, now);
+		if (script->pid >= 0 && script->deadline && now >= script->deadline) {
+			NCBAR_LOG_WARNING << "Scripts: \"" << script->command << "\" timed out";
+			Kill(*script);
+			TryReap(*script, now);
+		}
+		if (script->pid < 0 && script->due && script->due <= now)
+			dueScripts.push_back(script.get());
+	}
+
+	// The longest waiting first when there are more than free slots
+	std::sort(dueScripts.begin(), dueScripts.end(), [](const Script *a, const Script *b) { return a->due < b->due; });
+	for (auto script : dueScripts) {
+		if (script->options.tail || running < maxRunning)
+			Start(*script, now);
+	}
+
+	// Due scripts that wait for a slot get it when one exits, which schedules again
+	uint64_t next = 0;
+	auto earlier = [&next](uint64_t time) {
+		if (time && (!next || time < next))
+			next = time;
+	};
+	for (auto &script : scripts) {
+		if (script->reaping)
+			earlier(now + reapInterval);
+		else if (script->pid >= 0)
+			earlier(script->deadline);
+		else if (script->due > now)
+			earlier(script->due);
+	}
+
+	itimerspec timer = {};
+	timer.it_value.tv_sec = static_cast<time_t>(next / 1'000'000'000);
+	timer.it_value.tv_nsec = static_cast<long>(next % 1'000'000'000);
+	if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, nullptr) < 0)
+		NCBAR_LOG_ERROR << "Scripts: Failed to set timer: " << strerror(errno);
+}
+
+uint64_t Scripts::NextRun(const Script &script, uint64_t now)
+{
+	const uint64_t interval = script.options.interval;
+	const uint64_t jitter = interval / 20;
+	const uint64_t next = (script.options.tail ? now : script.started) + interval - jitter + std::uniform_int_distribution<uint64_t>(0, 2 * jitter)(random);
+	// A script that ran longer than its interval runs again right away
+	return std::max(next, now);
+}
+
+uint64_t Scripts::GetTime() const
+{
+	timespec time = {};
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1'000'000'000 + static_cast<uint64_t>(time.tv_nsec);
+}
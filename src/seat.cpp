@@ -0,0 +1,260 @@
+#include "seat.hpp"
+#include "trace.hpp"
+#include "window.hpp"
+#include <cmath>
+
+const wl_seat_listener Seat::seatListener = {
+	.capabilities = BindListener<&Seat::OnCapabilities>,
+	.name = IgnoreListener
+};
+const wl_pointer_listener Seat::pointerListener = {
+	.enter = BindListener<&Seat::OnPointerEnter>,
+	.leave = BindListener<&Seat::OnPointerLeave>,
+	.motion = BindListener<&Seat::OnPointerMotion>,
+	.button = BindListener<&Seat::OnPointerButton>,
+	.axis = BindListener<&Seat::OnPointerAxis>,
+	.frame = BindListener<&Seat::OnPointerFrame>,
+	.axis_source = IgnoreListener,
+	.axis_stop = IgnoreListener,
+	.axis_discrete = BindListener<&Seat::OnPointerAxisDiscrete>,
+	.axis_value120 = BindListener<&Seat::OnPointerAxisValue120>,
+	.axis_relative_direction = IgnoreListener
+};
+const wl_touch_listener Seat::touchListener = {
+	.down = BindListener<&Seat::OnTouchDown>,
+	.up = BindListener<&Seat::OnTouchUp>,
+	.motion = BindListener<&Seat::OnTouchMotion>,
+	.frame = IgnoreListener,
+	.cancel = BindListener<&Seat::OnTouchCancel>,
+	.shape = IgnoreListener,
+	.orientation = IgnoreListener
+};
+
+Seat::~Seat()
+{
+	ReleasePointer();
+	ReleaseTouch();
+	if (seat) {
+		if (wl_seat_get_version(seat) >= WL_SEAT_RELEASE_SINCE_VERSION)
+			wl_seat_release(seat);
+		else
+			wl_seat_destroy(seat);
+		seat = nullptr;
+	}
+}
+
+bool Seat::Init(wl_seat *seat)
+{
+	if (!seat)
+		return false;
+	this->seat = seat;
+	wl_seat_add_listener(seat, &seatListener, this);
+	return true;
+}
+
+void Seat::ForgetSurface(wl_surface *surface)
+{
+	if (pointerSurface == surface)
+		pointerSurface = nullptr;
+	if (touchSurface == surface) {
+		touchSurface = nullptr;
+		touchId = -1;
+	}
+}
+
+void Seat::ReleasePointer()
+{
+	if (!pointer)
+		return;
+	if (wl_pointer_get_version(pointer) >= WL_POINTER_RELEASE_SINCE_VERSION)
+		wl_pointer_release(pointer);
+	else
+		wl_pointer_destroy(pointer);
+	pointer = nullptr;
+	pointerSurface = nullptr;
+}
+
+void Seat::ReleaseTouch()
+{
+	if (!touch)
+		return;
+	if (wl_touch_get_version(touch) >= WL_TOUCH_RELEASE_SINCE_VERSION)
+		wl_touch_release(touch);
+	else
+		wl_touch_destroy(touch);
+	touch = nullptr;
+	touchSurface = nullptr;
+	touchId = -1;
+}
+
+Window* Seat::GetWindow(wl_surface *surface)
+{
+	return surface ? static_cast<Window*>(wl_surface_get_user_data(surface)) : nullptr;
+}
+
+void Seat::FlushScroll()
+{
+	if (!scrollPending)
+		return;
+	scrollPending = false;
+	auto window = GetWindow(pointerSurface);
+	for (int axis = 0; axis < 2; axis++) {
+		// Wheels are counted in 120ths when the compositor sends them, high resolution wheels send fractions
+		int32_t steps;
+		if (scrollDiscrete) {
+			steps = scroll120[axis] / 120;
+			scroll120[axis] -= steps * 120;
+			scrollDistance[axis] = 0.0;
+		}
+		else {
+			steps = static_cast<int32_t>(std::trunc(scrollDistance[axis] / scrollStepDistance));
+			scrollDistance[axis] -= steps * scrollStepDistance;
+		}
+		if (steps && window)
+			window->OnPointerScroll(steps, axis == WL_POINTER_AXIS_HORIZONTAL_SCROLL);
+	}
+	scrollDiscrete = false;
+}
+
+void Seat::OnCapabilities(wl_seat *seat, uint32_t capabilities)
+{
+	if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && !pointer) {
+		pointer = wl_seat_get_pointer(seat);
+		wl_pointer_add_listener(pointer, &pointerListener, this);
+	}
+	else if (!(capabilities & WL_SEAT_CAPABILITY_POINTER) && pointer) {
+		if (auto window = GetWindow(pointerSurface))
+			window->OnPointerLeave();
+		ReleasePointer();
+	}
+	if ((capabilities & WL_SEAT_CAPABILITY_TOUCH) && !touch) {
+		touch = wl_seat_get_touch(seat);
+		wl_touch_add_listener(touch, &touchListener, this);
+	}
+	else if (!(capabilities & WL_SEAT_CAPABILITY_TOUCH) && touch) {
+		if (auto window = GetWindow(touchSurface))
+			window->OnTouchCancel();
+		ReleaseTouch();
+	}
+}
+
+void Seat::OnPointerEnter(wl_pointer *pointer, uint32_t serial, wl_surface *surface, wl_fixed_t x, wl_fixed_t y)
+{
+	(void)pointer;
+	(void)serial;
+	pointerSurface = surface;
+	scrollDistance[0] = scrollDistance[1] = 0.0;
+	scroll120[0] = scroll120[1] = 0;
+	if (auto window = GetWindow(surface))
+		window->OnPointerMotion(wl_fixed_to_double(x), wl_fixed_to_double(y));
+}
+
+void Seat::OnPointerLeave(wl_pointer *pointer, uint32_t serial, wl_surface *surface)
+{
+	(void)pointer;
+	(void)serial;
+	(void)surface;
+	if (auto window = GetWindow(pointerSurface))
+		window->OnPointerLeave();
+	pointerSurface = nullptr;
+	scrollPending = false;
+}
+
+void Seat::OnPointerMotion(wl_pointer *pointer, uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+	(void)pointer;
+	(void)time;
+	if (auto window = GetWindow(pointerSurface))
+		window->OnPointerMotion(wl_fixed_to_double(x), wl_fixed_to_double(y));
+}
+
+void Seat::OnPointerButton(wl_pointer *pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state)
+{
+	(void)pointer;
+	(void)time;
+	NCBAR_TRACE_SCOPE("input", "Seat::OnPointerButton");
+	if (auto window = GetWindow(pointerSurface))
+		window->OnPointerButton(button, state == WL_POINTER_BUTTON_STATE_PRESSED, serial);
+}
+
+void Seat::OnPointerAxis(wl_pointer *pointer, uint32_t time, uint32_t axis, wl_fixed_t value)
+{
+	(void)time;
+	if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+		return;
+	scrollDistance[axis] += wl_fixed_to_double(value);
+	scrollPending = true;
+	// Before version 5 there are no frames, every event stands on its own
+	if (wl_pointer_get_version(pointer) < WL_POINTER_FRAME_SINCE_VERSION)
+		FlushScroll();
+}
+
+void Seat::OnPointerFrame(wl_pointer *pointer)
+{
+	(void)pointer;
+	FlushScroll();
+}
+
+void Seat::OnPointerAxisDiscrete(wl_pointer *pointer, uint32_t axis, int32_t discrete)
+{
+	(void)pointer;
+	if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+		return;
+	scroll120[axis] += discrete * 120;
+	scrollDiscrete = true;
+	scrollPending = true;
+}
+
+void Seat::OnPointerAxisValue120(wl_pointer *pointer, uint32_t axis, int32_t value120)
+{
+	(void)pointer;
+	if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+		return;
+	scroll120[axis] += value120;
+	scrollDiscrete = true;
+	scrollPending = true;
+}
+
+void Seat::OnTouchDown(wl_touch *touch, uint32_t serial, uint32_t time, wl_surface *surface, int32_t id, wl_fixed_t x, wl_fixed_t y)
+{
+	(void)touch;
+	(void)time;
+	NCBAR_TRACE_SCOPE("input", "Seat::OnTouchDown");
+	if (touchId >= 0)
+		return;
+	touchSurface = surface;
+	touchId = id;
+	if (auto window = GetWindow(surface))
+		window->OnTouchDown(wl_fixed_to_double(x), wl_fixed_to_double(y), serial);
+}
+
+void Seat::OnTouchUp(wl_touch *touch, uint32_t serial, uint32_t time, int32_t id)
+{
+	(void)touch;
+	(void)time;
+	if (id != touchId)
+		return;
+	if (auto window = GetWindow(touchSurface))
+		window->OnTouchUp(serial);
+	touchSurface = nullptr;
+	touchId = -1;
+}
+
+void Seat::OnTouchMotion(wl_touch *touch, uint32_t time, int32_t id, wl_fixed_t x, wl_fixed_t y)
+{
+	(void)touch;
+	(void)time;
+	if (id != touchId)
+		return;
+	if (auto window = GetWindow(touchSurface))
+		window->OnTouchMotion(wl_fixed_to_double(x), wl_fixed_to_double(y));
+}
+
+void Seat::OnTouchCancel(wl_touch *touch)
+{
+	(void)touch;
+	if (auto window = GetWindow(touchSurface))
+		window->OnTouchCancel();
+	touchSurface = nullptr;
+	touchId = -1;
+}
@@ -0,0 +1,198 @@
+#include "startupSnapshot.hpp"
+#include "core.hpp"
+#include "handoff.hpp"
+#include "log.hpp"
+#include "renderer.hpp"
+#include "window.hpp"
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+	constexpr char snapshotMagic[8] = { 'n', 'c', 'b', 'a', 'r', 'f', 'r', '1' };
+
+	// Native endianness like the handoff state, the file never leaves the machine. The pixels start at
+	// pixelsOffset, rows of bufferWidth * 4 bytes, the state follows them
+	struct Header {
+		char magic[8];
+		uint32_t width;
+		uint32_t height;
+		uint32_t scale;
+		uint32_t bufferWidth;
+		uint32_t bufferHeight;
+		uint32_t reserved;
+		uint64_t stateSize;
+	};
+	constexpr std::size_t pixelsOffset = 64;
+	static_assert(sizeof(Header) <= pixelsOffset);
+
+	bool writeAll(int fd, const void *data, std::size_t size)
+	{
+		const auto *bytes = static_cast<const uint8_t*>(data);
+		while (size) {
+			ssize_t result = write(fd, bytes, size);
+			if (result < 0 && errno == EINTR)
+				continue;
+			if (result <= 0)
+				return false;
+			bytes += result;
+			size -= static_cast<std::size_t>(result);
+		}
+		return true;
+	}
+}
+
+StartupSnapshot::~StartupSnapshot()
+{
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+std::string StartupSnapshot::GetDefaultPath()
+{
+	const char *cacheHome = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+	const char *waylandDisplay = getenv("WAYLAND_DISPLAY");
+	std::string path;
+	if (cacheHome && *cacheHome)
+		path = cacheHome;
+	else if (home && *home)
+		path = std::string(home) + "/.cache";
+	else if (runtimeDir && *runtimeDir)
+		path = runtimeDir;
+	else
+		return {};
+	path += "/ncbar-";
+	path += waylandDisplay ? waylandDisplay : "wayland-0";
+	path += ".frame";
+	return path;
+}
+
+bool StartupSnapshot::Init(const std::string &snapshotPath)
+{
+	const std::string path = snapshotPath.empty() ? GetDefaultPath() : snapshotPath;
+	if (path.empty())
+		return false;
+	// Writable, wl_shm maps pools for reading and writing. Only the compositor maps it and nobody writes to it
+	fd = open(path.c_str(), O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			NCBAR_LOG_WARNING << "Snapshot: Failed to open " << path << ": " << strerror(errno);
+		return false;
+	}
+	struct stat status = {};
+	Header header = {};
+	if (fstat(fd, &status) < 0) {
+		NCBAR_LOG_WARNING << "Snapshot: Failed to read " << path;
+		return false;
+	}
+	// The state is restored into the store, only a file of our own may set it
+	if (!S_ISREG(status.st_mode) || status.st_uid != getuid()) {
+		NCBAR_LOG_WARNING << "Snapshot: " << path << " is not a file of the user running the bar";
+		return false;
+	}
+	if (pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+		NCBAR_LOG_WARNING << "Snapshot: Failed to read " << path;
+		return false;
+	}
+	if (std::memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0) {
+		NCBAR_LOG_WARNING << "Snapshot: " << path << " is of an incompatible version";
+		return false;
+	}
+
+	// The compositor maps all of it, a pool is at most INT32_MAX bytes
+	const uint64_t pixelsSize = static_cast<uint64_t>(header.bufferWidth) * header.bufferHeight * 4;
+	fileSize = static_cast<uint64_t>(status.st_size);
+	if (!header.width || !header.height || !header.bufferWidth || !header.bufferHeight || !header.scale
+		|| header.stateSize > Handoff::maxStateSize || fileSize > INT32_MAX
+		|| fileSize != pixelsOffset + pixelsSize + header.stateSize) {
+		NCBAR_LOG_WARNING << "Snapshot: " << path << " is damaged";
+		return false;
+	}
+	width = header.width;
+	height = header.height;
+	scale = Scale{ .value = header.scale };
+	bufferWidth = header.bufferWidth;
+	bufferHeight = header.bufferHeight;
+
+	state.resize(header.stateSize);
+	if (pread(fd, state.data(), state.size(), static_cast<off_t>(pixelsOffset + pixelsSize)) != static_cast<ssize_t>(state.size())) {
+		NCBAR_LOG_WARNING << "Snapshot: Failed to read " << path;
+		return false;
+	}
+
+	return true;
+}
+
+wl_buffer* StartupSnapshot::CreateBuffer(wl_shm *shm) const
+{
+	if (!shm)
+		return nullptr;
+	// The buffer keeps the pool's memory alive
+	auto pool = wl_shm_create_pool(shm, fd, static_cast<int32_t>(fileSize));
+	if (!pool)
+		return nullptr;
+	auto buffer = wl_shm_pool_create_buffer(pool, static_cast<int32_t>(pixelsOffset), static_cast<int32_t>(bufferWidth), static_cast<int32_t>(bufferHeight), static_cast<int32_t>(bufferWidth * 4), WL_SHM_FORMAT_ARGB8888);
+	wl_shm_pool_destroy(pool);
+	return buffer;
+}
+
+bool StartupSnapshot::Save(const std::string &snapshotPath, Window &window, Core &core)
+{
+	Renderer *renderer = window.GetRenderer();
+	std::vector<uint8_t> pixels;
+	VkExtent2D extent = {};
+	if (!renderer || !renderer->CaptureFrame(pixels, extent))
+		return false;
+	// A swapchain clamped to the surface's limits isn't what the window would attach
+	if (extent.width != window.GetBufferWidth() || extent.height != window.GetBufferHeight())
+		return false;
+
+	std::string state;
+	Handoff::Serialize(core, state);
+	if (state.size() > Handoff::maxStateSize)
+		state.clear();
+
+	Header header = {};
+	std::memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+	header.width = static_cast<uint32_t>(window.GetWidth());
+	header.height = static_cast<uint32_t>(window.GetHeight());
+	header.scale = window.GetScale().value;
+	header.bufferWidth = extent.width;
+	header.bufferHeight = extent.height;
+	header.stateSize = state.size();
+	uint8_t headerBytes[pixelsOffset] = {};
+	std::memcpy(headerBytes, &header, sizeof(header));
+
+	const std::string path = snapshotPath.empty() ? GetDefaultPath() : snapshotPath;
+	if (path.empty()) {
+		NCBAR_LOG_WARNING << "Snapshot: Neither XDG_CACHE_HOME, HOME nor XDG_RUNTIME_DIR is set, pass --snapshot";
+		return false;
+	}
+	// Renamed over the old file, which the compositor may still have mapped as the bar's buffer. A new name of
+	// mode 0600 each time, nothing placed at the path beforehand is followed or written to
+	std::string temporaryPath = path + ".XXXXXX";
+	int fileFd = mkostemp(temporaryPath.data(), O_CLOEXEC);
+	if (fileFd < 0) {
+		NCBAR_LOG_WARNING << "Snapshot: Failed to create " << temporaryPath << ": " << strerror(errno);
+		return false;
+	}
+	const bool written = writeAll(fileFd, headerBytes, sizeof(headerBytes))
+		&& writeAll(fileFd, pixels.data(), pixels.size())
+		&& writeAll(fileFd, state.data(), state.size());
+	if (close(fileFd) < 0 || !written || rename(temporaryPath.c_str(), path.c_str()) < 0) {
+		NCBAR_LOG_WARNING << "Snapshot: Failed to write " << path << ": " << strerror(errno);
+		unlink(temporaryPath.c_str());
+		return false;
+	}
+
+	return true;
+}
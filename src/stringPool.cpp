@@ -0,0 +1,45 @@
+#include "stringPool.hpp"
+
+StringPool::StringPool()
+{
+	entries.emplace_back();
+}
+
+StringPool::Id StringPool::Intern(std::string_view string)
+{
+	if (string.empty())
+		return emptyId;
+
+	auto it = lookup.find(string);
+	if (it != lookup.end()) {
+		entries[it->second].references++;
+		return it->second;
+	}
+
+	Id id;
+	if (!freeIds.empty()) {
+		id = freeIds.back();
+		freeIds.pop_back();
+		// Assigning keeps the capacity of the released string
+		entries[id].string.assign(string);
+	}
+	else {
+		id = static_cast<Id>(entries.size());
+		entries.push_back(Entry{ .string = std::string(string), .references = 0 });
+	}
+	entries[id].references = 1;
+	lookup.emplace(entries[id].string, id);
+	return id;
+}
+
+void StringPool::Release(Id id)
+{
+	if (id == emptyId)
+		return;
+
+	auto &entry = entries[id];
+	if (--entry.references)
+		return;
+	lookup.erase(entry.string);
+	freeIds.push_back(id);
+}
@@ -0,0 +1,347 @@
+#include "taskbar.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "widgetStore.hpp"
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+
+namespace {
+	constexpr std::string_view stateNames[] = {
+		"maximized",
+		"minimized",
+		"activated",
+		"fullscreen"
+	};
+
+	// Directories with desktop entries, most important first, as the XDG base directory specification orders them
+	std::vector<std::string> getApplicationsDirs()
+	{
+		std::vector<std::string> dirs;
+		if (const char *dataHome = getenv("XDG_DATA_HOME"); dataHome && *dataHome)
+			dirs.push_back(std::string(dataHome) + "/applications/");
+		else if (const char *home = getenv("HOME"); home && *home)
+			dirs.push_back(std::string(home) + "/.local/share/applications/");
+
+		const char *dataDirsEnv = getenv("XDG_DATA_DIRS");
+		std::string_view dataDirs = (dataDirsEnv && *dataDirsEnv) ? dataDirsEnv : "/usr/local/share:/usr/share";
+		while (!dataDirs.empty()) {
+			auto colon = dataDirs.find(':');
+			auto dir = dataDirs.substr(0, colon);
+			if (!dir.empty())
+				dirs.push_back(std::string(dir) + "/applications/");
+			if (colon == std::string_view::npos)
+				break;
+			dataDirs.remove_prefix(colon + 1);
+		}
+		return dirs;
+	}
+
+	// Value of `Icon=` in the [Desktop Entry] group, empty if there is no such entry
+	std::string readDesktopEntryIcon(const std::string &path)
+	{
+		std::ifstream file(path);
+		std::string line;
+		bool inDesktopEntry = false;
+		while (std::getline(file, line)) {
+			if (line.starts_with('[')) {
+				inDesktopEntry = line == "[Desktop Entry]";
+				continue;
+			}
+			if (inDesktopEntry && line.starts_with("Icon="))
+				return line.substr(5);
+		}
+		return {};
+	}
+}
+
+const zwlr_foreign_toplevel_manager_v1_listener Taskbar::managerListener = {
+	.toplevel = BindListener<&Taskbar::OnToplevel>,
+	.finished = BindListener<&Taskbar::OnFinished>
+};
+const zwlr_foreign_toplevel_handle_v1_listener Taskbar::handleListener = {
+	.title = BindListener<&Taskbar::OnTitle>,
+	.app_id = BindListener<&Taskbar::OnAppId>,
+	.output_enter = BindListener<&Taskbar::OnOutputEnter>,
+	.output_leave = BindListener<&Taskbar::OnOutputLeave>,
+	.state = BindListener<&Taskbar::OnState>,
+	.done = BindListener<&Taskbar::OnDone>,
+	.closed = BindListener<&Taskbar::OnClosed>,
+	.parent = IgnoreListener
+};
+
+Taskbar::~Taskbar()
+{
+	for (auto &toplevel : toplevels) {
+		if (toplevel.handle)
+			ReleaseToplevel(toplevel);
+	}
+	toplevels.clear();
+	if (manager) {
+		zwlr_foreign_toplevel_manager_v1_stop(manager);
+		zwlr_foreign_toplevel_manager_v1_destroy(manager);
+		manager = nullptr;
+	}
+}
+
+bool Taskbar::Init(zwlr_foreign_toplevel_manager_v1 *manager)
+{
+	if (!manager) {
+		NCBAR_LOG_ERROR << "Taskbar: Failed to get foreign toplevel manager";
+		return false;
+	}
+	this->manager = manager;
+	zwlr_foreign_toplevel_manager_v1_add_listener(manager, &managerListener, this);
+	return true;
+}
+
+void Taskbar::SetOnChange(OnChangeCallbackType onChange)
+{
+	this->onChange = onChange;
+}
+
+std::string_view Taskbar::GetIcon(uint32_t slot)
+{
+	return strings.Get(ResolveIcon(toplevels[slot].appId));
+}
+
+void Taskbar::AddIcon(std::string_view appId, std::string_view icon)
+{
+	auto appIdId = strings.Intern(appId);
+	if (appIdId == StringPool::emptyId || icons.contains(appIdId)) {
+		strings.Release(appIdId);
+		return;
+	}
+	icons.emplace(appIdId, strings.Intern(icon));
+}
+
+void Taskbar::Activate(uint32_t slot, wl_seat *seat)
+{
+	if (slot < toplevels.size() && toplevels[slot].handle)
+		zwlr_foreign_toplevel_handle_v1_activate(toplevels[slot].handle, seat);
+}
+
+void Taskbar::Close(uint32_t slot)
+{
+	if (slot < toplevels.size() && toplevels[slot].handle)
+		zwlr_foreign_toplevel_handle_v1_close(toplevels[slot].handle);
+}
+
+void Taskbar::ForgetOutput(wl_output *output)
+{
+	for (auto &toplevel : toplevels) {
+		if (toplevel.output == output)
+			toplevel.output = nullptr;
+	}
+}
+
+Taskbar::Toplevel* Taskbar::FindToplevel(zwlr_foreign_toplevel_handle_v1 *handle, uint32_t *slot)
+{
+	auto it = slotsByHandle.find(handle);
+	if (it == slotsByHandle.end())
+		return nullptr;
+	if (slot)
+		*slot = it->second;
+	return &toplevels[it->second];
+}
+
+void Taskbar::Publish(uint32_t slot, uint32_t changes)
+{
+	const auto &toplevel = toplevels[slot];
+	keyBuffer.assign("taskbar.");
+	keyBuffer.append(std::to_string(slot));
+	keyBuffer.push_back('.');
+	const auto prefixSize = keyBuffer.size();
+
+	if (changes & ChangedTitle) {
+		keyBuffer.resize(prefixSize);
+		keyBuffer.append("title");
+		widgetStore.Set(keyBuffer, strings.Get(toplevel.title));
+	}
+	if (changes & ChangedAppId) {
+		keyBuffer.resize(prefixSize);
+		keyBuffer.append("app_id");
+		widgetStore.Set(keyBuffer, strings.Get(toplevel.appId));
+	}
+	if (changes & ChangedState) {
+		std::string states;
+		for (uint32_t state = 0; state < std::size(stateNames); state++) {
+			if (!(toplevel.states & (1u << state)))
+				continue;
+			if (!states.empty())
+				states.push_back(' ');
+			states.append(stateNames[state]);
+		}
+		keyBuffer.resize(prefixSize);
+		keyBuffer.append("state");
+		widgetStore.Set(keyBuffer, states);
+	}
+}
+
+void Taskbar::ReleaseToplevel(Toplevel &toplevel)
+{
+	zwlr_foreign_toplevel_handle_v1_destroy(toplevel.handle);
+	strings.Release(toplevel.title);
+	strings.Release(toplevel.appId);
+	strings.Release(toplevel.pendingTitle);
+	strings.Release(toplevel.pendingAppId);
+	toplevel = Toplevel();
+}
+
+StringPool::Id Taskbar::ResolveIcon(StringPool::Id appId)
+{
+	if (appId == StringPool::emptyId)
+		return StringPool::emptyId;
+	auto it = icons.find(appId);
+	if (it != icons.end())
+		return it->second;
+
+	// Desktop entries are named after the app id, some apps report it in a different case than the file has
+	std::string fileName(strings.Get(appId));
+	std::string lowerFileName = fileName;
+	for (auto &c : lowerFileName)
+		c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+	std::string icon;
+	for (const auto &dir : getApplicationsDirs()) {
+		icon = readDesktopEntryIcon(dir + fileName + ".desktop");
+		if (icon.empty() && lowerFileName != fileName)
+			icon = readDesktopEntryIcon(dir + lowerFileName + ".desktop");
+		if (!icon.empty())
+			break;
+	}
+	// Without a desktop entry the icon theme usually has an icon named after the app
+	auto iconId = icon.empty() ? appId : strings.Intern(icon);
+	if (icon.empty())
+		strings.Acquire(iconId);
+	strings.Acquire(appId);
+	icons.emplace(appId, iconId);
+	return iconId;
+}
+
+void Taskbar::OnToplevel(zwlr_foreign_toplevel_manager_v1 *manager, zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	(void)manager;
+	uint32_t slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else {
+		slot = static_cast<uint32_t>(toplevels.size());
+		toplevels.emplace_back();
+	}
+	toplevels[slot].handle = handle;
+	slotsByHandle.emplace(handle, slot);
+	toplevelsCount++;
+	zwlr_foreign_toplevel_handle_v1_add_listener(handle, &handleListener, this);
+}
+
+void Taskbar::OnFinished(zwlr_foreign_toplevel_manager_v1 *manager)
+{
+	zwlr_foreign_toplevel_manager_v1_destroy(manager);
+	this->manager = nullptr;
+}
+
+void Taskbar::OnTitle(zwlr_foreign_toplevel_handle_v1 *handle, const char *title)
+{
+	if (auto toplevel = FindToplevel(handle, nullptr)) {
+		auto id = strings.Intern(title);
+		strings.Release(toplevel->pendingTitle);
+		toplevel->pendingTitle = id;
+	}
+}
+
+void Taskbar::OnAppId(zwlr_foreign_toplevel_handle_v1 *handle, const char *appId)
+{
+	if (auto toplevel = FindToplevel(handle, nullptr)) {
+		auto id = strings.Intern(appId);
+		strings.Release(toplevel->pendingAppId);
+		toplevel->pendingAppId = id;
+	}
+}
+
+void Taskbar::OnOutputEnter(zwlr_foreign_toplevel_handle_v1 *handle, wl_output *output)
+{
+	if (auto toplevel = FindToplevel(handle, nullptr))
+		toplevel->output = output;
+}
+
+void Taskbar::OnOutputLeave(zwlr_foreign_toplevel_handle_v1 *handle, wl_output *output)
+{
+	auto toplevel = FindToplevel(handle, nullptr);
+	if (toplevel && toplevel->output == output)
+		toplevel->output = nullptr;
+}
+
+void Taskbar::OnState(zwlr_foreign_toplevel_handle_v1 *handle, wl_array *states)
+{
+	auto toplevel = FindToplevel(handle, nullptr);
+	if (!toplevel)
+		return;
+	toplevel->pendingStates = 0;
+	const auto *state = static_cast<const uint32_t*>(states->data);
+	for (std::size_t i = 0; i < states->size / sizeof(uint32_t); i++) {
+		// States of newer versions than we know are skipped
+		if (state[i] < std::size(stateNames))
+			toplevel->pendingStates |= 1u << state[i];
+	}
+}
+
+void Taskbar::OnDone(zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	NCBAR_TRACE_SCOPE("source", "Taskbar::OnDone");
+	uint32_t slot;
+	auto toplevel = FindToplevel(handle, &slot);
+	if (!toplevel)
+		return;
+
+	// Interned ids are equal only for equal strings, so nothing is compared character by character
+	uint32_t changes = ChangedNothing;
+	if (!toplevel->announced) {
+		toplevel->announced = true;
+		changes |= ChangedAdded | ChangedTitle | ChangedAppId | ChangedState;
+	}
+	if (toplevel->pendingTitle != toplevel->title) {
+		strings.Acquire(toplevel->pendingTitle);
+		strings.Release(toplevel->title);
+		toplevel->title = toplevel->pendingTitle;
+		changes |= ChangedTitle;
+	}
+	if (toplevel->pendingAppId != toplevel->appId) {
+		strings.Acquire(toplevel->pendingAppId);
+		strings.Release(toplevel->appId);
+		toplevel->appId = toplevel->pendingAppId;
+		changes |= ChangedAppId;
+	}
+	if (toplevel->pendingStates != toplevel->states) {
+		toplevel->states = toplevel->pendingStates;
+		changes |= ChangedState;
+	}
+	if (changes == ChangedNothing)
+		return;
+
+	Publish(slot, changes);
+	if (onChange)
+		onChange(slot, changes);
+}
+
+void Taskbar::OnClosed(zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	uint32_t slot;
+	auto toplevel = FindToplevel(handle, &slot);
+	if (!toplevel)
+		return;
+
+	const bool announced = toplevel->announced;
+	ReleaseToplevel(*toplevel);
+	slotsByHandle.erase(handle);
+	freeSlots.push_back(slot);
+	toplevelsCount--;
+	if (!announced)
+		return;
+
+	// Empty values tell the subscribers the slot is free
+	Publish(slot, ChangedTitle | ChangedAppId | ChangedState);
+	if (onChange)
+		onChange(slot, ChangedRemoved);
+}
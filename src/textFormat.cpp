@@ -0,0 +1,314 @@
+#include "textFormat.hpp"
+#include "log.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
+namespace {
+	bool isContinuationByte(char byte)
+	{
+		return (static_cast<unsigned char>(byte) & 0xc0) == 0x80;
+	}
+
+	// Appends to a fixed buffer and cuts what doesn't fit at a character boundary, nothing follows a cut
+	struct Writer {
+		std::span<char> output;
+		std::size_t length = 0;
+		bool full = false;
+
+		void Append(std::string_view text)
+		{
+			if (full)
+				return;
+			std::size_t size = text.size();
+			if (size > output.size() - length) {
+				size = output.size() - length;
+				while (size && isContinuationByte(text[size]))
+					size--;
+				full = true;
+			}
+			if (!size)
+				return;
+			std::memcpy(output.data() + length, text.data(), size);
+			length += size;
+		}
+		void Fill(char fill, std::size_t count)
+		{
+			if (full)
+				return;
+			const std::size_t size = std::min(count, output.size() - length);
+			if (!size)
+				return;
+			std::memset(output.data() + length, fill, size);
+			length += size;
+		}
+	};
+
+	std::size_t countCharacters(std::string_view text)
+	{
+		return static_cast<std::size_t>(std::count_if(text.begin(), text.end(), [](char byte) { return !isContinuationByte(byte); }));
+	}
+
+	// Longest prefix of at most `count` UTF-8 characters
+	std::string_view takeCharacters(std::string_view text, std::size_t count)
+	{
+		std::size_t characters = 0;
+		for (std::size_t i = 0; i < text.size(); i++) {
+			if (isContinuationByte(text[i]))
+				continue;
+			if (characters == count)
+				return text.substr(0, i);
+			characters++;
+		}
+		return text;
+	}
+
+	bool isTruthy(const TextFormat::Argument &argument)
+	{
+		if (!argument.isSet)
+			return false;
+		if (argument.isNumber)
+			return argument.number != 0.0;
+		return !argument.text.empty() && argument.text != "0";
+	}
+
+	// Integers past this don't fit long long, they are written as fixed without decimals instead
+	constexpr double maxRoundedNumber = 9.2e18;
+}
+
+bool TextFormat::Parse(std::string_view source)
+{
+	ops.clear();
+	literals.clear();
+	fields.clear();
+
+	auto fail = [this, source](const char *message, std::size_t position) {
+		NCBAR_LOG_ERROR << "TextFormat: " << message << " at " << position << " of \"" << source << "\"";
+		ops.clear();
+		literals.clear();
+		fields.clear();
+		return false;
+	};
+
+	// Ops of the conditions whose `{/}` hasn't come yet
+	std::vector<uint32_t> openConditions;
+	std::string literal;
+	for (std::size_t i = 0; i < source.size(); i++) {
+		const char c = source[i];
+		const bool doubled = i + 1 < source.size() && source[i + 1] == c;
+		if (c == '}') {
+			if (!doubled)
+				return fail("Unmatched '}'", i);
+			literal.push_back(c);
+			i++;
+			continue;
+		}
+		if (c != '{') {
+			literal.push_back(c);
+			continue;
+		}
+		if (doubled) {
+			literal.push_back(c);
+			i++;
+			continue;
+		}
+
+		const auto end = source.find('}', i + 1);
+		if (end == std::string_view::npos)
+			return fail("Unclosed '{'", i);
+		AddLiteral(literal);
+		literal.clear();
+
+		const auto field = source.substr(i + 1, end - i - 1);
+		if (field == "/") {
+			if (openConditions.empty())
+				return fail("'{/}' without a condition", i);
+			ops[openConditions.back()].skipTo = static_cast<uint32_t>(ops.size());
+			openConditions.pop_back();
+		}
+		else if (!field.empty() && (field[0] == '?' || field[0] == '!')) {
+			if (field.size() == 1)
+				return fail("Condition without a field", i);
+			Op op;
+			op.type = field[0] == '?' ? OpIf : OpUnless;
+			op.field = AddField(field.substr(1));
+			openConditions.push_back(static_cast<uint32_t>(ops.size()));
+			ops.push_back(op);
+		}
+		else if (!ParseField(field)) {
+			return fail("Invalid field", i);
+		}
+		i = end;
+	}
+	if (!openConditions.empty())
+		return fail("Condition without '{/}'", source.size());
+	AddLiteral(literal);
+
+	return true;
+}
+
+bool TextFormat::ParseField(std::string_view field)
+{
+	const auto colon = field.find(':');
+	const auto name = field.substr(0, colon);
+	if (name.empty())
+		return false;
+
+	Op op;
+	op.type = OpField;
+	op.field = AddField(name);
+	if (colon != std::string_view::npos) {
+		const auto spec = field.substr(colon + 1);
+		auto alignOf = [](char c) {
+			switch (c) {
+			case '<': return AlignLeft;
+			case '>': return AlignRight;
+			case '^': return AlignCenter;
+			default: return AlignDefault;
+			}
+		};
+		const char *position = spec.data();
+		const char *end = spec.data() + spec.size();
+		if (spec.size() >= 2 && alignOf(spec[1]) != AlignDefault) {
+			op.fill = spec[0];
+			op.align = alignOf(spec[1]);
+			position += 2;
+		}
+		else if (!spec.empty() && alignOf(spec[0]) != AlignDefault) {
+			op.align = alignOf(spec[0]);
+			position++;
+		}
+
+		// Both are optional, from_chars leaves the position where it is without digits
+		auto result = std::from_chars(position, end, op.width);
+		if (result.ec == std::errc::result_out_of_range || op.width > maxLength)
+			return false;
+		position = result.ptr;
+		if (position != end && *position == '.') {
+			result = std::from_chars(position + 1, end, op.precision);
+			if (result.ec != std::errc() || op.precision < 0 || static_cast<std::size_t>(op.precision) > maxLength)
+				return false;
+			position = result.ptr;
+		}
+		if (position != end) {
+			if (*position == 'f')
+				op.numberType = TypeFixed;
+			else if (*position == 'd')
+				op.numberType = TypeInteger;
+			else
+				return false;
+			position++;
+		}
+		if (position != end)
+			return false;
+	}
+	ops.push_back(op);
+
+	return true;
+}
+
+uint32_t TextFormat::AddField(std::string_view name)
+{
+	auto it = std::find(fields.begin(), fields.end(), name);
+	if (it == fields.end())
+		it = fields.emplace(fields.end(), name);
+	return static_cast<uint32_t>(it - fields.begin());
+}
+
+void TextFormat::AddLiteral(std::string_view literal)
+{
+	if (literal.empty())
+		return;
+	Op op;
+	op.type = OpLiteral;
+	op.offset = static_cast<uint32_t>(literals.size());
+	op.length = static_cast<uint32_t>(literal.size());
+	literals.append(literal);
+	ops.push_back(op);
+}
+
+std::size_t TextFormat::Format(std::span<const Argument> arguments, std::span<char> output) const
+{
+	Writer writer{ .output = output, .length = 0 };
+	const Argument unset;
+	for (std::size_t index = 0; index < ops.size();) {
+		const auto &op = ops[index];
+		const auto &argument = op.type != OpLiteral && op.field < arguments.size() ? arguments[op.field] : unset;
+		switch (op.type) {
+		case OpLiteral:
+			writer.Append(std::string_view(literals.data() + op.offset, op.length));
+			break;
+		case OpIf:
+		case OpUnless:
+			if (isTruthy(argument) != (op.type == OpIf)) {
+				index = op.skipTo;
+				continue;
+			}
+			break;
+		case OpField: {
+			std::array<char, maxLength> buffer;
+			bool isNumber = false;
+			const auto value = FormatValue(op, argument, buffer, isNumber);
+			const std::size_t characters = op.width ? countCharacters(value) : 0;
+			const std::size_t padding = op.width > characters ? op.width - characters : 0;
+			const auto align = op.align != AlignDefault ? op.align : (isNumber ? AlignRight : AlignLeft);
+			const std::size_t before = align == AlignRight ? padding : (align == AlignCenter ? padding / 2 : 0);
+			writer.Fill(op.fill, before);
+			writer.Append(value);
+			writer.Fill(op.fill, padding - before);
+			break;
+		}
+		}
+		index++;
+	}
+	return writer.length;
+}
+
+std::string_view TextFormat::FormatValue(const Op &op, const Argument &argument, std::span<char> buffer, bool &isNumber)
+{
+	isNumber = false;
+	if (!argument.isSet)
+		return {};
+
+	double number = argument.number;
+	isNumber = argument.isNumber;
+	if (!isNumber && op.numberType != TypeDefault) {
+		// Values of the store are texts, the numeric types read them as numbers
+		const auto &text = argument.text;
+		const auto result = std::from_chars(text.data(), text.data() + text.size(), number);
+		isNumber = result.ec == std::errc() && result.ptr == text.data() + text.size();
+	}
+	if (!isNumber)
+		return op.precision >= 0 ? takeCharacters(argument.text, static_cast<std::size_t>(op.precision)) : argument.text;
+
+	char *first = buffer.data();
+	char *last = buffer.data() + buffer.size();
+	std::to_chars_result result;
+	if (op.numberType == TypeInteger && std::abs(number) < maxRoundedNumber)
+		result = std::to_chars(first, last, std::llround(number));
+	else if (op.numberType == TypeInteger)
+		result = std::to_chars(first, last, number, std::chars_format::fixed, 0);
+	else if (op.numberType == TypeFixed)
+		result = std::to_chars(first, last, number, std::chars_format::fixed, op.precision >= 0 ? op.precision : 6);
+	else if (op.precision >= 0)
+		result = std::to_chars(first, last, number, std::chars_format::general, op.precision);
+	else
+		result = std::to_chars(first, last, number);
+	// Only numbers longer than the longest text don't fit
+	if (result.ec != std::errc())
+		return {};
+	return std::string_view(first, static_cast<std::size_t>(result.ptr - first));
+}
+
+bool FormattedText::Update(const TextFormat &format, std::span<const TextFormat::Argument> arguments)
+{
+	std::array<char, TextFormat::maxLength> scratch;
+	const std::size_t newLength = format.Format(arguments, scratch);
+	if (formatted && newLength == length && std::memcmp(scratch.data(), text.data(), length) == 0)
+		return false;
+	std::memcpy(text.data(), scratch.data(), newLength);
+	length = newLength;
+	formatted = true;
+	return true;
+}
@@ -0,0 +1,78 @@
+#include "textWidgets.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "widgetStore.hpp"
+#include <algorithm>
+
+TextWidgets::~TextWidgets()
+{
+	if (subscriptionId) {
+		core->GetWidgetStore().Unsubscribe(subscriptionId);
+		subscriptionId = 0;
+	}
+}
+
+bool TextWidgets::Init(CorePtr core)
+{
+	this->core = core;
+	subscriptionId = core->GetWidgetStore().Subscribe([this](std::string_view key, std::string_view value) {
+		(void)value;
+		OnChange(key);
+	});
+	return true;
+}
+
+bool TextWidgets::Add(std::string_view name, std::string_view source)
+{
+	auto widget = std::make_unique<Widget>();
+	if (name.empty() || !widget->format.Parse(source)) {
+		NCBAR_LOG_ERROR << "TextWidgets: Failed to add \"" << name << "\"";
+		return false;
+	}
+	widget->key.reserve(keyPrefix.size() + name.size());
+	widget->key.append(keyPrefix).append(name);
+	if (std::any_of(widgets.begin(), widgets.end(), [&widget](const auto &other) { return other->key == widget->key; })) {
+		NCBAR_LOG_ERROR << "TextWidgets: Failed to add \"" << name << "\", it already exists";
+		return false;
+	}
+	widget->arguments.resize(widget->format.GetFields().size());
+	for (const auto &field : widget->format.GetFields()) {
+		auto it = users.find(field);
+		if (it == users.end())
+			it = users.emplace(field, std::vector<Widget*>()).first;
+		it->second.push_back(widget.get());
+	}
+
+	Update(*widget);
+	widgets.push_back(std::move(widget));
+	return true;
+}
+
+void TextWidgets::OnChange(std::string_view key)
+{
+	auto it = users.find(key);
+	if (it == users.end())
+		return;
+	for (auto widget : it->second)
+		Update(*widget);
+}
+
+void TextWidgets::Update(Widget &widget)
+{
+	if (widget.updating)
+		return;
+	widget.updating = true;
+
+	auto &widgetStore = core->GetWidgetStore();
+	const auto &fields = widget.format.GetFields();
+	for (std::size_t i = 0; i < fields.size(); i++) {
+		const auto value = widgetStore.Get(fields[i]);
+		widget.arguments[i] = value ? TextFormat::Argument::FromText(*value) : TextFormat::Argument();
+	}
+	if (widget.text.Update(widget.format, widget.arguments))
+		widgetStore.Set(widget.key, widget.text.GetText());
+	// Values may move when the store changes, they are only valid while formatting
+	std::fill(widget.arguments.begin(), widget.arguments.end(), TextFormat::Argument());
+
+	widget.updating = false;
+}
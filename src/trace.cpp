@@ -0,0 +1,195 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+
+namespace {
+	// Written by its thread only. Readers copy entries and then check that the writer didn't lap them meanwhile
+	struct Ring {
+		std::array<Trace::Event, Trace::ringCapacity> events;
+		std::atomic<uint64_t> head = 0;
+		// Only touched by CollectNew()
+		uint64_t collected = 0;
+		uint32_t thread = 0;
+		const char *name = nullptr;
+	};
+	static_assert((Trace::ringCapacity & (Trace::ringCapacity - 1)) == 0, "Ring capacity must be a power of two");
+
+	// Rings outlive their threads, so a dump still shows threads that have exited
+	std::mutex ringsMutex;
+	std::vector<std::unique_ptr<Ring>> rings;
+
+	Ring* getThreadRing()
+	{
+		thread_local Ring *ring = nullptr;
+		if (!ring) {
+			std::lock_guard lock(ringsMutex);
+			rings.push_back(std::make_unique<Ring>());
+			ring = rings.back().get();
+			ring->thread = static_cast<uint32_t>(rings.size());
+		}
+		return ring;
+	}
+
+	// Copies the entries [first, head) that weren't overwritten while copying and returns the head they end at. The
+	// writer doesn't wait for readers, so an entry may be overwritten while it's copied: a formal data race on plain
+	// fields, accepted to keep recording at two stores. Such entries are always among the lapped ones found by reading
+	// the head again afterwards, and they are dropped, so a torn event is never exported
+	uint64_t copyEvents(const Ring &ring, uint64_t first, std::vector<Trace::Event> &events)
+	{
+		const uint64_t head = ring.head.load(std::memory_order_acquire);
+		first = std::max(first, head > Trace::ringCapacity ? head - Trace::ringCapacity : 0);
+		const auto size = events.size();
+		for (uint64_t i = first; i < head; i++)
+			events.push_back(ring.events[i & (Trace::ringCapacity - 1)]);
+
+		const uint64_t newHead = ring.head.load(std::memory_order_acquire);
+		const uint64_t valid = newHead > Trace::ringCapacity ? newHead - Trace::ringCapacity : 0;
+		if (valid > first) {
+			const auto lapped = static_cast<std::size_t>(std::min(valid, head) - first);
+			events.erase(events.begin() + static_cast<std::ptrdiff_t>(size), events.begin() + static_cast<std::ptrdiff_t>(size + lapped));
+		}
+		return head;
+	}
+
+	void writeJsonString(std::FILE *file, const char *string)
+	{
+		std::fputc('"', file);
+		for (const char *c = string ? string : ""; *c; c++) {
+			if (*c == '"' || *c == '\\')
+				std::fputc('\\', file);
+			std::fputc(*c, file);
+		}
+		std::fputc('"', file);
+	}
+}
+
+uint64_t Trace::Now()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1'000'000'000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+
+void Trace::Record(const char *category, const char *name, uint64_t start, uint64_t end)
+{
+	auto ring = getThreadRing();
+	const uint64_t head = ring->head.load(std::memory_order_relaxed);
+	ring->events[head & (ringCapacity - 1)] = Event{ .category = category, .name = name, .start = start, .duration = end - start, .thread = ring->thread };
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::SetThreadName(const char *name)
+{
+	getThreadRing()->name = name;
+}
+
+void Trace::CollectSince(uint64_t since, std::vector<Event> &events)
+{
+	std::lock_guard lock(ringsMutex);
+	for (auto &ring : rings) {
+		const auto size = events.size();
+		copyEvents(*ring, 0, events);
+		events.erase(std::remove_if(events.begin() + static_cast<std::ptrdiff_t>(size), events.end(), [since](const Event &event) {
+			return event.start < since;
+		}), events.end());
+	}
+}
+
+uint64_t Trace::CollectNew(std::vector<Event> &events)
+{
+	std::lock_guard lock(ringsMutex);
+	uint64_t lost = 0;
+	for (auto &ring : rings) {
+		const auto size = events.size();
+		const uint64_t head = copyEvents(*ring, ring->collected, events);
+		// Overwritten before or while they were copied
+		lost += head - ring->collected - (events.size() - size);
+		ring->collected = head;
+	}
+	return lost;
+}
+
+bool Trace::WriteChromeJson(const std::string &path, const std::vector<Event> &events)
+{
+	Stream stream;
+	return stream.Open(path, true) && stream.Append(events) && stream.Close();
+}
+
+Trace::Stream::~Stream()
+{
+	Close();
+}
+
+bool Trace::Stream::Open(const std::string &path, bool exclusive)
+{
+	Close();
+	if (exclusive) {
+		const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return false;
+		file = fdopen(fd, "w");
+		if (!file) {
+			close(fd);
+			return false;
+		}
+	} else {
+		file = std::fopen(path.c_str(), "w");
+		if (!file)
+			return false;
+	}
+	eventsCount = 0;
+	first = true;
+	std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+	return !std::ferror(file);
+}
+
+bool Trace::Stream::Append(const std::vector<Event> &events)
+{
+	if (!file)
+		return false;
+	// Chrome wants microseconds, the fraction keeps the nanoseconds
+	const int pid = static_cast<int>(getpid());
+	for (const auto &event : events) {
+		std::fprintf(file, "%s{\"name\":", first ? "" : ",\n");
+		writeJsonString(file, event.name);
+		std::fputs(",\"cat\":", file);
+		writeJsonString(file, event.category);
+		std::fprintf(file, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+			static_cast<double>(event.start) / 1000.0, static_cast<double>(event.duration) / 1000.0, pid, event.thread);
+		first = false;
+	}
+	eventsCount += events.size();
+	return !std::ferror(file);
+}
+
+bool Trace::Stream::Close()
+{
+	if (!file)
+		return false;
+	// Metadata events may come anywhere, threads named after the first events are named too
+	const int pid = static_cast<int>(getpid());
+	{
+		std::lock_guard lock(ringsMutex);
+		for (auto &ring : rings) {
+			if (!ring->name)
+				continue;
+			std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",\n", pid, ring->thread);
+			writeJsonString(file, ring->name);
+			std::fputs("}}", file);
+			first = false;
+		}
+	}
+	std::fputs("\n]}\n", file);
+
+	const bool written = !std::ferror(file);
+	const bool closed = std::fclose(file) == 0;
+	file = nullptr;
+	return closed && written;
+}
@@ -0,0 +1,676 @@
+#include "tray.hpp"
+#include "core.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "widgetStore.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+
+namespace {
+	constexpr const char *watcherName = "org.kde.StatusNotifierWatcher";
+	constexpr const char *watcherPath = "/StatusNotifierWatcher";
+	constexpr const char *watcherInterface = "org.kde.StatusNotifierWatcher";
+	constexpr const char *itemInterface = "org.kde.StatusNotifierItem";
+	constexpr const char *defaultItemPath = "/StatusNotifierItem";
+	constexpr const char *propertiesInterface = "org.freedesktop.DBus.Properties";
+	constexpr const char *busName = "org.freedesktop.DBus";
+	constexpr const char *busPath = "/org/freedesktop/DBus";
+
+	constexpr const char *watcherIntrospection =
+		DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+		"<node>\n"
+		" <interface name=\"org.kde.StatusNotifierWatcher\">\n"
+		"  <method name=\"RegisterStatusNotifierItem\"><arg name=\"service\" type=\"s\" direction=\"in\"/></method>\n"
+		"  <method name=\"RegisterStatusNotifierHost\"><arg name=\"service\" type=\"s\" direction=\"in\"/></method>\n"
+		"  <property name=\"RegisteredStatusNotifierItems\" type=\"as\" access=\"read\"/>\n"
+		"  <property name=\"IsStatusNotifierHostRegistered\" type=\"b\" access=\"read\"/>\n"
+		"  <property name=\"ProtocolVersion\" type=\"i\" access=\"read\"/>\n"
+		"  <signal name=\"StatusNotifierItemRegistered\"><arg type=\"s\"/></signal>\n"
+		"  <signal name=\"StatusNotifierItemUnregistered\"><arg type=\"s\"/></signal>\n"
+		"  <signal name=\"StatusNotifierHostRegistered\"/>\n"
+		" </interface>\n"
+		" <interface name=\"org.freedesktop.DBus.Properties\">\n"
+		"  <method name=\"Get\"><arg type=\"s\" direction=\"in\"/><arg type=\"s\" direction=\"in\"/><arg type=\"v\" direction=\"out\"/></method>\n"
+		"  <method name=\"GetAll\"><arg type=\"s\" direction=\"in\"/><arg type=\"a{sv}\" direction=\"out\"/></method>\n"
+		" </interface>\n"
+		" <interface name=\"org.freedesktop.DBus.Introspectable\">\n"
+		"  <method name=\"Introspect\"><arg type=\"s\" direction=\"out\"/></method>\n"
+		" </interface>\n"
+		"</node>\n";
+
+	// `busname/path`, or `busname` alone for the default path
+	std::pair<std::string, std::string> splitService(const std::string &service)
+	{
+		auto slash = service.find('/');
+		if (slash == std::string::npos)
+			return { service, defaultItemPath };
+		return { service.substr(0, slash), service.substr(slash) };
+	}
+
+	// FNV-1a, only to tell whether a pixmap changed
+	uint64_t hashPixmap(int32_t width, int32_t height, const uint8_t *data, int size)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		auto add = [&hash](uint8_t byte) {
+			hash ^= byte;
+			hash *= 1099511628211ull;
+		};
+		for (int shift = 0; shift < 32; shift += 8) {
+			add(static_cast<uint8_t>(static_cast<uint32_t>(width) >> shift));
+			add(static_cast<uint8_t>(static_cast<uint32_t>(height) >> shift));
+		}
+		for (int i = 0; i < size; i++)
+			add(data[i]);
+		return hash;
+	}
+
+	struct Pixmap {
+		int32_t width = 0;
+		int32_t height = 0;
+		// Points into the message
+		const uint8_t *data = nullptr;
+		int size = 0;
+	};
+
+	// a(iiay) of ARGB32 pixmaps in network byte order, the smallest one that is at least `size` wide or the
+	// largest one if all are smaller
+	Pixmap readPixmaps(DBusMessageIter *variant, uint32_t size)
+	{
+		Pixmap best;
+		if (dbus_message_iter_get_arg_type(variant) != DBUS_TYPE_ARRAY)
+			return best;
+		DBusMessageIter array;
+		dbus_message_iter_recurse(variant, &array);
+		while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+			DBusMessageIter fields;
+			dbus_message_iter_recurse(&array, &fields);
+			Pixmap pixmap;
+			if (dbus_message_iter_get_arg_type(&fields) == DBUS_TYPE_INT32) {
+				dbus_message_iter_get_basic(&fields, &pixmap.width);
+				dbus_message_iter_next(&fields);
+			}
+			if (dbus_message_iter_get_arg_type(&fields) == DBUS_TYPE_INT32) {
+				dbus_message_iter_get_basic(&fields, &pixmap.height);
+				dbus_message_iter_next(&fields);
+			}
+			if (dbus_message_iter_get_arg_type(&fields) == DBUS_TYPE_ARRAY && dbus_message_iter_get_element_type(&fields) == DBUS_TYPE_BYTE) {
+				DBusMessageIter bytes;
+				dbus_message_iter_recurse(&fields, &bytes);
+				dbus_message_iter_get_fixed_array(&bytes, &pixmap.data, &pixmap.size);
+			}
+			dbus_message_iter_next(&array);
+
+			if (pixmap.width <= 0 || pixmap.height <= 0 || static_cast<int64_t>(pixmap.width) * pixmap.height * 4 != pixmap.size)
+				continue;
+			const auto width = static_cast<uint32_t>(pixmap.width);
+			const auto bestWidth = static_cast<uint32_t>(best.width);
+			const bool better = !best.data ||
+				(width >= size && (bestWidth < size || width < bestWidth)) ||
+				(width < size && bestWidth < size && width > bestWidth);
+			if (better)
+				best = pixmap;
+		}
+		return best;
+	}
+
+	std::string readString(DBusMessageIter *variant)
+	{
+		const int type = dbus_message_iter_get_arg_type(variant);
+		if (type != DBUS_TYPE_STRING && type != DBUS_TYPE_OBJECT_PATH)
+			return {};
+		const char *value = nullptr;
+		dbus_message_iter_get_basic(variant, &value);
+		return value ? value : "";
+	}
+
+	void appendVariant(DBusMessageIter *iter, int type, const void *value)
+	{
+		const char signature[] = { static_cast<char>(type), '\0' };
+		DBusMessageIter variant;
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, signature, &variant);
+		dbus_message_iter_append_basic(&variant, type, value);
+		dbus_message_iter_close_container(iter, &variant);
+	}
+
+	void appendStringArrayVariant(DBusMessageIter *iter, const std::vector<std::string> &strings)
+	{
+		DBusMessageIter variant, array;
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "as", &variant);
+		dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s", &array);
+		for (const auto &string : strings) {
+			const char *value = string.c_str();
+			dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &value);
+		}
+		dbus_message_iter_close_container(&variant, &array);
+		dbus_message_iter_close_container(iter, &variant);
+	}
+}
+
+Tray::~Tray()
+{
+	if (filterId) {
+		bus->RemoveFilter(filterId);
+		filterId = 0;
+	}
+	for (auto &item : items) {
+		if (!item.matchRule.empty())
+			bus->RemoveMatch(item.matchRule);
+	}
+	items.clear();
+}
+
+bool Tray::Init(CorePtr core, Bus::Ptr bus)
+{
+	this->core = core;
+	this->bus = bus;
+	if (!bus) {
+		NCBAR_LOG_ERROR << "Tray: Failed to get the session bus";
+		return false;
+	}
+	hostName = "org.kde.StatusNotifierHost-" + std::to_string(getpid());
+
+	filterId = bus->AddFilter([this](DBusMessage *message) {
+		return this->OnMessage(message);
+	});
+	// Items and watchers that go away don't always unregister
+	bus->AddMatch("type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged'");
+	bus->AddMatch(std::string("type='signal',sender='") + watcherName + "',interface='" + watcherInterface + "'");
+	RequestWatcherName();
+	return true;
+}
+
+void Tray::SetOnChange(OnChangeCallbackType onChange)
+{
+	this->onChange = onChange;
+}
+
+void Tray::SetIconSize(uint32_t size)
+{
+	if (size == iconSize)
+		return;
+	iconSize = size;
+	// Another pixmap of the same items may fit better now
+	for (uint32_t slot = 0; slot < items.size(); slot++) {
+		if (!items[slot].service.empty())
+			FetchProperties(slot);
+	}
+}
+
+void Tray::Activate(uint32_t slot, int32_t x, int32_t y)
+{
+	CallItem(slot, "Activate", x, y);
+}
+
+void Tray::SecondaryActivate(uint32_t slot, int32_t x, int32_t y)
+{
+	CallItem(slot, "SecondaryActivate", x, y);
+}
+
+void Tray::ContextMenu(uint32_t slot, int32_t x, int32_t y)
+{
+	CallItem(slot, "ContextMenu", x, y);
+}
+
+void Tray::Scroll(uint32_t slot, int32_t delta, bool horizontal)
+{
+	if (slot >= items.size() || items[slot].service.empty())
+		return;
+	const auto &item = items[slot];
+	DBusMessage *message = dbus_message_new_method_call(item.busName.c_str(), item.path.c_str(), itemInterface, "Scroll");
+	if (!message)
+		return;
+	const char *orientation = horizontal ? "horizontal" : "vertical";
+	dbus_message_append_args(message, DBUS_TYPE_INT32, &delta, DBUS_TYPE_STRING, &orientation, DBUS_TYPE_INVALID);
+	dbus_message_set_no_reply(message, TRUE);
+	bus->Send(message);
+}
+
+void Tray::RequestWatcherName()
+{
+	DBusMessage *message = dbus_message_new_method_call(busName, busPath, busName, "RequestName");
+	if (!message)
+		return;
+	const char *name = watcherName;
+	const uint32_t flags = DBUS_NAME_FLAG_DO_NOT_QUEUE;
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &name, DBUS_TYPE_UINT32, &flags, DBUS_TYPE_INVALID);
+	bus->Call(message, [this](DBusMessage *reply) {
+		uint32_t result = 0;
+		if (!reply || !dbus_message_get_args(reply, nullptr, DBUS_TYPE_UINT32, &result, DBUS_TYPE_INVALID))
+			return;
+		if (result == DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER || result == DBUS_REQUEST_NAME_REPLY_ALREADY_OWNER) {
+			watcher = true;
+			// Items that wait for a host register when they see this
+			EmitWatcherSignal("StatusNotifierHostRegistered", nullptr);
+		}
+		else
+			RegisterAtWatcher();
+	});
+}
+
+void Tray::RegisterAtWatcher()
+{
+	// Some watchers want the host name to be owned by the caller, the reply isn't needed for that
+	DBusMessage *message = dbus_message_new_method_call(busName, busPath, busName, "RequestName");
+	if (!message)
+		return;
+	const char *name = hostName.c_str();
+	const uint32_t flags = DBUS_NAME_FLAG_DO_NOT_QUEUE;
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &name, DBUS_TYPE_UINT32, &flags, DBUS_TYPE_INVALID);
+	dbus_message_set_no_reply(message, TRUE);
+	bus->Send(message);
+
+	message = dbus_message_new_method_call(watcherName, watcherPath, watcherInterface, "RegisterStatusNotifierHost");
+	if (!message)
+		return;
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+	dbus_message_set_no_reply(message, TRUE);
+	bus->Send(message);
+
+	message = dbus_message_new_method_call(watcherName, watcherPath, propertiesInterface, "Get");
+	if (!message)
+		return;
+	const char *interface = watcherInterface;
+	const char *property = "RegisteredStatusNotifierItems";
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+	bus->Call(message, [this](DBusMessage *reply) {
+		DBusMessageIter iter, variant, array;
+		if (!reply || !dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+			return;
+		dbus_message_iter_recurse(&iter, &variant);
+		if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_ARRAY)
+			return;
+		dbus_message_iter_recurse(&variant, &array);
+		while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING) {
+			AddItem(readString(&array));
+			dbus_message_iter_next(&array);
+		}
+	});
+}
+
+void Tray::AddItem(const std::string &service)
+{
+	if (service.empty() || FindSlot(service) >= 0)
+		return;
+	uint32_t slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else {
+		slot = static_cast<uint32_t>(items.size());
+		items.emplace_back();
+	}
+	auto &item = items[slot];
+	item.service = service;
+	std::tie(item.busName, item.path) = splitService(service);
+	item.matchRule = "type='signal',sender='" + item.busName + "',path='" + item.path + "',interface='" + itemInterface + "'";
+	bus->AddMatch(item.matchRule);
+
+	// Signals carry the unique name of the sender, not the well-known name the item registered with
+	if (item.busName.starts_with(':'))
+		item.owner = item.busName;
+	else if (DBusMessage *message = dbus_message_new_method_call(busName, busPath, busName, "GetNameOwner")) {
+		const char *name = item.busName.c_str();
+		dbus_message_append_args(message, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+		bus->Call(message, [this, slot, service](DBusMessage *reply) {
+			const char *owner = nullptr;
+			if (!reply || !dbus_message_get_args(reply, nullptr, DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID))
+				return;
+			if (slot < items.size() && items[slot].service == service)
+				items[slot].owner = owner;
+		});
+	}
+	FetchProperties(slot);
+}
+
+void Tray::RemoveItem(const std::string &service)
+{
+	const auto index = FindSlot(service);
+	if (index < 0)
+		return;
+	const auto slot = static_cast<uint32_t>(index);
+	auto &item = items[slot];
+	bus->RemoveMatch(item.matchRule);
+	const bool announced = item.announced;
+	item = Item();
+	freeSlots.push_back(slot);
+	if (!announced)
+		return;
+
+	// Empty values tell the subscribers the slot is free
+	Publish(slot, ChangedTitle | ChangedStatus | ChangedIcon);
+	if (onChange)
+		onChange(slot, ChangedRemoved);
+}
+
+void Tray::FetchProperties(uint32_t slot)
+{
+	auto &item = items[slot];
+	if (item.fetching) {
+		// However many signals come meanwhile, it's one more fetch
+		item.refetch = true;
+		return;
+	}
+	DBusMessage *message = dbus_message_new_method_call(item.busName.c_str(), item.path.c_str(), propertiesInterface, "GetAll");
+	if (!message)
+		return;
+	const char *interface = itemInterface;
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID);
+	item.fetching = true;
+	item.refetch = false;
+	bus->Call(message, [this, slot, service = item.service](DBusMessage *reply) {
+		// The slot may belong to another item by now
+		if (slot >= items.size() || items[slot].service != service)
+			return;
+		items[slot].fetching = false;
+		if (reply)
+			OnProperties(slot, reply);
+		if (items[slot].refetch)
+			FetchProperties(slot);
+	});
+}
+
+void Tray::OnProperties(uint32_t slot, DBusMessage *reply)
+{
+	NCBAR_TRACE_SCOPE("source", "Tray::OnProperties");
+	DBusMessageIter iter, dictionary;
+	if (!dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+		return;
+	dbus_message_iter_recurse(&iter, &dictionary);
+
+	std::string id, title, status, iconName, attentionIconName;
+	Pixmap pixmap, attentionPixmap;
+	while (dbus_message_iter_get_arg_type(&dictionary) == DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, variant;
+		dbus_message_iter_recurse(&dictionary, &entry);
+		const std::string key = readString(&entry);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_next(&dictionary);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+			continue;
+		dbus_message_iter_recurse(&entry, &variant);
+		if (key == "Id")
+			id = readString(&variant);
+		else if (key == "Title")
+			title = readString(&variant);
+		else if (key == "Status")
+			status = readString(&variant);
+		else if (key == "IconName")
+			iconName = readString(&variant);
+		else if (key == "AttentionIconName")
+			attentionIconName = readString(&variant);
+		else if (key == "IconPixmap")
+			pixmap = readPixmaps(&variant, iconSize);
+		else if (key == "AttentionIconPixmap")
+			attentionPixmap = readPixmaps(&variant, iconSize);
+	}
+	if (status == "NeedsAttention") {
+		if (!attentionIconName.empty())
+			iconName = attentionIconName;
+		if (attentionPixmap.data)
+			pixmap = attentionPixmap;
+	}
+
+	auto &item = items[slot];
+	uint32_t changes = ChangedNothing;
+	if (!item.announced) {
+		item.announced = true;
+		changes |= ChangedAdded | ChangedTitle | ChangedStatus | ChangedIcon;
+	}
+	if (id != item.id || title != item.title) {
+		item.id = std::move(id);
+		item.title = std::move(title);
+		changes |= ChangedTitle;
+	}
+	if (status != item.status) {
+		item.status = std::move(status);
+		changes |= ChangedStatus;
+	}
+	if (iconName != item.iconName) {
+		item.iconName = std::move(iconName);
+		changes |= ChangedIcon;
+	}
+	// Items that animate by resending the same frames don't get re-uploaded
+	const uint64_t hash = pixmap.data ? hashPixmap(pixmap.width, pixmap.height, pixmap.data, pixmap.size) : 0;
+	if (hash != item.iconHash) {
+		item.iconHash = hash;
+		item.iconWidth = static_cast<uint32_t>(pixmap.width);
+		item.iconHeight = static_cast<uint32_t>(pixmap.height);
+		item.iconPixels.resize(static_cast<std::size_t>(pixmap.size));
+		for (int i = 0; i + 3 < pixmap.size; i += 4) {
+			// ARGB to RGBA
+			item.iconPixels[i] = pixmap.data[i + 1];
+			item.iconPixels[i + 1] = pixmap.data[i + 2];
+			item.iconPixels[i + 2] = pixmap.data[i + 3];
+			item.iconPixels[i + 3] = pixmap.data[i];
+		}
+		changes |= ChangedIcon;
+	}
+	if (changes == ChangedNothing)
+		return;
+
+	Publish(slot, changes);
+	if (onChange)
+		onChange(slot, changes);
+}
+
+void Tray::Publish(uint32_t slot, uint32_t changes)
+{
+	const auto &item = items[slot];
+	auto &widgetStore = core->GetWidgetStore();
+	keyBuffer.assign("tray.");
+	keyBuffer.append(std::to_string(slot));
+	keyBuffer.push_back('.');
+	const auto prefixSize = keyBuffer.size();
+
+	if (changes & ChangedTitle) {
+		keyBuffer.resize(prefixSize);
+		keyBuffer.append("id");
+		widgetStore.Set(keyBuffer, item.id);
+		keyBuffer.resize(prefixSize);
+		keyBuffer.append("title");
+		widgetStore.Set(keyBuffer, item.title);
+	}
+	if (changes & ChangedStatus) {
+		keyBuffer.resize(prefixSize);
+		keyBuffer.append("status");
+		widgetStore.Set(keyBuffer, item.status);
+	}
+	if (changes & ChangedIcon) {
+		keyBuffer.resize(prefixSize);
+		keyBuffer.append("icon_name");
+		widgetStore.Set(keyBuffer, item.iconName);
+	}
+}
+
+void Tray::CallItem(uint32_t slot, const char *method, int32_t x, int32_t y)
+{
+	if (slot >= items.size() || items[slot].service.empty())
+		return;
+	const auto &item = items[slot];
+	DBusMessage *message = dbus_message_new_method_call(item.busName.c_str(), item.path.c_str(), itemInterface, method);
+	if (!message)
+		return;
+	dbus_message_append_args(message, DBUS_TYPE_INT32, &x, DBUS_TYPE_INT32, &y, DBUS_TYPE_INVALID);
+	dbus_message_set_no_reply(message, TRUE);
+	bus->Send(message);
+}
+
+int32_t Tray::FindSlot(std::string_view service) const
+{
+	for (uint32_t slot = 0; slot < items.size(); slot++) {
+		if (items[slot].service == service)
+			return static_cast<int32_t>(slot);
+	}
+	return -1;
+}
+
+bool Tray::OnMessage(DBusMessage *message)
+{
+	const int type = dbus_message_get_type(message);
+	if (type == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+		const char *path = dbus_message_get_path(message);
+		if (watcher && path && strcmp(path, watcherPath) == 0)
+			return OnWatcherCall(message);
+		return false;
+	}
+	if (type != DBUS_MESSAGE_TYPE_SIGNAL)
+		return false;
+
+	if (dbus_message_is_signal(message, busName, "NameOwnerChanged")) {
+		const char *name = nullptr, *oldOwner = nullptr, *newOwner = nullptr;
+		if (!dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID))
+			return false;
+		if (strcmp(name, watcherName) == 0 && !watcher) {
+			if (*newOwner) {
+				// Another watcher (re)started, it doesn't know us
+				RegisterAtWatcher();
+			}
+			else {
+				// Its items register again with whoever takes over, maybe us
+				for (uint32_t slot = 0; slot < items.size(); slot++) {
+					if (!items[slot].service.empty())
+						RemoveItem(std::string(items[slot].service));
+				}
+				RequestWatcherName();
+			}
+			return false;
+		}
+		if (*newOwner)
+			return false;
+		// An item's process is gone
+		for (const auto &service : std::vector<std::string>(registeredServices)) {
+			if (splitService(service).first == name) {
+				std::erase(registeredServices, service);
+				EmitWatcherSignal("StatusNotifierItemUnregistered", &service);
+			}
+		}
+		for (uint32_t slot = 0; slot < items.size(); slot++) {
+			if (!items[slot].service.empty() && items[slot].busName == name)
+				RemoveItem(std::string(items[slot].service));
+		}
+		return false;
+	}
+
+	const char *interface = dbus_message_get_interface(message);
+	if (!interface)
+		return false;
+	if (!watcher && strcmp(interface, watcherInterface) == 0) {
+		const char *service = nullptr;
+		if (dbus_message_is_signal(message, watcherInterface, "StatusNotifierItemRegistered") &&
+			dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &service, DBUS_TYPE_INVALID))
+			AddItem(service);
+		else if (dbus_message_is_signal(message, watcherInterface, "StatusNotifierItemUnregistered") &&
+			dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &service, DBUS_TYPE_INVALID))
+			RemoveItem(service);
+		return false;
+	}
+	if (strcmp(interface, itemInterface) == 0) {
+		// NewIcon, NewTitle, NewStatus... all of them are answered with the same GetAll
+		const char *sender = dbus_message_get_sender(message);
+		const char *path = dbus_message_get_path(message);
+		if (!sender || !path)
+			return false;
+		for (uint32_t slot = 0; slot < items.size(); slot++) {
+			const auto &item = items[slot];
+			if (!item.service.empty() && item.owner == sender && item.path == path)
+				FetchProperties(slot);
+		}
+	}
+	return false;
+}
+
+bool Tray::OnWatcherCall(DBusMessage *message)
+{
+	DBusMessage *reply = nullptr;
+	if (dbus_message_is_method_call(message, watcherInterface, "RegisterStatusNotifierItem")) {
+		const char *argument = nullptr;
+		const char *sender = dbus_message_get_sender(message);
+		if (!sender || !dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &argument, DBUS_TYPE_INVALID))
+			reply = dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, "Expected a service name or an object path");
+		else {
+			// Ayatana items pass their object path, the others their bus name
+			std::string service = argument[0] == '/' ? std::string(sender) + argument : std::string(argument) + defaultItemPath;
+			if (std::find(registeredServices.begin(), registeredServices.end(), service) == registeredServices.end()) {
+				registeredServices.push_back(service);
+				EmitWatcherSignal("StatusNotifierItemRegistered", &service);
+				AddItem(service);
+			}
+			reply = dbus_message_new_method_return(message);
+		}
+	}
+	else if (dbus_message_is_method_call(message, watcherInterface, "RegisterStatusNotifierHost")) {
+		// We are the only host the watcher needs to know, others are welcome but not tracked
+		reply = dbus_message_new_method_return(message);
+	}
+	else if (dbus_message_is_method_call(message, propertiesInterface, "Get") || dbus_message_is_method_call(message, propertiesInterface, "GetAll")) {
+		const bool all = dbus_message_is_method_call(message, propertiesInterface, "GetAll");
+		const char *interface = nullptr;
+		const char *property = "";
+		const bool parsed = all ?
+			dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID) :
+			dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+		if (!parsed || strcmp(interface, watcherInterface) != 0)
+			reply = dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_INTERFACE, "Unknown interface");
+		else {
+			reply = dbus_message_new_method_return(message);
+			const dbus_bool_t hostRegistered = TRUE;
+			const int32_t protocolVersion = 0;
+			DBusMessageIter iter, dictionary, entry;
+			dbus_message_iter_init_append(reply, &iter);
+			if (all)
+				dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dictionary);
+			bool found = false;
+			for (const char *name : { "RegisteredStatusNotifierItems", "IsStatusNotifierHostRegistered", "ProtocolVersion" }) {
+				if (!all && strcmp(property, name) != 0)
+					continue;
+				found = true;
+				DBusMessageIter *target = &iter;
+				if (all) {
+					dbus_message_iter_open_container(&dictionary, DBUS_TYPE_DICT_ENTRY, nullptr, &entry);
+					dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name);
+					target = &entry;
+				}
+				if (name[0] == 'R')
+					appendStringArrayVariant(target, registeredServices);
+				else if (name[0] == 'I')
+					appendVariant(target, DBUS_TYPE_BOOLEAN, &hostRegistered);
+				else
+					appendVariant(target, DBUS_TYPE_INT32, &protocolVersion);
+				if (all)
+					dbus_message_iter_close_container(&dictionary, &entry);
+			}
+			if (all)
+				dbus_message_iter_close_container(&iter, &dictionary);
+			if (!found) {
+				dbus_message_unref(reply);
+				reply = dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property");
+			}
+		}
+	}
+	else if (dbus_message_is_method_call(message, DBUS_INTERFACE_INTROSPECTABLE, "Introspect")) {
+		reply = dbus_message_new_method_return(message);
+		dbus_message_append_args(reply, DBUS_TYPE_STRING, &watcherIntrospection, DBUS_TYPE_INVALID);
+	}
+	else
+		reply = dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_METHOD, "Unknown method");
+
+	if (reply && !dbus_message_get_no_reply(message))
+		bus->Send(reply);
+	else if (reply)
+		dbus_message_unref(reply);
+	return true;
+}
+
+void Tray::EmitWatcherSignal(const char *member, const std::string *service)
+{
+	DBusMessage *signal = dbus_message_new_signal(watcherPath, watcherInterface, member);
+	if (!signal)
+		return;
+	if (service) {
+		const char *value = service->c_str();
+		dbus_message_append_args(signal, DBUS_TYPE_STRING, &value, DBUS_TYPE_INVALID);
+	}
+	bus->Send(signal);
+}
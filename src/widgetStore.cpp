@@ -0,0 +1,89 @@
+#include "widgetStore.hpp"
+#include <algorithm>
+#include <vector>
+
+bool WidgetStore::Set(std::string_view key, std::string_view value)
+{
+	auto it = entries.find(key);
+	if (it == entries.end()) {
+		it = entries.emplace(std::string(key), Entry()).first;
+	}
+	else {
+		if (it->second.provisional) {
+			it->second.provisional = false;
+			provisionalCount--;
+		}
+		if (it->second.value == value)
+			return false;
+	}
+	// Assigning keeps the capacity, so updates of the same size don't allocate
+	it->second.value.assign(value);
+	it->second.generation = ++generation;
+
+	notifying++;
+	for (auto &[id, onChange] : subscribers) {
+		if (id && onChange)
+			onChange(it->first, it->second.value);
+	}
+	notifying--;
+	// Drop the ones that unsubscribed from their callbacks, once no notification is iterating the list
+	if (!notifying)
+		std::erase_if(subscribers, [](const auto &subscriber) { return subscriber.first == 0; });
+	return true;
+}
+
+bool WidgetStore::SetProvisional(std::string_view key, std::string_view value)
+{
+	const bool changed = Set(key, value);
+	auto it = entries.find(key);
+	if (!it->second.provisional) {
+		it->second.provisional = true;
+		provisionalCount++;
+	}
+	return changed;
+}
+
+void WidgetStore::ClearProvisional()
+{
+	if (!provisionalCount)
+		return;
+	// Collected first, the notifications may add keys
+	std::vector<std::string> keys;
+	for (const auto &[key, entry] : entries) {
+		if (entry.provisional)
+			keys.push_back(key);
+	}
+	for (const auto &key : keys)
+		Set(key, {});
+}
+
+const std::string *WidgetStore::Get(std::string_view key) const
+{
+	auto it = entries.find(key);
+	return it != entries.end() ? &it->second.value : nullptr;
+}
+
+uint64_t WidgetStore::GetGeneration(std::string_view key) const
+{
+	auto it = entries.find(key);
+	return it != entries.end() ? it->second.generation : 0;
+}
+
+uint32_t WidgetStore::Subscribe(OnChangeCallbackType onChange)
+{
+	subscribers.emplace_back(++lastSubscriberId, std::move(onChange));
+	return lastSubscriberId;
+}
+
+void WidgetStore::Unsubscribe(uint32_t id)
+{
+	if (notifying) {
+		// The callback may be the one that is running, so it's removed after the notification
+		for (auto &subscriber : subscribers) {
+			if (subscriber.first == id)
+				subscriber.first = 0;
+		}
+		return;
+	}
+	std::erase_if(subscribers, [id](const auto &subscriber) { return subscriber.first == id; });
+}
@@ -1,79 +1,112 @@
 #include "core.hpp"
 #include "globals.hpp"
+#include "log.hpp"
 #include "renderer.hpp"
+#include "startupSnapshot.hpp"
+#include "trace.hpp"
 #include "vulkanHelper.hpp"
 #include "window.hpp"
-#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <linux/input-event-codes.h>
+#include <mutex>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 namespace {
-	// Wayland
-	void xdgSurfaceOnConfigureListener(void *data, xdg_surface *shellSurface, uint32_t serial)
+	void signalFd(int fd)
 	{
-		if (data) {
-			if (auto onConfigure = reinterpret_cast<Window::XdgSurfaceListenerWrapper*>(data)->onConfigure)
-				onConfigure(shellSurface, serial);
-		}
-	}
-	const xdg_surface_listener xdgSurfaceListener = {
-		.configure = xdgSurfaceOnConfigureListener
-	};
-	void xdgToplevelOnConfigureListener(void *data, xdg_toplevel *toplevel, int32_t width, int32_t height, wl_array *states)
-	{
-		if (data) {
-			if (auto onConfigure = reinterpret_cast<Window::XdgToplevelListenerWrapper*>(data)->onConfigure)
-				onConfigure(toplevel, width, height, states);
-		}
+		const uint64_t one = 1;
+		if (write(fd, &one, sizeof(one)) < 0)
+			NCBAR_LOG_ERROR << "Window: Failed to signal the other thread: " << strerror(errno);
 	}
-	void xdgToplevelOnCloseListener(void *data, xdg_toplevel *toplevel)
-	{
-		if (data) {
-			if (auto onClose = reinterpret_cast<Window::XdgToplevelListenerWrapper*>(data)->onClose)
-				onClose(toplevel);
-		}
-	}
-	const xdg_toplevel_listener xdgToplevelListener = {
-		.configure = xdgToplevelOnConfigureListener,
-		.close = xdgToplevelOnCloseListener,
-		.configure_bounds = nullptr,
-		.wm_capabilities = nullptr
-	};
-	void xdgPopupOnConfigureListener(void *data, xdg_popup *popup, int32_t x, int32_t y, int32_t width, int32_t height)
+	void drainFd(int fd)
 	{
-		if (data) {
-			if (auto onConfigure = reinterpret_cast<Window::XdgPopupListenerWrapper*>(data)->onConfigure)
-				onConfigure(popup, x, y, width, height);
-		}
-	}
-	const xdg_popup_listener xdgPopupListener = {
-		.configure = xdgPopupOnConfigureListener,
-		.popup_done = nullptr,
-		.repositioned = nullptr
-	};
-	void zwlrLayerSurfaceV1OnConfigureListener(void *data, zwlr_layer_surface_v1 *layerSurface, uint32_t serial, uint32_t width, uint32_t height)
-	{
-		if (data) {
-			if (auto onConfigure = reinterpret_cast<Window::ZwlrLayerSurfaceListenerWrapper*>(data)->onConfigure)
-				onConfigure(layerSurface, serial, width, height);
-		}
-	}
-	void zwlrLayerSurfaceV1OnClosedListener(void *data, zwlr_layer_surface_v1 *layerSurface)
-	{
-		if (data) {
-			if (auto onClosed = reinterpret_cast<Window::ZwlrLayerSurfaceListenerWrapper*>(data)->onClosed)
-				onClosed(layerSurface);
-		}
+		uint64_t count;
+		(void)!read(fd, &count, sizeof(count));
 	}
-	const zwlr_layer_surface_v1_listener zwlrLayerSurfaceV1Listener = {
-		.configure = zwlrLayerSurfaceV1OnConfigureListener,
-		.closed = zwlrLayerSurfaceV1OnClosedListener
-	};
 }
 
+const xdg_surface_listener Window::xdgSurfaceListener = {
+	.configure = BindListener<&Window::OnXdgSurfaceConfigure>
+};
+const xdg_toplevel_listener Window::xdgToplevelListener = {
+	.configure = BindListener<&Window::OnXdgToplevelConfigure>,
+	.close = BindListener<&Window::OnXdgToplevelClose>,
+	.configure_bounds = IgnoreListener,
+	.wm_capabilities = IgnoreListener
+};
+const xdg_popup_listener Window::xdgPopupListener = {
+	.configure = BindListener<&Window::OnXdgPopupConfigure>,
+	.popup_done = BindListener<&Window::OnXdgPopupDone>,
+	.repositioned = IgnoreListener
+};
+const zwlr_layer_surface_v1_listener Window::zwlrLayerSurfaceListener = {
+	.configure = BindListener<&Window::OnLayerSurfaceConfigure>,
+	.closed = BindListener<&Window::OnLayerSurfaceClosed>
+};
+const wl_surface_listener Window::wlSurfaceListener = {
+	.enter = BindListener<&Window::OnSurfaceEnter>,
+	.leave = BindListener<&Window::OnSurfaceLeave>
+};
+const wp_fractional_scale_v1_listener Window::wpFractionalScaleListener = {
+	.preferred_scale = BindListener<&Window::OnPreferredScale>
+};
+const wl_callback_listener Window::wlFrameCallbackListener = {
+	.done = BindListener<&Window::OnFrameDone>
+};
+const wp_presentation_feedback_listener Window::PresentationFeedback::listener = {
+	.sync_output = IgnoreListener,
+	.presented = BindListener<&Window::PresentationFeedback::OnPresented>,
+	.discarded = BindListener<&Window::PresentationFeedback::OnDiscarded>
+};
+
+
 Window::Window(const Window::Private&)
 {}
 
 Window::~Window()
 {
+	Stop();
+	if (outputRemovedSubscription) {
+		core->UnsubscribeOutputRemoved(outputRemovedSubscription);
+		outputRemovedSubscription = 0;
+	}
+	if (renderStateFd >= 0) {
+		core->RemoveFd(renderStateFd);
+		close(renderStateFd);
+		renderStateFd = -1;
+	}
+	if (wakeFd >= 0) {
+		close(wakeFd);
+		wakeFd = -1;
+	}
+	// The Vulkan surface goes before the Wayland one
+	renderer.reset();
+	for (auto &presentationFeedback : presentationFeedbacks) {
+		if (presentationFeedback.feedback) {
+			wp_presentation_feedback_destroy(presentationFeedback.feedback);
+			presentationFeedback.feedback = nullptr;
+		}
+	}
+	if (frameCallback) {
+		wl_callback_destroy(frameCallback);
+		frameCallback = nullptr;
+	}
+	if (queuePresentation) {
+		wl_proxy_wrapper_destroy(queuePresentation);
+		queuePresentation = nullptr;
+	}
+	if (queueSurface) {
+		wl_proxy_wrapper_destroy(queueSurface);
+		queueSurface = nullptr;
+	}
 	if (xdgToplevel) {
 		xdg_toplevel_destroy(xdgToplevel);
 		xdgToplevel = nullptr;
@@ -86,13 +119,28 @@ Window::~Window()
 		zwlr_layer_surface_v1_destroy(layerSurface);
 		layerSurface = nullptr;
 	}
+	if (fractionalScale) {
+		wp_fractional_scale_v1_destroy(fractionalScale);
+		fractionalScale = nullptr;
+	}
+	if (viewport) {
+		wp_viewport_destroy(viewport);
+		viewport = nullptr;
+	}
 	if (surface) {
+		if (core && core->GetSeat())
+			core->GetSeat()->ForgetSurface(surface);
 		wl_surface_destroy(surface);
 		surface = nullptr;
 	}
+	// Events still queued for its objects are dropped with it
+	if (eventQueue) {
+		wl_event_queue_destroy(eventQueue);
+		eventQueue = nullptr;
+	}
 }
 
-bool Window::Init(CorePtr core)
+bool Window::Init(CorePtr core, const StartupSnapshot *snapshot)
 {
 	this->core = core;
 
@@ -100,53 +148,62 @@ bool Window::Init(CorePtr core)
 	// Create surface
 	surface = wl_compositor_create_surface(core->GetCompositor());
 	if (!surface) {
-		std::cerr << "Wayland: Failed to create surface" << std::endl;
+		NCBAR_LOG_ERROR << "Wayland: Failed to create surface";
 		return false;
 	}
 
+	// Frame callbacks and presentation feedback are created through wrappers on the render thread's queue, so their
+	// events never wait for the main thread's dispatch
+	eventQueue = wl_display_create_queue(core->GetDisplay());
+	if (!eventQueue) {
+		NCBAR_LOG_ERROR << "Wayland: Failed to create event queue";
+		return false;
+	}
+	queueSurface = static_cast<wl_surface*>(wl_proxy_create_wrapper(surface));
+	if (!queueSurface) {
+		NCBAR_LOG_ERROR << "Wayland: Failed to wrap surface";
+		return false;
+	}
+	wl_proxy_set_queue(reinterpret_cast<wl_proxy*>(queueSurface), eventQueue);
+	if (core->GetPresentation()) {
+		queuePresentation = static_cast<wp_presentation*>(wl_proxy_create_wrapper(core->GetPresentation()));
+		if (!queuePresentation) {
+			NCBAR_LOG_ERROR << "Wayland: Failed to wrap presentation";
+			return false;
+		}
+		wl_proxy_set_queue(reinterpret_cast<wl_proxy*>(queuePresentation), eventQueue);
+	}
+
+	// Scale
+	if (core->GetViewporter() && core->GetFractionalScaleManager()) {
+		// Render at the exact device-pixel size and let the viewport map it back to the logical size
+		viewport = wp_viewporter_get_viewport(core->GetViewporter(), surface);
+		fractionalScale = wp_fractional_scale_manager_v1_get_fractional_scale(core->GetFractionalScaleManager(), surface);
+		wp_fractional_scale_v1_add_listener(fractionalScale, &wpFractionalScaleListener, this);
+	}
+	wl_surface_add_listener(surface, &wlSurfaceListener, this);
+	outputRemovedSubscription = core->SubscribeOutputRemoved([this](wl_output *output) { ForgetOutput(output); });
+
+	// Presentation feedback slots, reused frame after frame
+	for (auto &presentationFeedback : presentationFeedbacks) {
+		presentationFeedback.window = this;
+	}
+
 	bool isBar = false;
 	// Create layer surface
 	if (isBar) { // Top bar
-		layerSurface = zwlr_layer_shell_v1_get_layer_surface(core->GetLayerShell(), surface, nullptr, ZWLR_LAYER_SHELL_V1_LAYER_TOP, "ncbar-blur");
-		if (!layerSurface) {
-			std::cerr << "Wayland: Failed to create layer surface" << std::endl;
+		if (!CreateLayerSurface())
 			return false;
-		}
-		zwlr_layer_surface_v1_set_anchor(layerSurface, ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-		zwlr_layer_surface_v1_set_size(layerSurface, 0, 30);
-		zwlr_layer_surface_v1_set_exclusive_zone(layerSurface, 1);
-
-		// Add listener to zwlr_layer_surface_v1
-		zwlrLayerSurfaceListenerWrapper->onConfigure = [this](zwlr_layer_surface_v1 *layerSurface, uint32_t serial, uint32_t width, uint32_t height) {
-			zwlr_layer_surface_v1_ack_configure(layerSurface, serial);
-			if (width && height) {
-				this->newWidth = width;
-				this->newHeight = height;
-				this->resize = true;
-				this->readyToResize = true;
-			}
-		};
-		zwlrLayerSurfaceListenerWrapper->onClosed = [this](zwlr_layer_surface_v1 *layerSurface) {
-			(void)layerSurface;
-			this->isGoingToClose = true;
-		};
-		zwlr_layer_surface_v1_add_listener(layerSurface, &zwlrLayerSurfaceV1Listener, zwlrLayerSurfaceListenerWrapper.get());
 	}
 	else { // Popup or regular window
 		// Create xdg surface
 		xdgSurface = xdg_wm_base_get_xdg_surface(core->GetXdgWmBase(), surface);
 		if (!xdgSurface) {
-			std::cerr << "Wayland: Failed to get xdg surface" << std::endl;
+			NCBAR_LOG_ERROR << "Wayland: Failed to get xdg surface";
 			return false;
 		}
 		// Add listener to xdg surface
-		xdgSurfaceListenerWrapper->onConfigure = [this](xdg_surface *shellSurface, uint32_t serial) {
-			xdg_surface_ack_configure(shellSurface, serial);
-			if (this->resize) {
-				this->readyToResize = true;
-			}
-		};
-		xdg_surface_add_listener(xdgSurface, &xdgSurfaceListener, xdgSurfaceListenerWrapper.get());
+		xdg_surface_add_listener(xdgSurface, &xdgSurfaceListener, this);
 
 		bool isPopup = true;
 		if (isPopup) { // Popup
@@ -154,49 +211,26 @@ bool Window::Init(CorePtr core)
 
 			xdgPopupPositioner = xdg_wm_base_create_positioner(core->GetXdgWmBase());
 			if (!xdgPopupPositioner) {
-				std::cerr << "Wayland: Failed to create xdg positioner" << std::endl;
+				NCBAR_LOG_ERROR << "Wayland: Failed to create xdg positioner";
 				return false;
 			}
 
 			xdgPopup = xdg_surface_get_popup(xdgSurface, parentXdgSurface, xdgPopupPositioner);
 			if (!xdgPopup) {
-				std::cerr << "Wayland: Failed to create xdg popup" << std::endl;
+				NCBAR_LOG_ERROR << "Wayland: Failed to create xdg popup";
 				return false;
 			}
-			xdgPopupListenerWrapper->onConfigure = [this](xdg_popup *popup, int32_t x, int32_t y, int32_t width, int32_t height) {
-				(void)popup;
-				(void)x;
-				(void)y;
-				if ((width > 0) && (height > 0)) {
-					this->newWidth = width;
-					this->newHeight = height;
-					this->resize = true;
-				}
-			};
-			xdg_popup_add_listener(xdgPopup, &xdgPopupListener, xdgPopupListenerWrapper.get());
+			xdg_popup_add_listener(xdgPopup, &xdgPopupListener, this);
 		}
 		else {
 			// Get xdg toplevel
 			xdgToplevel = xdg_surface_get_toplevel(xdgSurface);
 			if (!xdgToplevel) {
-				std::cerr << "Wayland: Failed to get xdg toplevel" << std::endl;
+				NCBAR_LOG_ERROR << "Wayland: Failed to get xdg toplevel";
 				return false;
 			}
 			// Add listener to xdg toplevel
-			xdgToplevelListenerWrapper->onConfigure = [this](xdg_toplevel *toplevel, int32_t width, int32_t height, wl_array *states) {
-				(void)toplevel;
-				(void)states;
-				if ((width > 0) && (height > 0)) {
-					this->newWidth = width;
-					this->newHeight = height;
-					this->resize = true;
-				}
-			};
-			xdgToplevelListenerWrapper->onClose = [this](xdg_toplevel *toplevel) {
-				(void)toplevel;
-				this->isGoingToClose = true;
-			};
-			xdg_toplevel_add_listener(xdgToplevel, &xdgToplevelListener, xdgToplevelListenerWrapper.get());
+			xdg_toplevel_add_listener(xdgToplevel, &xdgToplevelListener, this);
 
 			// Fill info
 			xdg_toplevel_set_title(xdgToplevel, windowTitle);
@@ -209,14 +243,45 @@ bool Window::Init(CorePtr core)
 	wl_display_roundtrip(core->GetDisplay());
 
 	if (readyToResize && resize && newWidth && newHeight) {
-		width = newWidth;
-		height = newHeight;
+		configuredWidth = newWidth;
+		configuredHeight = newHeight;
+	}
+	configuredScale = pendingScale;
+	readyToResize = false;
+	resize = false;
+	// The render thread starts at this size, the swapchain is made for it below
+	width = configuredWidth;
+	height = configuredHeight;
+	scale = configuredScale;
+	drawnScale = configuredScale;
+	if (snapshot)
+		PresentSnapshot(*snapshot);
+
+	// ==== Threads ====
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	renderStateFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd < 0 || renderStateFd < 0) {
+		NCBAR_LOG_ERROR << "Window: Failed to create eventfd: " << strerror(errno);
+		return false;
 	}
+	if (!core->AddFd(renderStateFd, EPOLLIN, [this](uint32_t events) {
+		(void)events;
+		this->OnRenderState();
+	}))
+		return false;
 
+	// ==== Graphics ====
+	// Only now, creating the instance and the device takes longer than everything above, and the snapshot is already
+	// on screen by then
+	core->TryInitVulkan();
+	if (!core->IsVulkanInitialized()) {
+		NCBAR_LOG_ERROR << "Vulkan is not available";
+		return false;
+	}
 	{
 		renderer = Renderer::Create(shared_from_this());
 		if (!renderer) {
-			std::cerr << "Failed to create renderer" << std::endl;
+			NCBAR_LOG_ERROR << "Failed to create renderer";
 			return false;
 		}
 	}
@@ -224,32 +289,702 @@ bool Window::Init(CorePtr core)
 	return true;
 }
 
-bool Window::Render()
+void Window::PresentSnapshot(const StartupSnapshot &snapshot)
+{
+	// The scale isn't known before the surface is on an output, so only the logical size has to match; the viewport
+	// or the buffer scale maps the pixels of the previous run's scale onto it
+	const Scale snapshotScale = snapshot.GetScale();
+	const bool canScale = viewport || (snapshotScale.IsInteger() && wl_proxy_get_version(reinterpret_cast<wl_proxy*>(surface)) >= WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION);
+	if (snapshot.GetWidth() != configuredWidth || snapshot.GetHeight() != configuredHeight || (!canScale && snapshotScale != Scale())) {
+		NCBAR_LOG_DEBUG << "Window: Snapshot of " << snapshot.GetWidth() << "x" << snapshot.GetHeight() << " doesn't fit " << configuredWidth << "x" << configuredHeight;
+		return;
+	}
+	wl_buffer *buffer = snapshot.CreateBuffer(core->GetShm());
+	if (!buffer)
+		return;
+
+	if (viewport)
+		wp_viewport_set_destination(viewport, static_cast<int32_t>(configuredWidth), static_cast<int32_t>(configuredHeight));
+	else if (canScale)
+		wl_surface_set_buffer_scale(surface, static_cast<int32_t>(snapshotScale.value / Scale::denominator));
+	wl_surface_attach(surface, buffer, 0, 0);
+	wl_surface_damage(surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(surface);
+	// The file is replaced rather than written, so the compositor can keep reading it without the buffer
+	wl_buffer_destroy(buffer);
+	wl_display_flush(core->GetDisplay());
+	// The first frame sets its own scale
+	surfaceStateDirty = true;
+}
+
+bool Window::CreateLayerSurface()
+{
+	layerSurface = zwlr_layer_shell_v1_get_layer_surface(core->GetLayerShell(), surface, nullptr, ZWLR_LAYER_SHELL_V1_LAYER_TOP, "ncbar-blur");
+	if (!layerSurface) {
+		NCBAR_LOG_ERROR << "Wayland: Failed to create layer surface";
+		return false;
+	}
+	zwlr_layer_surface_v1_set_anchor(layerSurface, ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+	zwlr_layer_surface_v1_set_size(layerSurface, 0, 30);
+	zwlr_layer_surface_v1_set_exclusive_zone(layerSurface, 1);
+
+	// Add listener to zwlr_layer_surface_v1
+	zwlr_layer_surface_v1_add_listener(layerSurface, &zwlrLayerSurfaceListener, this);
+	return true;
+}
+
+bool Window::ReopenLayerSurface()
+{
+	// The render thread has released its resources and dropped its frame callback by now, see Publish()
+	closedOutputsGeneration = core->GetOutputsGeneration();
+	zwlr_layer_surface_v1_destroy(layerSurface);
+	layerSurface = nullptr;
+
+	// The surface has to be unmapped before it gets a new role object, whose configure shows the bar again
+	wl_surface_attach(surface, nullptr, 0, 0);
+	wl_surface_commit(surface);
+	if (!CreateLayerSurface())
+		return false;
+	wl_surface_commit(surface);
+	return true;
+}
+
+void Window::Start()
+{
+	Publish();
+	renderThread = std::thread(&Window::RenderLoop, this);
+}
+
+void Window::Stop()
 {
+	if (!renderThread.joinable())
+		return;
+	stopping.store(true, std::memory_order_release);
+	signalFd(wakeFd);
+	renderThread.join();
+	// The queue is ours now, what the compositor still reports about the last frames goes into the stats
+	wl_display_roundtrip_queue(core->GetDisplay(), eventQueue);
+}
+
+bool Window::Publish()
+{
+	NCBAR_TRACE_SCOPE("loop", "Window::Publish");
+	// Only once the render thread is hidden for it, so no present races with the unmapping commit
+	if ((hiddenReasons & HiddenClosed) && (drawnHiddenReasons & HiddenClosed) && core->GetOutputsGeneration() != closedOutputsGeneration && !ReopenLayerSurface())
+		return false;
+
 	if (readyToResize && resize) {
-		width = newWidth;
-		height = newHeight;
+		configuredWidth = newWidth;
+		configuredHeight = newHeight;
+		configuredScale = pendingScale;
+		surfaceGeneration++;
+		readyToResize = false;
+		resize = false;
+		snapshotDirty = true;
+	}
+	UpdateOutputsPower();
+	// Every motion since the last dispatch comes down to one lookup
+	UpdateHover();
+	if (pendingInputTime && pendingInputTime == takenInputTime.load(std::memory_order_relaxed))
+		pendingInputTime = 0;
+	if (!snapshotDirty)
+		return true;
+	snapshotDirty = false;
+
+	auto &snapshot = snapshots.GetBack();
+	snapshot.width = configuredWidth;
+	snapshot.height = configuredHeight;
+	snapshot.scale = configuredScale;
+	snapshot.surfaceGeneration = surfaceGeneration;
+	snapshot.hiddenReasons = hiddenReasons;
+	snapshot.hoveredRegion = hoveredRegion;
+	snapshot.inputTime = pendingInputTime;
+	snapshot.widgets = widgets;
+	snapshots.Publish();
+	signalFd(wakeFd);
+	return true;
+}
+
+void Window::WaitForFirstFrame() const
+{
+	renderStatus.wait(RenderStarting, std::memory_order_acquire);
+}
+
+WidgetSnapshot& Window::EditWidgets()
+{
+	snapshotDirty = true;
+	return widgets;
+}
+
+void Window::SetOnLayout(OnLayoutCallbackType onLayout)
+{
+	renderer->SetOnLayout(onLayout);
+}
+
+void Window::SetOnWidgets(OnWidgetsCallbackType onWidgets)
+{
+	this->onWidgets = onWidgets;
+}
+
+void Window::SetOnResize(OnResizeCallbackType onResize)
+{
+	this->onResize = onResize;
+}
+
+void Window::SetOnFrame(OnFrameCallbackType onFrame)
+{
+	this->onFrame = onFrame;
+}
+
+void Window::SetContinuous(bool continuous)
+{
+	this->continuous = continuous;
+}
+
+void Window::SetOnInput(OnInputCallbackType onInput)
+{
+	this->onInput = onInput;
+}
+
+void Window::MarkInput(uint64_t inputTime)
+{
+	if (pendingInputTime && pendingInputTime == takenInputTime.load(std::memory_order_relaxed))
+		pendingInputTime = 0;
+	// Keep the oldest one, it's the one user waits for the longest
+	if (!pendingInputTime || inputTime < pendingInputTime)
+		pendingInputTime = inputTime;
+	snapshotDirty = true;
+}
+
+void Window::OnRenderState()
+{
+	drainFd(renderStateFd);
+	if (!renderStates.Take())
+		return;
+	NCBAR_TRACE_SCOPE("loop", "Window::OnRenderState");
+	const auto &state = renderStates.GetFront();
+	hitIndex.Clear();
+	for (const auto &region : state.regions)
+		hitIndex.Add(region.id, region.area.offset.x, region.area.offset.y, region.area.extent.width, region.area.extent.height);
+	hitIndex.Build();
+	const bool resized = state.extent.width != drawnExtent.width || state.extent.height != drawnExtent.height || state.scale != drawnScale;
+	drawnExtent = state.extent;
+	drawnScale = state.scale;
+	drawnHiddenReasons = state.hiddenReasons;
+
+	// Regions can move under a pointer that stands still
+	UpdateHover();
+	if (resized && onResize)
+		onResize(drawnExtent, drawnScale);
+}
+
+void Window::RenderLoop()
+{
+	Trace::SetThreadName("render");
+	// Signals are for the main thread, they wake up its event loop
+	sigset_t signals;
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	RenderStatus status = RenderStopped;
+	while (!stopping.load(std::memory_order_acquire)) {
+		ApplySnapshot();
+		if (wl_display_dispatch_queue_pending(core->GetDisplay(), eventQueue) < 0) {
+			NCBAR_LOG_ERROR << "Wayland: Failed to dispatch the render queue: " << strerror(errno);
+			status = RenderFailed;
+			break;
+		}
+		updateTime = core->GetPresentationTime();
+		UpdateVisibility();
+		if (renderHiddenReasons) {
+			// Nothing is committed while hidden, a frame callback or a snapshot brings the bar back
+			renderer->Trim();
+			redrawNeeded = true;
+			PublishRenderState();
+			if (!WaitForEvents(-1)) {
+				status = RenderFailed;
+				break;
+			}
+			continue;
+		}
+		// A frame only when something changed, and at most one per frame callback: the compositor says when the
+		// last one is on its way to the screen. Occlusion is noticed by waking up when the callback is overdue
+		if ((!redrawNeeded && !continuous) || frameCallback) {
+			int timeout = -1;
+			if (frameCallback) {
+				const uint64_t waited = updateTime - frameCallbackTime;
+				timeout = waited >= occlusionTimeout ? 0 : static_cast<int>((occlusionTimeout - waited + 999'999) / 1'000'000);
+			}
+			if (!WaitForEvents(timeout)) {
+				status = RenderFailed;
+				break;
+			}
+			continue;
+		}
+
+		redrawNeeded = false;
+		if (!RenderFrame()) {
+			status = RenderFailed;
+			break;
+		}
+		PublishRenderState();
+		auto starting = RenderStarting;
+		if (renderStatus.compare_exchange_strong(starting, RenderDrawing, std::memory_order_release))
+			renderStatus.notify_all();
+		if (onFrame && !onFrame())
+			break;
+	}
+
+	renderStatus.store(status, std::memory_order_release);
+	renderStatus.notify_all();
+	signalFd(renderStateFd);
+}
+
+void Window::ApplySnapshot()
+{
+	if (!snapshots.Take())
+		return;
+	NCBAR_TRACE_SCOPE("render", "Window::ApplySnapshot");
+	redrawNeeded = true;
+	const auto &snapshot = snapshots.GetFront();
+	if (snapshot.hoveredRegion != drawnSnapshot.hoveredRegion) {
+		// Only the widgets that gain or lose the hover are drawn again
+		if (drawnSnapshot.hoveredRegion)
+			renderer->InvalidateRegion(drawnSnapshot.hoveredRegion);
+		if (snapshot.hoveredRegion)
+			renderer->InvalidateRegion(snapshot.hoveredRegion);
+	}
+	if (snapshot.inputTime && snapshot.inputTime != drawnSnapshot.inputTime) {
+		if (!frameInputTime || snapshot.inputTime < frameInputTime)
+			frameInputTime = snapshot.inputTime;
+		takenInputTime.store(snapshot.inputTime, std::memory_order_relaxed);
+	}
+	if (onWidgets)
+		onWidgets(drawnSnapshot.widgets, snapshot.widgets, renderer.get());
+	// Into the same vectors every time, so it doesn't allocate once they've grown
+	drawnSnapshot = snapshot;
+}
+
+void Window::UpdateVisibility()
+{
+	uint32_t reasons = drawnSnapshot.hiddenReasons;
+	if (frameCallback && updateTime - frameCallbackTime > occlusionTimeout)
+		reasons |= HiddenOccluded;
+	if (reasons == renderHiddenReasons)
+		return;
 
-		CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
+	if (!renderHiddenReasons)
+		NCBAR_LOG_INFO << "Window: Hidden, releasing GPU resources";
+	else if (!reasons)
+		NCBAR_LOG_INFO << "Window: Visible again";
+	// Callbacks of an unmapped surface never come
+	if ((reasons & HiddenClosed) && frameCallback) {
+		wl_callback_destroy(frameCallback);
+		frameCallback = nullptr;
+	}
+	renderHiddenReasons = reasons;
+}
+
+bool Window::RenderFrame()
+{
+	NCBAR_TRACE_SCOPE("render", "Window::Render");
+	if (drawnSnapshot.surfaceGeneration != drawnSurfaceGeneration) {
+		NCBAR_TRACE_SCOPE("render", "Resize");
+		drawnSurfaceGeneration = drawnSnapshot.surfaceGeneration;
+		width = drawnSnapshot.width;
+		height = drawnSnapshot.height;
+		scale = drawnSnapshot.scale;
+		surfaceStateDirty = true;
+
+		{
+			std::lock_guard lock(core->GetQueueMutex());
+			CHECK_VK_RESULT(vkDeviceWaitIdle(core->GetDevice()));
+		}
 
 		if (!renderer->OnResize()) {
-			std::cerr << "Failed to resize renderer" << std::endl;
+			NCBAR_LOG_ERROR << "Failed to resize renderer";
 			return false;
 		}
 
-		readyToResize = false;
-		resize = false;
+		// No explicit commit here: buffer scale and viewport have to land together with a buffer of the new size,
+		// and that's the commit of the next present
+	}
+
+	return renderer->Render();
+}
+
+void Window::PublishRenderState()
+{
+	const auto extent = renderer->GetExtent();
+	if (renderer->GetRegionsGeneration() == publishedRegionsGeneration && extent.width == publishedExtent.width && extent.height == publishedExtent.height && scale == publishedScale && renderHiddenReasons == publishedHiddenReasons)
+		return;
+	publishedRegionsGeneration = renderer->GetRegionsGeneration();
+	publishedExtent = extent;
+	publishedScale = scale;
+	publishedHiddenReasons = renderHiddenReasons;
 
-		wl_surface_commit(surface);
+	auto &state = renderStates.GetBack();
+	state.regions.clear();
+	for (const auto &region : renderer->GetRegions()) {
+		if (region.id)
+			state.regions.push_back(RenderState::Region{ .id = region.id, .area = region.area });
 	}
+	state.extent = extent;
+	state.scale = scale;
+	state.hiddenReasons = renderHiddenReasons;
+	renderStates.Publish();
+	signalFd(renderStateFd);
+}
 
-	if (!renderer->Render())
+bool Window::WaitForEvents(int timeout)
+{
+	NCBAR_TRACE_SCOPE("render", "Window::WaitForEvents");
+	wl_display *display = core->GetDisplay();
+	// The same dance as the main loop, for this queue; whichever thread reads the socket sorts the events into the queues
+	while (wl_display_prepare_read_queue(display, eventQueue) != 0) {
+		if (wl_display_dispatch_queue_pending(display, eventQueue) < 0)
+			return false;
+	}
+	if (wl_display_flush(display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(display);
+		NCBAR_LOG_ERROR << "Wayland: Failed to flush display: " << strerror(errno);
 		return false;
-	
-	return true;
+	}
+
+	pollfd fds[] = {
+		{ .fd = wl_display_get_fd(display), .events = POLLIN, .revents = 0 },
+		{ .fd = wakeFd, .events = POLLIN, .revents = 0 }
+	};
+	if (poll(fds, std::size(fds), timeout) < 0) {
+		wl_display_cancel_read(display);
+		return errno == EINTR;
+	}
+	if (fds[0].revents & POLLIN) {
+		if (wl_display_read_events(display) < 0) {
+			NCBAR_LOG_ERROR << "Wayland: Failed to read events: " << strerror(errno);
+			return false;
+		}
+	}
+	else
+		wl_display_cancel_read(display);
+	if (fds[1].revents & POLLIN)
+		drainFd(wakeFd);
+	return wl_display_dispatch_queue_pending(display, eventQueue) >= 0;
+}
+
+void Window::RequestPresentationFeedback()
+{
+	if (!queuePresentation)
+		return;
+
+	const bool pending = std::any_of(presentationFeedbacks.begin(), presentationFeedbacks.end(), [](const PresentationFeedback &presentationFeedback) { return presentationFeedback.feedback != nullptr; });
+	for (auto &presentationFeedback : presentationFeedbacks) {
+		if (presentationFeedback.feedback)
+			continue;
+		presentationFeedback.feedback = wp_presentation_feedback(queuePresentation, surface);
+		presentationFeedback.consecutive = continuous || pending;
+		presentationFeedback.updateTime = updateTime;
+		presentationFeedback.inputTime = frameInputTime;
+		frameInputTime = 0;
+		wp_presentation_feedback_add_listener(presentationFeedback.feedback, &PresentationFeedback::listener, &presentationFeedback);
+		return;
+	}
+
+	frameStats.OnUntracked();
+}
+
+void Window::RequestFrameCallback()
+{
+	if (frameCallback)
+		return;
+	frameCallback = wl_surface_frame(queueSurface);
+	frameCallbackTime = updateTime;
+	wl_callback_add_listener(frameCallback, &wlFrameCallbackListener, this);
+}
+
+void Window::ApplySurfaceState()
+{
+	if (!surfaceStateDirty)
+		return;
+	surfaceStateDirty = false;
+
+	if (viewport) {
+		wp_viewport_set_destination(viewport, static_cast<int32_t>(width), static_cast<int32_t>(height));
+	}
+	else if (scale.IsInteger() && wl_proxy_get_version(reinterpret_cast<wl_proxy*>(surface)) >= WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION) {
+		wl_surface_set_buffer_scale(surface, static_cast<int32_t>(scale.value / Scale::denominator));
+	}
+}
+
+void Window::OnXdgSurfaceConfigure(xdg_surface *shellSurface, uint32_t serial)
+{
+	xdg_surface_ack_configure(shellSurface, serial);
+	if (resize) {
+		readyToResize = true;
+	}
+}
+
+void Window::OnXdgToplevelConfigure(xdg_toplevel *toplevel, int32_t width, int32_t height, wl_array *states)
+{
+	(void)toplevel;
+	(void)states;
+	if ((width > 0) && (height > 0)) {
+		newWidth = width;
+		newHeight = height;
+		resize = true;
+	}
+}
+
+void Window::OnXdgToplevelClose(xdg_toplevel *toplevel)
+{
+	(void)toplevel;
+	isGoingToClose = true;
+}
+
+void Window::OnXdgPopupConfigure(xdg_popup *popup, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	(void)popup;
+	(void)x;
+	(void)y;
+	if ((width > 0) && (height > 0)) {
+		newWidth = width;
+		newHeight = height;
+		resize = true;
+	}
+}
+
+void Window::OnXdgPopupDone(xdg_popup *popup)
+{
+	(void)popup;
+	isGoingToClose = true;
+}
+
+void Window::OnLayerSurfaceConfigure(zwlr_layer_surface_v1 *layerSurface, uint32_t serial, uint32_t width, uint32_t height)
+{
+	zwlr_layer_surface_v1_ack_configure(layerSurface, serial);
+	hiddenReasons &= ~HiddenClosed;
+	snapshotDirty = true;
+	if (width && height) {
+		newWidth = width;
+		newHeight = height;
+		resize = true;
+		readyToResize = true;
+	}
+}
+
+void Window::OnLayerSurfaceClosed(zwlr_layer_surface_v1 *layerSurface)
+{
+	(void)layerSurface;
+	// The output of the bar went away, it waits hidden for the next one instead of quitting
+	hiddenReasons |= HiddenClosed;
+	closedOutputsGeneration = core->GetOutputsGeneration();
+	snapshotDirty = true;
+}
+
+void Window::OnSurfaceEnter(wl_surface *surface, wl_output *output)
+{
+	(void)surface;
+	enteredOutputs.push_back(output);
+	UpdateIntegerScale();
+}
+
+void Window::OnSurfaceLeave(wl_surface *surface, wl_output *output)
+{
+	(void)surface;
+	std::erase(enteredOutputs, output);
+	UpdateIntegerScale();
+}
+
+void Window::ForgetOutput(wl_output *output)
+{
+	if (std::erase(enteredOutputs, output))
+		UpdateIntegerScale();
+}
+
+void Window::OnPreferredScale(wp_fractional_scale_v1 *fractionalScale, uint32_t scale)
+{
+	(void)fractionalScale;
+	SetPendingScale(Scale{ .value = scale });
+}
+
+void Window::OnFrameDone(wl_callback *callback, uint32_t time)
+{
+	(void)time;
+	wl_callback_destroy(callback);
+	frameCallback = nullptr;
+}
+
+void Window::PresentationFeedback::OnPresented(wp_presentation_feedback *feedback, uint32_t tvSecHi, uint32_t tvSecLo, uint32_t tvNsec, uint32_t refresh, uint32_t seqHi, uint32_t seqLo, uint32_t flags)
+{
+	uint64_t seconds = (static_cast<uint64_t>(tvSecHi) << 32) | tvSecLo;
+	// The counter is only valid for presentations synchronized to the vblank
+	uint64_t sequence = flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC ? (static_cast<uint64_t>(seqHi) << 32) | seqLo : 0;
+	window->frameStats.OnPresented(updateTime, inputTime, seconds * 1'000'000'000ull + tvNsec, refresh, sequence, consecutive);
+	wp_presentation_feedback_destroy(feedback);
+	this->feedback = nullptr;
+}
+
+void Window::PresentationFeedback::OnDiscarded(wp_presentation_feedback *feedback)
+{
+	window->frameStats.OnDiscarded();
+	wp_presentation_feedback_destroy(feedback);
+	this->feedback = nullptr;
+}
+
+void Window::SetPendingScale(Scale newScale)
+{
+	if (newScale == pendingScale)
+		return;
+	pendingScale = newScale;
+
+	if (!resize) {
+		newWidth = configuredWidth;
+		newHeight = configuredHeight;
+	}
+	resize = true;
+	readyToResize = true;
+}
+
+void Window::UpdateIntegerScale()
+{
+	// The fractional scale, when available, already accounts for the outputs
+	if (fractionalScale)
+		return;
+
+	int32_t maxScale = 1;
+	for (auto output : enteredOutputs) {
+		maxScale = std::max(maxScale, core->GetOutputScale(output));
+	}
+	SetPendingScale(Scale::FromInteger(maxScale));
+}
+
+void Window::UpdateOutputsPower()
+{
+	uint32_t reasons = hiddenReasons & ~HiddenOutputsOff;
+	if (!enteredOutputs.empty() && std::none_of(enteredOutputs.begin(), enteredOutputs.end(), [this](wl_output *output) { return core->IsOutputPowered(output); }))
+		reasons |= HiddenOutputsOff;
+	if (reasons == hiddenReasons)
+		return;
+	hiddenReasons = reasons;
+	snapshotDirty = true;
+}
+
+void Window::OnPointerMotion(double x, double y)
+{
+	const double factor = drawnScale.ToFloat();
+	pointerX = static_cast<int32_t>(std::floor(x * factor));
+	pointerY = static_cast<int32_t>(std::floor(y * factor));
+	if (!pointerMoved)
+		pointerTime = core->GetPresentationTime();
+	pointerInside = true;
+	pointerMoved = true;
+}
+
+void Window::OnPointerLeave()
+{
+	pointerInside = false;
+	pointerMoved = true;
+	pressedRegion = 0;
+	pressedButton = 0;
+	UpdateHover();
+}
+
+void Window::OnPointerButton(uint32_t button, bool pressed, uint32_t serial)
+{
+	UpdateHover();
+	if (pressed) {
+		pressedRegion = hoveredRegion;
+		pressedButton = button;
+		return;
+	}
+	if (button != pressedButton)
+		return;
+	const uint32_t region = pressedRegion;
+	pressedRegion = 0;
+	pressedButton = 0;
+	if (region && region == hoveredRegion) {
+		MarkInput(core->GetPresentationTime());
+		EmitInput(InputEvent::TypeClick, region, pointerX, pointerY, button, serial);
+	}
+}
+
+void Window::OnPointerScroll(int32_t steps, bool horizontal)
+{
+	UpdateHover();
+	if (!hoveredRegion || !onInput)
+		return;
+	InputEvent event;
+	event.type = InputEvent::TypeScroll;
+	event.region = hoveredRegion;
+	event.x = pointerX;
+	event.y = pointerY;
+	event.steps = steps;
+	event.horizontal = horizontal;
+	MarkInput(core->GetPresentationTime());
+	onInput(event);
+}
+
+void Window::OnTouchDown(double x, double y, uint32_t serial)
+{
+	(void)serial;
+	OnTouchMotion(x, y);
+	touchRegion = hitIndex.Find(touchX, touchY);
+}
+
+void Window::OnTouchMotion(double x, double y)
+{
+	const double factor = drawnScale.ToFloat();
+	touchX = static_cast<int32_t>(std::floor(x * factor));
+	touchY = static_cast<int32_t>(std::floor(y * factor));
+}
+
+void Window::OnTouchUp(uint32_t serial)
+{
+	const uint32_t region = touchRegion;
+	touchRegion = 0;
+	// A tap, or a drag that ends on the region it started on
+	if (region && hitIndex.Find(touchX, touchY) == region) {
+		MarkInput(core->GetPresentationTime());
+		EmitInput(InputEvent::TypeClick, region, touchX, touchY, BTN_LEFT, serial);
+	}
+}
+
+void Window::OnTouchCancel()
+{
+	touchRegion = 0;
+}
+
+void Window::UpdateHover()
+{
+	if (!pointerMoved && !pointerInside)
+		return;
+	// Regions can move under a pointer that stands still, so while it's inside it's looked up on every dispatch
+	const uint32_t region = pointerInside ? hitIndex.Find(pointerX, pointerY) : 0;
+	const bool moved = pointerMoved;
+	pointerMoved = false;
+	if (region == hoveredRegion)
+		return;
+	const uint32_t previous = hoveredRegion;
+	hoveredRegion = region;
+	snapshotDirty = true;
+	if (moved)
+		MarkInput(pointerTime);
+	if (previous)
+		EmitInput(InputEvent::TypeLeave, previous, pointerX, pointerY, 0, 0);
+	if (region)
+		EmitInput(InputEvent::TypeEnter, region, pointerX, pointerY, 0, 0);
 }
 
-void Window::SetOnPresent(OnPresentCallbackType onPresent)
+void Window::EmitInput(InputEvent::Type type, uint32_t region, int32_t x, int32_t y, uint32_t button, uint32_t serial)
 {
-	renderer->SetOnPresent(onPresent);
+	if (!onInput)
+		return;
+	InputEvent event;
+	event.type = type;
+	event.region = region;
+	event.x = x;
+	event.y = y;
+	event.button = button;
+	event.serial = serial;
+	onInput(event);
 }
@@ -0,0 +1,127 @@
+// Runs the pieces a steady state frame goes through that don't need a compositor or a GPU, once to warm them up and
+// then many times, and fails if the second part allocates. The same guarantee as `--benchmark --expect-no-allocations`,
+// checked headless by ctest
+#include "allocationCounter.hpp"
+#include "frameArena.hpp"
+#include "hitIndex.hpp"
+#include "textFormat.hpp"
+#include "tripleBuffer.hpp"
+#include "widgetStore.hpp"
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+	constexpr uint64_t warmupIterations = 16;
+	constexpr uint64_t iterations = 10'000;
+
+	// Keeps the compiler from dropping the work
+	volatile std::size_t sink = 0;
+
+	// Runs `function` for the warmup and then counts what the steady iterations allocate
+	template<typename Function>
+	bool check(const char *name, Function &&function)
+	{
+		for (uint64_t i = 0; i < warmupIterations; i++)
+			function(i);
+		const uint64_t before = AllocationCounter::GetCount();
+		for (uint64_t i = warmupIterations; i < warmupIterations + iterations; i++)
+			function(i);
+		const uint64_t allocations = AllocationCounter::GetCount() - before;
+		std::printf("%-24s %llu allocations in %llu iterations\n", name, static_cast<unsigned long long>(allocations), static_cast<unsigned long long>(iterations));
+		return !allocations;
+	}
+
+	// Numbers of a fixed width, like the texts modules publish
+	void writeNumber(std::array<char, 8> &buffer, uint64_t value)
+	{
+		std::snprintf(buffer.data(), buffer.size(), "%05llu", static_cast<unsigned long long>(value % 100'000));
+	}
+}
+
+int main()
+{
+	static_assert(AllocationCounter::enabled, "The test needs NCBAR_TRACK_ALLOCATIONS");
+	bool passed = true;
+
+	TextFormat format;
+	if (!format.Parse("{cpu:>3}% {mem_used:.1f}G {?title}{title:.12}{/}"))
+		return 1;
+	FormattedText text;
+	passed &= check("TextFormat", [&](uint64_t i) {
+		const TextFormat::Argument arguments[] = {
+			TextFormat::Argument::FromNumber(static_cast<double>(i % 101)),
+			TextFormat::Argument::FromNumber(static_cast<double>(i % 1600) / 100.0),
+			TextFormat::Argument::FromText(i % 2 ? "a window title that gets cut" : "")
+		};
+		text.Update(format, arguments);
+		sink = sink + text.GetText().size();
+	});
+
+	WidgetStore store;
+	std::size_t notified = 0;
+	store.Subscribe([&notified](std::string_view key, std::string_view value) { notified += key.size() + value.size(); });
+	std::array<char, 8> number = {};
+	passed &= check("WidgetStore::Set", [&](uint64_t i) {
+		writeNumber(number, i);
+		store.Set("network.rx", number.data());
+		store.Set("clock.time", i % 2 ? "12:34" : "12:35");
+		sink = sink + notified;
+	});
+
+	// The background region 0 spans the bar and is left out, a point between widgets finds nothing
+	HitIndex hitIndex;
+	hitIndex.Add(0, 0, 0, 2000, 28);
+	hitIndex.Add(2, 100, 0, 28, 28);
+	hitIndex.Add(1, 10, 0, 200, 28);
+	hitIndex.Build();
+	if (hitIndex.GetSize() != 2 || hitIndex.Find(5, 5) || hitIndex.Find(110, 5) != 2 || hitIndex.Find(150, 5) != 1 || hitIndex.Find(150, 28)) {
+		std::printf("HitIndex found the wrong widget\n");
+		return 1;
+	}
+	hitIndex.Clear();
+	for (uint32_t id = 1; id <= 64; id++)
+		hitIndex.Add(id, static_cast<int32_t>(id * 30), 0, 28, 28);
+	hitIndex.Build();
+	passed &= check("HitIndex::Find", [&](uint64_t i) {
+		sink = sink + hitIndex.Find(static_cast<int32_t>(i % 2000), static_cast<int32_t>(i % 30));
+	});
+	passed &= check("HitIndex rebuild", [&](uint64_t i) {
+		hitIndex.Clear();
+		for (uint32_t id = 1; id <= 64; id++)
+			hitIndex.Add(id, static_cast<int32_t>((id * 37 + i) % 2000), 0, 28, 28);
+		hitIndex.Build();
+		sink = sink + hitIndex.GetSize();
+	});
+
+	// Values whose assignment keeps the capacity, like the widget snapshots of the windows. The warmup publishes the
+	// largest one until every slot has held it
+	TripleBuffer<std::vector<uint32_t>> tripleBuffer;
+	passed &= check("TripleBuffer", [&](uint64_t i) {
+		auto &back = tripleBuffer.GetBack();
+		back.assign(i < warmupIterations ? 64 : 32 + i % 32, static_cast<uint32_t>(i));
+		tripleBuffer.Publish();
+		if (tripleBuffer.Take())
+			sink = sink + tripleBuffer.GetFront().size();
+	});
+
+	// The first frames overflow the block, the merged block fits them from then on
+	FrameArena arena(1024);
+	passed &= check("FrameArena", [&](uint64_t i) {
+		arena.Reset();
+		FrameArena::Vector<uint64_t> values(arena);
+		values.reserve(256);
+		for (uint64_t value = 0; value < 256; value++)
+			values.push_back(value * i);
+		auto array = arena.AllocateArray<uint32_t>(512);
+		sink = sink + values.size() + array.size();
+	});
+
+	if (!passed) {
+		std::printf("Steady state allocated\n");
+		return 1;
+	}
+	return 0;
+}
@@ -7,6 +7,30 @@ mkdir -p include src
 wayland-scanner client-header /usr/share/wayland-protocols/stable/xdg-shell/xdg-shell.xml ./include/xdg-shell.h
 wayland-scanner private-code /usr/share/wayland-protocols/stable/xdg-shell/xdg-shell.xml ./src/xdg-shell.c
 
+# presentation-time
+wayland-scanner client-header /usr/share/wayland-protocols/stable/presentation-time/presentation-time.xml ./include/presentation-time.h
+wayland-scanner private-code /usr/share/wayland-protocols/stable/presentation-time/presentation-time.xml ./src/presentation-time.c
+
+# viewporter
+wayland-scanner client-header /usr/share/wayland-protocols/stable/viewporter/viewporter.xml ./include/viewporter.h
+wayland-scanner private-code /usr/share/wayland-protocols/stable/viewporter/viewporter.xml ./src/viewporter.c
+
+# fractional-scale-v1
+wayland-scanner client-header /usr/share/wayland-protocols/staging/fractional-scale/fractional-scale-v1.xml ./include/fractional-scale-v1.h
+wayland-scanner private-code /usr/share/wayland-protocols/staging/fractional-scale/fractional-scale-v1.xml ./src/fractional-scale-v1.c
+
 # wlr-layer-shell-unstable-v1
 wayland-scanner client-header /usr/share/wlr-protocols/unstable/wlr-layer-shell-unstable-v1.xml ./include/wlr-layer-shell-unstable-v1.h
 wayland-scanner private-code /usr/share/wlr-protocols/unstable/wlr-layer-shell-unstable-v1.xml ./src/wlr-layer-shell-unstable-v1.c
+
+# wlr-foreign-toplevel-management-unstable-v1
+wayland-scanner client-header /usr/share/wlr-protocols/unstable/wlr-foreign-toplevel-management-unstable-v1.xml ./include/wlr-foreign-toplevel-management-unstable-v1.h
+wayland-scanner private-code /usr/share/wlr-protocols/unstable/wlr-foreign-toplevel-management-unstable-v1.xml ./src/wlr-foreign-toplevel-management-unstable-v1.c
+
+# wlr-output-power-management-unstable-v1
+wayland-scanner client-header /usr/share/wlr-protocols/unstable/wlr-output-power-management-unstable-v1.xml ./include/wlr-output-power-management-unstable-v1.h
+wayland-scanner private-code /usr/share/wlr-protocols/unstable/wlr-output-power-management-unstable-v1.xml ./src/wlr-output-power-management-unstable-v1.c
+
+# wlr-screencopy-unstable-v1
+wayland-scanner client-header /usr/share/wlr-protocols/unstable/wlr-screencopy-unstable-v1.xml ./include/wlr-screencopy-unstable-v1.h
+wayland-scanner private-code /usr/share/wlr-protocols/unstable/wlr-screencopy-unstable-v1.xml ./src/wlr-screencopy-unstable-v1.c